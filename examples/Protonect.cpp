@@ -77,6 +77,7 @@ public:
  * - cpu Perform depth processing with the CPU.
  * - gl  Perform depth processing with OpenGL.
  * - cl  Perform depth processing with OpenCL.
+ * - clhalf Perform depth processing with OpenCL, storing intermediate images in half precision.
  * - <number> Serial number of the device to open.
  * - -noviewer Disable viewer window.
  */
@@ -137,6 +138,15 @@ int main(int argc, char *argv[])
         pipeline = new libfreenect2::OpenCLPacketPipeline();
 #else
       std::cout << "OpenCL pipeline is not supported!" << std::endl;
+#endif
+    }
+    else if(arg == "clhalf")
+    {
+#ifdef LIBFREENECT2_WITH_OPENCL_SUPPORT
+      if(!pipeline)
+        pipeline = new libfreenect2::OpenCLPacketPipeline(-1, true);
+#else
+      std::cout << "OpenCL pipeline is not supported!" << std::endl;
 #endif
     }
     else if(arg.find_first_not_of("0123456789") == std::string::npos) //check if parameter could be a serial number
@@ -0,0 +1,206 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2014 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+/** @file test_binned_ir.cpp Binned IR output of the CPU, OpenCL and OpenGL depth packet processors. */
+
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include "test_depth_packets.h"
+
+/** Largest difference allowed between a binned IR pixel and the average of the four full resolution pixels it covers. */
+static const float max_ir_tolerance = 0.05f;
+
+/** IR of one processor at full resolution and binned. */
+struct BackendIr
+{
+  std::string name;
+  std::vector<float> full, binned;
+};
+
+/**
+ * Process a packet at full resolution and binned.
+ * @param processor Processor, its tables are loaded here.
+ * @param listener Listener of the IR frames, and of the depth frames with depth output.
+ * @param depth_output Whether depth output is enabled, without it the processors only compute the IR.
+ */
+template<typename ProcessorT>
+void processBackend(ProcessorT &processor, libfreenect2::SyncMultiFrameListener &listener, bool depth_output,
+                    std::vector<unsigned char> &p0_tables, libfreenect2::DepthPacket &packet, BackendIr &result)
+{
+  libfreenect2::DepthPacketProcessor::Config config;
+  config.EnableDepthOutput = depth_output;
+
+  processor.setConfiguration(config);
+  processor.setFrameListener(&listener);
+  processor.loadP0TablesFromCommandResponse(&p0_tables[0], p0_tables.size());
+  processor.load11To16LutFromFile("11to16.bin");
+  processor.loadXTableFromFile("xTable.bin");
+  processor.loadZTableFromFile("zTable.bin");
+
+  std::vector<float> depth;
+  processPacket(processor, listener, packet, result.full, depth);
+
+  config.EnableBinnedOutput = true;
+  processor.setConfiguration(config);
+  processPacket(processor, listener, packet, result.binned, depth);
+}
+
+/**
+ * Check that the binned IR of a processor is the average of its full resolution IR over every 2x2 block.
+ * @return Whether the largest difference is within #max_ir_tolerance.
+ */
+bool checkBinning(const BackendIr &result)
+{
+  float max_error = 0.0f;
+  size_t mixed = 0;
+
+  for(int y = 0; y < 212; ++y)
+  {
+    for(int x = 0; x < 256; ++x)
+    {
+      const float *row0 = &result.full[2 * y * 512 + 2 * x], *row1 = row0 + 512;
+      const float expected = (row0[0] + row0[1] + row1[0] + row1[1]) * 0.25f;
+      max_error = std::max(max_error, std::fabs(result.binned[y * 256 + x] - expected));
+
+      const int saturated = (row0[0] == 65535.0f) + (row0[1] == 65535.0f) + (row1[0] == 65535.0f) + (row1[1] == 65535.0f);
+      if(saturated != 0 && saturated != 4) ++mixed;
+    }
+  }
+
+  const bool ok = max_error <= max_ir_tolerance;
+  std::cout << (ok ? "ok  " : "FAIL") << " " << result.name << ": binned ir differs from the average of the full resolution ir by max " << max_error
+            << " (tolerance " << max_ir_tolerance << "), blocks with saturated and unsaturated pixels " << mixed << std::endl;
+  return ok;
+}
+
+/**
+ * Check that binning does not add to the difference between two processors: a binned IR pixel of one may differ
+ * from that of the other by at most the mean difference of the four full resolution pixels it covers.
+ */
+bool checkBackends(const BackendIr &reference, const BackendIr &result)
+{
+  float max_full_error = 0.0f, max_binned_error = 0.0f, max_excess = 0.0f;
+
+  for(size_t i = 0; i < reference.full.size(); ++i)
+  {
+    max_full_error = std::max(max_full_error, std::fabs(reference.full[i] - result.full[i]));
+  }
+
+  for(int y = 0; y < 212; ++y)
+  {
+    for(int x = 0; x < 256; ++x)
+    {
+      const size_t i = 2 * y * 512 + 2 * x;
+      const float full_error = (std::fabs(reference.full[i] - result.full[i]) + std::fabs(reference.full[i + 1] - result.full[i + 1])
+          + std::fabs(reference.full[i + 512] - result.full[i + 512]) + std::fabs(reference.full[i + 513] - result.full[i + 513])) * 0.25f;
+      const float binned_error = std::fabs(reference.binned[y * 256 + x] - result.binned[y * 256 + x]);
+
+      max_binned_error = std::max(max_binned_error, binned_error);
+      max_excess = std::max(max_excess, binned_error - full_error);
+    }
+  }
+
+  const bool ok = max_excess <= 2.0f * max_ir_tolerance;
+  std::cout << (ok ? "ok  " : "FAIL") << " " << result.name << " against " << reference.name << ": ir difference max " << max_full_error
+            << " at full resolution, " << max_binned_error << " binned, binned beyond its block " << max_excess << std::endl;
+  return ok;
+}
+
+/**
+ * Processes a depth packet at full resolution and binned with every processor this library was built with, with and
+ * without depth output. Fails if a binned IR pixel is not the average of the four full resolution IR pixels it covers,
+ * saturated each, or if binning makes the IR of the OpenCL or OpenGL processor differ more from the CPU processor.
+ * Usage: test_binned_ir [p0tables.bin packet.bin], where p0tables.bin holds the P0 tables command response
+ * and packet.bin the 352*424*10*2 bytes of a depth packet. Without arguments the packet of makeSyntheticPacket() is used.
+ */
+int main(int argc, char **argv)
+{
+  std::vector<unsigned char> p0_tables, buffer;
+
+  if(!loadTestPacket(argc, argv, p0_tables, buffer))
+  {
+    return -1;
+  }
+
+  libfreenect2::DepthPacket packet;
+  packet.sequence = 0;
+  packet.timestamp = 0;
+  packet.buffer = &buffer[0];
+  packet.buffer_length = buffer.size();
+
+  bool passed = true;
+
+  for(int depth_output = 1; depth_output >= 0; --depth_output)
+  {
+    const unsigned int frame_types = depth_output ? libfreenect2::Frame::Ir | libfreenect2::Frame::Depth : libfreenect2::Frame::Ir;
+    std::vector<BackendIr> results;
+
+    std::cout << (depth_output ? "ir and depth output" : "ir output only") << std::endl;
+
+    {
+      libfreenect2::SyncMultiFrameListener listener(frame_types);
+      libfreenect2::CpuDepthPacketProcessor processor;
+      results.push_back(BackendIr());
+      results.back().name = "cpu";
+      processBackend(processor, listener, depth_output != 0, p0_tables, packet, results.back());
+    }
+
+#ifdef LIBFREENECT2_WITH_OPENCL_SUPPORT
+    {
+      libfreenect2::SyncMultiFrameListener listener(frame_types);
+      libfreenect2::OpenCLDepthPacketProcessor processor;
+      results.push_back(BackendIr());
+      results.back().name = "opencl";
+      processBackend(processor, listener, depth_output != 0, p0_tables, packet, results.back());
+    }
+#endif
+
+#ifdef LIBFREENECT2_WITH_OPENGL_SUPPORT
+    {
+      libfreenect2::SyncMultiFrameListener listener(frame_types);
+      libfreenect2::OpenGLDepthPacketProcessor processor(0, false);
+      results.push_back(BackendIr());
+      results.back().name = "opengl";
+      processBackend(processor, listener, depth_output != 0, p0_tables, packet, results.back());
+    }
+#endif
+
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+      passed = checkBinning(results[i]) && passed;
+    }
+    for(size_t i = 1; i < results.size(); ++i)
+    {
+      passed = checkBackends(results[0], results[i]) && passed;
+    }
+  }
+
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2014 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+/** @file test_cpu_fast_math.cpp Accuracy of the fast math stage 2 of the CPU depth packet processor. */
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+#include "test_depth_packets.h"
+
+/** Largest depth difference in mm allowed between the exact and the fast math stage 2, see DepthPacketProcessor::Config::EnableFastMath. */
+static const float max_depth_tolerance = 0.05f;
+
+void initProcessor(libfreenect2::CpuDepthPacketProcessor &processor, const libfreenect2::DepthPacketProcessor::Config &config,
+                   libfreenect2::FrameListener *listener, std::vector<unsigned char> &p0_tables)
+{
+  processor.setConfiguration(config);
+  processor.setFrameListener(listener);
+  processor.loadP0TablesFromCommandResponse(&p0_tables[0], p0_tables.size());
+  processor.load11To16LutFromFile("");
+  processor.loadXTableFromFile("");
+  processor.loadZTableFromFile("");
+}
+
+/**
+ * Processes a depth packet with the exact and with the fast math stage 2 of the CPU processor, in every
+ * combination of the filters, and fails if the depth of a pixel differs by more than #max_depth_tolerance
+ * or is valid in only one of the frames.
+ * Usage: test_cpu_fast_math [p0tables.bin packet.bin], where p0tables.bin holds the P0 tables command response
+ * and packet.bin the 352*424*10*2 bytes of a depth packet. Without arguments the packet of makeSyntheticPacket() is used.
+ * The fast math stage 2 needs AVX2, on other CPUs both processors run the exact one.
+ */
+int main(int argc, char **argv)
+{
+  std::vector<unsigned char> p0_tables, buffer;
+
+  if(!loadTestPacket(argc, argv, p0_tables, buffer))
+  {
+    return -1;
+  }
+
+  libfreenect2::DepthPacket packet;
+  packet.sequence = 0;
+  packet.timestamp = 0;
+  packet.buffer = &buffer[0];
+  packet.buffer_length = buffer.size();
+
+  bool passed = true;
+
+  for(int filters = 0; filters < 4; ++filters)
+  {
+    libfreenect2::DepthPacketProcessor::Config config;
+    config.EnableBilateralFilter = (filters & 1) != 0;
+    config.EnableEdgeAwareFilter = (filters & 2) != 0;
+
+    libfreenect2::SyncMultiFrameListener exact_listener(libfreenect2::Frame::Ir | libfreenect2::Frame::Depth);
+    libfreenect2::SyncMultiFrameListener fast_listener(libfreenect2::Frame::Ir | libfreenect2::Frame::Depth);
+
+    libfreenect2::CpuDepthPacketProcessor exact_processor;
+    libfreenect2::CpuDepthPacketProcessor fast_processor;
+    initProcessor(exact_processor, config, &exact_listener, p0_tables);
+    config.EnableFastMath = true;
+    initProcessor(fast_processor, config, &fast_listener, p0_tables);
+
+    std::vector<float> exact_ir, exact_depth, fast_ir, fast_depth;
+    processPacket(exact_processor, exact_listener, packet, exact_ir, exact_depth);
+    processPacket(fast_processor, fast_listener, packet, fast_ir, fast_depth);
+
+    size_t valid = 0, mismatched = 0;
+    float max_depth_error = 0.0f, max_ir_error = 0.0f;
+
+    for(size_t i = 0; i < exact_depth.size(); ++i)
+    {
+      const bool exact_valid = exact_depth[i] > 0.0f;
+      const bool fast_valid = fast_depth[i] > 0.0f;
+
+      if(exact_valid && fast_valid)
+      {
+        ++valid;
+        max_depth_error = std::max(max_depth_error, std::fabs(exact_depth[i] - fast_depth[i]));
+      }
+      else if(exact_valid || fast_valid)
+      {
+        ++mismatched;
+      }
+    }
+
+    for(size_t i = 0; i < exact_ir.size(); ++i)
+    {
+      max_ir_error = std::max(max_ir_error, std::fabs(exact_ir[i] - fast_ir[i]));
+    }
+
+    const bool ok = valid > 0 && mismatched == 0 && max_depth_error <= max_depth_tolerance;
+    passed = passed && ok;
+
+    std::cout << (ok ? "ok  " : "FAIL") << " bilateral filter " << config.EnableBilateralFilter << " edge aware filter " << config.EnableEdgeAwareFilter
+              << ": pixels valid in both " << valid << ", in only one " << mismatched
+              << ", depth difference max " << max_depth_error << " mm (tolerance " << max_depth_tolerance << " mm)"
+              << ", ir difference max " << max_ir_error << std::endl;
+  }
+
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,217 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2014 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+/** @file test_depth_packets.cpp Depth packets and helpers shared by the depth processor test programs. */
+
+#include "test_depth_packets.h"
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <cmath>
+#include <stdint.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/** Value of each P0 table, see libfreenect2::protocol::P0TablesResponse. */
+static const uint16_t p0_table_values[3] = { 0x2c9a, 0x08ec, 0x42e8 };
+
+/** Size of the P0 tables command response: a 32 byte header and three tables of 512*424 values with a word before and after each. */
+static const size_t p0_tables_size = 32 + 3 * (2 + 512 * 424 * 2 + 2);
+
+/** Wraps of the phase of each frequency over the range the three frequencies together measure without ambiguity. */
+static const int phase_wraps[3] = { 10, 2, 15 };
+
+bool loadBufferFromFile(const std::string &filename, std::vector<unsigned char> &buffer)
+{
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  return in.good() || in.eof();
+}
+
+void makeSyntheticP0Tables(std::vector<unsigned char> &p0_tables)
+{
+  p0_tables.assign(p0_tables_size, 0);
+
+  for(int t = 0; t < 3; ++t)
+  {
+    uint16_t *table = reinterpret_cast<uint16_t *>(&p0_tables[32 + t * (2 + 512 * 424 * 2 + 2) + 2]);
+    std::fill(table, table + 512 * 424, p0_table_values[t]);
+  }
+}
+
+/** Measurement an 11 bit code stands for, the inverse of the 11to16 table of the processors. */
+static int decodeMeasurement(int code)
+{
+  const int magnitude = code & 1023;
+  int value;
+
+  if(magnitude <= 256)
+  {
+    value = magnitude;
+  }
+  else
+  {
+    // the step doubles every 128 codes
+    const int segment = (magnitude - 257) / 128;
+    const int base = 256 + 128 * ((2 << segment) - 2);
+    value = base + ((magnitude - 257) % 128 + 1) * (2 << segment);
+  }
+
+  return code < 1024 ? value : -value;
+}
+
+/** Code of the measurement closest to a value; the saturated code 1024 is never used. */
+static int encodeMeasurement(float value)
+{
+  int best = 0;
+  float best_error = std::fabs(value);
+
+  const int first = value < 0 ? 1025 : 1;
+  for(int code = first; code < first + 1023; ++code)
+  {
+    const float error = std::fabs(value - decodeMeasurement(code));
+    if(error < best_error)
+    {
+      best = code;
+      best_error = error;
+    }
+  }
+
+  return best;
+}
+
+/** Store the code of a pixel of a sub image, at the bit position the processors decode it from. */
+static void storeMeasurement(std::vector<unsigned char> &packet, int sub, int x, int y, int code)
+{
+  uint16_t *row = reinterpret_cast<uint16_t *>(&packet[sub * 352 * 424 * 2]) + 352 * (y < 212 ? y + 212 : 423 - y);
+  const int bit = (((x & 3) << 7) + (x >> 2)) * 11;
+  const int word = bit >> 4, shift = bit & 15;
+
+  row[word] |= static_cast<uint16_t>(code << shift);
+  if(shift > 5)
+  {
+    row[word + 1] |= static_cast<uint16_t>(code >> (16 - shift));
+  }
+}
+
+/** Distance of a pixel of the scene of makeSyntheticPacket(), as a fraction of the range without ambiguity. */
+static float sceneDistance(int x, int y)
+{
+  if(x >= 176 && x < 336 && y >= 132 && y < 292)
+  {
+    return 0.043f;
+  }
+
+  return 0.07f + 0.1f * x / 511.0f;
+}
+
+void makeSyntheticPacket(std::vector<unsigned char> &packet)
+{
+  const libfreenect2::DepthPacketProcessor::Parameters params;
+  packet.assign(depth_packet_size, 0);
+
+  // the processors skip the first and last column
+  for(int y = 0; y < 424; ++y)
+  {
+    for(int x = 1; x < 511; ++x)
+    {
+      const float distance = sceneDistance(x, y);
+      const float amplitude = 600.0f + 400.0f * std::cos(x * 0.02f) * std::cos(y * 0.03f);
+
+      for(int f = 0; f < 3; ++f)
+      {
+        const float cycles = distance * phase_wraps[f];
+        const float phase = 2.0f * M_PI * (cycles - std::floor(cycles));
+        const float p0 = -p0_table_values[f] * 0.000031f * M_PI;
+
+        for(int i = 0; i < 3; ++i)
+        {
+          const float m = amplitude * std::cos(p0 + params.phase_in_rad[i] + phase);
+          storeMeasurement(packet, 3 * f + i, x, y, encodeMeasurement(m));
+        }
+      }
+    }
+  }
+}
+
+bool loadTestPacket(int argc, char **argv, std::vector<unsigned char> &p0_tables, std::vector<unsigned char> &packet)
+{
+  if(argc == 1)
+  {
+    makeSyntheticP0Tables(p0_tables);
+    makeSyntheticPacket(packet);
+    return true;
+  }
+
+  if(argc != 3)
+  {
+    std::cerr << "usage: " << argv[0] << " [p0tables.bin packet.bin]" << std::endl;
+    return false;
+  }
+
+  if(!loadBufferFromFile(argv[1], p0_tables) || p0_tables.size() < p0_tables_size)
+  {
+    std::cerr << argv[1] << " is not a P0 tables command response" << std::endl;
+    return false;
+  }
+
+  if(!loadBufferFromFile(argv[2], packet) || packet.size() != depth_packet_size)
+  {
+    std::cerr << argv[2] << " is not a depth packet" << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+void processPacket(libfreenect2::DepthPacketProcessor &processor, libfreenect2::SyncMultiFrameListener &listener,
+                   const libfreenect2::DepthPacket &packet, std::vector<float> &ir, std::vector<float> &depth)
+{
+  libfreenect2::FrameMap frames;
+
+  processor.process(packet);
+  listener.waitForNewFrame(frames);
+
+  const libfreenect2::Frame *ir_frame = frames[libfreenect2::Frame::Ir];
+  const libfreenect2::Frame *depth_frame = frames[libfreenect2::Frame::Depth];
+  const float *ir_data = reinterpret_cast<const float *>(ir_frame->data);
+  ir.assign(ir_data, ir_data + ir_frame->width * ir_frame->height);
+
+  if(depth_frame != 0)
+  {
+    const float *depth_data = reinterpret_cast<const float *>(depth_frame->data);
+    depth.assign(depth_data, depth_data + depth_frame->width * depth_frame->height);
+  }
+  else
+  {
+    depth.clear();
+  }
+
+  listener.release(frames);
+}
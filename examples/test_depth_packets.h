@@ -0,0 +1,71 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2014 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+/** @file test_depth_packets.h Depth packets and helpers shared by the depth processor test programs. */
+
+#ifndef TEST_DEPTH_PACKETS_H_
+#define TEST_DEPTH_PACKETS_H_
+
+#include <string>
+#include <vector>
+
+#include <libfreenect2/depth_packet_processor.h>
+#include <libfreenect2/frame_listener_impl.h>
+
+/** Size of a depth packet: ten sub images of 512x424 11 bit measurements. */
+static const size_t depth_packet_size = 352 * 424 * 10 * 2;
+
+/** Read a whole file, @return Whether it could be read. */
+bool loadBufferFromFile(const std::string &filename, std::vector<unsigned char> &buffer);
+
+/**
+ * P0 tables command response with the same phase offset for every pixel of a table,
+ * the value the tables of a device have in their first and last row.
+ */
+void makeSyntheticP0Tables(std::vector<unsigned char> &p0_tables);
+
+/**
+ * Depth packet measuring a scene that the processors turn into mostly valid depth, for use with the tables of
+ * makeSyntheticP0Tables(): a plane sloping from about 1 m on the left to about 2.6 m on the right, in front of which
+ * a box floats at about 0.8 m, lit unevenly with amplitudes well above the thresholds of the filters.
+ * The measurements of each frequency are encoded from the phase of the distance the way the processors decode them.
+ */
+void makeSyntheticPacket(std::vector<unsigned char> &packet);
+
+/**
+ * P0 tables and packet of a test program: the files given on the command line, or the synthetic ones without arguments.
+ * Prints the usage or the error and @return false if the arguments are not usable.
+ */
+bool loadTestPacket(int argc, char **argv, std::vector<unsigned char> &p0_tables, std::vector<unsigned char> &packet);
+
+/**
+ * Process a packet and copy out its frames.
+ * @param depth Depth frame, left empty if the listener does not get depth frames.
+ */
+void processPacket(libfreenect2::DepthPacketProcessor &processor, libfreenect2::SyncMultiFrameListener &listener,
+                   const libfreenect2::DepthPacket &packet, std::vector<float> &ir, std::vector<float> &depth);
+
+#endif /* TEST_DEPTH_PACKETS_H_ */
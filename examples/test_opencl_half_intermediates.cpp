@@ -0,0 +1,150 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2014 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+/** @file test_opencl_half_intermediates.cpp Accuracy of half precision intermediates in the OpenCL depth packet processor. */
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+#include "test_depth_packets.h"
+
+#ifdef LIBFREENECT2_WITH_OPENCL_SUPPORT
+
+void initProcessor(libfreenect2::OpenCLDepthPacketProcessor &processor, libfreenect2::FrameListener *listener, std::vector<unsigned char> &p0_tables)
+{
+  processor.setConfiguration(libfreenect2::DepthPacketProcessor::Config());
+  processor.setFrameListener(listener);
+  processor.loadP0TablesFromCommandResponse(&p0_tables[0], p0_tables.size());
+  processor.load11To16LutFromFile("11to16.bin");
+  processor.loadXTableFromFile("xTable.bin");
+  processor.loadZTableFromFile("zTable.bin");
+}
+
+float percentile(const std::vector<float> &sorted, double p)
+{
+  return sorted.empty() ? 0.0f : sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+/**
+ * Processes depth packets with single and with half precision intermediates and reports how much the
+ * depth differs: the pixels that are valid in only one of the frames, and the error over the pixels valid in both.
+ * Usage: test_opencl_half_intermediates [p0tables.bin packet.bin [packet.bin ...]], where p0tables.bin holds the
+ * P0 tables command response and each packet file the 352*424*10*2 bytes of a recorded depth packet.
+ * Without arguments the packet of makeSyntheticPacket() is used.
+ */
+int main(int argc, char **argv)
+{
+  std::vector<unsigned char> p0_tables, buffer;
+
+  // the first packet comes with the tables, the others are read in turn
+  if(!loadTestPacket(std::min(argc, 3), argv, p0_tables, buffer))
+  {
+    return -1;
+  }
+
+  libfreenect2::SyncMultiFrameListener single_listener(libfreenect2::Frame::Ir | libfreenect2::Frame::Depth);
+  libfreenect2::SyncMultiFrameListener half_listener(libfreenect2::Frame::Ir | libfreenect2::Frame::Depth);
+
+  libfreenect2::OpenCLDepthPacketProcessor single_processor(-1, false);
+  libfreenect2::OpenCLDepthPacketProcessor half_processor(-1, true);
+  initProcessor(single_processor, &single_listener, p0_tables);
+  initProcessor(half_processor, &half_listener, p0_tables);
+
+  std::vector<float> single_ir, single_depth, half_ir, half_depth;
+  std::vector<float> errors;
+  size_t valid = 0, lost = 0, gained = 0;
+  float max_ir_error = 0.0f;
+
+  for(int i = 2; i < std::max(argc, 3); ++i)
+  {
+    if(i > 2 && (!loadBufferFromFile(argv[i], buffer) || buffer.size() != depth_packet_size))
+    {
+      std::cerr << "skipping " << argv[i] << ", not a depth packet" << std::endl;
+      continue;
+    }
+
+    libfreenect2::DepthPacket packet;
+    packet.sequence = i - 2;
+    packet.timestamp = 0;
+    packet.buffer = &buffer[0];
+    packet.buffer_length = buffer.size();
+
+    processPacket(single_processor, single_listener, packet, single_ir, single_depth);
+    processPacket(half_processor, half_listener, packet, half_ir, half_depth);
+
+    for(size_t j = 0; j < single_depth.size(); ++j)
+    {
+      const bool single_valid = single_depth[j] > 0.0f;
+      const bool half_valid = half_depth[j] > 0.0f;
+
+      if(single_valid && half_valid)
+      {
+        ++valid;
+        errors.push_back(std::fabs(single_depth[j] - half_depth[j]));
+      }
+      else if(single_valid)
+      {
+        ++lost;
+      }
+      else if(half_valid)
+      {
+        ++gained;
+      }
+    }
+
+    for(size_t j = 0; j < single_ir.size(); ++j)
+    {
+      max_ir_error = std::max(max_ir_error, std::fabs(single_ir[j] - half_ir[j]));
+    }
+  }
+
+  std::sort(errors.begin(), errors.end());
+  double error_sum = 0.0;
+  for(size_t j = 0; j < errors.size(); ++j)
+  {
+    error_sum += errors[j];
+  }
+
+  std::cout << "pixels valid in both: " << valid << ", only with single precision: " << lost << ", only with half precision: " << gained << std::endl;
+  std::cout << "depth difference mean: " << (errors.empty() ? 0.0 : error_sum / errors.size())
+            << " p50: " << percentile(errors, 0.5) << " p99: " << percentile(errors, 0.99) << " p99.9: " << percentile(errors, 0.999)
+            << " max: " << percentile(errors, 1.0) << " mm" << std::endl;
+  std::cout << "ir difference max: " << max_ir_error << std::endl;
+
+  return 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+  std::cout << "libfreenect2 was built without OpenCL support" << std::endl;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2014 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+/** @file allocator.h Allocation of packet buffers. */
+
+#ifndef ALLOCATOR_H_
+#define ALLOCATOR_H_
+
+#include <stddef.h>
+#include <libfreenect2/config.h>
+
+namespace libfreenect2
+{
+
+/** Data of a single buffer. */
+struct Buffer
+{
+public:
+  size_t capacity; ///< Capacity of the buffer.
+  size_t length;   ///< Used length of the buffer.
+  unsigned char* data; ///< Start address of the buffer.
+};
+
+/**
+ * Source of packet buffers. A processor provides one to have the stream parser assemble
+ * packets in memory its device reads directly, see PacketProcessor::getAllocator().
+ */
+class Allocator
+{
+public:
+  virtual ~Allocator() {}
+
+  /**
+   * Allocate a buffer.
+   * @param size Capacity of the buffer.
+   * @return The buffer, or 0 on failure.
+   */
+  virtual Buffer *allocate(size_t size) = 0;
+
+  /**
+   * Release a buffer.
+   * @param buffer Buffer returned by allocate() of this allocator.
+   */
+  virtual void free(Buffer *buffer) = 0;
+};
+
+/** Allocator of buffers on the heap. */
+class NewAllocator : public Allocator
+{
+public:
+  virtual Buffer *allocate(size_t size)
+  {
+    Buffer *buffer = new Buffer;
+    buffer->data = new unsigned char[size];
+    buffer->capacity = size;
+    buffer->length = 0;
+    return buffer;
+  }
+
+  virtual void free(Buffer *buffer)
+  {
+    delete[] buffer->data;
+    delete buffer;
+  }
+};
+
+} /* namespace libfreenect2 */
+#endif /* ALLOCATOR_H_ */
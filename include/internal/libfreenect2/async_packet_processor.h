@@ -78,6 +78,11 @@ public:
     return locked;
   }
 
+  virtual Allocator *getAllocator()
+  {
+    return processor_->getAllocator();
+  }
+
   virtual void process(const PacketT &packet)
   {
     {
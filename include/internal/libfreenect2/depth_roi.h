@@ -0,0 +1,92 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2014 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+/** @file depth_roi.h Region of interest of the depth processors. */
+
+#ifndef DEPTH_ROI_H_
+#define DEPTH_ROI_H_
+
+#include <libfreenect2/depth_packet_processor.h>
+
+namespace libfreenect2
+{
+
+/** Rectangle of the 512x424 depth image. */
+struct DepthRoi
+{
+  int x_begin; ///< First column.
+  int y_begin; ///< First row.
+  int x_end;   ///< Column just after the last column.
+  int y_end;   ///< Row just after the last row.
+
+  /**
+   * Region of interest of a configuration, clamped to the image.
+   * An empty region selects the whole image.
+   * @param config Configuration.
+   * @return Region in output image coordinates (first row at the top).
+   */
+  static DepthRoi fromConfig(const DepthPacketProcessor::Config &config);
+
+  /**
+   * Region widened by a halo on all sides, clamped to the image.
+   * @param halo Number of pixels to add on each side.
+   */
+  DepthRoi grow(int halo) const;
+
+  /** Same region with the rows counted from the bottom of the image. */
+  DepthRoi flipY() const;
+
+  /** Region of the 256x212 image of binned output covering this region, see DepthPacketProcessor::Config::EnableBinnedOutput. */
+  DepthRoi bin() const;
+
+  bool isFullFrame() const;
+
+  int width() const { return x_end - x_begin; }
+  int height() const { return y_end - y_begin; }
+};
+
+/**
+ * Regions the passes of the pipeline compute for a region of interest, each wide enough for the 3x3 filter after it.
+ * With binned output all of them are the whole image, the passes after stage 1 cover their DepthRoi::bin.
+ */
+struct DepthPassRois
+{
+  DepthRoi stage1;  ///< Decoding, one pixel wider than #stage2 with the bilateral filter.
+  DepthRoi stage2;  ///< Bilateral filter and depth, one pixel wider than #filter2 with the edge aware filter.
+  DepthRoi filter2; ///< Edge aware filter, the region of interest itself.
+
+  explicit DepthPassRois(const DepthPacketProcessor::Config &config);
+};
+
+/**
+ * Set all pixels of a 512x424 frame outside a region to zero.
+ * @param roi Region to keep.
+ * @param frame Depth or IR frame, in any format.
+ */
+void clearOutsideRoi(const DepthRoi &roi, Frame *frame);
+
+} /* namespace libfreenect2 */
+#endif /* DEPTH_ROI_H_ */
@@ -31,19 +31,11 @@
 
 #include <stddef.h>
 #include <libfreenect2/config.h>
+#include <libfreenect2/allocator.h>
 
 namespace libfreenect2
 {
 
-/** Data of a single buffer. */
-struct Buffer
-{
-public:
-  size_t capacity; ///< Capacity of the buffer.
-  size_t length;   ///< Used length of the buffer.
-  unsigned char* data; ///< Start address of the buffer.
-};
-
 /** Double bufffer class. */
 class DoubleBuffer
 {
@@ -51,7 +43,7 @@ public:
   DoubleBuffer();
   virtual ~DoubleBuffer();
 
-  void allocate(size_t buffer_size);
+  void allocate(size_t buffer_size, Allocator *allocator = 0);
 
   void swap();
 
@@ -59,10 +51,13 @@ public:
 
   Buffer& back();
 private:
-  Buffer buffer_[2]; // Both data buffers.
+  void release();
+
+  Buffer *buffer_[2]; ///< Both data buffers.
   unsigned char front_buffer_index_; ///< Index of the front buffer.
 
-  unsigned char* buffer_data_; ///< Memory holding both buffers.
+  NewAllocator default_allocator_; ///< Allocator used when none is given.
+  Allocator *allocator_; ///< Allocator of both buffers.
 };
 
 } /* namespace libfreenect2 */
@@ -0,0 +1,105 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2014 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+/** @file file_cache.h On-disk cache of data derived from device calibration. */
+
+#ifndef FILE_CACHE_H_
+#define FILE_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace libfreenect2
+{
+
+/**
+ * Directory of the cache files, created if needed: $LIBFREENECT2_CACHE_DIR if set, otherwise
+ * libfreenect2 in the user's cache directory (%LOCALAPPDATA%, $XDG_CACHE_HOME or ~/.cache).
+ * @return Path ending in a separator, empty if there is no usable directory.
+ */
+std::string getCacheDirectory();
+
+/**
+ * 64 bit FNV-1a hash, to key cache files by the data they were derived from.
+ * @param data Data to hash.
+ * @param length Number of bytes.
+ * @param hash Hash of the preceding data, to hash several pieces as one.
+ */
+uint64_t hashBytes(const void *data, size_t length, uint64_t hash = 0xcbf29ce484222325ULL);
+
+/**
+ * Name for a cache file: a prefix, the device serial (reduced to letters and digits, if any) and the key in hex.
+ * @param prefix Kind of cached data.
+ * @param serial Serial number of the device, may be empty.
+ * @param key Hash of everything the cached data depends on.
+ */
+std::string cacheFileName(const std::string &prefix, const std::string &serial, uint64_t key);
+
+/**
+ * Write a cache file atomically, through a temporary file that is renamed, so that concurrent
+ * readers never see a partial file.
+ * @param path Path of the file.
+ * @param header First part of the file.
+ * @param header_size Size of the first part.
+ * @param data Second part of the file.
+ * @param data_size Size of the second part.
+ * @return Whether the file was written.
+ */
+bool writeCacheFile(const std::string &path, const void *header, size_t header_size, const void *data, size_t data_size);
+
+/** Read only view of a cache file, memory mapped where the platform supports it. */
+class CacheFile
+{
+public:
+  CacheFile();
+  ~CacheFile();
+
+  /**
+   * Map a file, replacing the current one.
+   * @param path Path of the file.
+   * @return Whether the file exists and could be mapped.
+   */
+  bool open(const std::string &path);
+
+  /** Unmap the file. */
+  void close();
+
+  /** Start of the file contents (at least 64 byte aligned), 0 if no file is open. */
+  const unsigned char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  CacheFile(const CacheFile &);
+  CacheFile &operator=(const CacheFile &);
+
+  unsigned char *raw_; ///< Unaligned start of #data_ if the file was read instead of mapped.
+  unsigned char *data_;
+  size_t size_;
+};
+
+} /* namespace libfreenect2 */
+#endif /* FILE_CACHE_H_ */
@@ -31,6 +31,8 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 #include <libfreenect2/config.h>
 #include <libfreenect2/frame_listener.hpp>
@@ -63,6 +65,127 @@ public:
     bool EnableBilateralFilter; ///< Whether to run the bilateral filter.
     bool EnableEdgeAwareFilter; ///< Whether to run the edge aware filter.
 
+    int NumCpuThreads; ///< Number of threads the CPU processor splits each frame over (0 = one per hardware thread).
+    bool EnableFastMath; ///< Whether the CPU processor may use vectorized approximations of atan2, log and exp (AVX2 only, depth differs by at most 0.05 mm).
+    bool EnableHugePages; ///< Whether the CPU processor backs its scratch memory with huge pages (Linux only).
+    bool EnableFusedPipeline; ///< Whether the CPU processor runs all passes strip by strip instead of one full frame pass after the other.
+    bool EnableHalfTrigTables; ///< Whether the CPU processor stores its trigonometry tables in half precision (half the memory, IR and depth differ slightly).
+
+    int RoiX; ///< First column of the region of interest, only pixels inside it are processed and the rest of the output is zero.
+    int RoiY; ///< First row of the region of interest, counted from the top of the output image.
+    int RoiWidth; ///< Width of the region of interest.
+    int RoiHeight; ///< Height of the region of interest.
+
+    bool EnableIrOutput; ///< Whether to produce IR frames.
+    bool EnableDepthOutput; ///< Whether to produce depth frames, without them only the first stage runs.
+
+    /**
+     * Whether to deliver IR and depth frames at half resolution, 256x212 instead of 512x424.
+     * The first stage still decodes every pixel, then the a/b/amplitude measurements of each 2x2 block
+     * are averaged and the bilateral filter, the depth computation and the edge aware filter run on the
+     * binned image, a quarter of their full resolution work.
+     *
+     * Binning costs accuracy beyond the lost resolution: a block across a depth edge averages the
+     * phases of both surfaces and gets a depth in between (unless the edge aware filter drops it),
+     * invalid pixels dilute the amplitude of their block and saturated ones inflate it, and depth
+     * is computed with the x/z tables averaged over the block, i.e. along the ray through its centre.
+     * The region of interest and the fused CPU pipeline are not supported in this mode and are ignored.
+     */
+    bool EnableBinnedOutput;
+
+    /**
+     * Whether to deliver IR and depth frames as 2 byte unsigned integers (Frame::UInt16) instead of floats (Frame::Float).
+     * Depth is rounded to whole millimetres and IR to whole amplitude units, both saturate at 65535 and
+     * invalid depth stays 0. This halves the size of every frame, but Registration needs float depth.
+     */
+    bool EnableUInt16Output;
+
+    /**
+     * Whether to cache tables derived from the calibration of a device on disk, keyed by its serial number
+     * and a hash of the calibration, and map them on later starts instead of computing them again.
+     * The cache lives in $LIBFREENECT2_CACHE_DIR if set, otherwise in the user's cache directory.
+     * Off by default: the CPU processor writes about 16 MB per device and calibration, and nothing removes old
+     * files, so applications enabling it should point the cache at a directory they clean up.
+     */
+    bool EnableTableCache;
+
+    /**
+     * Whether the OpenCL and OpenGL processors cache their compiled programs on disk, in the same directory as the
+     * table cache. OpenCL programs are keyed by the device, its driver, the program source and the build options,
+     * OpenGL programs by the vendor, renderer and version strings of the driver and a hash of the shader sources.
+     * A matching binary is loaded instead of compiling the source, which can take seconds; unusable binaries fall
+     * back to compiling. The OpenGL processor builds its programs on the first packet and needs
+     * GL_ARB_get_program_binary for the cache. Off by default, as nothing removes the binaries of older drivers
+     * or sources from the cache directory.
+     */
+    bool EnableProgramCache;
+
+    /**
+     * Number of frames the OpenCL processor keeps in flight (1 to 3). With 1 every packet is uploaded, processed and
+     * read back before process() returns. With 2 or 3 the upload and first stage of a packet overlap the later passes
+     * and the readback of the previous one, which raises the throughput on devices that run transfers and kernels
+     * concurrently at the cost of up to that many frames of latency. Frames reach the listener in order from the
+     * thread calling process(): those complete by the end of a call of process() are delivered by it, later ones by
+     * the next call, or when the pipeline is drained by setConfiguration(), setParameters() or the destructor.
+     */
+    int NumOpenCLBufferSets;
+
+    /**
+     * Whether the OpenCL kernels read the depth range and the Parameters from a constant buffer instead of having
+     * them compiled in. Changing them then takes effect with the next frame instead of rebuilding the program,
+     * at the cost of the optimizations the compiler does with constants.
+     * Off by default: on a CPU OpenCL runtime the frame time stayed within 0.2% while each change of the parameters
+     * saved a rebuild of about 0.7 s, but GPU compilers may gain more from the constants.
+     */
+    bool EnableOpenCLRuntimeParameters;
+
+    /**
+     * Whether the OpenCL processor runs stage 1 with the bilateral filter, and stage 2 with the edge aware filter,
+     * as one kernel each. The kernels keep a tile of the intermediate images in local memory instead of writing
+     * them to global memory. Stage 1 is only fused at full resolution. The first packet after enabling them is
+     * also processed with the separate kernels, and if the outputs differ the separate kernels are used.
+     */
+    bool EnableOpenCLFusedKernels;
+
+    /**
+     * Whether the OpenCL processor picks the work group size of each kernel by timing a set of candidates, instead
+     * of leaving it to the driver. Tuning runs on the first packet of a program and the result is kept in the cache
+     * directory (see EnableTableCache), keyed by device, driver and program, so later runs reuse it.
+     * Off by default: without a cached result the first process() times hundreds of kernel launches, while
+     * the packets of a running device queue up.
+     */
+    bool EnableWorkGroupTuning;
+
+    /**
+     * Whether the OpenCL processor profiles the commands of each frame on the device, see
+     * OpenCLDepthPacketProcessor::getProfileStats. Profiling may slow down processing a little.
+     */
+    bool EnableOpenCLProfiling;
+
+    /**
+     * Number of pixel buffers the OpenGL processor reads its outputs back through (0 to 8). With 0 every output is
+     * copied into a new frame before process() returns. Otherwise the outputs are read into buffers that are mapped
+     * for the host once a fence says the GPU is done, and the frames handed to the listener point into the mapped
+     * buffers without a copy. With 2 or more the readback of a packet overlaps the processing of the next one, and its
+     * frames reach the listener in the following call of process(), one packet late, or from setConfiguration() or the
+     * destructor of the processor; buffers of frames the listener still holds are not reused, so keep one more buffer
+     * than the frames held at a time (3 for SyncMultiFrameListener). Frames may outlive the processor, which then copies
+     * their pixels into host memory; they must not be read while it is deleted. Needs GL_ARB_sync, else the processor
+     * reads back with copies.
+     */
+    int NumOpenGLReadbackBuffers;
+
+    /**
+     * Whether the OpenGL processor keeps its outputs on the GPU instead of reading them back. Every output is copied
+     * into a texture of its own and handed to the listener as an OpenGLTextureFrame, whose #Frame::data is 0, with a
+     * fence to wait on before drawing with the texture in a context sharing objects with the processor (see the
+     * parent context of OpenGLPacketPipeline). Textures of frames the listener still holds are not reused, up to 8
+     * packets are held at a time and beyond that frames are read back into host memory as usual. These frames must
+     * be deleted before the processor, which otherwise deletes their textures with its context and logs an error.
+     * Needs GL_ARB_sync, else the processor reads back into host memory.
+     */
+    bool EnableOpenGLTextureOutput;
+
     Config();
   };
 
@@ -109,15 +232,47 @@ public:
   virtual void setFrameListener(libfreenect2::FrameListener *listener);
   virtual void setConfiguration(const libfreenect2::DepthPacketProcessor::Config &config);
 
+  /**
+   * Identify the device whose tables are loaded next, the serial number names its table cache files.
+   * @param serial Serial number of the device.
+   */
+  virtual void setDeviceSerial(const std::string &serial);
+
   virtual void loadP0TablesFromCommandResponse(unsigned char* buffer, size_t buffer_length) = 0;
 protected:
   libfreenect2::DepthPacketProcessor::Config config_;
   libfreenect2::FrameListener *listener_;
+  std::string device_serial_;
 };
 
 #ifdef LIBFREENECT2_WITH_OPENGL_SUPPORT
 class OpenGLDepthPacketProcessorImpl;
 
+/**
+ * Frame of the OpenGL processor that stays on the GPU, see Config::EnableOpenGLTextureOutput.
+ * Its pixels are in #texture, a GL_TEXTURE_RECTANGLE of #width x #height texels whose internal format is GL_R32F for
+ * Frame::Float and GL_R16UI for Frame::UInt16. Texture row 0 holds the top line of the image. #data is 0.
+ *
+ * The texture is written by commands the processor has flushed but the GPU may not have run yet: call
+ * glWaitSync(), or glClientWaitSync(), on #fence in the consuming context, and bind the texture after that, before
+ * reading it. Both the texture and the fence belong to the processor and stay valid until the frame or the processor
+ * is deleted.
+ */
+class LIBFREENECT2_API OpenGLTextureFrame : public Frame
+{
+public:
+  unsigned int texture; ///< Name of the texture, a GLuint.
+  void *fence;          ///< Sync object signaled once the texture is written, a GLsync.
+
+protected:
+  OpenGLTextureFrame(size_t width, size_t height, size_t bytes_per_pixel, Format format, unsigned int texture, void *fence) :
+    Frame(width, height, bytes_per_pixel, format, 0),
+    texture(texture),
+    fence(fence)
+  {
+  }
+};
+
 /** Depth packet processor using OpenGL. */
 class LIBFREENECT2_API OpenGLDepthPacketProcessor : public DepthPacketProcessor
 {
@@ -172,6 +327,16 @@ public:
   void load11To16LutFromFile(const char* filename);
 
   virtual void process(const DepthPacket &packet);
+
+  /** Statistics of the scratch memory holding the intermediate buffers. */
+  struct ScratchMemoryStats
+  {
+    size_t bytes;       ///< Size of the scratch memory.
+    size_t allocations; ///< Number of times the scratch memory was allocated, constant while processing frames.
+    bool huge_pages;    ///< Whether the scratch memory is backed by huge pages.
+  };
+
+  ScratchMemoryStats getScratchMemoryStats() const;
 private:
   CpuDepthPacketProcessorImpl *impl_;
 };
@@ -183,10 +348,34 @@ class OpenCLDepthPacketProcessorImpl;
 class LIBFREENECT2_API OpenCLDepthPacketProcessor : public DepthPacketProcessor
 {
 public:
-  OpenCLDepthPacketProcessor(const int deviceId = -1);
+  /**
+   * @param deviceId Index of the OpenCL device, -1 for the default device.
+   * @param half_intermediates Store the images between the passes in half precision, which cuts their
+   *        memory traffic by more than half; the passes still compute in single precision. Depth then differs
+   *        by a fraction of a millimetre, and pixels close to the filter thresholds may change validity.
+   *        examples/test_opencl_half_intermediates.cpp reports the difference on recorded packets; on its
+   *        synthetic packet depth differs by 0.015 mm on average and 0.11 mm at most, with no change of validity.
+   */
+  OpenCLDepthPacketProcessor(const int deviceId = -1, bool half_intermediates = false);
   virtual ~OpenCLDepthPacketProcessor();
   virtual void setConfiguration(const libfreenect2::DepthPacketProcessor::Config &config);
 
+  /**
+   * Replace the listener, also for the frames still in flight with Config::NumOpenCLBufferSets above 1.
+   * After resetting it to 0, as closing the device does, these frames are dropped.
+   */
+  virtual void setFrameListener(libfreenect2::FrameListener *listener);
+
+  /**
+   * Replace the parameters of depth processing. With Config::EnableOpenCLRuntimeParameters they take effect with
+   * the next frame, otherwise the program is rebuilt.
+   * @param params New parameters.
+   */
+  void setParameters(const libfreenect2::DepthPacketProcessor::Parameters &params);
+
+  /** Allocator of mapped packet buffers on devices that share memory with the host, else 0. */
+  virtual Allocator *getAllocator();
+
   virtual void loadP0TablesFromCommandResponse(unsigned char* buffer, size_t buffer_length);
 
   /**
@@ -200,6 +389,60 @@ public:
   void load11To16LutFromFile(const char* filename);
 
   virtual void process(const DepthPacket &packet);
+
+  /** Statistics of the program binary cache, see Config::EnableProgramCache. */
+  struct ProgramCacheStats
+  {
+    size_t hits;     ///< Number of builds that loaded a cached binary.
+    size_t misses;   ///< Number of builds that compiled the source with the cache enabled.
+    size_t rejected; ///< Number of cache files that were found but could not be used.
+    size_t stores;   ///< Number of binaries written to the cache.
+  };
+
+  ProgramCacheStats getProgramCacheStats() const;
+
+  /** Work group size of a kernel, see Config::EnableWorkGroupTuning. */
+  struct WorkGroupTuning
+  {
+    const char *kernel;  ///< Name of the kernel.
+    size_t local_width;  ///< Work group width in use, 0 if the driver chooses.
+    size_t local_height; ///< Work group height in use, 0 if the driver chooses.
+    float time;          ///< Time of the kernel on the whole image with this size, in milliseconds.
+    float default_time;  ///< Time of the kernel with the size the driver chooses, in milliseconds.
+  };
+
+  /** Work group sizes of the tuned kernels, empty until they are tuned or loaded from the cache. */
+  std::vector<WorkGroupTuning> getWorkGroupTuning() const;
+
+  /** Percentiles of a duration over the recent frames, in milliseconds. */
+  struct ProfilePercentiles
+  {
+    float p50;
+    float p90;
+    float p99;
+    float max;
+  };
+
+  /** Device timings of a step of processing a frame, see Config::EnableOpenCLProfiling. */
+  struct ProfileStats
+  {
+    /**
+     * Name of the step: "upload", "stage1", "bin", "filter1", "stage2", "filter2", "ir pack", "ir readback",
+     * "depth pack" or "depth readback". With fused kernels "stage1" and "stage2" include their filters.
+     * The pack steps convert to 16 bit integers, the readbacks are mappings with zero copy.
+     */
+    const char *step;
+    size_t frames;                 ///< Number of recent frames the step ran in, at most 128.
+    ProfilePercentiles queued;     ///< From enqueueing the command to submitting it to the device.
+    ProfilePercentiles submitted;  ///< From submitting the command to the start of its execution.
+    ProfilePercentiles executed;   ///< Execution of the command.
+  };
+
+  /** Timings of the steps that ran in the last 128 frames, empty without Config::EnableOpenCLProfiling. */
+  std::vector<ProfileStats> getProfileStats() const;
+
+  /** Forget the timings collected so far. */
+  void resetProfileStats();
 private:
   OpenCLDepthPacketProcessorImpl *impl_;
 };
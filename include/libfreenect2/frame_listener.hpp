@@ -48,17 +48,32 @@ class LIBFREENECT2_API Frame
     Depth = 4  ///< Depth frame.
   };
 
+  /**
+   * Pixel encodings of frame data. The values follow upstream libfreenect2, which leaves 3 unused and has
+   * RGBX = 5 and Gray = 6; those stay free here so that formats added on either side do not collide.
+   */
+  enum Format
+  {
+    Invalid = 0, ///< Unspecified encoding.
+    Raw = 1,     ///< Undecoded bytes, e.g. JPEG data.
+    Float = 2,   ///< One 4 byte float per pixel: IR amplitude or depth in millimetres.
+    BGRX = 4,    ///< 4 bytes per pixel: blue, green, red and an unused byte.
+    UInt16 = 7   ///< One 2 byte unsigned integer per pixel: IR amplitude or depth in whole millimetres, saturated at 65535.
+  };
+
   uint32_t timestamp;
   uint32_t sequence;
   size_t width;           ///< Length of a line (in pixels).
   size_t height;          ///< Number of lines in the frame.
   size_t bytes_per_pixel; ///< Number of bytes in a pixel.
   unsigned char* data;    ///< Data of the frame (aligned).
+  Format format;          ///< Encoding of the pixels in #data.
 
-  Frame(size_t width, size_t height, size_t bytes_per_pixel) :
+  Frame(size_t width, size_t height, size_t bytes_per_pixel, Format format = Invalid) :
     width(width),
     height(height),
-    bytes_per_pixel(bytes_per_pixel)
+    bytes_per_pixel(bytes_per_pixel),
+    format(format)
   {
     const size_t alignment = 64;
     size_t space = width * height * bytes_per_pixel + alignment;
@@ -68,12 +83,30 @@ class LIBFREENECT2_API Frame
     data = reinterpret_cast<unsigned char *>(aligned);
   }
 
-  ~Frame()
+  virtual ~Frame()
   {
     delete[] rawdata;
   }
 
   protected:
+  /**
+   * Frame over memory managed by a subclass, which sets #data.
+   * @param width Length of a line (in pixels).
+   * @param height Number of lines in the frame.
+   * @param bytes_per_pixel Number of bytes in a pixel.
+   * @param format Encoding of the pixels.
+   * @param data Data of the frame.
+   */
+  Frame(size_t width, size_t height, size_t bytes_per_pixel, Format format, unsigned char *data) :
+    width(width),
+    height(height),
+    bytes_per_pixel(bytes_per_pixel),
+    data(data),
+    format(format),
+    rawdata(0)
+  {
+  }
+
   unsigned char* rawdata; ///< Unaligned start of #data.
 };
 
@@ -109,9 +109,14 @@ class LIBFREENECT2_API OpenCLPacketPipeline : public BasePacketPipeline
 {
 protected:
   const int deviceId;
+  const bool half_intermediates;
   virtual DepthPacketProcessor *createDepthPacketProcessor();
 public:
-  OpenCLPacketPipeline(const int deviceId = -1);
+  /**
+   * @param deviceId Index of the OpenCL device, -1 for the default device.
+   * @param half_intermediates Store the intermediate images in half precision, see OpenCLDepthPacketProcessor.
+   */
+  OpenCLPacketPipeline(const int deviceId = -1, bool half_intermediates = false);
   virtual ~OpenCLPacketPipeline();
 };
 #endif // LIBFREENECT2_WITH_OPENCL_SUPPORT
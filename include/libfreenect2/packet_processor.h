@@ -32,6 +32,8 @@
 namespace libfreenect2
 {
 
+class Allocator;
+
 /**
  * Processor node in the pipeline.
  * @tparam PacketT Type of the packet being processed.
@@ -48,6 +50,12 @@ public:
    */
   virtual bool ready() { return true; }
 
+  /**
+   * Allocator the stream parser should take its packet buffers from.
+   * @return The allocator, or 0 for buffers on the heap.
+   */
+  virtual Allocator *getAllocator() { return 0; }
+
   /**
    * A new packet has arrived, process it.
    * @param packet Packet to process.
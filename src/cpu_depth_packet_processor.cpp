@@ -30,8 +30,13 @@
 #include <libfreenect2/resource.h>
 #include <libfreenect2/protocol/response.h>
 #include <libfreenect2/logging.h>
+#include <libfreenect2/threading.h>
+#include <libfreenect2/depth_roi.h>
+#include <libfreenect2/file_cache.h>
 
 #include <fstream>
+#include <vector>
+#include <cstring>
 
 #include <limits>
 
@@ -41,6 +46,26 @@
 #include <cmath>
 #include <limits>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define LIBFREENECT2_CPU_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(LIBFREENECT2_CPU_X86) && (defined(__GNUC__) || defined(__clang__))
+#define LIBFREENECT2_TARGET_SSE2 __attribute__((target("sse2")))
+#define LIBFREENECT2_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define LIBFREENECT2_TARGET_SSE2
+#define LIBFREENECT2_TARGET_AVX2
+#endif
+
 /**
  * Vector class.
  * @tparam ScalarT Type of the elements.
@@ -107,7 +132,7 @@ private:
 
 public:
   /** Default constructor. */
-  Mat():buffer_(0), buffer_end_(0)
+  Mat():owns_buffer(false), buffer_(0), buffer_end_(0)
   {
   }
 
@@ -230,34 +255,6 @@ public:
   }
 };
 
-/**
- * Copy and flip buffer upside-down (upper part to bottom, bottom part to top).
- * @tparam ScalarT Type of the element of the buffer.
- * @param in Source buffer.
- * @param [out] out Destination buffer to be filled with flipped \a in data.
- */
-template<typename ScalarT>
-void flipHorizontal(const Mat<ScalarT> &in, Mat<ScalarT>& out)
-{
-  in.copyTo(out);
-  
-  typedef unsigned char type;
-
-  int linestep = out.sizeInBytes() / out.height() / sizeof(type);
-
-  type *first_line = reinterpret_cast<type *>(out.buffer()), *last_line = reinterpret_cast<type *>(out.buffer()) + (out.height() - 1) * linestep;
-
-
-  for(int y = 0; y < out.height() / 2; ++y)
-  {
-    for(int x = 0; x < linestep; ++x, ++first_line, ++last_line)
-    {
-      std::swap(*first_line, *last_line);
-    }
-    last_line -= 2 * linestep;
-  }
-}
-
 namespace libfreenect2
 {
 
@@ -287,292 +284,1375 @@ inline int bfi(int width, int offset, int src2, int src3)
   return ((src2 << offset) & bitmask) | (src3 & ~bitmask);
 }
 
-class CpuDepthPacketProcessorImpl: public WithPerfLogging
+/**
+ * Convert a float to IEEE half precision, rounding to nearest even.
+ * Only meant for finite values inside the half range, like the trigonometry tables.
+ */
+inline uint16_t floatToHalf(float value)
 {
-public:
-  Mat<uint16_t> p0_table0, p0_table1, p0_table2;
-  Mat<float> x_table, z_table;
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
 
-  int16_t lut11to16[2048];
+  uint32_t sign = (bits >> 16) & 0x8000;
+  bits &= 0x7fffffff;
 
-  float trig_table0[512*424][6];
-  float trig_table1[512*424][6];
-  float trig_table2[512*424][6];
-
-  bool enable_bilateral_filter, enable_edge_filter;
-  DepthPacketProcessor::Parameters params;
+  if(bits >= (143u << 23)) // too large for a half
+    return sign | 0x7c00;
 
-  Frame *ir_frame, *depth_frame;
+  if(bits < (113u << 23))
+  {
+    // zero or subnormal half, let the fpu round the mantissa into place
+    const uint32_t magic_bits = 126u << 23;
+    float magic, f;
+    std::memcpy(&magic, &magic_bits, sizeof(magic));
+    std::memcpy(&f, &bits, sizeof(f));
+    f += magic;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return sign | (bits - magic_bits);
+  }
 
-  bool flip_ptables;
+  uint32_t mantissa_odd = (bits >> 13) & 1;
+  bits += (uint32_t(15 - 127) << 23) + 0xfff + mantissa_odd;
+  return sign | (bits >> 13);
+}
 
-  CpuDepthPacketProcessorImpl()
-  {
-    newIrFrame();
-    newDepthFrame();
+/**
+ * Convert an IR amplitude or a depth in millimetres to a 16 bit output value,
+ * rounded to nearest and saturated, NaN and negative values become 0.
+ */
+inline uint16_t floatToUInt16Output(float value)
+{
+  return !(value > 0.0f) ? 0 : value < 65534.5f ? uint16_t(value + 0.5f) : 65535;
+}
 
-    enable_bilateral_filter = true;
-    enable_edge_filter = true;
+/**
+ * Convert an IEEE half precision value (no infinity or NaN) to a float.
+ */
+inline float halfToFloat(uint16_t value)
+{
+  uint32_t bits = uint32_t(value & 0x7fff) << 13;
+  float f;
 
-    flip_ptables = true;
+  if((bits & (0x7c00 << 13)) == 0)
+  {
+    // zero or subnormal, normalized by subtracting 2^-14
+    const uint32_t magic_bits = 113u << 23;
+    float magic;
+    bits += magic_bits;
+    std::memcpy(&magic, &magic_bits, sizeof(magic));
+    std::memcpy(&f, &bits, sizeof(f));
+    f -= magic;
+    std::memcpy(&bits, &f, sizeof(bits));
   }
-
-  /** Allocate a new IR frame. */
-  void newIrFrame()
+  else
   {
-    ir_frame = new Frame(512, 424, 4);
-    //ir_frame = new Frame(512, 424, 12);
+    bits += 112u << 23;
   }
 
-  /** Allocate a new depth frame. */
-  void newDepthFrame()
+  bits |= uint32_t(value & 0x8000) << 16;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+/** Instruction sets the CPU processor has specialized kernels for. */
+enum CpuKernelType
+{
+  CpuKernelScalar,
+  CpuKernelSSE2,
+  CpuKernelAVX2
+};
+
+/**
+ * Find the best instruction set supported by the running CPU (and OS).
+ * @return Kernel type to use.
+ */
+CpuKernelType detectCpuKernelType()
+{
+#if defined(LIBFREENECT2_CPU_X86) && (defined(__GNUC__) || defined(__clang__))
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return CpuKernelAVX2;
+  if(__builtin_cpu_supports("sse2"))
+    return CpuKernelSSE2;
+#elif defined(LIBFREENECT2_CPU_X86) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  int max_leaf = info[0];
+
+  __cpuid(info, 1);
+  bool sse2 = (info[3] & (1 << 26)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx = (info[2] & (1 << 28)) != 0;
+
+  if(osxsave && avx && max_leaf >= 7 && (_xgetbv(0) & 6) == 6)
   {
-    depth_frame = new Frame(512, 424, 4);
+    __cpuidex(info, 7, 0);
+    if((info[1] & (1 << 5)) != 0)
+      return CpuKernelAVX2;
   }
+  if(sse2)
+    return CpuKernelSSE2;
+#endif
+  return CpuKernelScalar;
+}
 
-  int32_t decodePixelMeasurement(unsigned char* data, int sub, int x, int y)
+const char *cpuKernelTypeName(CpuKernelType type)
+{
+  switch(type)
   {
-    // 298496 = 512 * 424 * 11 / 8 = number of bytes per sub image
-    uint16_t *ptr = reinterpret_cast<uint16_t *>(data + 298496 * sub);
-    int i = y < 212 ? y + 212 : 423 - y;
-    ptr += 352*i;
+  case CpuKernelAVX2:
+    return "AVX2";
+  case CpuKernelSSE2:
+    return "SSE2";
+  default:
+    return "scalar";
+  }
+}
 
-    /**
-     r1.yz = r2.xxyx < l(0, 1, 0, 0) // ilt
-     r1.y = r1.z | r1.y // or
-     */
-    bool r1y = x < 1 || y < 0;
-    /*
-    r1.zw = l(0, 0, 510, 423) < r2.xxxy // ilt
-    r1.z = r1.w | r1.z // or
-    */
-    bool r1z = 510 < x || 423 < y;
-    /*
-    r1.y = r1.z | r1.y // or
-    */
-    r1y = r1y || r1z;
-    /*
-    r1.y = r1.y & l(0x1fffffff) // and
-    */
-    int r1yi = r1y ? 0xffffffff : 0x0;
-    r1yi &= 0x1fffffff;
-
-    /*
-    bfi r1.z, l(2), l(7), r2.x, l(0)
-    ushr r1.w, r2.x, l(2)
-    r1.z = r1.w + r1.z // iadd
-    */
-    int r1zi = bfi(2, 7, x, 0);
-    int r1wi = x >> 2;
-    r1zi = r1wi + r1zi;
-
-    /*
-    imul null, r1.z, r1.z, l(11)
-    ushr r1.w, r1.z, l(4)
-    r1.y = r1.w + r1.y // iadd
-    r1.w = r1.y + l(1) // iadd
-    r1.z = r1.z & l(15) // and
-    r4.w = -r1.z + l(16) // iadd
-     */
-    r1zi = (r1zi * 11L) & 0xffffffff;
-    r1wi = r1zi >> 4;
-    r1yi = r1yi + r1wi;
-    r1zi = r1zi & 15;
-    int r4wi = -r1zi + 16;
+#ifdef LIBFREENECT2_CPU_X86
+/**
+ * SSE2 version of #halfToFloat for 4 adjacent values.
+ */
+LIBFREENECT2_TARGET_SSE2
+inline __m128 loadHalfSSE2(const uint16_t *ptr)
+{
+  __m128i h = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(ptr)), _mm_setzero_si128());
+  __m128i bits = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7fff)), 13);
+  __m128i sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16);
 
-    if(r1yi > 352)
-    {
-      return lut11to16[0];
-    }
+  __m128 small = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(bits, _mm_set1_epi32(0x7c00 << 13)), _mm_setzero_si128()));
+  __m128 normal = _mm_castsi128_ps(_mm_add_epi32(bits, _mm_set1_epi32(112 << 23)));
+  __m128 subnormal = _mm_sub_ps(_mm_castsi128_ps(_mm_add_epi32(bits, _mm_set1_epi32(113 << 23))), _mm_castsi128_ps(_mm_set1_epi32(113 << 23)));
 
-    int i1 = ptr[r1yi];
-    int i2 = ptr[r1yi + 1];
-    i1 = i1 >> r1zi;
-    i2 = i2 << r4wi;
+  __m128 f = _mm_or_ps(_mm_and_ps(small, subnormal), _mm_andnot_ps(small, normal));
+  return _mm_or_ps(f, _mm_castsi128_ps(sign));
+}
 
-    return lut11to16[((i1 | i2) & 2047)];
-  }
+/**
+ * AVX2 version of #halfToFloat for 8 adjacent values.
+ */
+LIBFREENECT2_TARGET_AVX2
+inline __m256 loadHalfAVX2(const uint16_t *ptr)
+{
+  __m256i h = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr)));
+  __m256i bits = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0x7fff)), 13);
+  __m256i sign = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0x8000)), 16);
 
-  /**
-   * Initialize cos and sin trigonometry tables for each of the three #phase_in_rad parameters.
-   * @param p0table Angle at every (x, y) position.
-   * @param [out] trig_tables (3 cos tables, followed by 3 sin tables for the three phases.
-   */
-  void fillTrigTable(Mat<uint16_t> &p0table, float trig_table[512*424][6])
-  {
-    int i = 0;
+  __m256 small = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(bits, _mm256_set1_epi32(0x7c00 << 13)), _mm256_setzero_si256()));
+  __m256 normal = _mm256_castsi256_ps(_mm256_add_epi32(bits, _mm256_set1_epi32(112 << 23)));
+  __m256 subnormal = _mm256_sub_ps(_mm256_castsi256_ps(_mm256_add_epi32(bits, _mm256_set1_epi32(113 << 23))), _mm256_castsi256_ps(_mm256_set1_epi32(113 << 23)));
 
-    for(int y = 0; y < 424; ++y)
-      for(int x = 0; x < 512; ++x, ++i)
-      {
-        float p0 = -((float)p0table.at(y, x)) * 0.000031 * M_PI;
+  __m256 f = _mm256_blendv_ps(normal, subnormal, small);
+  return _mm256_or_ps(f, _mm256_castsi256_ps(sign));
+}
 
-        float tmp0 = p0 + params.phase_in_rad[0];
-        float tmp1 = p0 + params.phase_in_rad[1];
-        float tmp2 = p0 + params.phase_in_rad[2];
+/**
+ * Vectorized atan2(y, x), mapped to [0, 2*pi) like in #transformMeasurements.
+ * The ratio is reduced to [0, tan(pi/8)] and evaluated with the Cephes atanf polynomial,
+ * the maximum absolute error against std::atan2 is about 5e-7 rad (one float ulp at 2*pi, measured over the full circle).
+ * NaN inputs result in 0.
+ */
+LIBFREENECT2_TARGET_AVX2
+inline __m256 phaseAVX2(__m256 y, __m256 x)
+{
+  const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+  const __m256 zero = _mm256_setzero_ps();
+
+  __m256 ax = _mm256_andnot_ps(sign_mask, x);
+  __m256 ay = _mm256_andnot_ps(sign_mask, y);
+
+  // first octant, r = min / max in [0, 1]
+  __m256 swap = _mm256_cmp_ps(ax, ay, _CMP_LT_OQ);
+  __m256 num = _mm256_blendv_ps(ay, ax, swap);
+  __m256 den = _mm256_blendv_ps(ax, ay, swap);
+  __m256 r = _mm256_div_ps(num, den);
+  r = _mm256_and_ps(r, _mm256_cmp_ps(den, zero, _CMP_NEQ_OQ)); // atan2(0, 0) = 0
+
+  // reduce to [0, tan(pi/8)] with atan(r) = pi/4 + atan((r - 1) / (r + 1))
+  __m256 reduce = _mm256_cmp_ps(r, _mm256_set1_ps(0.4142135623730950f), _CMP_GT_OQ);
+  r = _mm256_blendv_ps(r, _mm256_div_ps(_mm256_sub_ps(r, _mm256_set1_ps(1.0f)), _mm256_add_ps(r, _mm256_set1_ps(1.0f))), reduce);
+
+  __m256 z = _mm256_mul_ps(r, r);
+  __m256 p = _mm256_set1_ps(8.05374449538e-2f);
+  p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(-1.38776856032e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(1.99777106478e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(-3.33329491539e-1f));
+  __m256 a = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, z), r), r);
+  a = _mm256_add_ps(a, _mm256_and_ps(reduce, _mm256_set1_ps(float(M_PI / 4.0))));
+
+  // back to the full circle
+  a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps(float(M_PI / 2.0)), a), swap);
+  a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps(float(M_PI)), a), _mm256_cmp_ps(x, zero, _CMP_LT_OQ));
+  a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps(float(M_PI * 2.0)), a), _mm256_cmp_ps(y, zero, _CMP_LT_OQ));
+  return _mm256_and_ps(a, _mm256_cmp_ps(a, a, _CMP_ORD_Q));
+}
 
-        trig_table[i][0] = std::cos(tmp0);
-        trig_table[i][1] = std::cos(tmp1);
-        trig_table[i][2] = std::cos(tmp2);
+/**
+ * Vectorized natural logarithm (Cephes logf), maximum relative error about 1e-7 for positive normal inputs.
+ * Zero and denormal inputs are treated as the smallest normal number.
+ */
+LIBFREENECT2_TARGET_AVX2
+inline __m256 logAVX2(__m256 x)
+{
+  x = _mm256_max_ps(x, _mm256_set1_ps(std::numeric_limits<float>::min()));
+
+  __m256i xi = _mm256_castps_si256(x);
+  __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(xi, 23), _mm256_set1_epi32(0x7e)));
+  // mantissa in [0.5, 1)
+  __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(xi, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f000000)));
+
+  // shift to [sqrt(0.5), sqrt(2)) around 1
+  __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+  e = _mm256_sub_ps(e, _mm256_and_ps(small, _mm256_set1_ps(1.0f)));
+  m = _mm256_add_ps(_mm256_sub_ps(m, _mm256_set1_ps(1.0f)), _mm256_and_ps(small, m));
+
+  __m256 z = _mm256_mul_ps(m, m);
+  __m256 p = _mm256_set1_ps(7.0376836292e-2f);
+  p = _mm256_add_ps(_mm256_mul_ps(p, m), _mm256_set1_ps(-1.1514610310e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, m), _mm256_set1_ps(1.1676998740e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, m), _mm256_set1_ps(-1.2420140846e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, m), _mm256_set1_ps(1.4249322787e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, m), _mm256_set1_ps(-1.6668057665e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, m), _mm256_set1_ps(2.0000714765e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, m), _mm256_set1_ps(-2.4999993993e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, m), _mm256_set1_ps(3.3333331174e-1f));
+  p = _mm256_mul_ps(_mm256_mul_ps(p, m), z);
+
+  p = _mm256_add_ps(p, _mm256_mul_ps(e, _mm256_set1_ps(-2.12194440e-4f)));
+  p = _mm256_sub_ps(p, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+  return _mm256_add_ps(_mm256_add_ps(m, p), _mm256_mul_ps(e, _mm256_set1_ps(0.693359375f)));
+}
 
-        trig_table[i][3] = std::sin(-tmp0);
-        trig_table[i][4] = std::sin(-tmp1);
-        trig_table[i][5] = std::sin(-tmp2);
-      }
-  }
+/**
+ * Vectorized exponential (Cephes expf), maximum relative error about 1e-7.
+ * The input is clamped to [-87, 88], so the result is always a finite normal number.
+ */
+LIBFREENECT2_TARGET_AVX2
+inline __m256 expAVX2(__m256 x)
+{
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)), _mm256_set1_ps(88.0f));
+
+  // x = n * ln(2) + r, |r| <= ln(2) / 2
+  __m256 n = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _mm256_set1_ps(0.5f)));
+  x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(0.693359375f)));
+  x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(-2.12194440e-4f)));
+
+  __m256 z = _mm256_mul_ps(x, x);
+  __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+  p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(1.3981999507e-3f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(8.3334519073e-3f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(4.1665795894e-2f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(1.6666665459e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(5.0000001201e-1f));
+  p = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(p, z), x), _mm256_set1_ps(1.0f));
+
+  // scale by 2^n
+  __m256i pow2n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(0x7f)), 23);
+  return _mm256_mul_ps(p, _mm256_castsi256_ps(pow2n));
+}
+#endif // LIBFREENECT2_CPU_X86
 
+/**
+ * Runs a function over the rows of an image, split into one band of rows per thread.
+ * The worker threads are kept alive between calls; the calling thread processes the first band itself.
+ */
+class RowBandExecutor
+{
+public:
   /**
-   * Process measurement (all three layers).
-   * @param [in] trig_table Trigonometry tables.
-   * @param abMultiplierPerFrq Multiplier.
-   * @param x X position in the image.
-   * @param y Y position in the image.
-   * @param m Measurement.
-   * @param [out] m_out Processed measurement (IR a, IR b, IR amplitude).
+   * Function processing a band of rows.
+   * @param context User data passed to #run.
+   * @param y_begin First row of the band.
+   * @param y_end Row just after the last row of the band.
    */
-  void processMeasurementTriple(float trig_table[512*424][6], float abMultiplierPerFrq, int x, int y, const int32_t* m, float* m_out)
+  typedef void (*BandFunction)(void *context, int y_begin, int y_end);
+
+  RowBandExecutor() :
+    num_threads_(1),
+    function_(0),
+    context_(0),
+    y_begin_(0),
+    y_end_(0),
+    generation_(0),
+    pending_(0),
+    shutdown_(false)
   {
-    int offset = y * 512 + x;
-    float cos_tmp0 = trig_table[offset][0];
-    float cos_tmp1 = trig_table[offset][1];
-    float cos_tmp2 = trig_table[offset][2];
-
-    float sin_negtmp0 = trig_table[offset][3];
-    float sin_negtmp1 = trig_table[offset][4];
-    float sin_negtmp2 = trig_table[offset][5];
+  }
 
-    float zmultiplier = z_table.at(y, x);
-    bool cond0 = 0 < zmultiplier;
-    bool cond1 = (m[0] == 32767 || m[1] == 32767 || m[2] == 32767) && cond0;
+  ~RowBandExecutor()
+  {
+    stopWorkers();
+  }
 
-    // formula given in Patent US 8,587,771 B2
-    float tmp3 = cos_tmp0 * m[0] + cos_tmp1 * m[1] + cos_tmp2 * m[2];
-    float tmp4 = sin_negtmp0 * m[0] + sin_negtmp1 * m[1] + sin_negtmp2 * m[2];
+  int numThreads() const
+  {
+    return num_threads_;
+  }
 
-    // only if modeMask & 32 != 0;
-    if(true)//(modeMask & 32) != 0)
+  /**
+   * Change the number of threads. Must not be called while #run is active.
+   * @param num_threads Number of threads (including the calling thread), 0 selects one per hardware thread.
+   */
+  void setNumThreads(int num_threads)
+  {
+    if(num_threads <= 0)
     {
-        tmp3 *= abMultiplierPerFrq;
-        tmp4 *= abMultiplierPerFrq;
+      num_threads = (int)libfreenect2::thread::hardware_concurrency();
+      num_threads = num_threads > 0 ? num_threads : 1;
     }
-    float tmp5 = std::sqrt(tmp3 * tmp3 + tmp4 * tmp4) * params.ab_multiplier;
 
-    // invalid pixel because zmultiplier < 0 ??
-    tmp3 = cond0 ? tmp3 : 0;
-    tmp4 = cond0 ? tmp4 : 0;
-    tmp5 = cond0 ? tmp5 : 0;
+    if(num_threads == num_threads_) return;
 
-    // invalid pixel because saturated?
-    tmp3 = !cond1 ? tmp3 : 0;
-    tmp4 = !cond1 ? tmp4 : 0;
-    tmp5 = !cond1 ? tmp5 : 65535.0; // some kind of norm calculated from tmp3 and tmp4
+    stopWorkers();
+    num_threads_ = num_threads;
 
-    m_out[0] = tmp3; // ir image a
-    m_out[1] = tmp4; // ir image b
-    m_out[2] = tmp5; // ir amplitude
+    for(int i = 1; i < num_threads_; ++i)
+    {
+      Worker *worker = new Worker();
+      worker->executor = this;
+      worker->index = i;
+      worker->generation = generation_;
+      worker->thread = new libfreenect2::thread(&RowBandExecutor::static_execute, worker);
+      workers_.push_back(worker);
+    }
   }
 
   /**
-   * Transform measurement.
-   * @param [in, out] m Measurement.
+   * Process a range of rows and wait until every band is done.
+   * @param function Function to call for each band.
+   * @param context User data passed to \a function.
+   * @param y_begin First row to process.
+   * @param y_end Row just after the last row to process.
    */
-  void transformMeasurements(float* m)
+  void run(BandFunction function, void *context, int y_begin, int y_end)
   {
-    float tmp0 = std::atan2((m[1]), (m[0]));
-    tmp0 = tmp0 < 0 ? tmp0 + M_PI * 2.0f : tmp0;
-    tmp0 = (tmp0 != tmp0) ? 0 : tmp0;
-
-    float tmp1 = std::sqrt(m[0] * m[0] + m[1] * m[1]) * params.ab_multiplier;
+    if(y_begin >= y_end) return;
 
-    m[0] = tmp0; // phase
-    m[1] = tmp1; // ir amplitude - (possibly bilateral filtered)
-  }
+    if(num_threads_ == 1)
+    {
+      function(context, y_begin, y_end);
+      return;
+    }
 
-  /**
-   * Process first pixel stage.
-   * @param x Horizontal position.
-   * @param y Vertical position.
-   * @param data
-   * @param [out] m0_out First layer output.
-   * @param [out] m1_out Second layer output.
-   * @param [out] m2_out Third layer output.
-   */
-  void processPixelStage1(int x, int y, unsigned char* data, float *m0_out, float *m1_out, float *m2_out)
-  {
-    int32_t m0_raw[3], m1_raw[3], m2_raw[3];
+    {
+      libfreenect2::lock_guard l(mutex_);
+      function_ = function;
+      context_ = context;
+      y_begin_ = y_begin;
+      y_end_ = y_end;
+      pending_ = num_threads_ - 1;
+      ++generation_;
+    }
+    work_condition_.notify_all();
 
-    m0_raw[0] = decodePixelMeasurement(data, 0, x, y);
-    m0_raw[1] = decodePixelMeasurement(data, 1, x, y);
-    m0_raw[2] = decodePixelMeasurement(data, 2, x, y);
-    m1_raw[0] = decodePixelMeasurement(data, 3, x, y);
-    m1_raw[1] = decodePixelMeasurement(data, 4, x, y);
-    m1_raw[2] = decodePixelMeasurement(data, 5, x, y);
-    m2_raw[0] = decodePixelMeasurement(data, 6, x, y);
-    m2_raw[1] = decodePixelMeasurement(data, 7, x, y);
-    m2_raw[2] = decodePixelMeasurement(data, 8, x, y);
+    function(context, y_begin, bandBegin(1, y_begin, y_end));
 
-    processMeasurementTriple(trig_table0, params.ab_multiplier_per_frq[0], x, y, m0_raw, m0_out);
-    processMeasurementTriple(trig_table1, params.ab_multiplier_per_frq[1], x, y, m1_raw, m1_out);
-    processMeasurementTriple(trig_table2, params.ab_multiplier_per_frq[2], x, y, m2_raw, m2_out);
+    libfreenect2::unique_lock l(mutex_);
+    while(pending_ != 0)
+    {
+      WAIT_CONDITION(done_condition_, mutex_, l);
+    }
   }
 
-  /**
-   * Filter pixels in stage 1.
-   * @param x Horizontal position.
-   * @param y Vertical position.
-   * @param m Input data?
-   * @param [out] Output data.
-   * @param [out] bilateral_max_edge_test Whether the accumulated distance of each image stayed within limits.
-   */
-  void filterPixelStage1(int x, int y, const Mat<Vec<float, 9> >& m, float* m_out, bool& bilateral_max_edge_test)
+private:
+  struct Worker
   {
-    const float *m_ptr = (m.ptr(y, x)->val);
-    bilateral_max_edge_test = true;
+    RowBandExecutor *executor;
+    int index;
+    unsigned int generation; ///< Last work generation processed by this worker.
+    libfreenect2::thread *thread;
+  };
+
+  int num_threads_;
+  std::vector<Worker *> workers_;
+
+  BandFunction function_;
+  void *context_;
+  int y_begin_, y_end_;
+  unsigned int generation_; ///< Incremented for every call to #run.
+  int pending_;             ///< Number of worker bands not finished yet.
+  bool shutdown_;
+
+  libfreenect2::mutex mutex_;
+  libfreenect2::condition_variable work_condition_;
+  libfreenect2::condition_variable done_condition_;
+
+  int bandBegin(int index, int y_begin, int y_end) const
+  {
+    return y_begin + (y_end - y_begin) * index / num_threads_;
+  }
 
-    if(x < 1 || y < 1 || x > 510 || y > 422)
+  void stopWorkers()
+  {
     {
-      for(int i = 0; i < 9; ++i)
-        m_out[i] = m_ptr[i];
+      libfreenect2::lock_guard l(mutex_);
+      shutdown_ = true;
     }
-    else
+    work_condition_.notify_all();
+
+    for(size_t i = 0; i < workers_.size(); ++i)
     {
-      float m_normalized[2];
-      float other_m_normalized[2];
+      workers_[i]->thread->join();
+      delete workers_[i]->thread;
+      delete workers_[i];
+    }
+    workers_.clear();
 
-      int offset = 0;
+    shutdown_ = false;
+    num_threads_ = 1;
+  }
 
-      for(int i = 0; i < 3; ++i, m_ptr += 3, m_out += 3, offset += 3)
-      {
-        float norm2 = m_ptr[0] * m_ptr[0] + m_ptr[1] * m_ptr[1];
-        float inv_norm = 1.0f / std::sqrt(norm2);
-        inv_norm = (inv_norm == inv_norm) ? inv_norm : std::numeric_limits<float>::infinity();
+  static void static_execute(void *data)
+  {
+    Worker *worker = static_cast<Worker *>(data);
+    worker->executor->execute(worker);
+  }
 
-        m_normalized[0] = m_ptr[0] * inv_norm;
-        m_normalized[1] = m_ptr[1] * inv_norm;
+  void execute(Worker *worker)
+  {
+    for(;;)
+    {
+      BandFunction function;
+      void *context;
+      int y_begin, y_end;
 
-        int j = 0;
+      {
+        libfreenect2::unique_lock l(mutex_);
+        while(!shutdown_ && generation_ == worker->generation)
+        {
+          WAIT_CONDITION(work_condition_, mutex_, l);
+        }
 
-        float weight_acc = 0.0f;
-        float weighted_m_acc[2] = {0.0f, 0.0f};
+        if(shutdown_) return;
 
-        float threshold = (params.joint_bilateral_ab_threshold * params.joint_bilateral_ab_threshold) / (params.ab_multiplier * params.ab_multiplier);
-        float joint_bilateral_exp = params.joint_bilateral_exp;
+        worker->generation = generation_;
+        function = function_;
+        context = context_;
+        y_begin = y_begin_;
+        y_end = y_end_;
+      }
 
-        if(norm2 < threshold)
+      function(context, bandBegin(worker->index, y_begin, y_end), bandBegin(worker->index + 1, y_begin, y_end));
+
+      {
+        libfreenect2::lock_guard l(mutex_);
+        if(--pending_ == 0)
         {
-          threshold = 0.0f;
-          joint_bilateral_exp = 0.0f;
+          done_condition_.notify_one();
         }
+      }
+    }
+  }
+};
 
-        float dist_acc = 0.0f;
+/**
+ * One block of 64 byte aligned memory, handed out in pieces to the intermediate buffers of the processor.
+ * The block is allocated and touched once, so processing a frame neither allocates nor page faults.
+ */
+class ScratchArena
+{
+public:
+  static const size_t Alignment = 64;
 
-        for(int yi = -1; yi < 2; ++yi)
-        {
-          for(int xi = -1; xi < 2; ++xi, ++j)
-          {
-            if(yi == 0 && xi == 0)
-            {
-              weight_acc += params.gaussian_kernel[j];
+  ScratchArena() :
+    raw_(0), block_(0), mapped_size_(0), size_(0), used_(0), allocations_(0), huge_pages_(false)
+  {
+  }
+
+  ~ScratchArena()
+  {
+    release();
+  }
+
+  /**
+   * Replace the block by a new one.
+   * @param size Number of bytes in the block.
+   * @param huge_pages Whether to try to back the block with huge pages (Linux only).
+   */
+  void reserve(size_t size, bool huge_pages)
+  {
+    release();
+    size_ = alignUp(size, Alignment);
+
+#ifdef __linux__
+    if(huge_pages)
+    {
+      const size_t huge_page_size = 2 * 1024 * 1024;
+      size_t mapped_size = alignUp(size_, huge_page_size);
+
+      void *block = mmap(0, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      bool advised = block != MAP_FAILED;
+
+      if(block == MAP_FAILED)
+      {
+        // no reserved huge pages, ask for transparent ones instead
+        block = mmap(0, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+        advised = block != MAP_FAILED && madvise(block, mapped_size, MADV_HUGEPAGE) == 0;
+#endif
+      }
+
+      if(block != MAP_FAILED)
+      {
+        block_ = static_cast<unsigned char *>(block);
+        mapped_size_ = mapped_size;
+        huge_pages_ = advised;
+      }
+
+      if(!huge_pages_)
+      {
+        LOG_WARNING << "huge pages are not available, using normal pages for the scratch memory";
+      }
+    }
+#endif
+
+    if(block_ == 0)
+    {
+      raw_ = new unsigned char[size_ + Alignment];
+      block_ = reinterpret_cast<unsigned char *>(alignUp(reinterpret_cast<uintptr_t>(raw_), Alignment));
+    }
+
+    // fault the pages in now instead of during the first frame
+    std::fill(block_, block_ + size_, 0);
+
+    used_ = 0;
+    ++allocations_;
+  }
+
+  /**
+   * Hand out the next piece of the block.
+   * @param size Number of bytes.
+   * @return Start of the piece, 64 byte aligned.
+   */
+  unsigned char *take(size_t size)
+  {
+    size = alignUp(size, Alignment);
+
+    if(used_ + size > size_)
+    {
+      LOG_ERROR << "scratch memory exhausted";
+      return 0;
+    }
+
+    unsigned char *piece = block_ + used_;
+    used_ += size;
+    return piece;
+  }
+
+  size_t size() const { return size_; }
+  size_t allocations() const { return allocations_; }
+  bool usesHugePages() const { return huge_pages_; }
+
+  static size_t alignUp(size_t value, size_t alignment)
+  {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+  /** Free the block. */
+  void release()
+  {
+#ifdef __linux__
+    if(mapped_size_ != 0)
+    {
+      munmap(block_, mapped_size_);
+    }
+#endif
+    delete[] raw_;
+
+    raw_ = 0;
+    block_ = 0;
+    mapped_size_ = 0;
+    size_ = 0;
+    used_ = 0;
+    huge_pages_ = false;
+  }
+
+private:
+  unsigned char *raw_; ///< Unaligned start of #block_ when it was allocated with new.
+  unsigned char *block_;
+  size_t mapped_size_; ///< Size of the mapping when #block_ was allocated with mmap.
+  size_t size_, used_;
+  size_t allocations_; ///< Number of blocks allocated so far.
+  bool huge_pages_;
+};
+
+class CpuDepthPacketProcessorImpl: public WithPerfLogging
+{
+public:
+  Mat<uint16_t> p0_table0, p0_table1, p0_table2;
+  Mat<float> x_table, z_table;
+  Mat<float> x_table_binned, z_table_binned; ///< Tables averaged over 2x2 blocks, see #binTable.
+  const Mat<float> *stage2_x_table, *stage2_z_table; ///< Tables of the image stage 2 runs on, full resolution or binned.
+
+  int16_t lut11to16[2048 + 1]; ///< Padded by one entry, so 32 bit gathers of the last entry stay inside the table.
+
+  /** Where the 11 bit measurements of each pixel are in a packet, shared by the scalar and SIMD decoders. */
+  struct DecodePlan
+  {
+    int32_t word[512];    ///< Index of the first 16 bit word holding the measurement of each column, within its row.
+    int32_t shift[512];   ///< Bit offset of the measurement in that word.
+    int32_t invalid[512]; ///< All bits set for the columns without measurements.
+    int32_t row[424];     ///< Index of the first 16 bit word of each image row in a sub image.
+  };
+  DecodePlan decode_plan;
+
+  /**
+   * Trigonometry tables of one frequency, one plane of 512x424 values for each of
+   * cos(phase 0..2) and sin(-phase 0..2). The planes are either float or half precision.
+   */
+  struct TrigTable
+  {
+    float *planes[6];         ///< Float planes, 0 in half precision mode.
+    uint16_t *half_planes[6]; ///< Half precision planes, 0 in float mode.
+
+    float at(int plane, int offset) const
+    {
+      return planes[plane] != 0 ? planes[plane][offset] : halfToFloat(half_planes[plane][offset]);
+    }
+  };
+
+  TrigTable trig_table0, trig_table1, trig_table2;
+  ScratchArena trig_storage;
+  CacheFile trig_cache; ///< Table cache file the trigonometry tables point into, see #updateTrigTables.
+  bool half_trig_tables;
+  bool enable_table_cache;
+
+  /** Header of a trigonometry table cache file, followed by the planes as laid out by #setTrigTablePlanes. */
+  struct TrigCacheHeader
+  {
+    static const uint32_t Version = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t half;
+    uint64_t key; ///< See #trigTableKey.
+    uint64_t planes_size;
+    unsigned char padding[32]; ///< Keeps the planes 64 byte aligned.
+  };
+
+  bool enable_bilateral_filter, enable_edge_filter, enable_fast_math, enable_fused_pipeline;
+  bool enable_ir_output, enable_depth_output, enable_binned_output, enable_uint16_output;
+  DepthPacketProcessor::Parameters params;
+  float joint_bilateral_threshold; ///< Squared AB threshold of the bilateral filter, derived from #params.
+
+  Frame *ir_frame, *depth_frame;
+
+  bool flip_ptables; ///< Whether the p0 tables are stored upside down relative to the processed rows, see #fillTrigTable.
+
+  RowBandExecutor executor;
+  CpuKernelType kernel_type;
+
+  DepthRoi roi; ///< Region of interest in output image coordinates.
+  DepthRoi stage1_roi, stage2_roi, filter2_roi; ///< Regions computed by each pass, rows in processing order (bottom up).
+
+  /** Stage 2 kernels specialized for the current filter configuration, see #selectKernels. */
+  RowBandExecutor::BandFunction stage2_band, fused_band, fused_border_stage2_band;
+
+  ScratchArena scratch;
+  bool scratch_huge_pages; ///< Whether huge pages were requested for #scratch.
+  Vec<float, 9> *m_buffer, *m_filtered_buffer;
+  unsigned char *m_max_edge_test_buffer;
+  Vec<float, 3> *depth_ir_sum_buffer;
+
+  /** Buffers of the frame being processed, shared by the row band passes. */
+  struct FrameContext
+  {
+    CpuDepthPacketProcessorImpl *impl;
+    unsigned char *data;
+    Mat<Vec<float, 9> > *m;        ///< Stage 1 output.
+    Mat<Vec<float, 9> > *m_stage2; ///< Stage 2 input, #m or its binned version.
+    Mat<Vec<float, 9> > *m_filtered;
+    Mat<unsigned char> *m_max_edge_test;
+    Mat<Vec<float, 3> > *depth_ir_sum;
+    void *out_ir, *out_depth; ///< Output images, 0 if the output is disabled.
+    void *out_binned_ir; ///< IR output image computed by #processBinnedStage1Rows, 0 without binned IR output.
+    bool uint16; ///< Whether the output images hold 16 bit integers instead of floats.
+    int width, height; ///< Size of the output images, which is the size of #m_stage2.
+
+    /**
+     * Row to compute a processed row of an output image into, the output is flipped upside down.
+     * Images of 16 bit integers are computed into a scratch row first, which #storeRow converts.
+     * @param image Output image.
+     * @param y Processed row.
+     * @param scratch Row of 512 floats used for 16 bit integer images.
+     */
+    float *outputRow(void *image, int y, float *scratch) const
+    {
+      return uint16 ? scratch : static_cast<float *>(image) + (height - 1 - y) * width;
+    }
+
+    /**
+     * Finish a row computed into #outputRow, converting it if the image holds 16 bit integers.
+     * @param image Output image.
+     * @param y Processed row.
+     * @param row Row returned by #outputRow.
+     * @param x_begin First computed column.
+     * @param x_end Column just after the last computed column.
+     */
+    void storeRow(void *image, int y, const float *row, int x_begin, int x_end) const
+    {
+      if(!uint16) return;
+
+      uint16_t *out = static_cast<uint16_t *>(image) + (height - 1 - y) * width;
+
+      for(int x = x_begin; x < x_end; ++x)
+      {
+        out[x] = floatToUInt16Output(row[x]);
+      }
+    }
+  };
+
+  CpuDepthPacketProcessorImpl()
+  {
+    enable_bilateral_filter = true;
+    enable_edge_filter = true;
+    enable_fast_math = false;
+    enable_fused_pipeline = false;
+    enable_ir_output = true;
+    enable_depth_output = true;
+    enable_binned_output = false;
+    enable_uint16_output = false;
+    enable_table_cache = true;
+    stage2_x_table = &x_table;
+    stage2_z_table = &z_table;
+
+    // after the output flags, which pick the frame size and format
+    newIrFrame();
+    newDepthFrame();
+
+    flip_ptables = true;
+
+    std::fill(lut11to16, lut11to16 + 2048 + 1, 0);
+    buildDecodePlan(decode_plan);
+
+    kernel_type = detectCpuKernelType();
+    LOG_INFO << "using " << cpuKernelTypeName(kernel_type) << " kernels for stage 1";
+
+    allocateScratch(false);
+    allocateTrigTables(false);
+    selectKernels();
+    setRoi(DepthPacketProcessor::Config());
+  }
+
+  /**
+   * Restrict processing to the region of interest of a configuration.
+   * @param config Configuration holding the region of interest and the enabled filters.
+   */
+  void setRoi(const DepthPacketProcessor::Config &config)
+  {
+    DepthPassRois rois(config);
+
+    // the output is written bottom up, see #processStage2Rows
+    roi = rois.filter2;
+    stage1_roi = rois.stage1.flipY();
+    stage2_roi = rois.stage2.flipY();
+    filter2_roi = rois.filter2.flipY();
+
+    if(config.EnableBinnedOutput)
+    {
+      stage2_roi = stage2_roi.bin();
+      filter2_roi = filter2_roi.bin();
+    }
+  }
+
+  /**
+   * Switch between full resolution and binned output, see #processBinnedStage1Rows.
+   * The frames are reallocated by the next #allocateFrames if their size changes.
+   * @param binned Whether to bin.
+   */
+  void setBinnedOutput(bool binned)
+  {
+    if(binned != enable_binned_output)
+    {
+      allocateFrames(false, false);
+    }
+
+    enable_binned_output = binned;
+    stage2_x_table = binned ? &x_table_binned : &x_table;
+    stage2_z_table = binned ? &z_table_binned : &z_table;
+  }
+
+  /**
+   * Switch between float and 16 bit integer output, see #FrameContext::storeRow.
+   * The frames are reallocated by the next #allocateFrames if their format changes.
+   * @param uint16 Whether to output 16 bit integers.
+   */
+  void setUInt16Output(bool uint16)
+  {
+    if(uint16 != enable_uint16_output)
+    {
+      allocateFrames(false, false);
+    }
+
+    enable_uint16_output = uint16;
+  }
+
+  /**
+   * Average a 512x424 table of x or z multipliers over 2x2 blocks, for stage 2 on the binned image.
+   * Only the pixels with a valid (positive) z multiplier count, a block without any stays invalid.
+   * @param table Table to bin.
+   * @param z_table Z table of the full image, deciding which pixels are valid.
+   * @param [out] binned 256x212 table.
+   */
+  static void binTable(const Mat<float> &table, const Mat<float> &z_table, Mat<float> &binned)
+  {
+    binned.create(212, 256);
+
+    for(int y = 0; y < 212; ++y)
+      for(int x = 0; x < 256; ++x)
+      {
+        float sum = 0.0f;
+        int n = 0;
+
+        for(int i = 0; i < 4; ++i)
+        {
+          int yi = 2 * y + i / 2, xi = 2 * x + i % 2;
+
+          if(0 < z_table.at(yi, xi))
+          {
+            sum += table.at(yi, xi);
+            ++n;
+          }
+        }
+
+        binned.at(y, x) = n != 0 ? sum / n : 0.0f;
+      }
+  }
+
+  /** Compute the binned x and z tables, once both tables are loaded. */
+  void binTables()
+  {
+    if(x_table.buffer() == 0 || z_table.buffer() == 0) return;
+
+    binTable(x_table, z_table, x_table_binned);
+    binTable(z_table, z_table, z_table_binned);
+  }
+
+  template<bool BilateralFilter, bool EdgeFilter, bool FastMath, bool SlopePositive>
+  void selectKernels()
+  {
+    stage2_band = &processStage2Band<BilateralFilter, EdgeFilter, FastMath, SlopePositive>;
+    fused_band = &processFusedBand<BilateralFilter, EdgeFilter, FastMath, SlopePositive>;
+    fused_border_stage2_band = &processFusedBorderStage2Band<BilateralFilter, EdgeFilter, FastMath, SlopePositive>;
+  }
+
+  /** Specialize the kernels for the sign of Parameters::ab_confidence_slope too, which picks the IR amplitude the dealiasing confidence is computed from. */
+  template<bool BilateralFilter, bool EdgeFilter, bool FastMath>
+  void selectKernels()
+  {
+    if(0 < params.ab_confidence_slope)
+      selectKernels<BilateralFilter, EdgeFilter, FastMath, true>();
+    else
+      selectKernels<BilateralFilter, EdgeFilter, FastMath, false>();
+  }
+
+  /**
+   * Pick the stage 2 kernels specialized for the enabled filters and the sign of the confidence slope,
+   * so the per-pixel loops carry no configuration branches, and precompute the constants derived from #params.
+   * Must be called whenever the configuration changes.
+   */
+  void selectKernels()
+  {
+    joint_bilateral_threshold = (params.joint_bilateral_ab_threshold * params.joint_bilateral_ab_threshold) / (params.ab_multiplier * params.ab_multiplier);
+
+    bool fast_math = enable_fast_math && kernel_type == CpuKernelAVX2;
+
+    switch((enable_bilateral_filter ? 4 : 0) | (enable_edge_filter ? 2 : 0) | (fast_math ? 1 : 0))
+    {
+    case 0: selectKernels<false, false, false>(); break;
+    case 1: selectKernels<false, false, true>(); break;
+    case 2: selectKernels<false, true, false>(); break;
+    case 3: selectKernels<false, true, true>(); break;
+    case 4: selectKernels<true, false, false>(); break;
+    case 5: selectKernels<true, false, true>(); break;
+    case 6: selectKernels<true, true, false>(); break;
+    default: selectKernels<true, true, true>(); break;
+    }
+  }
+
+  /** Size of a plane of the trigonometry tables, padded to keep the next one aligned. */
+  static size_t trigPlaneSize(bool half)
+  {
+    return ScratchArena::alignUp(512 * 424 * (half ? sizeof(uint16_t) : sizeof(float)), ScratchArena::Alignment);
+  }
+
+  /**
+   * Point the planes of the trigonometry tables into a block holding all 18 of them, table by table.
+   * @param block Start of the block.
+   * @param half Whether the planes are in half precision.
+   */
+  void setTrigTablePlanes(unsigned char *block, bool half)
+  {
+    const size_t plane_size = trigPlaneSize(half);
+    TrigTable *tables[3] = { &trig_table0, &trig_table1, &trig_table2 };
+
+    half_trig_tables = half;
+
+    for(int t = 0; t < 3; ++t)
+    {
+      for(int i = 0; i < 6; ++i)
+      {
+        unsigned char *plane = block + (t * 6 + i) * plane_size;
+        tables[t]->planes[i] = half ? 0 : reinterpret_cast<float *>(plane);
+        tables[t]->half_planes[i] = half ? reinterpret_cast<uint16_t *>(plane) : 0;
+      }
+    }
+  }
+
+  /**
+   * (Re)allocate the planes of the trigonometry tables, see #fillTrigTables.
+   * @param half Whether to store them in half precision.
+   */
+  void allocateTrigTables(bool half)
+  {
+    const size_t size = 3 * 6 * trigPlaneSize(half);
+
+    trig_storage.reserve(size, false);
+    setTrigTablePlanes(trig_storage.take(size), half);
+    trig_cache.close();
+  }
+
+  /** Hash of everything the trigonometry tables are computed from, the key of their cache file. */
+  uint64_t trigTableKey()
+  {
+    const uint32_t version = TrigCacheHeader::Version, half = half_trig_tables, flip = flip_ptables;
+
+    uint64_t key = hashBytes(&version, sizeof(version));
+    key = hashBytes(&half, sizeof(half), key);
+    key = hashBytes(&flip, sizeof(flip), key);
+    key = hashBytes(params.phase_in_rad, sizeof(params.phase_in_rad), key);
+    key = hashBytes(p0_table0.buffer(), p0_table0.sizeInBytes(), key);
+    key = hashBytes(p0_table1.buffer(), p0_table1.sizeInBytes(), key);
+    key = hashBytes(p0_table2.buffer(), p0_table2.sizeInBytes(), key);
+    return key;
+  }
+
+  /**
+   * Fill the trigonometry tables from the p0 tables, or map them from the table cache if it holds them already.
+   * The cache file is written after filling, so the next start with the same tables only maps it.
+   * @param serial Serial number of the device, part of the cache file name.
+   */
+  void updateTrigTables(const std::string &serial)
+  {
+    // the planes may still point into the cache file of the previous tables
+    if(trig_cache.data() != 0)
+    {
+      allocateTrigTables(half_trig_tables);
+    }
+
+    std::string path;
+    uint64_t key = 0;
+
+    if(enable_table_cache)
+    {
+      const std::string dir = getCacheDirectory();
+      key = trigTableKey();
+      path = dir.empty() ? dir : dir + cacheFileName("trig", serial, key);
+    }
+
+    if(!path.empty() && mapTrigTables(path, key))
+    {
+      LOG_INFO << "loaded trigonometry tables from " << path;
+      return;
+    }
+
+    fillTrigTables();
+
+    if(!path.empty() && saveTrigTables(path, key))
+    {
+      LOG_INFO << "saved trigonometry tables to " << path;
+    }
+  }
+
+  /**
+   * Point the trigonometry tables into a cache file, the storage of the computed tables is released.
+   * @param path Path of the cache file.
+   * @param key Expected key, see #trigTableKey.
+   * @return Whether the file exists and holds the tables.
+   */
+  bool mapTrigTables(const std::string &path, uint64_t key)
+  {
+    if(!trig_cache.open(path)) return false;
+
+    const TrigCacheHeader *header = reinterpret_cast<const TrigCacheHeader *>(trig_cache.data());
+    const size_t planes_size = 3 * 6 * trigPlaneSize(half_trig_tables);
+
+    if(trig_cache.size() != sizeof(TrigCacheHeader) + planes_size
+      || std::memcmp(header->magic, "FN2TRIG", 8) != 0
+      || header->version != TrigCacheHeader::Version
+      || header->half != (half_trig_tables ? 1u : 0u)
+      || header->key != key
+      || header->planes_size != planes_size)
+    {
+      LOG_WARNING << "ignoring invalid table cache file " << path;
+      trig_cache.close();
+      return false;
+    }
+
+    // the tables are only read while processing, so they can point into the read only mapping
+    setTrigTablePlanes(const_cast<unsigned char *>(trig_cache.data()) + sizeof(TrigCacheHeader), half_trig_tables);
+    trig_storage.release();
+    return true;
+  }
+
+  /**
+   * Write the trigonometry tables computed in #trig_storage to a cache file.
+   * @param path Path of the cache file.
+   * @param key Key of the tables, see #trigTableKey.
+   * @return Whether the file was written.
+   */
+  bool saveTrigTables(const std::string &path, uint64_t key)
+  {
+    TrigCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "FN2TRIG", 8);
+    header.version = TrigCacheHeader::Version;
+    header.half = half_trig_tables ? 1 : 0;
+    header.key = key;
+    header.planes_size = 3 * 6 * trigPlaneSize(half_trig_tables);
+
+    // the planes are consecutive, starting with the first one of the first table
+    const void *planes = half_trig_tables ? static_cast<const void *>(trig_table0.half_planes[0]) : static_cast<const void *>(trig_table0.planes[0]);
+    return writeCacheFile(path, &header, sizeof(header), planes, header.planes_size);
+  }
+
+  /**
+   * (Re)allocate the intermediate buffers of #process in #scratch.
+   * @param huge_pages Whether to try to back them with huge pages.
+   */
+  void allocateScratch(bool huge_pages)
+  {
+    const size_t m_size = ScratchArena::alignUp(424 * 512 * sizeof(Vec<float, 9>), ScratchArena::Alignment);
+    const size_t m_max_edge_test_size = ScratchArena::alignUp(424 * 512 * sizeof(unsigned char), ScratchArena::Alignment);
+    const size_t depth_ir_sum_size = ScratchArena::alignUp(424 * 512 * sizeof(Vec<float, 3>), ScratchArena::Alignment);
+
+    scratch.reserve(2 * m_size + m_max_edge_test_size + depth_ir_sum_size, huge_pages);
+    scratch_huge_pages = huge_pages;
+
+    m_buffer = reinterpret_cast<Vec<float, 9> *>(scratch.take(m_size));
+    m_filtered_buffer = reinterpret_cast<Vec<float, 9> *>(scratch.take(m_size));
+    m_max_edge_test_buffer = scratch.take(m_max_edge_test_size);
+    depth_ir_sum_buffer = reinterpret_cast<Vec<float, 3> *>(scratch.take(depth_ir_sum_size));
+  }
+
+  /** Allocate a new IR or depth frame of the current output size and format. */
+  Frame *newOutputFrame() const
+  {
+    const size_t width = enable_binned_output ? 256 : 512, height = enable_binned_output ? 212 : 424;
+    return enable_uint16_output ? new Frame(width, height, 2, Frame::UInt16) : new Frame(width, height, 4, Frame::Float);
+  }
+
+  /** Allocate a new IR frame. */
+  void newIrFrame()
+  {
+    ir_frame = newOutputFrame();
+    //ir_frame = new Frame(512, 424, 12);
+  }
+
+  /** Allocate a new depth frame. */
+  void newDepthFrame()
+  {
+    depth_frame = newOutputFrame();
+  }
+
+  /**
+   * Allocate the frames of the enabled outputs and release the others.
+   * @param ir Whether IR output is enabled.
+   * @param depth Whether depth output is enabled.
+   */
+  void allocateFrames(bool ir, bool depth)
+  {
+    if(!ir)
+    {
+      delete ir_frame;
+      ir_frame = 0;
+    }
+    else if(ir_frame == 0)
+    {
+      newIrFrame();
+    }
+
+    if(!depth)
+    {
+      delete depth_frame;
+      depth_frame = 0;
+    }
+    else if(depth_frame == 0)
+    {
+      newDepthFrame();
+    }
+  }
+
+  /**
+   * Compute the unpacking positions of the 11 bit measurements, they only depend on the pixel position.
+   * @param [out] plan Decode plan to fill.
+   */
+  static void buildDecodePlan(DecodePlan &plan)
+  {
+    for(int x = 0; x < 512; ++x)
+    {
+      /*
+       r1.yz = r2.xxyx < l(0, 1, 0, 0) // ilt
+       r1.y = r1.z | r1.y // or
+       r1.zw = l(0, 0, 510, 423) < r2.xxxy // ilt
+       r1.z = r1.w | r1.z // or
+       r1.y = r1.z | r1.y // or
+       */
+      plan.invalid[x] = (x < 1 || 510 < x) ? -1 : 0;
+
+      /*
+      bfi r1.z, l(2), l(7), r2.x, l(0)
+      ushr r1.w, r2.x, l(2)
+      r1.z = r1.w + r1.z // iadd
+      */
+      int r1zi = bfi(2, 7, x, 0);
+      int r1wi = x >> 2;
+      r1zi = r1wi + r1zi;
+
+      /*
+      imul null, r1.z, r1.z, l(11)
+      ushr r1.w, r1.z, l(4)
+      r1.z = r1.z & l(15) // and
+       */
+      r1zi = (r1zi * 11L) & 0xffffffff;
+      plan.word[x] = r1zi >> 4;
+      plan.shift[x] = r1zi & 15;
+    }
+
+    // 352 16 bit words per row, the two halves of the image are interleaved
+    for(int y = 0; y < 424; ++y)
+    {
+      plan.row[y] = 352 * (y < 212 ? y + 212 : 423 - y);
+    }
+  }
+
+  int32_t decodePixelMeasurement(unsigned char* data, int sub, int x, int y)
+  {
+    if(decode_plan.invalid[x])
+    {
+      return lut11to16[0];
+    }
+
+    // 298496 = 512 * 424 * 11 / 8 = number of bytes per sub image
+    const uint16_t *ptr = reinterpret_cast<uint16_t *>(data + 298496 * sub) + decode_plan.row[y] + decode_plan.word[x];
+
+    // the 11 bits may span two words
+    uint32_t packed = ptr[0] | (uint32_t(ptr[1]) << 16);
+    return lut11to16[(packed >> decode_plan.shift[x]) & 2047];
+  }
+
+  /**
+   * Initialize cos and sin trigonometry tables for each of the three #phase_in_rad parameters.
+   * With #flip_ptables row y of the trigonometry tables comes from row 423 - y of the p0 table.
+   * @param p0table Angle at every (x, y) position, as received from the device.
+   * @param [out] trig_table 3 cos planes, followed by 3 sin planes for the three phases.
+   * @return Largest error of a stored value (rounding to half precision), 0 for float tables.
+   */
+  float fillTrigTable(Mat<uint16_t> &p0table, TrigTable &trig_table)
+  {
+    float max_error = 0.0f;
+    int i = 0;
+
+    for(int y = 0; y < 424; ++y)
+      for(int x = 0; x < 512; ++x, ++i)
+      {
+        float p0 = -((float)p0table.at(flip_ptables ? 423 - y : y, x)) * 0.000031 * M_PI;
+
+        float tmp0 = p0 + params.phase_in_rad[0];
+        float tmp1 = p0 + params.phase_in_rad[1];
+        float tmp2 = p0 + params.phase_in_rad[2];
+
+        float values[6];
+        values[0] = std::cos(tmp0);
+        values[1] = std::cos(tmp1);
+        values[2] = std::cos(tmp2);
+
+        values[3] = std::sin(-tmp0);
+        values[4] = std::sin(-tmp1);
+        values[5] = std::sin(-tmp2);
+
+        for(int k = 0; k < 6; ++k)
+        {
+          if(trig_table.planes[k] != 0)
+          {
+            trig_table.planes[k][i] = values[k];
+          }
+          else
+          {
+            trig_table.half_planes[k][i] = floatToHalf(values[k]);
+            max_error = std::max(max_error, std::abs(halfToFloat(trig_table.half_planes[k][i]) - values[k]));
+          }
+        }
+      }
+
+    return max_error;
+  }
+
+  /** Fill the trigonometry tables of the three frequencies from the p0 tables. */
+  void fillTrigTables()
+  {
+    float max_error = fillTrigTable(p0_table0, trig_table0);
+    max_error = std::max(max_error, fillTrigTable(p0_table1, trig_table1));
+    max_error = std::max(max_error, fillTrigTable(p0_table2, trig_table2));
+
+    if(half_trig_tables)
+    {
+      LOG_INFO << "half precision trigonometry tables, max error " << max_error;
+    }
+  }
+
+  /**
+   * Process measurement (all three layers).
+   * @param [in] trig_table Trigonometry tables.
+   * @param abMultiplierPerFrq Multiplier.
+   * @param x X position in the image.
+   * @param y Y position in the image.
+   * @param m Measurement.
+   * @param [out] m_out Processed measurement (IR a, IR b, IR amplitude).
+   */
+  void processMeasurementTriple(const TrigTable &trig_table, float abMultiplierPerFrq, int x, int y, const int32_t* m, float* m_out)
+  {
+    int offset = y * 512 + x;
+    float cos_tmp0 = trig_table.at(0, offset);
+    float cos_tmp1 = trig_table.at(1, offset);
+    float cos_tmp2 = trig_table.at(2, offset);
+
+    float sin_negtmp0 = trig_table.at(3, offset);
+    float sin_negtmp1 = trig_table.at(4, offset);
+    float sin_negtmp2 = trig_table.at(5, offset);
+
+    float zmultiplier = z_table.at(y, x);
+    bool cond0 = 0 < zmultiplier;
+    bool cond1 = (m[0] == 32767 || m[1] == 32767 || m[2] == 32767) && cond0;
+
+    // formula given in Patent US 8,587,771 B2
+    float tmp3 = cos_tmp0 * m[0] + cos_tmp1 * m[1] + cos_tmp2 * m[2];
+    float tmp4 = sin_negtmp0 * m[0] + sin_negtmp1 * m[1] + sin_negtmp2 * m[2];
+
+    // only if modeMask & 32 != 0;
+    if(true)//(modeMask & 32) != 0)
+    {
+        tmp3 *= abMultiplierPerFrq;
+        tmp4 *= abMultiplierPerFrq;
+    }
+    float tmp5 = std::sqrt(tmp3 * tmp3 + tmp4 * tmp4) * params.ab_multiplier;
+
+    // invalid pixel because zmultiplier < 0 ??
+    tmp3 = cond0 ? tmp3 : 0;
+    tmp4 = cond0 ? tmp4 : 0;
+    tmp5 = cond0 ? tmp5 : 0;
+
+    // invalid pixel because saturated?
+    tmp3 = !cond1 ? tmp3 : 0;
+    tmp4 = !cond1 ? tmp4 : 0;
+    tmp5 = !cond1 ? tmp5 : 65535.0; // some kind of norm calculated from tmp3 and tmp4
+
+    m_out[0] = tmp3; // ir image a
+    m_out[1] = tmp4; // ir image b
+    m_out[2] = tmp5; // ir amplitude
+  }
+
+  /**
+   * Transform measurement.
+   * @param [in, out] m Measurement.
+   */
+  void transformMeasurements(float* m)
+  {
+    float tmp0 = std::atan2((m[1]), (m[0]));
+    tmp0 = tmp0 < 0 ? tmp0 + M_PI * 2.0f : tmp0;
+    tmp0 = (tmp0 != tmp0) ? 0 : tmp0;
+
+    float tmp1 = std::sqrt(m[0] * m[0] + m[1] * m[1]) * params.ab_multiplier;
+
+    m[0] = tmp0; // phase
+    m[1] = tmp1; // ir amplitude - (possibly bilateral filtered)
+  }
+
+  /**
+   * Process first pixel stage.
+   * @param x Horizontal position.
+   * @param y Vertical position.
+   * @param data
+   * @param [out] m0_out First layer output.
+   * @param [out] m1_out Second layer output.
+   * @param [out] m2_out Third layer output.
+   */
+  void processPixelStage1(int x, int y, unsigned char* data, float *m0_out, float *m1_out, float *m2_out)
+  {
+    int32_t m0_raw[3], m1_raw[3], m2_raw[3];
+
+    m0_raw[0] = decodePixelMeasurement(data, 0, x, y);
+    m0_raw[1] = decodePixelMeasurement(data, 1, x, y);
+    m0_raw[2] = decodePixelMeasurement(data, 2, x, y);
+    m1_raw[0] = decodePixelMeasurement(data, 3, x, y);
+    m1_raw[1] = decodePixelMeasurement(data, 4, x, y);
+    m1_raw[2] = decodePixelMeasurement(data, 5, x, y);
+    m2_raw[0] = decodePixelMeasurement(data, 6, x, y);
+    m2_raw[1] = decodePixelMeasurement(data, 7, x, y);
+    m2_raw[2] = decodePixelMeasurement(data, 8, x, y);
+
+    processMeasurementTriple(trig_table0, params.ab_multiplier_per_frq[0], x, y, m0_raw, m0_out);
+    processMeasurementTriple(trig_table1, params.ab_multiplier_per_frq[1], x, y, m1_raw, m1_out);
+    processMeasurementTriple(trig_table2, params.ab_multiplier_per_frq[2], x, y, m2_raw, m2_out);
+  }
+
+  /**
+   * Filter pixels in stage 1.
+   * @param x Horizontal position.
+   * @param y Vertical position.
+   * @param m Input data?
+   * @param [out] Output data.
+   * @param [out] bilateral_max_edge_test Whether the accumulated distance of each image stayed within limits.
+   */
+  void filterPixelStage1(int x, int y, const Mat<Vec<float, 9> >& m, float* m_out, bool& bilateral_max_edge_test)
+  {
+    const float *m_ptr = (m.ptr(y, x)->val);
+    bilateral_max_edge_test = true;
+
+    if(x < 1 || y < 1 || x > m.width() - 2 || y > m.height() - 2)
+    {
+      for(int i = 0; i < 9; ++i)
+        m_out[i] = m_ptr[i];
+    }
+    else
+    {
+      float m_normalized[2];
+      float other_m_normalized[2];
+
+      int offset = 0;
+
+      for(int i = 0; i < 3; ++i, m_ptr += 3, m_out += 3, offset += 3)
+      {
+        float norm2 = m_ptr[0] * m_ptr[0] + m_ptr[1] * m_ptr[1];
+        float inv_norm = 1.0f / std::sqrt(norm2);
+        inv_norm = (inv_norm == inv_norm) ? inv_norm : std::numeric_limits<float>::infinity();
+
+        m_normalized[0] = m_ptr[0] * inv_norm;
+        m_normalized[1] = m_ptr[1] * inv_norm;
+
+        int j = 0;
+
+        float weight_acc = 0.0f;
+        float weighted_m_acc[2] = {0.0f, 0.0f};
+
+        float threshold = joint_bilateral_threshold;
+        float joint_bilateral_exp = params.joint_bilateral_exp;
+
+        if(norm2 < threshold)
+        {
+          threshold = 0.0f;
+          joint_bilateral_exp = 0.0f;
+        }
+
+        float dist_acc = 0.0f;
+
+        for(int yi = -1; yi < 2; ++yi)
+        {
+          for(int xi = -1; xi < 2; ++xi, ++j)
+          {
+            if(yi == 0 && xi == 0)
+            {
+              weight_acc += params.gaussian_kernel[j];
 
               weighted_m_acc[0] += params.gaussian_kernel[j] * m_ptr[0];
               weighted_m_acc[1] += params.gaussian_kernel[j] * m_ptr[1];
@@ -588,257 +1668,1043 @@ public:
             other_m_normalized[0] = other_m_ptr[0] * other_inv_norm;
             other_m_normalized[1] = other_m_ptr[1] * other_inv_norm;
 
-            float dist = -(other_m_normalized[0] * m_normalized[0] + other_m_normalized[1] * m_normalized[1]);
-            dist += 1.0f;
-            dist *= 0.5f;
+            float dist = -(other_m_normalized[0] * m_normalized[0] + other_m_normalized[1] * m_normalized[1]);
+            dist += 1.0f;
+            dist *= 0.5f;
+
+            float weight = 0.0f;
+
+            if(other_norm2 >= threshold)
+            {
+              weight = (params.gaussian_kernel[j] * std::exp(-1.442695f * joint_bilateral_exp * dist));
+              dist_acc += dist;
+            }
+
+            weighted_m_acc[0] += weight * other_m_ptr[0];
+            weighted_m_acc[1] += weight * other_m_ptr[1];
+
+            weight_acc += weight;
+          }
+        }
+
+        bilateral_max_edge_test = bilateral_max_edge_test && dist_acc < params.joint_bilateral_max_edge;
+
+        m_out[0] = 0.0f < weight_acc ? weighted_m_acc[0] / weight_acc : 0.0f;
+        m_out[1] = 0.0f < weight_acc ? weighted_m_acc[1] / weight_acc : 0.0f;
+        m_out[2] = m_ptr[2];
+      }
+    }
+  }
+
+  template<bool SlopePositive>
+  void processPixelStage2(int x, int y, float *m0, float *m1, float *m2, float *ir_out, float *depth_out, float *ir_sum_out)
+  {
+    //// 10th measurement
+    //float m9 = 1; // decodePixelMeasurement(data, 9, x, y);
+    //
+    //// WTF?
+    //bool cond0 = zmultiplier == 0 || (m9 >= 0 && m9 < 32767);
+    //m9 = std::max(-m9, m9);
+    //// if m9 is positive or pixel is invalid (zmultiplier) we set it to 0 otherwise to its absolute value O.o
+    //m9 = cond0 ? 0 : m9;
+
+    transformMeasurements(m0);
+    transformMeasurements(m1);
+    transformMeasurements(m2);
+
+    float ir_sum = m0[1] + m1[1] + m2[1];
+
+    float phase;
+    // if(DISABLE_DISAMBIGUATION)
+    if(false)
+    {
+        //r0.yz = r3.zx + r4.zx // add
+        //r0.yz = r5.xz + r0.zy // add
+        float phase = m0[0] + m1[0] + m2[0]; // r0.y
+        float tmp1 = m0[2] + m1[2] + m2[2];  // r0.z
+
+        //r7.xyz = r3.zxy + r4.zxy // add
+        //r4.xyz = r5.zyx + r7.xzy // add
+        float tmp2 = m0[0] + m1[0] + m2[0]; // r4.z
+        //r3.zw = r4.xy // mov
+        float tmp3 = m0[2] + m1[2] + m2[2]; // r3.z
+        float tmp4 = m0[1] + m1[1] + m2[1]; // r3.w
+    }
+    else
+    {
+      float ir_min = std::min(std::min(m0[1], m1[1]), m2[1]);
+
+      if (ir_min < params.individual_ab_threshold || ir_sum < params.ab_threshold)
+      {
+        phase = 0;
+      }
+      else
+      {
+        float t0 = m0[0] / (2.0f * M_PI) * 3.0f;
+        float t1 = m1[0] / (2.0f * M_PI) * 15.0f;
+        float t2 = m2[0] / (2.0f * M_PI) * 2.0f;
+
+        float t5 = (std::floor((t1 - t0) * 0.333333f + 0.5f) * 3.0f + t0);
+        float t3 = (-t2 + t5);
+        float t4 = t3 * 2.0f;
+
+        bool c1 = t4 >= -t4; // true if t4 positive
+
+        float f1 = c1 ? 2.0f : -2.0f;
+        float f2 = c1 ? 0.5f : -0.5f;
+        t3 *= f2;
+        t3 = (t3 - std::floor(t3)) * f1;
+
+        bool c2 = 0.5f < std::abs(t3) && std::abs(t3) < 1.5f;
+
+        float t6 = c2 ? t5 + 15.0f : t5;
+        float t7 = c2 ? t1 + 15.0f : t1;
+
+        float t8 = (std::floor((-t2 + t6) * 0.5f + 0.5f) * 2.0f + t2) * 0.5f;
+
+        t6 *= 0.333333f; // = / 3
+        t7 *= 0.066667f; // = / 15
+
+        float t9 = (t8 + t6 + t7); // transformed phase measurements (they are transformed and divided by the values the original values were multiplied with)
+        float t10 = t9 * 0.333333f; // some avg
+
+        t6 *= 2.0f * M_PI;
+        t7 *= 2.0f * M_PI;
+        t8 *= 2.0f * M_PI;
+
+        // some cross product
+        float t8_new = t7 * 0.826977f - t8 * 0.110264f;
+        float t6_new = t8 * 0.551318f - t6 * 0.826977f;
+        float t7_new = t6 * 0.110264f - t7 * 0.551318f;
+
+        t8 = t8_new;
+        t6 = t6_new;
+        t7 = t7_new;
+
+        float norm = t8 * t8 + t6 * t6 + t7 * t7;
+        float mask = t9 >= 0.0f ? 1.0f : 0.0f;
+        t10 *= mask;
+
+        float ir_min_ = std::min(std::min(m0[1], m1[1]), m2[1]);
+        float ir_max_ = std::max(std::max(m0[1], m1[1]), m2[1]);
+
+        float ir_x = SlopePositive ? ir_min_ : ir_max_;
+
+        ir_x = std::log(ir_x);
+        ir_x = (ir_x * params.ab_confidence_slope * 0.301030f + params.ab_confidence_offset) * 3.321928f;
+        ir_x = std::exp(ir_x);
+        ir_x = std::min(params.max_dealias_confidence, std::max(params.min_dealias_confidence, ir_x));
+        ir_x *= ir_x;
+
+        float mask2 = ir_x >= norm ? 1.0f : 0.0f;
+
+        float t11 = t10 * mask2;
+
+        float mask3 = params.max_dealias_confidence * params.max_dealias_confidence >= norm ? 1.0f : 0.0f;
+        t10 *= mask3;
+        phase = true/*(modeMask & 2) != 0*/ ? t11 : t10;
+      }
+    }
+
+    // this seems to be the phase to depth mapping :)
+    float zmultiplier = stage2_z_table->at(y, x);
+    float xmultiplier = stage2_x_table->at(y, x);
+
+    phase = 0 < phase ? phase + params.phase_offset : phase;
+
+    float depth_linear = zmultiplier * phase;
+    float max_depth = phase * params.unambigious_dist * 2;
+
+    bool cond1 = /*(modeMask & 32) != 0*/ true && 0 < depth_linear && 0 < max_depth;
+
+    xmultiplier = (xmultiplier * 90) / (max_depth * max_depth * 8192.0);
+
+    float depth_fit = depth_linear / (-depth_linear * xmultiplier + 1);
+
+    depth_fit = depth_fit < 0 ? 0 : depth_fit;
+    float depth = cond1 ? depth_fit : depth_linear; // r1.y -> later r2.z
+
+    // depth
+    *depth_out = depth;
+    if(ir_sum_out != 0)
+    {
+      *ir_sum_out = ir_sum;
+    }
+
+    // ir
+    //*ir_out = std::min((m1[2]) * ab_output_multiplier, 65535.0f);
+    // ir avg
+    *ir_out = std::min((m0[2] + m1[2] + m2[2]) * 0.3333333f * params.ab_output_multiplier, 65535.0f);
+    //ir_out[0] = std::min(m0[2] * ab_output_multiplier, 65535.0f);
+    //ir_out[1] = std::min(m1[2] * ab_output_multiplier, 65535.0f);
+    //ir_out[2] = std::min(m2[2] * ab_output_multiplier, 65535.0f);
+  }
+
+  void filterPixelStage2(int x, int y, Mat<Vec<float, 3> > &m, bool max_edge_test_ok, float *depth_out)
+  {
+    Vec<float, 3> &depth_and_ir_sum = m.at(y, x);
+    float &raw_depth = depth_and_ir_sum.val[0], &ir_sum = depth_and_ir_sum.val[2];
+
+    if(raw_depth >= params.min_depth && raw_depth <= params.max_depth)
+    {
+      if(x < 1 || y < 1 || x > m.width() - 2 || y > m.height() - 2)
+      {
+        *depth_out = raw_depth;
+      }
+      else
+      {
+        float ir_sum_acc = ir_sum, squared_ir_sum_acc = ir_sum * ir_sum, min_depth = raw_depth, max_depth = raw_depth;
+
+        for(int yi = -1; yi < 2; ++yi)
+        {
+          for(int xi = -1; xi < 2; ++xi)
+          {
+            if(yi == 0 && xi == 0) continue;
+
+            Vec<float, 3> &other = m.at(y + yi, x + xi);
+
+            ir_sum_acc += other.val[2];
+            squared_ir_sum_acc += other.val[2] * other.val[2];
+
+            if(0.0f < other.val[1])
+            {
+              min_depth = std::min(min_depth, other.val[1]);
+              max_depth = std::max(max_depth, other.val[1]);
+            }
+          }
+        }
+
+        float tmp0 = std::sqrt(squared_ir_sum_acc * 9.0f - ir_sum_acc * ir_sum_acc) / 9.0f;
+        float edge_avg = std::max(ir_sum_acc / 9.0f, params.edge_ab_avg_min_value);
+        tmp0 /= edge_avg;
+
+        float abs_min_diff = std::abs(raw_depth - min_depth);
+        float abs_max_diff = std::abs(raw_depth - max_depth);
+
+        float avg_diff = (abs_min_diff + abs_max_diff) * 0.5f;
+        float max_abs_diff = std::max(abs_min_diff, abs_max_diff);
 
-            float weight = 0.0f;
+        bool cond0 =
+            0.0f < raw_depth &&
+            tmp0 >= params.edge_ab_std_dev_threshold &&
+            params.edge_close_delta_threshold < abs_min_diff &&
+            params.edge_far_delta_threshold < abs_max_diff &&
+            params.edge_max_delta_threshold < max_abs_diff &&
+            params.edge_avg_delta_threshold < avg_diff;
 
-            if(other_norm2 >= threshold)
-            {
-              weight = (params.gaussian_kernel[j] * std::exp(-1.442695f * joint_bilateral_exp * dist));
-              dist_acc += dist;
-            }
+        *depth_out = cond0 ? 0.0f : raw_depth;
 
-            weighted_m_acc[0] += weight * other_m_ptr[0];
-            weighted_m_acc[1] += weight * other_m_ptr[1];
+        if(!cond0)
+        {
+          if(max_edge_test_ok)
+          {
+            //float tmp1 = 1500.0f > raw_depth ? 30.0f : 0.02f * raw_depth;
+            float edge_count = 0.0f;
 
-            weight_acc += weight;
+            *depth_out = edge_count > params.max_edge_count ? 0.0f : raw_depth;
+          }
+          else
+          {
+            *depth_out = !max_edge_test_ok ? 0.0f : raw_depth;
+            *depth_out = true ? *depth_out : raw_depth;
           }
         }
+      }
+    }
+    else
+    {
+      *depth_out = 0.0f;
+    }
 
-        bilateral_max_edge_test = bilateral_max_edge_test && dist_acc < params.joint_bilateral_max_edge;
+    // override raw depth
+    depth_and_ir_sum.val[0] = depth_and_ir_sum.val[1];
+  }
 
-        m_out[0] = 0.0f < weight_acc ? weighted_m_acc[0] / weight_acc : 0.0f;
-        m_out[1] = 0.0f < weight_acc ? weighted_m_acc[1] / weight_acc : 0.0f;
-        m_out[2] = m_ptr[2];
-      }
+#ifdef LIBFREENECT2_CPU_X86
+  /**
+   * SSE2 version of #decodePixelMeasurement for 4 adjacent pixels.
+   * SSE2 has neither gathers nor variable shifts, so the values are unpacked per lane
+   * with the positions from #decode_plan.
+   * @param data Packet data.
+   * @param sub Sub image to decode.
+   * @param x First horizontal position, multiple of 4.
+   * @param y Vertical position.
+   * @return Decoded measurements.
+   */
+  LIBFREENECT2_TARGET_SSE2
+  __m128i decodePixelMeasurementSSE2(unsigned char *data, int sub, int x, int y)
+  {
+    const uint16_t *row = reinterpret_cast<uint16_t *>(data + 298496 * sub) + decode_plan.row[y];
+    const int32_t *word = decode_plan.word + x, *shift = decode_plan.shift + x, *invalid = decode_plan.invalid + x;
+    __m128i v[4];
+
+    for(int lane = 0; lane < 4; ++lane)
+    {
+      uint32_t packed = row[word[lane]] | (uint32_t(row[word[lane] + 1]) << 16);
+      v[lane] = _mm_cvtsi32_si128(lut11to16[invalid[lane] ? 0 : (packed >> shift[lane]) & 2047]);
     }
+
+    // assemble in registers, going through memory stalls on store forwarding
+    return _mm_unpacklo_epi64(_mm_unpacklo_epi32(v[0], v[1]), _mm_unpacklo_epi32(v[2], v[3]));
   }
 
-  void processPixelStage2(int x, int y, float *m0, float *m1, float *m2, float *ir_out, float *depth_out, float *ir_sum_out)
+  /**
+   * SSE2 version of #processMeasurementTriple for 4 adjacent pixels.
+   * @param trig_table Trigonometry tables of the frequency.
+   * @param abMultiplierPerFrq Multiplier of the frequency.
+   * @param sub First sub image of the frequency.
+   * @param x First horizontal position, multiple of 4.
+   * @param y Vertical position.
+   * @param data Packet data.
+   * @param [out] m_out Output of the first pixel, the measurements of the next pixels follow with a stride of 9 floats.
+   */
+  LIBFREENECT2_TARGET_SSE2
+  void processMeasurementTripleSSE2(const TrigTable &trig_table, float abMultiplierPerFrq, int sub, int x, int y, unsigned char *data, float *m_out)
   {
-    //// 10th measurement
-    //float m9 = 1; // decodePixelMeasurement(data, 9, x, y);
-    //
-    //// WTF?
-    //bool cond0 = zmultiplier == 0 || (m9 >= 0 && m9 < 32767);
-    //m9 = std::max(-m9, m9);
-    //// if m9 is positive or pixel is invalid (zmultiplier) we set it to 0 otherwise to its absolute value O.o
-    //m9 = cond0 ? 0 : m9;
+    const int offset = y * 512 + x;
+    __m128 m[3], cos_tmp[3], sin_negtmp[3];
+    __m128i saturated = _mm_setzero_si128();
 
-    transformMeasurements(m0);
-    transformMeasurements(m1);
-    transformMeasurements(m2);
+    for(int k = 0; k < 3; ++k)
+    {
+      __m128i v = decodePixelMeasurementSSE2(data, sub + k, x, y);
+      saturated = _mm_or_si128(saturated, _mm_cmpeq_epi32(v, _mm_set1_epi32(32767)));
+      m[k] = _mm_cvtepi32_ps(v);
 
-    float ir_sum = m0[1] + m1[1] + m2[1];
+      if(trig_table.planes[k] != 0)
+      {
+        cos_tmp[k] = _mm_load_ps(trig_table.planes[k] + offset);
+        sin_negtmp[k] = _mm_load_ps(trig_table.planes[3 + k] + offset);
+      }
+      else
+      {
+        cos_tmp[k] = loadHalfSSE2(trig_table.half_planes[k] + offset);
+        sin_negtmp[k] = loadHalfSSE2(trig_table.half_planes[3 + k] + offset);
+      }
+    }
 
-    float phase;
-    // if(DISABLE_DISAMBIGUATION)
-    if(false)
+    __m128 cond0 = _mm_cmplt_ps(_mm_setzero_ps(), _mm_loadu_ps(z_table.ptr(y, x)));
+    __m128 cond1 = _mm_and_ps(_mm_castsi128_ps(saturated), cond0);
+
+    __m128 tmp3 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cos_tmp[0], m[0]), _mm_mul_ps(cos_tmp[1], m[1])), _mm_mul_ps(cos_tmp[2], m[2]));
+    __m128 tmp4 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sin_negtmp[0], m[0]), _mm_mul_ps(sin_negtmp[1], m[1])), _mm_mul_ps(sin_negtmp[2], m[2]));
+
+    tmp3 = _mm_mul_ps(tmp3, _mm_set1_ps(abMultiplierPerFrq));
+    tmp4 = _mm_mul_ps(tmp4, _mm_set1_ps(abMultiplierPerFrq));
+    __m128 tmp5 = _mm_mul_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(tmp3, tmp3), _mm_mul_ps(tmp4, tmp4))), _mm_set1_ps(params.ab_multiplier));
+
+    __m128 valid = _mm_andnot_ps(cond1, cond0);
+    tmp3 = _mm_and_ps(tmp3, valid);
+    tmp4 = _mm_and_ps(tmp4, valid);
+    tmp5 = _mm_or_ps(_mm_and_ps(tmp5, valid), _mm_and_ps(cond1, _mm_set1_ps(65535.0f)));
+
+    float tmp[3][4];
+    _mm_storeu_ps(tmp[0], tmp3);
+    _mm_storeu_ps(tmp[1], tmp4);
+    _mm_storeu_ps(tmp[2], tmp5);
+
+    for(int lane = 0; lane < 4; ++lane, m_out += 9)
     {
-        //r0.yz = r3.zx + r4.zx // add
-        //r0.yz = r5.xz + r0.zy // add
-        float phase = m0[0] + m1[0] + m2[0]; // r0.y
-        float tmp1 = m0[2] + m1[2] + m2[2];  // r0.z
+      m_out[0] = tmp[0][lane];
+      m_out[1] = tmp[1][lane];
+      m_out[2] = tmp[2][lane];
+    }
+  }
 
-        //r7.xyz = r3.zxy + r4.zxy // add
-        //r4.xyz = r5.zyx + r7.xzy // add
-        float tmp2 = m0[0] + m1[0] + m2[0]; // r4.z
-        //r3.zw = r4.xy // mov
-        float tmp3 = m0[2] + m1[2] + m2[2]; // r3.z
-        float tmp4 = m0[1] + m1[1] + m2[1]; // r3.w
+  /**
+   * SSE2 version of #processPixelStage1 for a range of columns of a row.
+   * @param y Vertical position.
+   * @param x_begin First column, multiple of 4.
+   * @param x_end Column just after the last column, multiple of 4.
+   * @param data Packet data.
+   * @param [out] m_out Output of the row (9 floats per pixel).
+   */
+  LIBFREENECT2_TARGET_SSE2
+  void processRowStage1SSE2(int y, int x_begin, int x_end, unsigned char *data, float *m_out)
+  {
+    m_out += x_begin * 9;
+
+    for(int x = x_begin; x < x_end; x += 4, m_out += 4 * 9)
+    {
+      processMeasurementTripleSSE2(trig_table0, params.ab_multiplier_per_frq[0], 0, x, y, data, m_out + 0);
+      processMeasurementTripleSSE2(trig_table1, params.ab_multiplier_per_frq[1], 3, x, y, data, m_out + 3);
+      processMeasurementTripleSSE2(trig_table2, params.ab_multiplier_per_frq[2], 6, x, y, data, m_out + 6);
     }
-    else
+  }
+
+  /**
+   * AVX2 version of #decodePixelMeasurement for 8 adjacent pixels.
+   * The two 16 bit words holding the 11 bit value are fetched with one 32 bit gather,
+   * the lookup table is read with a second gather.
+   * @param data Packet data.
+   * @param sub Sub image to decode.
+   * @param y Vertical position.
+   * @param word Index of the first 16 bit word of each pixel in the row.
+   * @param shift Bit offset of each pixel in its first word.
+   * @param invalid Mask of the pixels outside the valid columns.
+   * @return Decoded measurements.
+   */
+  LIBFREENECT2_TARGET_AVX2
+  __m256i decodePixelMeasurementAVX2(unsigned char *data, int sub, int y, __m256i word, __m256i shift, __m256i invalid)
+  {
+    const int *row = reinterpret_cast<const int *>(reinterpret_cast<uint16_t *>(data + 298496 * sub) + decode_plan.row[y]);
+
+    __m256i packed = _mm256_i32gather_epi32(row, word, 2);
+    __m256i lut_idx = _mm256_and_si256(_mm256_srlv_epi32(packed, shift), _mm256_set1_epi32(2047));
+
+    // the lut holds 16 bit values, sign extend the lower half of the gathered 32 bits
+    __m256i v = _mm256_i32gather_epi32(reinterpret_cast<const int *>(lut11to16), lut_idx, 2);
+    v = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+
+    return _mm256_blendv_epi8(v, _mm256_set1_epi32(lut11to16[0]), invalid);
+  }
+
+  /**
+   * AVX2 version of #processMeasurementTriple for 8 adjacent pixels.
+   * @param trig_table Trigonometry tables of the frequency.
+   * @param abMultiplierPerFrq Multiplier of the frequency.
+   * @param sub First sub image of the frequency.
+   * @param x First horizontal position, multiple of 8.
+   * @param y Vertical position.
+   * @param data Packet data.
+   * @param word Index of the first 16 bit word of each pixel in the row.
+   * @param shift Bit offset of each pixel in its first word.
+   * @param invalid Mask of the pixels outside the valid columns.
+   * @param [out] m_out Output of the first pixel, the measurements of the next pixels follow with a stride of 9 floats.
+   */
+  LIBFREENECT2_TARGET_AVX2
+  void processMeasurementTripleAVX2(const TrigTable &trig_table, float abMultiplierPerFrq, int sub, int x, int y, unsigned char *data,
+                                    __m256i word, __m256i shift, __m256i invalid, float *m_out)
+  {
+    const int offset = y * 512 + x;
+
+    __m256 m[3], cos_tmp[3], sin_negtmp[3];
+    __m256i saturated = _mm256_setzero_si256();
+
+    for(int k = 0; k < 3; ++k)
     {
-      float ir_min = std::min(std::min(m0[1], m1[1]), m2[1]);
+      __m256i v = decodePixelMeasurementAVX2(data, sub + k, y, word, shift, invalid);
+      saturated = _mm256_or_si256(saturated, _mm256_cmpeq_epi32(v, _mm256_set1_epi32(32767)));
+      m[k] = _mm256_cvtepi32_ps(v);
 
-      if (ir_min < params.individual_ab_threshold || ir_sum < params.ab_threshold)
+      if(trig_table.planes[k] != 0)
       {
-        phase = 0;
+        cos_tmp[k] = _mm256_load_ps(trig_table.planes[k] + offset);
+        sin_negtmp[k] = _mm256_load_ps(trig_table.planes[3 + k] + offset);
       }
       else
       {
-        float t0 = m0[0] / (2.0f * M_PI) * 3.0f;
-        float t1 = m1[0] / (2.0f * M_PI) * 15.0f;
-        float t2 = m2[0] / (2.0f * M_PI) * 2.0f;
+        cos_tmp[k] = loadHalfAVX2(trig_table.half_planes[k] + offset);
+        sin_negtmp[k] = loadHalfAVX2(trig_table.half_planes[3 + k] + offset);
+      }
+    }
 
-        float t5 = (std::floor((t1 - t0) * 0.333333f + 0.5f) * 3.0f + t0);
-        float t3 = (-t2 + t5);
-        float t4 = t3 * 2.0f;
+    __m256 cond0 = _mm256_cmp_ps(_mm256_setzero_ps(), _mm256_loadu_ps(z_table.ptr(y, x)), _CMP_LT_OQ);
+    __m256 cond1 = _mm256_and_ps(_mm256_castsi256_ps(saturated), cond0);
 
-        bool c1 = t4 >= -t4; // true if t4 positive
+    __m256 tmp3 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cos_tmp[0], m[0]), _mm256_mul_ps(cos_tmp[1], m[1])), _mm256_mul_ps(cos_tmp[2], m[2]));
+    __m256 tmp4 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sin_negtmp[0], m[0]), _mm256_mul_ps(sin_negtmp[1], m[1])), _mm256_mul_ps(sin_negtmp[2], m[2]));
 
-        float f1 = c1 ? 2.0f : -2.0f;
-        float f2 = c1 ? 0.5f : -0.5f;
-        t3 *= f2;
-        t3 = (t3 - std::floor(t3)) * f1;
+    tmp3 = _mm256_mul_ps(tmp3, _mm256_set1_ps(abMultiplierPerFrq));
+    tmp4 = _mm256_mul_ps(tmp4, _mm256_set1_ps(abMultiplierPerFrq));
+    __m256 tmp5 = _mm256_mul_ps(_mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(tmp3, tmp3), _mm256_mul_ps(tmp4, tmp4))), _mm256_set1_ps(params.ab_multiplier));
 
-        bool c2 = 0.5f < std::abs(t3) && std::abs(t3) < 1.5f;
+    __m256 valid = _mm256_andnot_ps(cond1, cond0);
+    tmp3 = _mm256_and_ps(tmp3, valid);
+    tmp4 = _mm256_and_ps(tmp4, valid);
+    tmp5 = _mm256_blendv_ps(_mm256_and_ps(tmp5, valid), _mm256_set1_ps(65535.0f), cond1);
 
-        float t6 = c2 ? t5 + 15.0f : t5;
-        float t7 = c2 ? t1 + 15.0f : t1;
+    float tmp[3][8];
+    _mm256_storeu_ps(tmp[0], tmp3);
+    _mm256_storeu_ps(tmp[1], tmp4);
+    _mm256_storeu_ps(tmp[2], tmp5);
 
-        float t8 = (std::floor((-t2 + t6) * 0.5f + 0.5f) * 2.0f + t2) * 0.5f;
+    for(int lane = 0; lane < 8; ++lane, m_out += 9)
+    {
+      m_out[0] = tmp[0][lane];
+      m_out[1] = tmp[1][lane];
+      m_out[2] = tmp[2][lane];
+    }
+  }
 
-        t6 *= 0.333333f; // = / 3
-        t7 *= 0.066667f; // = / 15
+  /**
+   * AVX2 version of #processPixelStage1 for a range of columns of a row.
+   * @param y Vertical position.
+   * @param x_begin First column, multiple of 8.
+   * @param x_end Column just after the last column, multiple of 8.
+   * @param data Packet data.
+   * @param [out] m_out Output of the row (9 floats per pixel).
+   */
+  LIBFREENECT2_TARGET_AVX2
+  void processRowStage1AVX2(int y, int x_begin, int x_end, unsigned char *data, float *m_out)
+  {
+    m_out += x_begin * 9;
 
-        float t9 = (t8 + t6 + t7); // transformed phase measurements (they are transformed and divided by the values the original values were multiplied with)
-        float t10 = t9 * 0.333333f; // some avg
+    for(int x = x_begin; x < x_end; x += 8, m_out += 8 * 9)
+    {
+      __m256i word = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(decode_plan.word + x));
+      __m256i shift = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(decode_plan.shift + x));
+      __m256i invalid = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(decode_plan.invalid + x));
 
-        t6 *= 2.0f * M_PI;
-        t7 *= 2.0f * M_PI;
-        t8 *= 2.0f * M_PI;
+      processMeasurementTripleAVX2(trig_table0, params.ab_multiplier_per_frq[0], 0, x, y, data, word, shift, invalid, m_out + 0);
+      processMeasurementTripleAVX2(trig_table1, params.ab_multiplier_per_frq[1], 3, x, y, data, word, shift, invalid, m_out + 3);
+      processMeasurementTripleAVX2(trig_table2, params.ab_multiplier_per_frq[2], 6, x, y, data, word, shift, invalid, m_out + 6);
+    }
 
-        // some cross product
-        float t8_new = t7 * 0.826977f - t8 * 0.110264f;
-        float t6_new = t8 * 0.551318f - t6 * 0.826977f;
-        float t7_new = t6 * 0.110264f - t7 * 0.551318f;
+    // the rest of the pipeline is compiled for SSE, avoid the AVX-SSE transition penalty
+    _mm256_zeroupper();
+  }
 
-        t8 = t8_new;
-        t6 = t6_new;
-        t7 = t7_new;
+  /**
+   * AVX2 version of #processPixelStage2 for 8 adjacent pixels.
+   * atan2, log and exp are replaced by the approximations #phaseAVX2, #logAVX2 and #expAVX2,
+   * the branches of the phase unwrapping by masked blends. Unlike the scalar version, @p m is not modified.
+   * @param x First horizontal position, multiple of 8.
+   * @param y Vertical position.
+   * @param m Measurements of the first pixel (9 floats per pixel).
+   * @param [out] ir_out IR output of the 8 pixels.
+   * @param [out] depth_out Depth output of the 8 pixels.
+   * @param [out] ir_sum_out Sum of the IR amplitudes of the 8 pixels, may be 0.
+   */
+  template<bool SlopePositive>
+  LIBFREENECT2_TARGET_AVX2
+  void processPixelsStage2AVX2(int x, int y, const float *m, float *ir_out, float *depth_out, float *ir_sum_out)
+  {
+    const __m256i idx = _mm256_setr_epi32(0, 9, 18, 27, 36, 45, 54, 63);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 ab_multiplier = _mm256_set1_ps(params.ab_multiplier);
+
+    __m256 phase[3], ir[3], ir_out_sum = zero;
+
+    for(int k = 0; k < 3; ++k)
+    {
+      __m256 a = _mm256_i32gather_ps(m + 3 * k + 0, idx, 4);
+      __m256 b = _mm256_i32gather_ps(m + 3 * k + 1, idx, 4);
+
+      phase[k] = phaseAVX2(b, a);
+      ir[k] = _mm256_mul_ps(_mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b))), ab_multiplier);
+      ir_out_sum = _mm256_add_ps(ir_out_sum, _mm256_i32gather_ps(m + 3 * k + 2, idx, 4));
+    }
+
+    __m256 ir_sum = _mm256_add_ps(_mm256_add_ps(ir[0], ir[1]), ir[2]);
+    __m256 ir_min = _mm256_min_ps(ir[2], _mm256_min_ps(ir[1], ir[0]));
+    __m256 ir_max = _mm256_max_ps(ir[2], _mm256_max_ps(ir[1], ir[0]));
+
+    __m256 t0 = _mm256_mul_ps(phase[0], _mm256_set1_ps(float(3.0 / (2.0 * M_PI))));
+    __m256 t1 = _mm256_mul_ps(phase[1], _mm256_set1_ps(float(15.0 / (2.0 * M_PI))));
+    __m256 t2 = _mm256_mul_ps(phase[2], _mm256_set1_ps(float(2.0 / (2.0 * M_PI))));
+
+    __m256 t5 = _mm256_add_ps(_mm256_mul_ps(_mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(t1, t0), _mm256_set1_ps(0.333333f)), half)), _mm256_set1_ps(3.0f)), t0);
+    __m256 t3 = _mm256_sub_ps(t5, t2);
+
+    // c1: t3 positive, t3 = frac(t3 / 2) * 2 with the sign of t3
+    __m256 c1 = _mm256_cmp_ps(t3, zero, _CMP_GE_OQ);
+    __m256 sign = _mm256_andnot_ps(c1, _mm256_set1_ps(-0.0f));
+    t3 = _mm256_mul_ps(t3, _mm256_xor_ps(half, sign));
+    t3 = _mm256_mul_ps(_mm256_sub_ps(t3, _mm256_floor_ps(t3)), _mm256_xor_ps(_mm256_set1_ps(2.0f), sign));
+
+    __m256 abs_t3 = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), t3);
+    __m256 c2 = _mm256_and_ps(_mm256_cmp_ps(half, abs_t3, _CMP_LT_OQ), _mm256_cmp_ps(abs_t3, _mm256_set1_ps(1.5f), _CMP_LT_OQ));
+
+    __m256 t6 = _mm256_add_ps(t5, _mm256_and_ps(c2, _mm256_set1_ps(15.0f)));
+    __m256 t7 = _mm256_add_ps(t1, _mm256_and_ps(c2, _mm256_set1_ps(15.0f)));
+
+    __m256 t8 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(t6, t2), half), half)), _mm256_set1_ps(2.0f)), t2), half);
+
+    t6 = _mm256_mul_ps(t6, _mm256_set1_ps(0.333333f));
+    t7 = _mm256_mul_ps(t7, _mm256_set1_ps(0.066667f));
+
+    __m256 t9 = _mm256_add_ps(_mm256_add_ps(t8, t6), t7);
+    __m256 t10 = _mm256_mul_ps(t9, _mm256_set1_ps(0.333333f));
+
+    const __m256 two_pi = _mm256_set1_ps(float(2.0 * M_PI));
+    t6 = _mm256_mul_ps(t6, two_pi);
+    t7 = _mm256_mul_ps(t7, two_pi);
+    t8 = _mm256_mul_ps(t8, two_pi);
+
+    __m256 t8_new = _mm256_sub_ps(_mm256_mul_ps(t7, _mm256_set1_ps(0.826977f)), _mm256_mul_ps(t8, _mm256_set1_ps(0.110264f)));
+    __m256 t6_new = _mm256_sub_ps(_mm256_mul_ps(t8, _mm256_set1_ps(0.551318f)), _mm256_mul_ps(t6, _mm256_set1_ps(0.826977f)));
+    __m256 t7_new = _mm256_sub_ps(_mm256_mul_ps(t6, _mm256_set1_ps(0.110264f)), _mm256_mul_ps(t7, _mm256_set1_ps(0.551318f)));
+
+    __m256 norm = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(t8_new, t8_new), _mm256_mul_ps(t6_new, t6_new)), _mm256_mul_ps(t7_new, t7_new));
+    t10 = _mm256_and_ps(t10, _mm256_cmp_ps(t9, zero, _CMP_GE_OQ));
+
+    __m256 ir_x = SlopePositive ? ir_min : ir_max;
+    ir_x = logAVX2(ir_x);
+    ir_x = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(ir_x, _mm256_set1_ps(params.ab_confidence_slope * 0.301030f)), _mm256_set1_ps(params.ab_confidence_offset)), _mm256_set1_ps(3.321928f));
+    ir_x = expAVX2(ir_x);
+    ir_x = _mm256_min_ps(_mm256_max_ps(ir_x, _mm256_set1_ps(params.min_dealias_confidence)), _mm256_set1_ps(params.max_dealias_confidence));
+    ir_x = _mm256_mul_ps(ir_x, ir_x);
+
+    __m256 p = _mm256_and_ps(t10, _mm256_cmp_ps(ir_x, norm, _CMP_GE_OQ));
+
+    // too weak signal
+    __m256 invalid = _mm256_or_ps(_mm256_cmp_ps(ir_min, _mm256_set1_ps(params.individual_ab_threshold), _CMP_LT_OQ),
+                                  _mm256_cmp_ps(ir_sum, _mm256_set1_ps(params.ab_threshold), _CMP_LT_OQ));
+    p = _mm256_andnot_ps(invalid, p);
+
+    // phase to depth mapping
+    __m256 zmultiplier = _mm256_loadu_ps(stage2_z_table->ptr(y, x));
+    __m256 xmultiplier = _mm256_loadu_ps(stage2_x_table->ptr(y, x));
+
+    p = _mm256_add_ps(p, _mm256_and_ps(_mm256_cmp_ps(zero, p, _CMP_LT_OQ), _mm256_set1_ps(params.phase_offset)));
+
+    __m256 depth_linear = _mm256_mul_ps(zmultiplier, p);
+    __m256 max_depth = _mm256_mul_ps(p, _mm256_set1_ps(params.unambigious_dist * 2));
+
+    __m256 cond1 = _mm256_and_ps(_mm256_cmp_ps(zero, depth_linear, _CMP_LT_OQ), _mm256_cmp_ps(zero, max_depth, _CMP_LT_OQ));
+
+    xmultiplier = _mm256_div_ps(_mm256_mul_ps(xmultiplier, _mm256_set1_ps(90.0f)), _mm256_mul_ps(_mm256_mul_ps(max_depth, max_depth), _mm256_set1_ps(8192.0f)));
+
+    __m256 depth_fit = _mm256_div_ps(depth_linear, _mm256_sub_ps(one, _mm256_mul_ps(depth_linear, xmultiplier)));
+    depth_fit = _mm256_and_ps(depth_fit, _mm256_cmp_ps(depth_fit, zero, _CMP_NLT_UQ));
+
+    _mm256_storeu_ps(depth_out, _mm256_blendv_ps(depth_linear, depth_fit, cond1));
+    if(ir_sum_out != 0)
+    {
+      _mm256_storeu_ps(ir_sum_out, ir_sum);
+    }
+
+    __m256 ir_avg = _mm256_mul_ps(_mm256_mul_ps(ir_out_sum, _mm256_set1_ps(0.3333333f)), _mm256_set1_ps(params.ab_output_multiplier));
+    _mm256_storeu_ps(ir_out, _mm256_min_ps(_mm256_set1_ps(65535.0f), ir_avg));
+  }
+
+  /**
+   * AVX2 version of #processPixelStage2 for a range of columns of a row.
+   * @param y Vertical position.
+   * @param x_begin First column, multiple of 8.
+   * @param x_end Column just after the last column, multiple of 8.
+   * @param m Measurements of the row (9 floats per pixel).
+   * @param [out] ir_out IR output of the row.
+   * @param [out] depth_out Depth output of the row.
+   * @param [out] ir_sum_out Sum of the IR amplitudes of the row, may be 0.
+   */
+  template<bool SlopePositive>
+  LIBFREENECT2_TARGET_AVX2
+  void processRowStage2AVX2(int y, int x_begin, int x_end, const float *m, float *ir_out, float *depth_out, float *ir_sum_out)
+  {
+    for(int x = x_begin; x < x_end; x += 8)
+    {
+      processPixelsStage2AVX2<SlopePositive>(x, y, m + 9 * x, ir_out + x, depth_out + x, ir_sum_out != 0 ? ir_sum_out + x : 0);
+    }
+
+    _mm256_zeroupper();
+  }
+#endif // LIBFREENECT2_CPU_X86
+
+  /**
+   * Decode the measurements of a band of rows, within the columns of #stage1_roi.
+   * @param ctx Buffers of the current frame.
+   * @param y_begin First row of the band.
+   * @param y_end Row just after the last row of the band.
+   */
+  void processStage1Rows(FrameContext &ctx, int y_begin, int y_end)
+  {
+    const int x_begin = stage1_roi.x_begin, x_end = stage1_roi.x_end;
+
+    for(int y = y_begin; y < y_end; ++y)
+    {
+      float *m_ptr = (ctx.m->ptr(y, 0)->val);
+
+      // the vector kernels round the columns out to whole vectors, the extra pixels are unused
+      switch(kernel_type)
+      {
+#ifdef LIBFREENECT2_CPU_X86
+      case CpuKernelAVX2:
+        processRowStage1AVX2(y, x_begin & ~7, (x_end + 7) & ~7, ctx.data, m_ptr);
+        break;
+      case CpuKernelSSE2:
+        processRowStage1SSE2(y, x_begin & ~3, (x_end + 3) & ~3, ctx.data, m_ptr);
+        break;
+#endif
+      default:
+        m_ptr += x_begin * 9;
+
+        for(int x = x_begin; x < x_end; ++x, m_ptr += 9)
+        {
+          processPixelStage1(x, y, ctx.data, m_ptr + 0, m_ptr + 3, m_ptr + 6);
+        }
+      }
+    }
+  }
+
+  /**
+   * Bilateral filter and compute the depth of a band of rows, within the columns of #stage2_roi.
+   * The filter reads one halo row above and below the band, so stage 1 must be
+   * complete for the whole frame before this runs.
+   * @param ctx Buffers of the current frame.
+   * @param y_begin First row of the band.
+   * @param y_end Row just after the last row of the band.
+   */
+  template<bool BilateralFilter, bool EdgeFilter, bool FastMath, bool SlopePositive>
+  void processStage2Rows(FrameContext &ctx, int y_begin, int y_end)
+  {
+    const int x_begin = stage2_roi.x_begin, x_end = stage2_roi.x_end;
+    Mat<Vec<float, 9> > &m = BilateralFilter ? *ctx.m_filtered : *ctx.m_stage2;
+
+    for(int y = y_begin; y < y_end; ++y)
+    {
+      unsigned char *m_max_edge_test_ptr = ctx.m_max_edge_test->ptr(y, x_begin);
+
+      if(BilateralFilter)
+      {
+        float *m_filtered_ptr = (ctx.m_filtered->ptr(y, x_begin)->val);
+
+        for(int x = x_begin; x < x_end; ++x, m_filtered_ptr += 9, ++m_max_edge_test_ptr)
+        {
+          bool max_edge_test_val = true;
+          filterPixelStage1(x, y, *ctx.m_stage2, m_filtered_ptr, max_edge_test_val);
+          *m_max_edge_test_ptr = max_edge_test_val ? 1 : 0;
+        }
+      }
+      else
+      {
+        std::fill(m_max_edge_test_ptr, m_max_edge_test_ptr + (x_end - x_begin), 1);
+      }
+    }
+
+    if(EdgeFilter)
+    {
+      for(int y = y_begin; y < y_end; ++y)
+      {
+        float raw_depth[512], ir_sum[512], ir_row[512];
+        float *ir_out = ctx.out_ir != 0 ? ctx.outputRow(ctx.out_ir, y, ir_row) : ir_row;
+
+        processRowStage2<FastMath, SlopePositive>(y, x_begin, x_end, m.ptr(y, 0)->val, ir_out, raw_depth, ir_sum);
+
+        if(ctx.out_ir != 0) ctx.storeRow(ctx.out_ir, y, ir_out, x_begin, x_end);
+
+        unsigned char *m_max_edge_test_ptr = ctx.m_max_edge_test->ptr(y, x_begin);
+        Vec<float, 3> *depth_ir_sum_ptr = ctx.depth_ir_sum->ptr(y, x_begin);
+
+        for(int x = x_begin; x < x_end; ++x, ++m_max_edge_test_ptr, ++depth_ir_sum_ptr)
+        {
+          depth_ir_sum_ptr->val[0] = raw_depth[x];
+          depth_ir_sum_ptr->val[1] = *m_max_edge_test_ptr == 1 ? raw_depth[x] : 0;
+          depth_ir_sum_ptr->val[2] = ir_sum[x];
+        }
+      }
+    }
+    else
+    {
+      for(int y = y_begin; y < y_end; ++y)
+      {
+        float ir_row[512], depth_row[512];
+        float *ir_out = ctx.out_ir != 0 ? ctx.outputRow(ctx.out_ir, y, ir_row) : ir_row;
+        float *depth_out = ctx.outputRow(ctx.out_depth, y, depth_row);
 
-        float norm = t8 * t8 + t6 * t6 + t7 * t7;
-        float mask = t9 >= 0.0f ? 1.0f : 0.0f;
-        t10 *= mask;
+        processRowStage2<FastMath, SlopePositive>(y, x_begin, x_end, m.ptr(y, 0)->val, ir_out, depth_out, 0);
 
-        bool slope_positive = 0 < params.ab_confidence_slope;
+        if(ctx.out_ir != 0) ctx.storeRow(ctx.out_ir, y, ir_out, x_begin, x_end);
+        ctx.storeRow(ctx.out_depth, y, depth_out, x_begin, x_end);
+      }
+    }
+  }
 
-        float ir_min_ = std::min(std::min(m0[1], m1[1]), m2[1]);
-        float ir_max_ = std::max(std::max(m0[1], m1[1]), m2[1]);
+  /**
+   * Compute the depth of a range of columns of a row, with the vectorized approximations in fast math mode.
+   * FastMath must only be set if the AVX2 kernels are supported, which round the columns out to whole
+   * vectors. The pixels outside the region of interest are cleared after the last pass.
+   * @param y Vertical position.
+   * @param x_begin First column.
+   * @param x_end Column just after the last column.
+   * @param m_ptr Measurements of the row (9 floats per pixel).
+   * @param [out] ir_out IR output of the row.
+   * @param [out] depth_out Depth output of the row.
+   * @param [out] ir_sum_out Sum of the IR amplitudes of the row, may be 0.
+   */
+  template<bool FastMath, bool SlopePositive>
+  void processRowStage2(int y, int x_begin, int x_end, float *m_ptr, float *ir_out, float *depth_out, float *ir_sum_out)
+  {
+#ifdef LIBFREENECT2_CPU_X86
+    if(FastMath)
+    {
+      processRowStage2AVX2<SlopePositive>(y, x_begin & ~7, (x_end + 7) & ~7, m_ptr, ir_out, depth_out, ir_sum_out);
+      return;
+    }
+#endif
 
-        float ir_x = slope_positive ? ir_min_ : ir_max_;
+    m_ptr += x_begin * 9;
 
-        ir_x = std::log(ir_x);
-        ir_x = (ir_x * params.ab_confidence_slope * 0.301030f + params.ab_confidence_offset) * 3.321928f;
-        ir_x = std::exp(ir_x);
-        ir_x = std::min(params.max_dealias_confidence, std::max(params.min_dealias_confidence, ir_x));
-        ir_x *= ir_x;
+    for(int x = x_begin; x < x_end; ++x, m_ptr += 9)
+    {
+      processPixelStage2<SlopePositive>(x, y, m_ptr + 0, m_ptr + 3, m_ptr + 6, ir_out + x, depth_out + x, ir_sum_out != 0 ? ir_sum_out + x : 0);
+    }
+  }
 
-        float mask2 = ir_x >= norm ? 1.0f : 0.0f;
+  /**
+   * Edge aware filter a band of rows, within the columns of #filter2_roi.
+   * Reads one halo row above and below the band, so stage 2 must be complete
+   * for the whole frame before this runs.
+   * @param ctx Buffers of the current frame.
+   * @param y_begin First row of the band.
+   * @param y_end Row just after the last row of the band.
+   */
+  void filterStage2Rows(FrameContext &ctx, int y_begin, int y_end)
+  {
+    const int x_begin = filter2_roi.x_begin, x_end = filter2_roi.x_end;
 
-        float t11 = t10 * mask2;
+    for(int y = y_begin; y < y_end; ++y)
+    {
+      unsigned char *m_max_edge_test_ptr = ctx.m_max_edge_test->ptr(y, x_begin);
+      float depth_row[512];
+      float *depth_out = ctx.outputRow(ctx.out_depth, y, depth_row);
 
-        float mask3 = params.max_dealias_confidence * params.max_dealias_confidence >= norm ? 1.0f : 0.0f;
-        t10 *= mask3;
-        phase = true/*(modeMask & 2) != 0*/ ? t11 : t10;
+      for(int x = x_begin; x < x_end; ++x, ++m_max_edge_test_ptr)
+      {
+        filterPixelStage2(x, y, *ctx.depth_ir_sum, *m_max_edge_test_ptr == 1, depth_out + x);
       }
+
+      ctx.storeRow(ctx.out_depth, y, depth_out, x_begin, x_end);
     }
+  }
 
-    // this seems to be the phase to depth mapping :)
-    float zmultiplier = z_table.at(y, x);
-    float xmultiplier = x_table.at(y, x);
+  /**
+   * IR output of a pixel, the average of its three amplitudes like stage 2 computes it.
+   * @param m Stage 1 measurements of the pixel.
+   */
+  float pixelIr(const float *m) const
+  {
+    return std::min((m[2] + m[5] + m[8]) * 0.3333333f * params.ab_output_multiplier, 65535.0f);
+  }
 
-    phase = 0 < phase ? phase + params.phase_offset : phase;
+  /**
+   * Decode a band of rows of the binned image, each from the two rows of the full image it
+   * covers, and average the measurements of every 2x2 block into #FrameContext::m_stage2.
+   * The binned IR is the average of the IR of the four pixels, saturated each like at full
+   * resolution, as the OpenCL and OpenGL processors bin it; it goes to #FrameContext::out_binned_ir.
+   * @param ctx Buffers of the current frame.
+   * @param y_begin First binned row of the band.
+   * @param y_end Binned row just after the last row of the band.
+   */
+  void processBinnedStage1Rows(FrameContext &ctx, int y_begin, int y_end)
+  {
+    const int x_begin = filter2_roi.x_begin, x_end = filter2_roi.x_end;
 
-    float depth_linear = zmultiplier * phase;
-    float max_depth = phase * params.unambigious_dist * 2;
+    for(int y = y_begin; y < y_end; ++y)
+    {
+      processStage1Rows(ctx, 2 * y, 2 * y + 2);
 
-    bool cond1 = /*(modeMask & 32) != 0*/ true && 0 < depth_linear && 0 < max_depth;
+      const float *m0_ptr = (ctx.m->ptr(2 * y, 0)->val), *m1_ptr = (ctx.m->ptr(2 * y + 1, 0)->val);
+      float *m_out = (ctx.m_stage2->ptr(y, 0)->val);
 
-    xmultiplier = (xmultiplier * 90) / (max_depth * max_depth * 8192.0);
+      for(int x = 0; x < 256; ++x, m0_ptr += 18, m1_ptr += 18, m_out += 9)
+      {
+        for(int i = 0; i < 9; ++i)
+        {
+          m_out[i] = (m0_ptr[i] + m0_ptr[i + 9] + m1_ptr[i] + m1_ptr[i + 9]) * 0.25f;
+        }
+      }
 
-    float depth_fit = depth_linear / (-depth_linear * xmultiplier + 1);
+      if(ctx.out_binned_ir == 0) continue;
 
-    depth_fit = depth_fit < 0 ? 0 : depth_fit;
-    float depth = cond1 ? depth_fit : depth_linear; // r1.y -> later r2.z
+      float ir_row[512];
+      float *ir_out = ctx.outputRow(ctx.out_binned_ir, y, ir_row);
+      m0_ptr = (ctx.m->ptr(2 * y, 2 * x_begin)->val);
+      m1_ptr = (ctx.m->ptr(2 * y + 1, 2 * x_begin)->val);
 
-    // depth
-    *depth_out = depth;
-    if(ir_sum_out != 0)
-    {
-      *ir_sum_out = ir_sum;
-    }
+      for(int x = x_begin; x < x_end; ++x, m0_ptr += 18, m1_ptr += 18)
+      {
+        ir_out[x] = (pixelIr(m0_ptr) + pixelIr(m0_ptr + 9) + pixelIr(m1_ptr) + pixelIr(m1_ptr + 9)) * 0.25f;
+      }
 
-    // ir
-    //*ir_out = std::min((m1[2]) * ab_output_multiplier, 65535.0f);
-    // ir avg
-    *ir_out = std::min((m0[2] + m1[2] + m2[2]) * 0.3333333f * params.ab_output_multiplier, 65535.0f);
-    //ir_out[0] = std::min(m0[2] * ab_output_multiplier, 65535.0f);
-    //ir_out[1] = std::min(m1[2] * ab_output_multiplier, 65535.0f);
-    //ir_out[2] = std::min(m2[2] * ab_output_multiplier, 65535.0f);
+      ctx.storeRow(ctx.out_binned_ir, y, ir_out, x_begin, x_end);
+    }
   }
 
-  void filterPixelStage2(int x, int y, Mat<Vec<float, 3> > &m, bool max_edge_test_ok, float *depth_out)
+  /**
+   * Decode a band of rows and compute only their IR, for IR only output.
+   * The amplitudes averaged into the IR pass through the bilateral filter unchanged,
+   * so the result equals the IR of the full pipeline.
+   * @param ctx Buffers of the current frame.
+   * @param y_begin First row of the band.
+   * @param y_end Row just after the last row of the band.
+   */
+  void processIrRows(FrameContext &ctx, int y_begin, int y_end)
   {
-    Vec<float, 3> &depth_and_ir_sum = m.at(y, x);
-    float &raw_depth = depth_and_ir_sum.val[0], &ir_sum = depth_and_ir_sum.val[2];
+    const int x_begin = filter2_roi.x_begin, x_end = filter2_roi.x_end;
 
-    if(raw_depth >= params.min_depth && raw_depth <= params.max_depth)
+    for(int y = y_begin; y < y_end; ++y)
     {
-      if(x < 1 || y < 1 || x > 510 || y > 422)
+      if(enable_binned_output)
       {
-        *depth_out = raw_depth;
+        // binning computes the IR
+        processBinnedStage1Rows(ctx, y, y + 1);
+        continue;
       }
-      else
+
+      processStage1Rows(ctx, y, y + 1);
+
+      const float *m_ptr = (ctx.m->ptr(y, x_begin)->val);
+      float ir_row[512];
+      float *ir_out = ctx.outputRow(ctx.out_ir, y, ir_row);
+
+      for(int x = x_begin; x < x_end; ++x, m_ptr += 9)
       {
-        float ir_sum_acc = ir_sum, squared_ir_sum_acc = ir_sum * ir_sum, min_depth = raw_depth, max_depth = raw_depth;
+        ir_out[x] = pixelIr(m_ptr);
+      }
 
-        for(int yi = -1; yi < 2; ++yi)
-        {
-          for(int xi = -1; xi < 2; ++xi)
-          {
-            if(yi == 0 && xi == 0) continue;
+      ctx.storeRow(ctx.out_ir, y, ir_out, x_begin, x_end);
+    }
+  }
+  static void processIrBand(void *context, int y_begin, int y_end)
+  {
+    FrameContext *ctx = static_cast<FrameContext *>(context);
+    ctx->impl->processIrRows(*ctx, y_begin, y_end);
+  }
 
-            Vec<float, 3> &other = m.at(y + yi, x + xi);
+  static void processStage1Band(void *context, int y_begin, int y_end)
+  {
+    FrameContext *ctx = static_cast<FrameContext *>(context);
+    ctx->impl->processStage1Rows(*ctx, y_begin, y_end);
+  }
 
-            ir_sum_acc += other.val[2];
-            squared_ir_sum_acc += other.val[2] * other.val[2];
+  static void processBinnedStage1Band(void *context, int y_begin, int y_end)
+  {
+    FrameContext *ctx = static_cast<FrameContext *>(context);
+    ctx->impl->processBinnedStage1Rows(*ctx, y_begin, y_end);
+  }
 
-            if(0.0f < other.val[1])
-            {
-              min_depth = std::min(min_depth, other.val[1]);
-              max_depth = std::max(max_depth, other.val[1]);
-            }
-          }
-        }
+  template<bool BilateralFilter, bool EdgeFilter, bool FastMath, bool SlopePositive>
+  static void processStage2Band(void *context, int y_begin, int y_end)
+  {
+    FrameContext *ctx = static_cast<FrameContext *>(context);
+    ctx->impl->processStage2Rows<BilateralFilter, EdgeFilter, FastMath, SlopePositive>(*ctx, y_begin, y_end);
+  }
 
-        float tmp0 = std::sqrt(squared_ir_sum_acc * 9.0f - ir_sum_acc * ir_sum_acc) / 9.0f;
-        float edge_avg = std::max(ir_sum_acc / 9.0f, params.edge_ab_avg_min_value);
-        tmp0 /= edge_avg;
+  static void filterStage2Band(void *context, int y_begin, int y_end)
+  {
+    FrameContext *ctx = static_cast<FrameContext *>(context);
+    ctx->impl->filterStage2Rows(*ctx, y_begin, y_end);
+  }
 
-        float abs_min_diff = std::abs(raw_depth - min_depth);
-        float abs_max_diff = std::abs(raw_depth - max_depth);
+  /** Number of rows the fused pipeline pushes through all passes at once, sized to stay in L2. */
+  static const int FusedStripRows = 16;
 
-        float avg_diff = (abs_min_diff + abs_max_diff) * 0.5f;
-        float max_abs_diff = std::max(abs_min_diff, abs_max_diff);
+  /**
+   * Rows of a band whose 3x3 neighbourhoods, widened over @p passes passes, lie inside the band.
+   * @param y_begin First row of the band.
+   * @param y_end Row just after the last row of the band.
+   * @param passes Number of 3x3 passes before the one computing the rows.
+   * @param [out] inner_begin First inner row.
+   * @param [out] inner_end Row just after the last inner row.
+   */
+  static void innerRows(int y_begin, int y_end, int passes, int &inner_begin, int &inner_end)
+  {
+    inner_begin = std::min(y_begin + passes, y_end);
+    inner_end = std::max(y_end - passes, inner_begin);
+  }
 
-        bool cond0 =
-            0.0f < raw_depth &&
-            tmp0 >= params.edge_ab_std_dev_threshold &&
-            params.edge_close_delta_threshold < abs_min_diff &&
-            params.edge_far_delta_threshold < abs_max_diff &&
-            params.edge_max_delta_threshold < max_abs_diff &&
-            params.edge_avg_delta_threshold < avg_diff;
+  /**
+   * Restrict a range of rows to the rows of a region, the range may end up empty.
+   * @param roi Region.
+   * @param [in,out] y_begin First row.
+   * @param [in,out] y_end Row just after the last row.
+   */
+  static void clipRows(const DepthRoi &roi, int &y_begin, int &y_end)
+  {
+    y_begin = std::max(y_begin, roi.y_begin);
+    y_end = std::min(y_end, roi.y_end);
+  }
 
-        *depth_out = cond0 ? 0.0f : raw_depth;
+  /**
+   * Run all passes over the inner rows of a band, strip by strip.
+   * Each pass lags one row behind the previous one, so its 3x3 neighbourhood is complete
+   * and still in cache. The outer rows need the neighbouring bands and are done by
+   * #processFusedBorderStage2 and #filterFusedBorderStage2 afterwards.
+   * @param ctx Buffers of the current frame.
+   * @param y_begin First row of the band.
+   * @param y_end Row just after the last row of the band.
+   */
+  template<bool BilateralFilter, bool EdgeFilter, bool FastMath, bool SlopePositive>
+  void processFusedRows(FrameContext &ctx, int y_begin, int y_end)
+  {
+    int stage2_begin, stage2_end, filter2_begin, filter2_end;
+    innerRows(y_begin, y_end, 1, stage2_begin, stage2_end);
+    innerRows(y_begin, y_end, 2, filter2_begin, filter2_end);
+    clipRows(stage2_roi, stage2_begin, stage2_end);
+    clipRows(filter2_roi, filter2_begin, filter2_end);
 
-        if(!cond0)
-        {
-          if(max_edge_test_ok)
-          {
-            //float tmp1 = 1500.0f > raw_depth ? 30.0f : 0.02f * raw_depth;
-            float edge_count = 0.0f;
+    for(int y = y_begin; y < y_end; y += FusedStripRows)
+    {
+      int strip_end = std::min(y + FusedStripRows, y_end);
 
-            *depth_out = edge_count > params.max_edge_count ? 0.0f : raw_depth;
-          }
-          else
-          {
-            *depth_out = !max_edge_test_ok ? 0.0f : raw_depth;
-            *depth_out = true ? *depth_out : raw_depth;
-          }
-        }
+      processStage1Rows(ctx, y, strip_end);
+
+      int begin = std::max(y - 1, stage2_begin), end = std::min(strip_end - 1, stage2_end);
+      if(begin < end)
+      {
+        processStage2Rows<BilateralFilter, EdgeFilter, FastMath, SlopePositive>(ctx, begin, end);
+      }
+
+      begin = std::max(y - 2, filter2_begin);
+      end = std::min(strip_end - 2, filter2_end);
+      if(EdgeFilter && begin < end)
+      {
+        filterStage2Rows(ctx, begin, end);
       }
     }
-    else
-    {
-      *depth_out = 0.0f;
-    }
+  }
 
-    // override raw depth
-    depth_and_ir_sum.val[0] = depth_and_ir_sum.val[1];
+  /**
+   * Bilateral filter and compute the depth of the outer rows of a band, see #processFusedRows.
+   * Stage 1 must be complete for the whole frame.
+   */
+  template<bool BilateralFilter, bool EdgeFilter, bool FastMath, bool SlopePositive>
+  void processFusedBorderStage2(FrameContext &ctx, int y_begin, int y_end)
+  {
+    int inner_begin, inner_end;
+    innerRows(y_begin, y_end, 1, inner_begin, inner_end);
+
+    int begin = y_begin, end = inner_begin;
+    clipRows(stage2_roi, begin, end);
+    processStage2Rows<BilateralFilter, EdgeFilter, FastMath, SlopePositive>(ctx, begin, end);
+
+    begin = inner_end;
+    end = y_end;
+    clipRows(stage2_roi, begin, end);
+    processStage2Rows<BilateralFilter, EdgeFilter, FastMath, SlopePositive>(ctx, begin, end);
+  }
+
+  /**
+   * Edge aware filter the outer rows of a band, see #processFusedRows.
+   * Stage 2 must be complete for the whole frame.
+   */
+  void filterFusedBorderStage2(FrameContext &ctx, int y_begin, int y_end)
+  {
+    int inner_begin, inner_end;
+    innerRows(y_begin, y_end, 2, inner_begin, inner_end);
+
+    int begin = y_begin, end = inner_begin;
+    clipRows(filter2_roi, begin, end);
+    filterStage2Rows(ctx, begin, end);
+
+    begin = inner_end;
+    end = y_end;
+    clipRows(filter2_roi, begin, end);
+    filterStage2Rows(ctx, begin, end);
+  }
+
+  template<bool BilateralFilter, bool EdgeFilter, bool FastMath, bool SlopePositive>
+  static void processFusedBand(void *context, int y_begin, int y_end)
+  {
+    FrameContext *ctx = static_cast<FrameContext *>(context);
+    ctx->impl->processFusedRows<BilateralFilter, EdgeFilter, FastMath, SlopePositive>(*ctx, y_begin, y_end);
+  }
+
+  template<bool BilateralFilter, bool EdgeFilter, bool FastMath, bool SlopePositive>
+  static void processFusedBorderStage2Band(void *context, int y_begin, int y_end)
+  {
+    FrameContext *ctx = static_cast<FrameContext *>(context);
+    ctx->impl->processFusedBorderStage2<BilateralFilter, EdgeFilter, FastMath, SlopePositive>(*ctx, y_begin, y_end);
+  }
+
+  static void filterFusedBorderStage2Band(void *context, int y_begin, int y_end)
+  {
+    FrameContext *ctx = static_cast<FrameContext *>(context);
+    ctx->impl->filterFusedBorderStage2(*ctx, y_begin, y_end);
   }
 };
 
@@ -860,6 +2726,52 @@ void CpuDepthPacketProcessor::setConfiguration(const libfreenect2::DepthPacketPr
   impl_->params.max_depth = config.MaxDepth * 1000.0f;
   impl_->enable_bilateral_filter = config.EnableBilateralFilter;
   impl_->enable_edge_filter = config.EnableEdgeAwareFilter;
+  impl_->enable_fast_math = config.EnableFastMath;
+  impl_->enable_fused_pipeline = config.EnableFusedPipeline;
+  if(config.EnableFastMath && impl_->kernel_type != CpuKernelAVX2)
+  {
+    LOG_WARNING << "fast math requires AVX2, using the exact stage 2";
+  }
+  impl_->executor.setNumThreads(config.NumCpuThreads);
+  impl_->enable_table_cache = config.EnableTableCache;
+  impl_->setRoi(config);
+
+  if(!config.EnableIrOutput && !config.EnableDepthOutput)
+  {
+    LOG_WARNING << "neither IR nor depth output enabled, packets will be dropped";
+  }
+  impl_->enable_ir_output = config.EnableIrOutput;
+  impl_->enable_depth_output = config.EnableDepthOutput;
+  impl_->setBinnedOutput(config.EnableBinnedOutput);
+  impl_->setUInt16Output(config.EnableUInt16Output);
+  impl_->allocateFrames(config.EnableIrOutput, config.EnableDepthOutput);
+
+  if(config.EnableHugePages != impl_->scratch_huge_pages)
+  {
+    impl_->allocateScratch(config.EnableHugePages);
+  }
+
+  if(config.EnableHalfTrigTables != impl_->half_trig_tables)
+  {
+    impl_->allocateTrigTables(config.EnableHalfTrigTables);
+
+    // refill if the p0 tables are already loaded
+    if(impl_->p0_table0.buffer() != 0)
+    {
+      impl_->updateTrigTables(device_serial_);
+    }
+  }
+
+  impl_->selectKernels();
+}
+
+CpuDepthPacketProcessor::ScratchMemoryStats CpuDepthPacketProcessor::getScratchMemoryStats() const
+{
+  ScratchMemoryStats stats;
+  stats.bytes = impl_->scratch.size();
+  stats.allocations = impl_->scratch.allocations();
+  stats.huge_pages = impl_->scratch.usesHugePages();
+  return stats;
 }
 
 /**
@@ -878,23 +2790,11 @@ void CpuDepthPacketProcessor::loadP0TablesFromCommandResponse(unsigned char* buf
     return;
   }
 
-  if(impl_->flip_ptables)
-  {
-    flipHorizontal(Mat<uint16_t>(424, 512, p0table->p0table0), impl_->p0_table0);
-    flipHorizontal(Mat<uint16_t>(424, 512, p0table->p0table1), impl_->p0_table1);
-    flipHorizontal(Mat<uint16_t>(424, 512, p0table->p0table2), impl_->p0_table2);
-  }
-  else
-  {
-    Mat<uint16_t> p00(424, 512, p0table->p0table0);
-    p00.copyTo(impl_->p0_table0);
-    Mat<uint16_t>(424, 512, p0table->p0table1).copyTo(impl_->p0_table1);
-    Mat<uint16_t>(424, 512, p0table->p0table2).copyTo(impl_->p0_table2);
-  }
+  Mat<uint16_t>(424, 512, p0table->p0table0).copyTo(impl_->p0_table0);
+  Mat<uint16_t>(424, 512, p0table->p0table1).copyTo(impl_->p0_table1);
+  Mat<uint16_t>(424, 512, p0table->p0table2).copyTo(impl_->p0_table2);
 
-  impl_->fillTrigTable(impl_->p0_table0, impl_->trig_table0);
-  impl_->fillTrigTable(impl_->p0_table1, impl_->trig_table1);
-  impl_->fillTrigTable(impl_->p0_table2, impl_->trig_table2);
+  impl_->updateTrigTables(device_serial_);
 }
 
 /**
@@ -905,40 +2805,25 @@ void CpuDepthPacketProcessor::loadP0TablesFromCommandResponse(unsigned char* buf
  */
 void CpuDepthPacketProcessor::loadP0TablesFromFiles(const char* p0_filename, const char* p1_filename, const char* p2_filename)
 {
-  Mat<uint16_t> p0_table0(424, 512);
-  if(!loadBufferFromFile2(p0_filename, p0_table0.buffer(), p0_table0.sizeInBytes()))
+  impl_->p0_table0.create(424, 512);
+  if(!loadBufferFromFile2(p0_filename, impl_->p0_table0.buffer(), impl_->p0_table0.sizeInBytes()))
   {
     LOG_ERROR << "Loading p0table 0 from '" << p0_filename << "' failed!";
   }
 
-  Mat<uint16_t> p0_table1(424, 512);
-  if(!loadBufferFromFile2(p1_filename, p0_table1.buffer(), p0_table1.sizeInBytes()))
+  impl_->p0_table1.create(424, 512);
+  if(!loadBufferFromFile2(p1_filename, impl_->p0_table1.buffer(), impl_->p0_table1.sizeInBytes()))
   {
     LOG_ERROR << "Loading p0table 1 from '" << p1_filename << "' failed!";
   }
 
-  Mat<uint16_t> p0_table2(424, 512);
-  if(!loadBufferFromFile2(p2_filename, p0_table2.buffer(), p0_table2.sizeInBytes()))
+  impl_->p0_table2.create(424, 512);
+  if(!loadBufferFromFile2(p2_filename, impl_->p0_table2.buffer(), impl_->p0_table2.sizeInBytes()))
   {
     LOG_ERROR << "Loading p0table 2 from '" << p2_filename << "' failed!";
   }
 
-  if(impl_->flip_ptables)
-  {
-    flipHorizontal(p0_table0, impl_->p0_table0);
-    flipHorizontal(p0_table1, impl_->p0_table1);
-    flipHorizontal(p0_table2, impl_->p0_table2);
-
-    impl_->fillTrigTable(impl_->p0_table0, impl_->trig_table0);
-    impl_->fillTrigTable(impl_->p0_table1, impl_->trig_table1);
-    impl_->fillTrigTable(impl_->p0_table2, impl_->trig_table2);
-  }
-  else
-  {
-    impl_->fillTrigTable(p0_table0, impl_->trig_table0);
-    impl_->fillTrigTable(p0_table1, impl_->trig_table1);
-    impl_->fillTrigTable(p0_table2, impl_->trig_table2);
-  }
+  impl_->updateTrigTables(device_serial_);
 }
 
 /**
@@ -960,6 +2845,8 @@ void CpuDepthPacketProcessor::loadXTableFromFile(const char* filename)
   {
     LOG_ERROR << "Loading xtable from resource 'xTable.bin' failed!";
   }
+
+  impl_->binTables();
 }
 
 /**
@@ -982,6 +2869,8 @@ void CpuDepthPacketProcessor::loadZTableFromFile(const char* filename)
   {
     LOG_ERROR << "Loading ztable from resource 'zTable.bin' failed!";
   }
+
+  impl_->binTables();
 }
 
 /**
@@ -1011,95 +2900,116 @@ void CpuDepthPacketProcessor::load11To16LutFromFile(const char* filename)
 void CpuDepthPacketProcessor::process(const DepthPacket &packet)
 {
   if(listener_ == 0) return;
+  if(!impl_->enable_ir_output && !impl_->enable_depth_output) return;
 
   impl_->startTiming();
 
-  impl_->ir_frame->timestamp = packet.timestamp;
-  impl_->depth_frame->timestamp = packet.timestamp;
-  impl_->ir_frame->sequence = packet.sequence;
-  impl_->depth_frame->sequence = packet.sequence;
+  // the frame of a disabled output is not allocated
+  Frame *ir_frame = impl_->ir_frame, *depth_frame = impl_->depth_frame;
+
+  if(ir_frame != 0)
+  {
+    ir_frame->timestamp = packet.timestamp;
+    ir_frame->sequence = packet.sequence;
+  }
+  if(depth_frame != 0)
+  {
+    depth_frame->timestamp = packet.timestamp;
+    depth_frame->sequence = packet.sequence;
+  }
 
+  // the intermediates live in the preallocated scratch memory, the binned image is a quarter
+  // of the full one and its stage 2 buffers fit into the full resolution ones it leaves unused
+  const bool binned = impl_->enable_binned_output;
+  const int width = binned ? 256 : 512, height = binned ? 212 : 424;
   Mat<Vec<float, 9> >
-      m(424, 512),
-      m_filtered(424, 512)
+      m(424, 512, impl_->m_buffer),
+      m_binned(height, width, impl_->m_filtered_buffer),
+      m_filtered(height, width, impl_->m_filtered_buffer + (binned ? width * height : 0))
   ;
-  Mat<unsigned char> m_max_edge_test(424, 512);
+  Mat<unsigned char> m_max_edge_test(height, width, impl_->m_max_edge_test_buffer);
+  Mat<Vec<float, 3> > depth_ir_sum(height, width, impl_->depth_ir_sum_buffer);
+
+  CpuDepthPacketProcessorImpl::FrameContext ctx;
+  ctx.impl = impl_;
+  ctx.data = packet.buffer;
+  ctx.m = &m;
+  ctx.m_stage2 = binned ? &m_binned : &m;
+  ctx.m_filtered = &m_filtered;
+  ctx.m_max_edge_test = &m_max_edge_test;
+  ctx.depth_ir_sum = &depth_ir_sum;
+  ctx.out_ir = ir_frame != 0 ? ir_frame->data : 0;
+  ctx.out_depth = depth_frame != 0 ? depth_frame->data : 0;
+  ctx.out_binned_ir = 0;
+
+  // binned IR is averaged from the full resolution IR, stage 2 on the binned image leaves it alone
+  if(binned)
+  {
+    ctx.out_binned_ir = ctx.out_ir;
+    ctx.out_ir = 0;
+  }
+  ctx.uint16 = impl_->enable_uint16_output;
+  ctx.width = width;
+  ctx.height = height;
 
-  float *m_ptr = (m.ptr(0, 0)->val);
+  // every pass only writes the rows of its own band, the filters read one halo
+  // row of the neighbouring bands which is why the passes run one after another
+  if(!impl_->enable_depth_output)
+  {
+    // the IR only needs stage 1
+    impl_->executor.run(&CpuDepthPacketProcessorImpl::processIrBand, &ctx, impl_->filter2_roi.y_begin, impl_->filter2_roi.y_end);
+  }
+  else if(binned)
+  {
+    // stage 1 runs in bands of binned rows, the 2x2 blocks never span two bands
+    impl_->executor.run(&CpuDepthPacketProcessorImpl::processBinnedStage1Band, &ctx, impl_->stage2_roi.y_begin, impl_->stage2_roi.y_end);
+    impl_->executor.run(impl_->stage2_band, &ctx, impl_->stage2_roi.y_begin, impl_->stage2_roi.y_end);
 
-  for(int y = 0; y < 424; ++y)
-    for(int x = 0; x < 512; ++x, m_ptr += 9)
+    if(impl_->enable_edge_filter)
     {
-      impl_->processPixelStage1(x, y, packet.buffer, m_ptr + 0, m_ptr + 3, m_ptr + 6);
+      impl_->executor.run(&CpuDepthPacketProcessorImpl::filterStage2Band, &ctx, impl_->filter2_roi.y_begin, impl_->filter2_roi.y_end);
     }
-
-  // bilateral filtering
-  if(impl_->enable_bilateral_filter)
+  }
+  else if(impl_->enable_fused_pipeline)
   {
-    float *m_filtered_ptr = (m_filtered.ptr(0, 0)->val);
-    unsigned char *m_max_edge_test_ptr = m_max_edge_test.ptr(0, 0);
-
-    for(int y = 0; y < 424; ++y)
-      for(int x = 0; x < 512; ++x, m_filtered_ptr += 9, ++m_max_edge_test_ptr)
-      {
-        bool max_edge_test_val = true;
-        impl_->filterPixelStage1(x, y, m, m_filtered_ptr, max_edge_test_val);
-        *m_max_edge_test_ptr = max_edge_test_val ? 1 : 0;
-      }
+    // the bands run fused except for their outer rows, which wait for the neighbouring bands
+    // all three passes split the rows of stage 1 the same way, the later passes clip them to their region
+    const DepthRoi &rows = impl_->stage1_roi;
+    impl_->executor.run(impl_->fused_band, &ctx, rows.y_begin, rows.y_end);
+    impl_->executor.run(impl_->fused_border_stage2_band, &ctx, rows.y_begin, rows.y_end);
 
-    m_ptr = (m_filtered.ptr(0, 0)->val);
+    if(impl_->enable_edge_filter)
+    {
+      impl_->executor.run(&CpuDepthPacketProcessorImpl::filterFusedBorderStage2Band, &ctx, rows.y_begin, rows.y_end);
+    }
   }
   else
   {
-    m_ptr = (m.ptr(0, 0)->val);
-  }
-
-  Mat<float> out_ir(424, 512, impl_->ir_frame->data), out_depth(424, 512, impl_->depth_frame->data);
-
-  if(impl_->enable_edge_filter)
-  {
-    Mat<Vec<float, 3> > depth_ir_sum(424, 512);
-    Vec<float, 3> *depth_ir_sum_ptr = depth_ir_sum.ptr(0, 0);
-    unsigned char *m_max_edge_test_ptr = m_max_edge_test.ptr(0, 0);
-
-    for(int y = 0; y < 424; ++y)
-      for(int x = 0; x < 512; ++x, m_ptr += 9, ++m_max_edge_test_ptr, ++depth_ir_sum_ptr)
-      {
-        float raw_depth, ir_sum;
-
-        impl_->processPixelStage2(x, y, m_ptr + 0, m_ptr + 3, m_ptr + 6, out_ir.ptr(423 - y, x), &raw_depth, &ir_sum);
-
-        depth_ir_sum_ptr->val[0] = raw_depth;
-        depth_ir_sum_ptr->val[1] = *m_max_edge_test_ptr == 1 ? raw_depth : 0;
-        depth_ir_sum_ptr->val[2] = ir_sum;
-      }
-
-    m_max_edge_test_ptr = m_max_edge_test.ptr(0, 0);
+    impl_->executor.run(&CpuDepthPacketProcessorImpl::processStage1Band, &ctx, impl_->stage1_roi.y_begin, impl_->stage1_roi.y_end);
+    impl_->executor.run(impl_->stage2_band, &ctx, impl_->stage2_roi.y_begin, impl_->stage2_roi.y_end);
 
-    for(int y = 0; y < 424; ++y)
-      for(int x = 0; x < 512; ++x, ++m_max_edge_test_ptr)
-      {
-        impl_->filterPixelStage2(x, y, depth_ir_sum, *m_max_edge_test_ptr == 1, out_depth.ptr(423 - y, x));
-      }
+    if(impl_->enable_edge_filter)
+    {
+      impl_->executor.run(&CpuDepthPacketProcessorImpl::filterStage2Band, &ctx, impl_->filter2_roi.y_begin, impl_->filter2_roi.y_end);
+    }
   }
-  else
+
+  // the passes only write their own region, and the halo of the filters spills outside the region of interest
+  if(!impl_->roi.isFullFrame())
   {
-    for(int y = 0; y < 424; ++y)
-      for(int x = 0; x < 512; ++x, m_ptr += 9)
-      {
-        impl_->processPixelStage2(x, y, m_ptr + 0, m_ptr + 3, m_ptr + 6, out_ir.ptr(423 - y, x), out_depth.ptr(423 - y, x), 0);
-      }
+    if(ir_frame != 0) clearOutsideRoi(impl_->roi, ir_frame);
+    if(depth_frame != 0) clearOutsideRoi(impl_->roi, depth_frame);
   }
 
   impl_->stopTiming(LOG_INFO);
 
   if (listener_ != 0 ){
-    if(listener_->onNewFrame(Frame::Ir, impl_->ir_frame))
+    if(ir_frame != 0 && listener_->onNewFrame(Frame::Ir, ir_frame))
     {
       impl_->newIrFrame();
     }
 
-    if(listener_->onNewFrame(Frame::Depth, impl_->depth_frame))
+    if(depth_frame != 0 && listener_->onNewFrame(Frame::Depth, depth_frame))
     {
       impl_->newDepthFrame();
     }
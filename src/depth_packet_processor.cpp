@@ -28,6 +28,10 @@
 
 #include <libfreenect2/depth_packet_processor.h>
 #include <libfreenect2/async_packet_processor.h>
+#include <libfreenect2/depth_roi.h>
+#include <libfreenect2/logging.h>
+
+#include <algorithm>
 
 namespace libfreenect2
 {
@@ -36,7 +40,29 @@ DepthPacketProcessor::Config::Config() :
   MinDepth(0.5f),
   MaxDepth(4.5f),
   EnableBilateralFilter(true),
-  EnableEdgeAwareFilter(true)
+  EnableEdgeAwareFilter(true),
+  NumCpuThreads(1),
+  EnableFastMath(false),
+  EnableHugePages(false),
+  EnableFusedPipeline(false),
+  EnableHalfTrigTables(false),
+  RoiX(0),
+  RoiY(0),
+  RoiWidth(512),
+  RoiHeight(424),
+  EnableIrOutput(true),
+  EnableDepthOutput(true),
+  EnableBinnedOutput(false),
+  EnableUInt16Output(false),
+  EnableTableCache(false),
+  EnableProgramCache(false),
+  NumOpenCLBufferSets(1),
+  EnableOpenCLRuntimeParameters(false),
+  EnableOpenCLFusedKernels(false),
+  EnableWorkGroupTuning(false),
+  EnableOpenCLProfiling(false),
+  NumOpenGLReadbackBuffers(0),
+  EnableOpenGLTextureOutput(false)
 {
 
 }
@@ -102,9 +128,104 @@ void DepthPacketProcessor::setConfiguration(const libfreenect2::DepthPacketProce
   config_ = config;
 }
 
+DepthRoi DepthRoi::fromConfig(const DepthPacketProcessor::Config &config)
+{
+  DepthRoi roi;
+  roi.x_begin = std::min(std::max(config.RoiX, 0), 512);
+  roi.y_begin = std::min(std::max(config.RoiY, 0), 424);
+  roi.x_end = std::min(std::max(config.RoiX + config.RoiWidth, roi.x_begin), 512);
+  roi.y_end = std::min(std::max(config.RoiY + config.RoiHeight, roi.y_begin), 424);
+
+  if(roi.width() == 0 || roi.height() == 0)
+  {
+    LOG_WARNING << "region of interest outside the image, processing the whole image";
+    roi.x_begin = 0;
+    roi.y_begin = 0;
+    roi.x_end = 512;
+    roi.y_end = 424;
+  }
+  return roi;
+}
+
+DepthRoi DepthRoi::grow(int halo) const
+{
+  DepthRoi roi;
+  roi.x_begin = std::max(x_begin - halo, 0);
+  roi.y_begin = std::max(y_begin - halo, 0);
+  roi.x_end = std::min(x_end + halo, 512);
+  roi.y_end = std::min(y_end + halo, 424);
+  return roi;
+}
+
+DepthRoi DepthRoi::flipY() const
+{
+  DepthRoi roi = *this;
+  roi.y_begin = 424 - y_end;
+  roi.y_end = 424 - y_begin;
+  return roi;
+}
+
+bool DepthRoi::isFullFrame() const
+{
+  return x_begin == 0 && y_begin == 0 && x_end == 512 && y_end == 424;
+}
+
+DepthRoi DepthRoi::bin() const
+{
+  DepthRoi roi;
+  roi.x_begin = x_begin / 2;
+  roi.y_begin = y_begin / 2;
+  roi.x_end = (x_end + 1) / 2;
+  roi.y_end = (y_end + 1) / 2;
+  return roi;
+}
+
+DepthPassRois::DepthPassRois(const DepthPacketProcessor::Config &config)
+{
+  filter2 = DepthRoi::fromConfig(config);
+
+  if(config.EnableBinnedOutput)
+  {
+    if(!filter2.isFullFrame())
+    {
+      LOG_WARNING << "region of interest not supported with binned output, processing the whole image";
+    }
+    filter2 = DepthRoi::fromConfig(DepthPacketProcessor::Config());
+    stage2 = stage1 = filter2;
+    return;
+  }
+
+  // without depth output the filters do not run and need no halo
+  stage2 = config.EnableDepthOutput && config.EnableEdgeAwareFilter ? filter2.grow(1) : filter2;
+  stage1 = config.EnableDepthOutput && config.EnableBilateralFilter ? stage2.grow(1) : stage2;
+}
+
+void clearOutsideRoi(const DepthRoi &roi, Frame *frame)
+{
+  // zero is all zero bytes in every encoding of depth and IR frames
+  const size_t line = frame->width * frame->bytes_per_pixel;
+  unsigned char *image = frame->data;
+
+  std::fill(image, image + roi.y_begin * line, 0);
+
+  for(int y = roi.y_begin; y < roi.y_end; ++y)
+  {
+    unsigned char *row = image + y * line;
+    std::fill(row, row + roi.x_begin * frame->bytes_per_pixel, 0);
+    std::fill(row + roi.x_end * frame->bytes_per_pixel, row + line, 0);
+  }
+
+  std::fill(image + roi.y_end * line, image + frame->height * line, 0);
+}
+
 void DepthPacketProcessor::setFrameListener(libfreenect2::FrameListener *listener)
 {
   listener_ = listener;
 }
 
+void DepthPacketProcessor::setDeviceSerial(const std::string &serial)
+{
+  device_serial_ = serial;
+}
+
 } /* namespace libfreenect2 */
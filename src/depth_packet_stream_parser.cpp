@@ -57,6 +57,13 @@ DepthPacketStreamParser::~DepthPacketStreamParser()
 void DepthPacketStreamParser::setPacketProcessor(libfreenect2::BaseDepthPacketProcessor *processor)
 {
   processor_ = (processor != 0) ? processor : noopProcessor<DepthPacket>();
+
+  // assemble the packets where the processor reads them
+  size_t single_image = 512*424*11/8;
+
+  buffer_.allocate((single_image) * 10, processor_->getAllocator());
+  buffer_.front().length = buffer_.front().capacity;
+  buffer_.back().length = buffer_.back().capacity;
 }
 
 void DepthPacketStreamParser::onDataReceived(unsigned char* buffer, size_t in_length)
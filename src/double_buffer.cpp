@@ -33,36 +33,51 @@ namespace libfreenect2
 
 DoubleBuffer::DoubleBuffer() :
     front_buffer_index_(0),
-    buffer_data_(0)
+    allocator_(&default_allocator_)
 {
+  buffer_[0] = 0;
+  buffer_[1] = 0;
 }
 
 DoubleBuffer::~DoubleBuffer()
 {
-  if(buffer_data_ != 0)
-  {
-    buffer_[0].data = 0;
-    buffer_[1].data = 0;
-    delete[] buffer_data_;
-  }
+  release();
 }
 
 /**
- * Allocate double buffering of capacity \a buffer_size.
+ * Allocate double buffering of capacity \a buffer_size, releasing the previous buffers.
  * @param buffer_size Capacity of both buffers.
+ * @param allocator Allocator of the buffers, 0 for the heap. The heap is used as well if it fails.
  */
-void DoubleBuffer::allocate(size_t buffer_size)
+void DoubleBuffer::allocate(size_t buffer_size, Allocator *allocator)
 {
-  size_t total_buffer_size = 2 * buffer_size;
-  buffer_data_ = new unsigned char[total_buffer_size];
+  release();
+
+  allocator_ = allocator != 0 ? allocator : &default_allocator_;
+  buffer_[0] = allocator_->allocate(buffer_size);
+  buffer_[1] = buffer_[0] != 0 ? allocator_->allocate(buffer_size) : 0;
+
+  if(buffer_[1] == 0)
+  {
+    release();
 
-  buffer_[0].capacity = buffer_size;
-  buffer_[0].length = 0;
-  buffer_[0].data = buffer_data_;
+    allocator_ = &default_allocator_;
+    buffer_[0] = allocator_->allocate(buffer_size);
+    buffer_[1] = allocator_->allocate(buffer_size);
+  }
+}
 
-  buffer_[1].capacity = buffer_size;
-  buffer_[1].length = 0;
-  buffer_[1].data = buffer_data_ + buffer_size;
+/** Release both buffers. */
+void DoubleBuffer::release()
+{
+  for(int i = 0; i < 2; ++i)
+  {
+    if(buffer_[i] != 0)
+    {
+      allocator_->free(buffer_[i]);
+      buffer_[i] = 0;
+    }
+  }
 }
 
 /** Swap back and front buffer. */
@@ -77,7 +92,7 @@ void DoubleBuffer::swap()
  */
 Buffer& DoubleBuffer::front()
 {
-  return buffer_[front_buffer_index_ & 1];
+  return *buffer_[front_buffer_index_ & 1];
 }
 
 /**
@@ -86,7 +101,7 @@ Buffer& DoubleBuffer::front()
  */
 Buffer& DoubleBuffer::back()
 {
-  return buffer_[(front_buffer_index_ + 1) & 1];
+  return *buffer_[(front_buffer_index_ + 1) & 1];
 }
 
 } /* namespace libfreenect2 */
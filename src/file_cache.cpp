@@ -0,0 +1,269 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2014 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+/** @file file_cache.cpp Cache directory, file naming and mapped cache files. */
+
+#include <libfreenect2/file_cache.h>
+#include <libfreenect2/logging.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <sstream>
+#include <iomanip>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+namespace libfreenect2
+{
+
+#ifdef _WIN32
+static const char PathSeparator = '\\';
+#else
+static const char PathSeparator = '/';
+#endif
+
+/**
+ * Create a directory and its missing parents.
+ * @param path Directory to create.
+ * @return Whether the directory exists afterwards.
+ */
+static bool makeDirectories(const std::string &path)
+{
+  for(size_t i = 1; i <= path.size(); ++i)
+  {
+    if(i < path.size() && path[i] != '/' && path[i] != PathSeparator) continue;
+
+    const std::string prefix = path.substr(0, i);
+#ifdef _WIN32
+    _mkdir(prefix.c_str());
+#else
+    mkdir(prefix.c_str(), 0755);
+#endif
+  }
+
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 && (info.st_mode & S_IFDIR) != 0;
+}
+
+std::string getCacheDirectory()
+{
+  std::string dir;
+  const char *env = getenv("LIBFREENECT2_CACHE_DIR");
+
+  if(env != 0 && env[0] != '\0')
+  {
+    dir = env;
+  }
+  else
+  {
+#ifdef _WIN32
+    const char *base = getenv("LOCALAPPDATA");
+    if(base == 0 || base[0] == '\0') return std::string();
+    dir = std::string(base) + PathSeparator + "libfreenect2";
+#else
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if(base != 0 && base[0] != '\0')
+    {
+      dir = std::string(base) + "/libfreenect2";
+    }
+    else if(home != 0 && home[0] != '\0')
+    {
+      dir = std::string(home) + "/.cache/libfreenect2";
+    }
+    else
+    {
+      return std::string();
+    }
+#endif
+  }
+
+  if(!makeDirectories(dir))
+  {
+    LOG_WARNING << "cannot create cache directory " << dir;
+    return std::string();
+  }
+
+  return dir + PathSeparator;
+}
+
+uint64_t hashBytes(const void *data, size_t length, uint64_t hash)
+{
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+
+  for(size_t i = 0; i < length; ++i)
+  {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+std::string cacheFileName(const std::string &prefix, const std::string &serial, uint64_t key)
+{
+  std::ostringstream name;
+  name << prefix << '_';
+
+  for(size_t i = 0; i < serial.size(); ++i)
+  {
+    if(std::isalnum(static_cast<unsigned char>(serial[i]))) name << serial[i];
+  }
+
+  if(name.tellp() > std::streampos(prefix.size() + 1)) name << '_';
+
+  name << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+  return name.str();
+}
+
+bool writeCacheFile(const std::string &path, const void *header, size_t header_size, const void *data, size_t data_size)
+{
+  std::ostringstream tmp_path;
+#ifdef _WIN32
+  tmp_path << path << '.' << _getpid() << ".tmp";
+#else
+  tmp_path << path << '.' << getpid() << ".tmp";
+#endif
+
+  FILE *file = std::fopen(tmp_path.str().c_str(), "wb");
+
+  if(file == 0)
+  {
+    LOG_WARNING << "cannot write cache file " << tmp_path.str();
+    return false;
+  }
+
+  bool ok = std::fwrite(header, 1, header_size, file) == header_size && std::fwrite(data, 1, data_size, file) == data_size;
+  ok = std::fclose(file) == 0 && ok;
+
+#ifdef _WIN32
+  // rename does not replace existing files on Windows
+  if(ok) std::remove(path.c_str());
+#endif
+
+  if(!ok || std::rename(tmp_path.str().c_str(), path.c_str()) != 0)
+  {
+    LOG_WARNING << "cannot write cache file " << path;
+    std::remove(tmp_path.str().c_str());
+    return false;
+  }
+
+  return true;
+}
+
+CacheFile::CacheFile() :
+  raw_(0), data_(0), size_(0)
+{
+}
+
+CacheFile::~CacheFile()
+{
+  close();
+}
+
+bool CacheFile::open(const std::string &path)
+{
+  close();
+
+#ifdef _WIN32
+  FILE *file = std::fopen(path.c_str(), "rb");
+  if(file == 0) return false;
+
+  std::fseek(file, 0, SEEK_END);
+  long size = std::ftell(file);
+  std::fseek(file, 0, SEEK_SET);
+
+  if(size <= 0)
+  {
+    std::fclose(file);
+    return false;
+  }
+
+  const size_t alignment = 64;
+  raw_ = new unsigned char[size + alignment];
+  data_ = reinterpret_cast<unsigned char *>((reinterpret_cast<uintptr_t>(raw_) + alignment - 1) & ~uintptr_t(alignment - 1));
+  size_ = size;
+
+  bool ok = std::fread(data_, 1, size_, file) == size_;
+  std::fclose(file);
+
+  if(!ok) close();
+  return ok;
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+
+  struct stat info;
+  if(fstat(fd, &info) != 0 || info.st_size <= 0)
+  {
+    ::close(fd);
+    return false;
+  }
+
+  int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+  // read the whole file now instead of faulting during the first frames
+  flags |= MAP_POPULATE;
+#endif
+
+  void *mapping = mmap(0, info.st_size, PROT_READ, flags, fd, 0);
+  ::close(fd);
+
+  if(mapping == MAP_FAILED) return false;
+
+  data_ = static_cast<unsigned char *>(mapping);
+  size_ = info.st_size;
+  return true;
+#endif
+}
+
+void CacheFile::close()
+{
+#ifndef _WIN32
+  if(data_ != 0)
+  {
+    munmap(data_, size_);
+  }
+#endif
+  delete[] raw_;
+
+  raw_ = 0;
+  data_ = 0;
+  size_ = 0;
+}
+
+} /* namespace libfreenect2 */
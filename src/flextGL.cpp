@@ -270,10 +270,34 @@ void flextInit(OpenGLBindings *bindings)
     bindings->glGetActiveUniformBlockName = (PFNGLGETACTIVEUNIFORMBLOCKNAME_PROC*)glfwGetProcAddress("glGetActiveUniformBlockName");
     bindings->glUniformBlockBinding = (PFNGLUNIFORMBLOCKBINDING_PROC*)glfwGetProcAddress("glUniformBlockBinding");
 
+    /* GL_ARB_sync */
+
+    bindings->glFenceSync = (PFNGLFENCESYNC_PROC*)glfwGetProcAddress("glFenceSync");
+    bindings->glIsSync = (PFNGLISSYNC_PROC*)glfwGetProcAddress("glIsSync");
+    bindings->glDeleteSync = (PFNGLDELETESYNC_PROC*)glfwGetProcAddress("glDeleteSync");
+    bindings->glClientWaitSync = (PFNGLCLIENTWAITSYNC_PROC*)glfwGetProcAddress("glClientWaitSync");
+    bindings->glWaitSync = (PFNGLWAITSYNC_PROC*)glfwGetProcAddress("glWaitSync");
+    bindings->glGetInteger64v = (PFNGLGETINTEGER64V_PROC*)glfwGetProcAddress("glGetInteger64v");
+    bindings->glGetSynciv = (PFNGLGETSYNCIV_PROC*)glfwGetProcAddress("glGetSynciv");
+
+    /* GL_ARB_get_program_binary */
+
+    bindings->glGetProgramBinary = (PFNGLGETPROGRAMBINARY_PROC*)glfwGetProcAddress("glGetProgramBinary");
+    bindings->glProgramBinary = (PFNGLPROGRAMBINARY_PROC*)glfwGetProcAddress("glProgramBinary");
+    bindings->glProgramParameteri = (PFNGLPROGRAMPARAMETERI_PROC*)glfwGetProcAddress("glProgramParameteri");
+
+    /* --- Flags for optional extensions --- */
+
+    FLEXT_ARB_sync = glfwExtensionSupported("GL_ARB_sync");
+    FLEXT_ARB_get_program_binary = glfwExtensionSupported("GL_ARB_get_program_binary");
+
 }
 
 /* ----------------------- Extension flag definitions ---------------------- */
 
+int FLEXT_ARB_sync = GL_FALSE;
+int FLEXT_ARB_get_program_binary = GL_FALSE;
+
 #ifdef __cplusplus
 }
 #endif
@@ -837,6 +837,31 @@ typedef struct __GLsync *GLsync;
 #define GL_UNIFORM_BLOCK_REFERENCED_BY_FRAGMENT_SHADER 0x8A46
 #define GL_INVALID_INDEX 0xFFFFFFFFu
 
+/* GL_ARB_sync */
+
+#define GL_MAX_SERVER_WAIT_TIMEOUT 0x9111
+#define GL_OBJECT_TYPE 0x9112
+#define GL_SYNC_CONDITION 0x9113
+#define GL_SYNC_STATUS 0x9114
+#define GL_SYNC_FLAGS 0x9115
+#define GL_SYNC_FENCE 0x9116
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_UNSIGNALED 0x9118
+#define GL_SIGNALED 0x9119
+#define GL_ALREADY_SIGNALED 0x911A
+#define GL_TIMEOUT_EXPIRED 0x911B
+#define GL_CONDITION_SATISFIED 0x911C
+#define GL_WAIT_FAILED 0x911D
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#define GL_TIMEOUT_IGNORED 0xFFFFFFFFFFFFFFFFull
+
+/* GL_ARB_get_program_binary */
+
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#define GL_PROGRAM_BINARY_FORMATS 0x87FF
+
 /* --------------------------- FUNCTION PROTOTYPES --------------------------- */
 
     
@@ -1168,6 +1193,22 @@ typedef void (APIENTRY PFNGLGETACTIVEUNIFORMBLOCKIV_PROC (GLuint program, GLuint
 typedef void (APIENTRY PFNGLGETACTIVEUNIFORMBLOCKNAME_PROC (GLuint program, GLuint uniformBlockIndex, GLsizei bufSize, GLsizei * length, GLchar * uniformBlockName));
 typedef void (APIENTRY PFNGLUNIFORMBLOCKBINDING_PROC (GLuint program, GLuint uniformBlockIndex, GLuint uniformBlockBinding));
     
+/* GL_ARB_sync */
+  
+typedef GLsync (APIENTRY PFNGLFENCESYNC_PROC (GLenum condition, GLbitfield flags));
+typedef GLboolean (APIENTRY PFNGLISSYNC_PROC (GLsync sync));
+typedef void (APIENTRY PFNGLDELETESYNC_PROC (GLsync sync));
+typedef GLenum (APIENTRY PFNGLCLIENTWAITSYNC_PROC (GLsync sync, GLbitfield flags, GLuint64 timeout));
+typedef void (APIENTRY PFNGLWAITSYNC_PROC (GLsync sync, GLbitfield flags, GLuint64 timeout));
+typedef void (APIENTRY PFNGLGETINTEGER64V_PROC (GLenum pname, GLint64 * data));
+typedef void (APIENTRY PFNGLGETSYNCIV_PROC (GLsync sync, GLenum pname, GLsizei bufSize, GLsizei * length, GLint * values));
+    
+/* GL_ARB_get_program_binary */
+  
+typedef void (APIENTRY PFNGLGETPROGRAMBINARY_PROC (GLuint program, GLsizei bufSize, GLsizei * length, GLenum * binaryFormat, void * binary));
+typedef void (APIENTRY PFNGLPROGRAMBINARY_PROC (GLuint program, GLenum binaryFormat, const void * binary, GLsizei length));
+typedef void (APIENTRY PFNGLPROGRAMPARAMETERI_PROC (GLuint program, GLenum pname, GLint value));
+    
 struct OpenGLBindings
 {
     
@@ -1431,6 +1472,22 @@ struct OpenGLBindings
   PFNGLGETACTIVEUNIFORMBLOCKNAME_PROC* glGetActiveUniformBlockName;
   PFNGLUNIFORMBLOCKBINDING_PROC* glUniformBlockBinding;
     
+  /* GL_ARB_sync */
+
+  PFNGLFENCESYNC_PROC* glFenceSync;
+  PFNGLISSYNC_PROC* glIsSync;
+  PFNGLDELETESYNC_PROC* glDeleteSync;
+  PFNGLCLIENTWAITSYNC_PROC* glClientWaitSync;
+  PFNGLWAITSYNC_PROC* glWaitSync;
+  PFNGLGETINTEGER64V_PROC* glGetInteger64v;
+  PFNGLGETSYNCIV_PROC* glGetSynciv;
+    
+  /* GL_ARB_get_program_binary */
+
+  PFNGLGETPROGRAMBINARY_PROC* glGetProgramBinary;
+  PFNGLPROGRAMBINARY_PROC* glProgramBinary;
+  PFNGLPROGRAMPARAMETERI_PROC* glProgramParameteri;
+    
 };
 
 typedef struct OpenGLBindings OpenGLBindings;
@@ -1450,6 +1507,9 @@ typedef struct OpenGLBindings OpenGLBindings;
 
 /* ---------------------- Flags for optional extensions ---------------------- */
 
+extern int FLEXT_ARB_sync;
+extern int FLEXT_ARB_get_program_binary;
+
 void flextInit(OpenGLBindings *bindings);
 
 #define FLEXT_MAJOR_VERSION 3
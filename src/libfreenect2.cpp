@@ -513,7 +513,10 @@ void Freenect2DeviceImpl::start()
 
   command_tx_.execute(ReadP0TablesCommand(nextCommandSeq()), result);
   if(pipeline_->getDepthPacketProcessor() != 0)
+  {
+    pipeline_->getDepthPacketProcessor()->setDeviceSerial(serial_);
     pipeline_->getDepthPacketProcessor()->loadP0TablesFromCommandResponse(result.data, result.length);
+  }
 
   command_tx_.execute(ReadRgbCameraParametersCommand(nextCommandSeq()), result);
   RgbCameraParamsResponse *rgb_p = reinterpret_cast<RgbCameraParamsResponse *>(result.data);
@@ -24,6 +24,128 @@
  * either License.
  */
 
+/*******************************************************************************
+ * Parameters, compiled in as constants unless RUNTIME_PARAMETERS is defined,
+ * then the kernels read them from a constant buffer in their last argument
+ ******************************************************************************/
+#ifdef RUNTIME_PARAMETERS
+
+// same layout as OpenCLDepthPacketProcessorImpl::KernelParameters
+typedef struct
+{
+  float ab_multiplier;
+  float ab_multiplier_per_frq0;
+  float ab_multiplier_per_frq1;
+  float ab_multiplier_per_frq2;
+  float ab_output_multiplier;
+  float phase_in_rad0;
+  float phase_in_rad1;
+  float phase_in_rad2;
+  float joint_bilateral_ab_threshold;
+  float joint_bilateral_max_edge;
+  float joint_bilateral_exp;
+  float joint_bilateral_threshold;
+  float gaussian_kernel_0;
+  float gaussian_kernel_1;
+  float gaussian_kernel_2;
+  float gaussian_kernel_3;
+  float gaussian_kernel_4;
+  float gaussian_kernel_5;
+  float gaussian_kernel_6;
+  float gaussian_kernel_7;
+  float gaussian_kernel_8;
+  float phase_offset;
+  float unambigious_dist;
+  float individual_ab_threshold;
+  float ab_threshold;
+  float ab_confidence_slope;
+  float ab_confidence_offset;
+  float min_dealias_confidence;
+  float max_dealias_confidence;
+  float edge_ab_avg_min_value;
+  float edge_ab_std_dev_threshold;
+  float edge_close_delta_threshold;
+  float edge_far_delta_threshold;
+  float edge_max_delta_threshold;
+  float edge_avg_delta_threshold;
+  float max_edge_count;
+  float min_depth;
+  float max_depth;
+} Parameters;
+
+#define AB_MULTIPLIER (params->ab_multiplier)
+#define AB_MULTIPLIER_PER_FRQ0 (params->ab_multiplier_per_frq0)
+#define AB_MULTIPLIER_PER_FRQ1 (params->ab_multiplier_per_frq1)
+#define AB_MULTIPLIER_PER_FRQ2 (params->ab_multiplier_per_frq2)
+#define AB_OUTPUT_MULTIPLIER (params->ab_output_multiplier)
+#define PHASE_IN_RAD0 (params->phase_in_rad0)
+#define PHASE_IN_RAD1 (params->phase_in_rad1)
+#define PHASE_IN_RAD2 (params->phase_in_rad2)
+#define JOINT_BILATERAL_AB_THRESHOLD (params->joint_bilateral_ab_threshold)
+#define JOINT_BILATERAL_MAX_EDGE (params->joint_bilateral_max_edge)
+#define JOINT_BILATERAL_EXP (params->joint_bilateral_exp)
+#define JOINT_BILATERAL_THRESHOLD (params->joint_bilateral_threshold)
+#define GAUSSIAN_KERNEL_0 (params->gaussian_kernel_0)
+#define GAUSSIAN_KERNEL_1 (params->gaussian_kernel_1)
+#define GAUSSIAN_KERNEL_2 (params->gaussian_kernel_2)
+#define GAUSSIAN_KERNEL_3 (params->gaussian_kernel_3)
+#define GAUSSIAN_KERNEL_4 (params->gaussian_kernel_4)
+#define GAUSSIAN_KERNEL_5 (params->gaussian_kernel_5)
+#define GAUSSIAN_KERNEL_6 (params->gaussian_kernel_6)
+#define GAUSSIAN_KERNEL_7 (params->gaussian_kernel_7)
+#define GAUSSIAN_KERNEL_8 (params->gaussian_kernel_8)
+#define PHASE_OFFSET (params->phase_offset)
+#define UNAMBIGIOUS_DIST (params->unambigious_dist)
+#define INDIVIDUAL_AB_THRESHOLD (params->individual_ab_threshold)
+#define AB_THRESHOLD (params->ab_threshold)
+#define AB_CONFIDENCE_SLOPE (params->ab_confidence_slope)
+#define AB_CONFIDENCE_OFFSET (params->ab_confidence_offset)
+#define MIN_DEALIAS_CONFIDENCE (params->min_dealias_confidence)
+#define MAX_DEALIAS_CONFIDENCE (params->max_dealias_confidence)
+#define EDGE_AB_AVG_MIN_VALUE (params->edge_ab_avg_min_value)
+#define EDGE_AB_STD_DEV_THRESHOLD (params->edge_ab_std_dev_threshold)
+#define EDGE_CLOSE_DELTA_THRESHOLD (params->edge_close_delta_threshold)
+#define EDGE_FAR_DELTA_THRESHOLD (params->edge_far_delta_threshold)
+#define EDGE_MAX_DELTA_THRESHOLD (params->edge_max_delta_threshold)
+#define EDGE_AVG_DELTA_THRESHOLD (params->edge_avg_delta_threshold)
+#define MAX_EDGE_COUNT (params->max_edge_count)
+#define MIN_DEPTH (params->min_depth)
+#define MAX_DEPTH (params->max_depth)
+
+#define PARAMETERS_ARG , constant Parameters *params
+#define PARAMETERS_PASS , params
+
+#else
+
+#define PARAMETERS_ARG
+#define PARAMETERS_PASS
+
+#endif
+
+/*******************************************************************************
+ * Intermediate images between the passes, stored in half precision if
+ * HALF_INTERMEDIATES is defined, the passes still compute in single precision
+ ******************************************************************************/
+#ifdef HALF_INTERMEDIATES
+
+#define INTERMEDIATE half
+#define INTERMEDIATE3 half
+#define LOAD_INTERMEDIATE(p, i) vload_half((i), (p))
+#define LOAD_INTERMEDIATE3(p, i) vload_half3((i), (p))
+#define STORE_INTERMEDIATE(p, i, value) vstore_half((value), (i), (p))
+#define STORE_INTERMEDIATE3(p, i, value) vstore_half3((value), (i), (p))
+
+#else
+
+#define INTERMEDIATE float
+#define INTERMEDIATE3 float3
+#define LOAD_INTERMEDIATE(p, i) ((p)[i])
+#define LOAD_INTERMEDIATE3(p, i) ((p)[i])
+#define STORE_INTERMEDIATE(p, i, value) ((p)[i] = (value))
+#define STORE_INTERMEDIATE3(p, i, value) ((p)[i] = (value))
+
+#endif
+
 /*******************************************************************************
  * Process pixel stage 1
  ******************************************************************************/
@@ -43,7 +165,7 @@ float decodePixelMeasurement(global const ushort *data, global const short *lut1
   return (float)lut11to16[(x < 1 || 510 < x || col_idx > 352) ? 0 : ((data[data_idx0] >> upper_bytes) | (data[data_idx1] << lower_bytes)) & 2047];
 }
 
-float2 processMeasurementTriple(const float ab_multiplier_per_frq, const float p0, const float3 v, int *invalid)
+float2 processMeasurementTriple(const float ab_multiplier_per_frq, const float p0, const float3 v, int *invalid PARAMETERS_ARG)
 {
   float3 p0vec = (float3)(p0 + PHASE_IN_RAD0, p0 + PHASE_IN_RAD1, p0 + PHASE_IN_RAD2);
   float3 p0cos = cos(p0vec);
@@ -54,13 +176,10 @@ float2 processMeasurementTriple(const float ab_multiplier_per_frq, const float p
   return (float2)(dot(v, p0cos), dot(v, p0sin)) * ab_multiplier_per_frq;
 }
 
-void kernel processPixelStage1(global const short *lut11to16, global const float *z_table, global const float3 *p0_table, global const ushort *data,
-                               global float3 *a_out, global float3 *b_out, global float3 *n_out, global float *ir_out)
+void computePixelStage1(global const short *lut11to16, global const float *z_table, global const float3 *p0_table, global const ushort *data,
+                        const uint x, const uint y, float3 *a_out, float3 *b_out, float3 *n_out, float *ir_out PARAMETERS_ARG)
 {
-  const uint i = get_global_id(0);
-
-  const uint x = i % 512;
-  const uint y = i / 512;
+  const uint i = y * 512 + x;
 
   const uint y_in = (423 - y);
 
@@ -75,17 +194,17 @@ void kernel processPixelStage1(global const short *lut11to16, global const float
   const float3 v0 = (float3)(decodePixelMeasurement(data, lut11to16, 0, x, y_in),
                              decodePixelMeasurement(data, lut11to16, 1, x, y_in),
                              decodePixelMeasurement(data, lut11to16, 2, x, y_in));
-  const float2 ab0 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ0, p0.x, v0, &saturatedX);
+  const float2 ab0 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ0, p0.x, v0, &saturatedX PARAMETERS_PASS);
 
   const float3 v1 = (float3)(decodePixelMeasurement(data, lut11to16, 3, x, y_in),
                              decodePixelMeasurement(data, lut11to16, 4, x, y_in),
                              decodePixelMeasurement(data, lut11to16, 5, x, y_in));
-  const float2 ab1 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ1, p0.y, v1, &saturatedY);
+  const float2 ab1 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ1, p0.y, v1, &saturatedY PARAMETERS_PASS);
 
   const float3 v2 = (float3)(decodePixelMeasurement(data, lut11to16, 6, x, y_in),
                              decodePixelMeasurement(data, lut11to16, 7, x, y_in),
                              decodePixelMeasurement(data, lut11to16, 8, x, y_in));
-  const float2 ab2 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ2, p0.z, v2, &saturatedZ);
+  const float2 ab2 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ2, p0.z, v2, &saturatedZ PARAMETERS_PASS);
 
   float3 a = select((float3)(ab0.x, ab1.x, ab2.x), (float3)(0.0f), invalid_pixel);
   float3 b = select((float3)(ab0.y, ab1.y, ab2.y), (float3)(0.0f), invalid_pixel);
@@ -95,95 +214,155 @@ void kernel processPixelStage1(global const short *lut11to16, global const float
   a = select(a, (float3)(0.0f), saturated);
   b = select(b, (float3)(0.0f), saturated);
 
-  a_out[i] = a;
-  b_out[i] = b;
-  n_out[i] = n;
-  ir_out[i] = min(dot(select(n, (float3)(65535.0f), saturated), (float3)(0.333333333f  * AB_MULTIPLIER * AB_OUTPUT_MULTIPLIER)), 65535.0f);
+  *a_out = a;
+  *b_out = b;
+  *n_out = n;
+  *ir_out = min(dot(select(n, (float3)(65535.0f), saturated), (float3)(0.333333333f  * AB_MULTIPLIER * AB_OUTPUT_MULTIPLIER)), 65535.0f);
+}
+
+void kernel processPixelStage1(global const short *lut11to16, global const float *z_table, global const float3 *p0_table, global const ushort *data,
+                               global INTERMEDIATE3 *a_out, global INTERMEDIATE3 *b_out, global INTERMEDIATE3 *n_out, global float *ir_out PARAMETERS_ARG)
+{
+  const uint x = get_global_id(0);
+  const uint y = get_global_id(1);
+  const uint i = y * 512 + x;
+
+  float3 a, b, n;
+  float ir;
+  computePixelStage1(lut11to16, z_table, p0_table, data, x, y, &a, &b, &n, &ir PARAMETERS_PASS);
+
+  STORE_INTERMEDIATE3(a_out, i, a);
+  STORE_INTERMEDIATE3(b_out, i, b);
+  STORE_INTERMEDIATE3(n_out, i, n);
+  ir_out[i] = ir;
+}
+
+/*******************************************************************************
+ * Bin pixel stage 1, averages the 2x2 blocks of the image for binned output.
+ * The outputs are 256x212 images whatever STAGE2_WIDTH is, the work group size
+ * tuning runs this kernel without binned output too.
+ ******************************************************************************/
+void kernel binPixelStage1(global const INTERMEDIATE3 *a, global const INTERMEDIATE3 *b, global const float *ir,
+                           global INTERMEDIATE3 *a_out, global INTERMEDIATE3 *b_out, global INTERMEDIATE3 *n_out, global float *ir_out)
+{
+  const uint x = get_global_id(0);
+  const uint y = get_global_id(1);
+  const uint i = y * 256 + x;
+  const uint i_in = 2 * y * 512 + 2 * x;
+
+  const float3 a_binned = (LOAD_INTERMEDIATE3(a, i_in) + LOAD_INTERMEDIATE3(a, i_in + 1) + LOAD_INTERMEDIATE3(a, i_in + 512) + LOAD_INTERMEDIATE3(a, i_in + 513)) * 0.25f;
+  const float3 b_binned = (LOAD_INTERMEDIATE3(b, i_in) + LOAD_INTERMEDIATE3(b, i_in + 1) + LOAD_INTERMEDIATE3(b, i_in + 512) + LOAD_INTERMEDIATE3(b, i_in + 513)) * 0.25f;
+
+  // the bilateral filter takes n as the norm of a and b
+  STORE_INTERMEDIATE3(a_out, i, a_binned);
+  STORE_INTERMEDIATE3(b_out, i, b_binned);
+  STORE_INTERMEDIATE3(n_out, i, sqrt(a_binned * a_binned + b_binned * b_binned));
+  ir_out[i] = (ir[i_in] + ir[i_in + 1] + ir[i_in + 512] + ir[i_in + 513]) * 0.25f;
 }
 
 /*******************************************************************************
  * Filter pixel stage 1
  ******************************************************************************/
-void kernel filterPixelStage1(global const float3 *a, global const float3 *b, global const float3 *n,
-                              global float3 *a_out, global float3 *b_out, global uchar *max_edge_test)
+/**
+ * Bilateral filter of a pixel away from the border.
+ * a, b and n hold its 3x3 neighbourhood row by row, the pixel itself at index 4.
+ */
+void filterPixelStage1Neighbourhood(const float3 *a, const float3 *b, const float3 *n,
+                                    float3 *a_out, float3 *b_out, uchar *max_edge_test PARAMETERS_ARG)
 {
-  const uint i = get_global_id(0);
+  const float3 self_a = a[4];
+  const float3 self_b = b[4];
+
+  const float gaussian[9] = {GAUSSIAN_KERNEL_0, GAUSSIAN_KERNEL_1, GAUSSIAN_KERNEL_2, GAUSSIAN_KERNEL_3, GAUSSIAN_KERNEL_4, GAUSSIAN_KERNEL_5, GAUSSIAN_KERNEL_6, GAUSSIAN_KERNEL_7, GAUSSIAN_KERNEL_8};
 
-  const uint x = i % 512;
-  const uint y = i / 512;
+  float3 threshold = (float3)(JOINT_BILATERAL_THRESHOLD);
+  float3 joint_bilateral_exp = (float3)(JOINT_BILATERAL_EXP);
 
-  const float3 self_a = a[i];
-  const float3 self_b = b[i];
+  const float3 self_norm = n[4];
+  const float3 self_normalized_a = self_a / self_norm;
+  const float3 self_normalized_b = self_b / self_norm;
 
-  const float gaussian[9] = {GAUSSIAN_KERNEL_0, GAUSSIAN_KERNEL_1, GAUSSIAN_KERNEL_2, GAUSSIAN_KERNEL_3, GAUSSIAN_KERNEL_4, GAUSSIAN_KERNEL_5, GAUSSIAN_KERNEL_6, GAUSSIAN_KERNEL_7, GAUSSIAN_KERNEL_8};
+  float3 weight_acc = (float3)(0.0f);
+  float3 weighted_a_acc = (float3)(0.0f);
+  float3 weighted_b_acc = (float3)(0.0f);
+  float3 dist_acc = (float3)(0.0f);
 
-  if(x < 1 || y < 1 || x > 510 || y > 422)
+  const int3 c0 = isless(self_norm * self_norm, threshold);
+
+  threshold = select(threshold, (float3)(0.0f), c0);
+  joint_bilateral_exp = select(joint_bilateral_exp, (float3)(0.0f), c0);
+
+  for(int j = 0; j < 9; ++j)
   {
-    a_out[i] = self_a;
-    b_out[i] = self_b;
-    max_edge_test[i] = 1;
+    const float3 other_a = a[j];
+    const float3 other_b = b[j];
+    const float3 other_norm = n[j];
+    const float3 other_normalized_a = other_a / other_norm;
+    const float3 other_normalized_b = other_b / other_norm;
+
+    const int3 c1 = isless(other_norm * other_norm, threshold);
+
+    const float3 dist = 0.5f * (1.0f - (self_normalized_a * other_normalized_a + self_normalized_b * other_normalized_b));
+    const float3 weight = select(gaussian[j] * exp(-1.442695f * joint_bilateral_exp * dist), (float3)(0.0f), c1);
+
+    weighted_a_acc += weight * other_a;
+    weighted_b_acc += weight * other_b;
+    weight_acc += weight;
+    dist_acc += select(dist, (float3)(0.0f), c1);
   }
-  else
-  {
-    float3 threshold = (float3)(JOINT_BILATERAL_THRESHOLD);
-    float3 joint_bilateral_exp = (float3)(JOINT_BILATERAL_EXP);
 
-    const float3 self_norm = n[i];
-    const float3 self_normalized_a = self_a / self_norm;
-    const float3 self_normalized_b = self_b / self_norm;
+  const int3 c2 = isless((float3)(0.0f), weight_acc.xyz);
+  *a_out = select((float3)(0.0f), weighted_a_acc / weight_acc, c2);
+  *b_out = select((float3)(0.0f), weighted_b_acc / weight_acc, c2);
 
-    float3 weight_acc = (float3)(0.0f);
-    float3 weighted_a_acc = (float3)(0.0f);
-    float3 weighted_b_acc = (float3)(0.0f);
-    float3 dist_acc = (float3)(0.0f);
+  *max_edge_test = all(isless(dist_acc, (float3)(JOINT_BILATERAL_MAX_EDGE)));
+}
 
-    const int3 c0 = isless(self_norm * self_norm, threshold);
+void kernel filterPixelStage1(global const INTERMEDIATE3 *a, global const INTERMEDIATE3 *b, global const INTERMEDIATE3 *n,
+                              global INTERMEDIATE3 *a_out, global INTERMEDIATE3 *b_out, global uchar *max_edge_test PARAMETERS_ARG)
+{
+  const uint x = get_global_id(0);
+  const uint y = get_global_id(1);
+  const uint i = y * STAGE2_WIDTH + x;
 
-    threshold = select(threshold, (float3)(0.0f), c0);
-    joint_bilateral_exp = select(joint_bilateral_exp, (float3)(0.0f), c0);
+  if(x < 1 || y < 1 || x > STAGE2_WIDTH - 2 || y > STAGE2_HEIGHT - 2)
+  {
+    STORE_INTERMEDIATE3(a_out, i, LOAD_INTERMEDIATE3(a, i));
+    STORE_INTERMEDIATE3(b_out, i, LOAD_INTERMEDIATE3(b, i));
+    max_edge_test[i] = 1;
+  }
+  else
+  {
+    float3 a_nb[9], b_nb[9], n_nb[9];
 
     for(int yi = -1, j = 0; yi < 2; ++yi)
     {
-      uint i_other = (y + yi) * 512 + x - 1;
+      uint i_other = (y + yi) * STAGE2_WIDTH + x - 1;
 
       for(int xi = -1; xi < 2; ++xi, ++j, ++i_other)
       {
-        const float3 other_a = a[i_other];
-        const float3 other_b = b[i_other];
-        const float3 other_norm = n[i_other];
-        const float3 other_normalized_a = other_a / other_norm;
-        const float3 other_normalized_b = other_b / other_norm;
-
-        const int3 c1 = isless(other_norm * other_norm, threshold);
-
-        const float3 dist = 0.5f * (1.0f - (self_normalized_a * other_normalized_a + self_normalized_b * other_normalized_b));
-        const float3 weight = select(gaussian[j] * exp(-1.442695f * joint_bilateral_exp * dist), (float3)(0.0f), c1);
-
-        weighted_a_acc += weight * other_a;
-        weighted_b_acc += weight * other_b;
-        weight_acc += weight;
-        dist_acc += select(dist, (float3)(0.0f), c1);
+        a_nb[j] = LOAD_INTERMEDIATE3(a, i_other);
+        b_nb[j] = LOAD_INTERMEDIATE3(b, i_other);
+        n_nb[j] = LOAD_INTERMEDIATE3(n, i_other);
       }
     }
 
-    const int3 c2 = isless((float3)(0.0f), weight_acc.xyz);
-    a_out[i] = select((float3)(0.0f), weighted_a_acc / weight_acc, c2);
-    b_out[i] = select((float3)(0.0f), weighted_b_acc / weight_acc, c2);
+    float3 filtered_a, filtered_b;
+    uchar edge_test;
+    filterPixelStage1Neighbourhood(a_nb, b_nb, n_nb, &filtered_a, &filtered_b, &edge_test PARAMETERS_PASS);
 
-    max_edge_test[i] = all(isless(dist_acc, (float3)(JOINT_BILATERAL_MAX_EDGE)));
+    STORE_INTERMEDIATE3(a_out, i, filtered_a);
+    STORE_INTERMEDIATE3(b_out, i, filtered_b);
+    max_edge_test[i] = edge_test;
   }
 }
 
 /*******************************************************************************
  * Process pixel stage 2
  ******************************************************************************/
-void kernel processPixelStage2(global const float3 *a_in, global const float3 *b_in, global const float *x_table, global const float *z_table,
-                               global float *depth, global float *ir_sums)
+/** Depth of a pixel from its filtered a and b, also returns the sum of its amplitudes in ir_sum_out. */
+float computePixelStage2(const float3 a, const float3 b, float xmultiplier, const float zmultiplier, float *ir_sum_out PARAMETERS_ARG)
 {
-  const uint i = get_global_id(0);
-  float3 a = a_in[i];
-  float3 b = b_in[i];
-
   float3 phase = atan2(b, a);
   phase = select(phase, phase + 2.0f * M_PI_F, isless(phase, (float3)(0.0f)));
   phase = select(phase, (float3)(0.0f), isnan(phase));
@@ -263,9 +442,6 @@ void kernel processPixelStage2(global const float3 *a_in, global const float3 *b
     phase_final = true/*(modeMask & 2) != 0*/ ? t11 : t10;
   }
 
-  float zmultiplier = z_table[i];
-  float xmultiplier = x_table[i];
-
   phase_final = 0.0f < phase_final ? phase_final + PHASE_OFFSET : phase_final;
 
   float depth_linear = zmultiplier * phase_final;
@@ -279,29 +455,38 @@ void kernel processPixelStage2(global const float3 *a_in, global const float3 *b
   depth_fit = depth_fit < 0.0f ? 0.0f : depth_fit;
 
   float d = cond1 ? depth_fit : depth_linear; // r1.y -> later r2.z
-  depth[i] = d;
-  ir_sums[i] = ir_sum;
+  *ir_sum_out = ir_sum;
+  return d;
+}
+
+void kernel processPixelStage2(global const INTERMEDIATE3 *a_in, global const INTERMEDIATE3 *b_in, global const float *x_table, global const float *z_table,
+                               global float *depth, global INTERMEDIATE *ir_sums PARAMETERS_ARG)
+{
+  const uint i = get_global_id(1) * STAGE2_WIDTH + get_global_id(0);
+
+  float ir_sum;
+  depth[i] = computePixelStage2(LOAD_INTERMEDIATE3(a_in, i), LOAD_INTERMEDIATE3(b_in, i), x_table[i], z_table[i], &ir_sum PARAMETERS_PASS);
+  STORE_INTERMEDIATE(ir_sums, i, ir_sum);
 }
 
 /*******************************************************************************
  * Filter pixel stage 2
  ******************************************************************************/
-void kernel filterPixelStage2(global const float *depth, global const float *ir_sums, global const uchar *max_edge_test, global float *filtered)
+/**
+ * Edge aware filter of a pixel.
+ * depth and ir_sums hold its 3x3 neighbourhood row by row, the pixel itself at index 4.
+ * On the border of the image only the pixel itself is used.
+ */
+float filterPixelStage2Neighbourhood(const float *depth, const float *ir_sums, const uchar edge_test, const int border PARAMETERS_ARG)
 {
-  const uint i = get_global_id(0);
-
-  const uint x = i % 512;
-  const uint y = i / 512;
-
-  const float raw_depth = depth[i];
-  const float ir_sum = ir_sums[i];
-  const uchar edge_test = max_edge_test[i];
+  const float raw_depth = depth[4];
+  const float ir_sum = ir_sums[4];
 
   if(raw_depth >= MIN_DEPTH && raw_depth <= MAX_DEPTH)
   {
-    if(x < 1 || y < 1 || x > 510 || y > 422)
+    if(border)
     {
-      filtered[i] = raw_depth;
+      return raw_depth;
     }
     else
     {
@@ -310,28 +495,23 @@ void kernel filterPixelStage2(global const float *depth, global const float *ir_
       float min_depth = raw_depth;
       float max_depth = raw_depth;
 
-      for(int yi = -1; yi < 2; ++yi)
+      for(int j = 0; j < 9; ++j)
       {
-        uint i_other = (y + yi) * 512 + x - 1;
+        if(j == 4)
+        {
+          continue;
+        }
+
+        const float raw_depth_other = depth[j];
+        const float ir_sum_other = ir_sums[j];
 
-        for(int xi = -1; xi < 2; ++xi, ++i_other)
+        ir_sum_acc += ir_sum_other;
+        squared_ir_sum_acc += ir_sum_other * ir_sum_other;
+
+        if(0.0f < raw_depth_other)
         {
-          if(i_other == i)
-          {
-            continue;
-          }
-
-          const float raw_depth_other = depth[i_other];
-          const float ir_sum_other = ir_sums[i_other];
-
-          ir_sum_acc += ir_sum_other;
-          squared_ir_sum_acc += ir_sum_other * ir_sum_other;
-
-          if(0.0f < raw_depth_other)
-          {
-            min_depth = min(min_depth, raw_depth_other);
-            max_depth = max(max_depth, raw_depth_other);
-          }
+          min_depth = min(min_depth, raw_depth_other);
+          max_depth = max(max_depth, raw_depth_other);
         }
       }
 
@@ -360,21 +540,230 @@ void kernel filterPixelStage2(global const float *depth, global const float *ir_
           float tmp1 = 1500.0f > raw_depth ? 30.0f : 0.02f * raw_depth;
           float edge_count = 0.0f;
 
-          filtered[i] = edge_count > MAX_EDGE_COUNT ? 0.0f : raw_depth;
+          return edge_count > MAX_EDGE_COUNT ? 0.0f : raw_depth;
         }
         else
         {
-          filtered[i] = 0.0f;
+          return 0.0f;
         }
       }
       else
       {
-        filtered[i] = 0.0f;
+        return 0.0f;
+      }
+    }
+  }
+  else
+  {
+    return 0.0f;
+  }
+}
+
+void kernel filterPixelStage2(global const float *depth, global const INTERMEDIATE *ir_sums, global const uchar *max_edge_test, global float *filtered PARAMETERS_ARG)
+{
+  const uint x = get_global_id(0);
+  const uint y = get_global_id(1);
+  const uint i = y * STAGE2_WIDTH + x;
+
+  const int border = x < 1 || y < 1 || x > STAGE2_WIDTH - 2 || y > STAGE2_HEIGHT - 2;
+  float depth_nb[9], ir_sum_nb[9];
+
+  if(border)
+  {
+    depth_nb[4] = depth[i];
+    ir_sum_nb[4] = LOAD_INTERMEDIATE(ir_sums, i);
+  }
+  else
+  {
+    for(int yi = -1, j = 0; yi < 2; ++yi)
+    {
+      uint i_other = (y + yi) * STAGE2_WIDTH + x - 1;
+
+      for(int xi = -1; xi < 2; ++xi, ++j, ++i_other)
+      {
+        depth_nb[j] = depth[i_other];
+        ir_sum_nb[j] = LOAD_INTERMEDIATE(ir_sums, i_other);
       }
     }
   }
+
+  filtered[i] = filterPixelStage2Neighbourhood(depth_nb, ir_sum_nb, max_edge_test[i], border PARAMETERS_PASS);
+}
+
+/*******************************************************************************
+ * Fused passes, each work group computes a tile of FUSED_TILE_WIDTH x FUSED_TILE_HEIGHT
+ * pixels. The first pass of a pair is computed for the tile and a one pixel halo into
+ * local memory, the filter then reads its neighbourhood from there, so the intermediate
+ * images never go through global memory. The global size is rounded up to whole tiles.
+ ******************************************************************************/
+#define FUSED_HALO_WIDTH (FUSED_TILE_WIDTH + 2)
+#define FUSED_HALO_HEIGHT (FUSED_TILE_HEIGHT + 2)
+
+/**
+ * Stage 1 and the bilateral filter, for the full resolution image only.
+ * Writes the same images as filterPixelStage1, and the IR of processPixelStage1.
+ */
+void kernel processFilterPixelStage1(global const short *lut11to16, global const float *z_table, global const float3 *p0_table, global const ushort *data,
+                                     global INTERMEDIATE3 *a_out, global INTERMEDIATE3 *b_out, global uchar *max_edge_test, global float *ir_out PARAMETERS_ARG)
+{
+  local float3 tile_a[FUSED_HALO_WIDTH * FUSED_HALO_HEIGHT];
+  local float3 tile_b[FUSED_HALO_WIDTH * FUSED_HALO_HEIGHT];
+  local float3 tile_n[FUSED_HALO_WIDTH * FUSED_HALO_HEIGHT];
+
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const int lx = get_local_id(0);
+  const int ly = get_local_id(1);
+
+  // top left corner of the tile including its halo
+  const int x0 = x - lx - 1;
+  const int y0 = y - ly - 1;
+
+  for(int t = ly * FUSED_TILE_WIDTH + lx; t < FUSED_HALO_WIDTH * FUSED_HALO_HEIGHT; t += FUSED_TILE_WIDTH * FUSED_TILE_HEIGHT)
+  {
+    const int tx = t % FUSED_HALO_WIDTH;
+    const int ty = t / FUSED_HALO_WIDTH;
+    const int xt = x0 + tx;
+    const int yt = y0 + ty;
+
+    if(xt < 0 || yt < 0 || xt > 511 || yt > 423)
+    {
+      continue;
+    }
+
+    float3 a, b, n;
+    float ir;
+    computePixelStage1(lut11to16, z_table, p0_table, data, xt, yt, &a, &b, &n, &ir PARAMETERS_PASS);
+
+    tile_a[t] = a;
+    tile_b[t] = b;
+    tile_n[t] = n;
+
+    // the halo belongs to the neighbouring tiles
+    if(tx > 0 && ty > 0 && tx <= FUSED_TILE_WIDTH && ty <= FUSED_TILE_HEIGHT)
+    {
+      ir_out[yt * 512 + xt] = ir;
+    }
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if(x > 511 || y > 423)
+  {
+    return;
+  }
+
+  const int i = y * 512 + x;
+  const int t = (ly + 1) * FUSED_HALO_WIDTH + lx + 1;
+
+  if(x < 1 || y < 1 || x > 510 || y > 422)
+  {
+    STORE_INTERMEDIATE3(a_out, i, tile_a[t]);
+    STORE_INTERMEDIATE3(b_out, i, tile_b[t]);
+    max_edge_test[i] = 1;
+    return;
+  }
+
+  float3 a_nb[9], b_nb[9], n_nb[9];
+
+  for(int yi = -1, j = 0; yi < 2; ++yi)
+  {
+    int t_other = t + yi * FUSED_HALO_WIDTH - 1;
+
+    for(int xi = -1; xi < 2; ++xi, ++j, ++t_other)
+    {
+      a_nb[j] = tile_a[t_other];
+      b_nb[j] = tile_b[t_other];
+      n_nb[j] = tile_n[t_other];
+    }
+  }
+
+  float3 filtered_a, filtered_b;
+  uchar edge_test;
+  filterPixelStage1Neighbourhood(a_nb, b_nb, n_nb, &filtered_a, &filtered_b, &edge_test PARAMETERS_PASS);
+
+  STORE_INTERMEDIATE3(a_out, i, filtered_a);
+  STORE_INTERMEDIATE3(b_out, i, filtered_b);
+  max_edge_test[i] = edge_test;
+}
+
+/**
+ * Stage 2 and the edge aware filter, writes the same image as filterPixelStage2.
+ */
+void kernel processFilterPixelStage2(global const INTERMEDIATE3 *a_in, global const INTERMEDIATE3 *b_in, global const float *x_table, global const float *z_table,
+                                     global const uchar *max_edge_test, global float *filtered PARAMETERS_ARG)
+{
+  local float tile_depth[FUSED_HALO_WIDTH * FUSED_HALO_HEIGHT];
+  local float tile_ir_sum[FUSED_HALO_WIDTH * FUSED_HALO_HEIGHT];
+
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const int lx = get_local_id(0);
+  const int ly = get_local_id(1);
+
+  // top left corner of the tile including its halo
+  const int x0 = x - lx - 1;
+  const int y0 = y - ly - 1;
+
+  for(int t = ly * FUSED_TILE_WIDTH + lx; t < FUSED_HALO_WIDTH * FUSED_HALO_HEIGHT; t += FUSED_TILE_WIDTH * FUSED_TILE_HEIGHT)
+  {
+    const int xt = x0 + t % FUSED_HALO_WIDTH;
+    const int yt = y0 + t / FUSED_HALO_WIDTH;
+
+    if(xt < 0 || yt < 0 || xt > STAGE2_WIDTH - 1 || yt > STAGE2_HEIGHT - 1)
+    {
+      continue;
+    }
+
+    const int i_other = yt * STAGE2_WIDTH + xt;
+    float ir_sum;
+    tile_depth[t] = computePixelStage2(LOAD_INTERMEDIATE3(a_in, i_other), LOAD_INTERMEDIATE3(b_in, i_other), x_table[i_other], z_table[i_other], &ir_sum PARAMETERS_PASS);
+    tile_ir_sum[t] = ir_sum;
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if(x > STAGE2_WIDTH - 1 || y > STAGE2_HEIGHT - 1)
+  {
+    return;
+  }
+
+  const int i = y * STAGE2_WIDTH + x;
+  const int t = (ly + 1) * FUSED_HALO_WIDTH + lx + 1;
+
+  const int border = x < 1 || y < 1 || x > STAGE2_WIDTH - 2 || y > STAGE2_HEIGHT - 2;
+  float depth_nb[9], ir_sum_nb[9];
+
+  if(border)
+  {
+    depth_nb[4] = tile_depth[t];
+    ir_sum_nb[4] = tile_ir_sum[t];
+  }
   else
   {
-    filtered[i] = 0.0f;
+    for(int yi = -1, j = 0; yi < 2; ++yi)
+    {
+      int t_other = t + yi * FUSED_HALO_WIDTH - 1;
+
+      for(int xi = -1; xi < 2; ++xi, ++j, ++t_other)
+      {
+        depth_nb[j] = tile_depth[t_other];
+        ir_sum_nb[j] = tile_ir_sum[t_other];
+      }
+    }
   }
+
+  filtered[i] = filterPixelStage2Neighbourhood(depth_nb, ir_sum_nb, max_edge_test[i], border PARAMETERS_PASS);
+}
+
+/*******************************************************************************
+ * Pack output, converts IR or depth to 16 bit integers for compact frames
+ ******************************************************************************/
+void kernel packOutputUInt16(global const float *in, global ushort *out)
+{
+  const uint i = get_global_id(1) * STAGE2_WIDTH + get_global_id(0);
+  const float value = in[i];
+
+  // rounded to nearest and saturated, NaN and negative values become 0
+  out[i] = value > 0.0f ? convert_ushort_sat(value + 0.5f) : 0;
 }
@@ -30,8 +30,15 @@
 #include <libfreenect2/resource.h>
 #include <libfreenect2/protocol/response.h>
 #include <libfreenect2/logging.h>
+#include <libfreenect2/depth_roi.h>
+#include <libfreenect2/threading.h>
+#include <libfreenect2/allocator.h>
+#include <libfreenect2/file_cache.h>
 
 #include <sstream>
+#include <deque>
+#include <algorithm>
+#include <cstring>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -66,83 +73,423 @@ std::string loadCLSource(const std::string &filename)
   return std::string(reinterpret_cast<const char *>(data), length);
 }
 
+/** Packet buffer in host accessible device memory, see OpenCLAllocator. */
+struct OpenCLBuffer : public Buffer
+{
+  cl::Buffer buffer;
+};
+
+/**
+ * Allocates packet buffers the first stage reads in place. A buffer stays mapped while
+ * the stream parser fills it and is only unmapped while the first stage runs.
+ */
+class OpenCLAllocator : public Allocator
+{
+public:
+  OpenCLAllocator(const cl::Context &context, const cl::CommandQueue &queue) :
+    context(context),
+    queue(queue)
+  {
+  }
+
+  virtual Buffer *allocate(size_t size)
+  {
+    cl_int err;
+    OpenCLBuffer *buffer = new OpenCLBuffer;
+    buffer->capacity = size;
+    buffer->length = 0;
+    buffer->data = 0;
+    buffer->buffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+
+    if(err == CL_SUCCESS)
+    {
+      err = map(*buffer, NULL, true);
+    }
+    if(err != CL_SUCCESS)
+    {
+      LOG_ERROR << "failed to allocate mapped packet buffer: " << err;
+      delete buffer;
+      return 0;
+    }
+
+    buffers.push_back(buffer);
+    return buffer;
+  }
+
+  virtual void free(Buffer *buffer)
+  {
+    OpenCLBuffer *b = static_cast<OpenCLBuffer *>(buffer);
+    unmap(*b, NULL);
+    buffers.erase(std::find(buffers.begin(), buffers.end(), b));
+    delete b;
+  }
+
+  /**
+   * Find the buffer a packet was assembled in.
+   * @param data Data of the packet.
+   * @return The buffer, or 0 if \a data was not allocated here.
+   */
+  OpenCLBuffer *find(const unsigned char *data) const
+  {
+    for(size_t i = 0; i < buffers.size(); ++i)
+    {
+      if(buffers[i]->data == data)
+        return buffers[i];
+    }
+    return 0;
+  }
+
+  /**
+   * Enqueue mapping a buffer for the host to write, its data may move.
+   * @param buffer Buffer to map.
+   * @param events Events to wait for.
+   * @param blocking Whether to wait until the buffer is mapped.
+   */
+  cl_int map(OpenCLBuffer &buffer, const std::vector<cl::Event> *events, bool blocking)
+  {
+    cl_int err;
+    buffer.data = static_cast<unsigned char *>(queue.enqueueMapBuffer(buffer.buffer, blocking ? CL_TRUE : CL_FALSE, CL_MAP_WRITE, 0, buffer.capacity, events, NULL, &err));
+    return err;
+  }
+
+  /**
+   * Enqueue unmapping a buffer for the device to read.
+   * @param buffer Buffer to unmap.
+   * @param [out] event Event of the unmapping.
+   */
+  cl_int unmap(OpenCLBuffer &buffer, cl::Event *event)
+  {
+    if(buffer.data == 0)
+    {
+      return CL_SUCCESS;
+    }
+
+    cl_int err = queue.enqueueUnmapMemObject(buffer.buffer, buffer.data, NULL, event);
+    buffer.data = 0;
+    return err;
+  }
+
+private:
+  const cl::Context &context;
+  const cl::CommandQueue &queue;
+  std::vector<OpenCLBuffer *> buffers;
+};
+
+/** Frame whose pixels the kernels write in place, mapped for the host once they are done. */
+class OpenCLFrame : public Frame
+{
+public:
+  OpenCLFrame(size_t width, size_t height, size_t bytes_per_pixel, Format format, const cl::Context &context, const cl::CommandQueue &queue) :
+    Frame(width, height, bytes_per_pixel, format, 0),
+    queue(queue)
+  {
+    cl_int err;
+    buffer = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, width * height * bytes_per_pixel, NULL, &err);
+    if(err != CL_SUCCESS)
+    {
+      LOG_ERROR << "cl::Buffer failed: " << err;
+    }
+  }
+
+  virtual ~OpenCLFrame()
+  {
+    if(data != 0)
+    {
+      queue.enqueueUnmapMemObject(buffer, data);
+    }
+  }
+
+  cl::Buffer buffer; ///< Pixels on the device, mapped at #data while the frame is on the host.
+  cl::CommandQueue queue; ///< Queue the frame was allocated for, to unmap #buffer on when the frame is deleted.
+};
+
 class OpenCLDepthPacketProcessorImpl: public WithPerfLogging
 {
 public:
   cl_short lut11to16[2048];
   cl_float x_table[512 * 424];
   cl_float z_table[512 * 424];
+  cl_float x_table_binned[256 * 212]; ///< Tables averaged over 2x2 blocks for binned output, see #binTables.
+  cl_float z_table_binned[256 * 212];
   cl_float3 p0_table[512 * 424];
   libfreenect2::DepthPacketProcessor::Config config;
+  DepthPassRois rois;
   DepthPacketProcessor::Parameters params;
 
-  Frame *ir_frame, *depth_frame;
-
   cl::Context context;
   cl::Device device;
 
   cl::Program program;
-  cl::CommandQueue queue;
+  cl::CommandQueue queue; ///< Queue of the packet upload and the first stage.
+  cl::CommandQueue queue_stage2; ///< Queue of the passes after the first stage and the readback, #queue without pipelining.
+
+  bool zero_copy; ///< Whether the device shares memory with the host, the packets and frames are then used in place.
+  const bool half_intermediates; ///< Whether the images between the passes are stored in half precision.
+  bool use_fused;      ///< Whether the fused kernels run, see Config::EnableOpenCLFusedKernels.
+  bool validate_fused; ///< Whether the next packet checks the fused kernels against the unfused ones first.
 
-  cl::Kernel kernel_processPixelStage1;
-  cl::Kernel kernel_filterPixelStage1;
-  cl::Kernel kernel_processPixelStage2;
-  cl::Kernel kernel_filterPixelStage2;
+  // work group size of the fused kernels, the tile each group computes
+  static const size_t FusedTileWidth = 16;
+  static const size_t FusedTileHeight = 8;
+  OpenCLAllocator allocator; ///< Allocator of the packet buffers with #zero_copy.
+
+  /** Steps of processing a frame whose commands are profiled, see Config::EnableOpenCLProfiling. */
+  enum ProfiledStep
+  {
+    ProfiledUpload,
+    ProfiledStage1,
+    ProfiledBin,
+    ProfiledFilter1,
+    ProfiledStage2,
+    ProfiledFilter2,
+    ProfiledIrPack,
+    ProfiledIrReadback,
+    ProfiledDepthPack,
+    ProfiledDepthReadback,
+    NumProfiledSteps
+  };
+
+  /** Device buffers, kernels and output frames of one frame in the pipeline, see Config::NumOpenCLBufferSets. */
+  struct BufferSet
+  {
+    OpenCLDepthPacketProcessorImpl *impl; ///< Owner, for the completion callback.
+
+    cl::Buffer buf_packet;
+    cl::Buffer buf_a;
+    cl::Buffer buf_b;
+    cl::Buffer buf_n;
+    cl::Buffer buf_ir;
+    cl::Buffer buf_a_binned;
+    cl::Buffer buf_b_binned;
+    cl::Buffer buf_n_binned;
+    cl::Buffer buf_ir_binned;
+    cl::Buffer buf_a_filtered;
+    cl::Buffer buf_b_filtered;
+    cl::Buffer buf_edge_test;
+    cl::Buffer buf_depth;
+    cl::Buffer buf_ir_sum;
+    cl::Buffer buf_filtered;
+    cl::Buffer buf_ir_packed;
+    cl::Buffer buf_depth_packed;
+
+    cl::Kernel kernel_processPixelStage1;
+    cl::Kernel kernel_binPixelStage1;
+    cl::Kernel kernel_filterPixelStage1;
+    cl::Kernel kernel_processPixelStage2;
+    cl::Kernel kernel_filterPixelStage2;
+    cl::Kernel kernel_processFilterPixelStage1;
+    cl::Kernel kernel_processFilterPixelStage2;
+    cl::Kernel kernel_packIr;
+    cl::Kernel kernel_packDepth;
+
+    Frame *ir_frame, *depth_frame;
+
+    cl::Event events[NumProfiledSteps]; ///< Commands of the last frame, null for the steps it did not run.
+
+    bool busy;   ///< Whether the set has a frame in flight or not yet delivered.
+    bool done;   ///< Whether the frame in flight has completed, guarded by #pipeline_mutex.
+    bool failed; ///< Whether the frame in flight failed on the device.
+  };
+
+  static const size_t MaxBufferSets = 3;
+  BufferSet sets[MaxBufferSets];
+  size_t num_sets;     ///< Number of buffer sets in use.
+  size_t next_set;     ///< Set the next packet is processed with.
+  std::deque<BufferSet *> pending; ///< Sets with frames not yet delivered, oldest first, changed by the processor thread under #pipeline_mutex.
+  libfreenect2::mutex pipeline_mutex;
+  libfreenect2::condition_variable pipeline_condition; ///< Signalled whenever a frame in flight completes.
+  FrameListener *listener; ///< Listener of the processor, see OpenCLDepthPacketProcessor::setFrameListener().
 
   size_t image_size;
+  size_t binned_image_size;
 
   // Read only buffers
   size_t buf_lut11to16_size;
   size_t buf_p0_table_size;
   size_t buf_x_table_size;
   size_t buf_z_table_size;
+  size_t buf_x_table_binned_size;
+  size_t buf_z_table_binned_size;
   size_t buf_packet_size;
 
   cl::Buffer buf_lut11to16;
   cl::Buffer buf_p0_table;
   cl::Buffer buf_x_table;
   cl::Buffer buf_z_table;
-  cl::Buffer buf_packet;
+  cl::Buffer buf_x_table_binned;
+  cl::Buffer buf_z_table_binned;
+  cl::Buffer buf_parameters; ///< KernelParameters with Config::EnableOpenCLRuntimeParameters.
 
   // Read-Write buffers
   size_t buf_a_size;
   size_t buf_b_size;
   size_t buf_n_size;
   size_t buf_ir_size;
+  size_t buf_a_binned_size;
+  size_t buf_b_binned_size;
+  size_t buf_n_binned_size;
+  size_t buf_ir_binned_size;
   size_t buf_a_filtered_size;
   size_t buf_b_filtered_size;
   size_t buf_edge_test_size;
   size_t buf_depth_size;
   size_t buf_ir_sum_size;
   size_t buf_filtered_size;
+  size_t buf_ir_packed_size;
+  size_t buf_depth_packed_size;
+
+  /** Parameters the kernels read at runtime with Config::EnableOpenCLRuntimeParameters, laid out like Parameters in the OpenCL source. */
+  struct KernelParameters
+  {
+    cl_float ab_multiplier;
+    cl_float ab_multiplier_per_frq0;
+    cl_float ab_multiplier_per_frq1;
+    cl_float ab_multiplier_per_frq2;
+    cl_float ab_output_multiplier;
+    cl_float phase_in_rad0;
+    cl_float phase_in_rad1;
+    cl_float phase_in_rad2;
+    cl_float joint_bilateral_ab_threshold;
+    cl_float joint_bilateral_max_edge;
+    cl_float joint_bilateral_exp;
+    cl_float joint_bilateral_threshold;
+    cl_float gaussian_kernel_0;
+    cl_float gaussian_kernel_1;
+    cl_float gaussian_kernel_2;
+    cl_float gaussian_kernel_3;
+    cl_float gaussian_kernel_4;
+    cl_float gaussian_kernel_5;
+    cl_float gaussian_kernel_6;
+    cl_float gaussian_kernel_7;
+    cl_float gaussian_kernel_8;
+    cl_float phase_offset;
+    cl_float unambigious_dist;
+    cl_float individual_ab_threshold;
+    cl_float ab_threshold;
+    cl_float ab_confidence_slope;
+    cl_float ab_confidence_offset;
+    cl_float min_dealias_confidence;
+    cl_float max_dealias_confidence;
+    cl_float edge_ab_avg_min_value;
+    cl_float edge_ab_std_dev_threshold;
+    cl_float edge_close_delta_threshold;
+    cl_float edge_far_delta_threshold;
+    cl_float edge_max_delta_threshold;
+    cl_float edge_avg_delta_threshold;
+    cl_float max_edge_count;
+    cl_float min_depth;
+    cl_float max_depth;
+  };
+
+  /** Header of a program cache file, followed by the program binary. */
+  struct ProgramCacheHeader
+  {
+    static const uint32_t Version = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t key; ///< See #programKey.
+    uint64_t binary_size;
+  };
+
+  OpenCLDepthPacketProcessor::ProgramCacheStats cache_stats;
 
-  cl::Buffer buf_a;
-  cl::Buffer buf_b;
-  cl::Buffer buf_n;
-  cl::Buffer buf_ir;
-  cl::Buffer buf_a_filtered;
-  cl::Buffer buf_b_filtered;
-  cl::Buffer buf_edge_test;
-  cl::Buffer buf_depth;
-  cl::Buffer buf_ir_sum;
-  cl::Buffer buf_filtered;
+  /** Kernels whose work group size is tuned, see Config::EnableWorkGroupTuning. */
+  enum TunedKernel
+  {
+    TunedStage1,
+    TunedBin,
+    TunedFilter1,
+    TunedStage2,
+    TunedFilter2,
+    TunedPack,
+    NumTunedKernels
+  };
+
+  /** Header of a work group size cache file, followed by a WorkGroupCacheEntry for each TunedKernel. */
+  struct WorkGroupCacheHeader
+  {
+    static const uint32_t Version = 1;
+    char magic[8]; ///< "FN2CLWGS".
+    uint32_t version;
+    uint32_t count; ///< Number of entries.
+    uint64_t key;   ///< See #workGroupKey.
+  };
+
+  struct WorkGroupCacheEntry
+  {
+    uint32_t width;
+    uint32_t height;
+    float time;
+    float default_time;
+  };
+
+  OpenCLDepthPacketProcessor::WorkGroupTuning tuning[NumTunedKernels]; ///< Work group sizes in use, 0 lets the driver choose.
+  bool tuned;        ///< Whether #tuning holds tuned or cached sizes for the current program.
+  bool tune_pending; ///< Whether the next packet tunes the work group sizes first.
+
+  static const size_t ProfileWindow = 128;
+
+  /** Durations of a profiled step over the last ProfileWindow frames, in milliseconds. */
+  struct StepProfile
+  {
+    float queued[ProfileWindow];    ///< From enqueueing to submission.
+    float submitted[ProfileWindow]; ///< From submission to the start of execution.
+    float executed[ProfileWindow];  ///< From the start to the end of execution.
+    size_t count; ///< Number of frames in the window.
+    size_t next;  ///< Slot of the next frame.
+  };
+
+  StepProfile profiles[NumProfiledSteps];
+  libfreenect2::mutex profile_mutex; ///< Guards #profiles, which the application may read from another thread.
+  cl_command_queue_properties queue_properties; ///< Properties #queue was created with.
 
   bool deviceInitialized;
   bool programBuilt;
   bool programInitialized;
   std::string sourceCode;
 
-  OpenCLDepthPacketProcessorImpl(const int deviceId = -1) 
-    : deviceInitialized(false)
+  OpenCLDepthPacketProcessorImpl(const int deviceId = -1, bool half_intermediates = false)
+    : rois(config)
+    , zero_copy(false)
+    , half_intermediates(half_intermediates)
+    , use_fused(false)
+    , validate_fused(false)
+    , allocator(context, queue)
+    , num_sets(1)
+    , next_set(0)
+    , listener(0)
+    , tuned(false)
+    , tune_pending(false)
+    , queue_properties(0)
+    , deviceInitialized(false)
     , programBuilt(false)
     , programInitialized(false)
   {
-    newIrFrame();
-    newDepthFrame();
+    for(size_t i = 0; i < MaxBufferSets; ++i)
+    {
+      sets[i].impl = this;
+      sets[i].ir_frame = 0;
+      sets[i].depth_frame = 0;
+      sets[i].busy = false;
+      sets[i].done = false;
+      sets[i].failed = false;
+    }
+
+    resetTuning();
+    resetProfiles();
+
+    cache_stats.hits = 0;
+    cache_stats.misses = 0;
+    cache_stats.rejected = 0;
+    cache_stats.stores = 0;
 
     image_size = 512 * 424;
+    binned_image_size = 256 * 212;
 
     deviceInitialized = initDevice(deviceId);
+    allocateFrames(config.EnableIrOutput, config.EnableDepthOutput);
 
     const int CL_ICDL_VERSION = 2;
     typedef cl_int (*icdloader_func)(int, size_t, void*, size_t*);
@@ -165,49 +512,69 @@ public:
     oss << std::scientific;
     oss << " -D BFI_BITMASK=" << "0x180";
 
-    oss << " -D AB_MULTIPLIER=" << params.ab_multiplier << "f";
-    oss << " -D AB_MULTIPLIER_PER_FRQ0=" << params.ab_multiplier_per_frq[0] << "f";
-    oss << " -D AB_MULTIPLIER_PER_FRQ1=" << params.ab_multiplier_per_frq[1] << "f";
-    oss << " -D AB_MULTIPLIER_PER_FRQ2=" << params.ab_multiplier_per_frq[2] << "f";
-    oss << " -D AB_OUTPUT_MULTIPLIER=" << params.ab_output_multiplier << "f";
-
-    oss << " -D PHASE_IN_RAD0=" << params.phase_in_rad[0] << "f";
-    oss << " -D PHASE_IN_RAD1=" << params.phase_in_rad[1] << "f";
-    oss << " -D PHASE_IN_RAD2=" << params.phase_in_rad[2] << "f";
-
-    oss << " -D JOINT_BILATERAL_AB_THRESHOLD=" << params.joint_bilateral_ab_threshold << "f";
-    oss << " -D JOINT_BILATERAL_MAX_EDGE=" << params.joint_bilateral_max_edge << "f";
-    oss << " -D JOINT_BILATERAL_EXP=" << params.joint_bilateral_exp << "f";
-    oss << " -D JOINT_BILATERAL_THRESHOLD=" << (params.joint_bilateral_ab_threshold * params.joint_bilateral_ab_threshold) / (params.ab_multiplier * params.ab_multiplier) << "f";
-    oss << " -D GAUSSIAN_KERNEL_0=" << params.gaussian_kernel[0] << "f";
-    oss << " -D GAUSSIAN_KERNEL_1=" << params.gaussian_kernel[1] << "f";
-    oss << " -D GAUSSIAN_KERNEL_2=" << params.gaussian_kernel[2] << "f";
-    oss << " -D GAUSSIAN_KERNEL_3=" << params.gaussian_kernel[3] << "f";
-    oss << " -D GAUSSIAN_KERNEL_4=" << params.gaussian_kernel[4] << "f";
-    oss << " -D GAUSSIAN_KERNEL_5=" << params.gaussian_kernel[5] << "f";
-    oss << " -D GAUSSIAN_KERNEL_6=" << params.gaussian_kernel[6] << "f";
-    oss << " -D GAUSSIAN_KERNEL_7=" << params.gaussian_kernel[7] << "f";
-    oss << " -D GAUSSIAN_KERNEL_8=" << params.gaussian_kernel[8] << "f";
-
-    oss << " -D PHASE_OFFSET=" << params.phase_offset << "f";
-    oss << " -D UNAMBIGIOUS_DIST=" << params.unambigious_dist << "f";
-    oss << " -D INDIVIDUAL_AB_THRESHOLD=" << params.individual_ab_threshold << "f";
-    oss << " -D AB_THRESHOLD=" << params.ab_threshold << "f";
-    oss << " -D AB_CONFIDENCE_SLOPE=" << params.ab_confidence_slope << "f";
-    oss << " -D AB_CONFIDENCE_OFFSET=" << params.ab_confidence_offset << "f";
-    oss << " -D MIN_DEALIAS_CONFIDENCE=" << params.min_dealias_confidence << "f";
-    oss << " -D MAX_DEALIAS_CONFIDENCE=" << params.max_dealias_confidence << "f";
-
-    oss << " -D EDGE_AB_AVG_MIN_VALUE=" << params.edge_ab_avg_min_value << "f";
-    oss << " -D EDGE_AB_STD_DEV_THRESHOLD=" << params.edge_ab_std_dev_threshold << "f";
-    oss << " -D EDGE_CLOSE_DELTA_THRESHOLD=" << params.edge_close_delta_threshold << "f";
-    oss << " -D EDGE_FAR_DELTA_THRESHOLD=" << params.edge_far_delta_threshold << "f";
-    oss << " -D EDGE_MAX_DELTA_THRESHOLD=" << params.edge_max_delta_threshold << "f";
-    oss << " -D EDGE_AVG_DELTA_THRESHOLD=" << params.edge_avg_delta_threshold << "f";
-    oss << " -D MAX_EDGE_COUNT=" << params.max_edge_count << "f";
-
-    oss << " -D MIN_DEPTH=" << config.MinDepth * 1000.0f << "f";
-    oss << " -D MAX_DEPTH=" << config.MaxDepth * 1000.0f << "f";
+    // with runtime parameters the kernels read them from #buf_parameters, see #fillKernelParameters
+    if(config.EnableOpenCLRuntimeParameters)
+    {
+      oss << " -D RUNTIME_PARAMETERS";
+    }
+    else
+    {
+      oss << " -D AB_MULTIPLIER=" << params.ab_multiplier << "f";
+      oss << " -D AB_MULTIPLIER_PER_FRQ0=" << params.ab_multiplier_per_frq[0] << "f";
+      oss << " -D AB_MULTIPLIER_PER_FRQ1=" << params.ab_multiplier_per_frq[1] << "f";
+      oss << " -D AB_MULTIPLIER_PER_FRQ2=" << params.ab_multiplier_per_frq[2] << "f";
+      oss << " -D AB_OUTPUT_MULTIPLIER=" << params.ab_output_multiplier << "f";
+
+      oss << " -D PHASE_IN_RAD0=" << params.phase_in_rad[0] << "f";
+      oss << " -D PHASE_IN_RAD1=" << params.phase_in_rad[1] << "f";
+      oss << " -D PHASE_IN_RAD2=" << params.phase_in_rad[2] << "f";
+
+      oss << " -D JOINT_BILATERAL_AB_THRESHOLD=" << params.joint_bilateral_ab_threshold << "f";
+      oss << " -D JOINT_BILATERAL_MAX_EDGE=" << params.joint_bilateral_max_edge << "f";
+      oss << " -D JOINT_BILATERAL_EXP=" << params.joint_bilateral_exp << "f";
+      oss << " -D JOINT_BILATERAL_THRESHOLD=" << (params.joint_bilateral_ab_threshold * params.joint_bilateral_ab_threshold) / (params.ab_multiplier * params.ab_multiplier) << "f";
+      oss << " -D GAUSSIAN_KERNEL_0=" << params.gaussian_kernel[0] << "f";
+      oss << " -D GAUSSIAN_KERNEL_1=" << params.gaussian_kernel[1] << "f";
+      oss << " -D GAUSSIAN_KERNEL_2=" << params.gaussian_kernel[2] << "f";
+      oss << " -D GAUSSIAN_KERNEL_3=" << params.gaussian_kernel[3] << "f";
+      oss << " -D GAUSSIAN_KERNEL_4=" << params.gaussian_kernel[4] << "f";
+      oss << " -D GAUSSIAN_KERNEL_5=" << params.gaussian_kernel[5] << "f";
+      oss << " -D GAUSSIAN_KERNEL_6=" << params.gaussian_kernel[6] << "f";
+      oss << " -D GAUSSIAN_KERNEL_7=" << params.gaussian_kernel[7] << "f";
+      oss << " -D GAUSSIAN_KERNEL_8=" << params.gaussian_kernel[8] << "f";
+
+      oss << " -D PHASE_OFFSET=" << params.phase_offset << "f";
+      oss << " -D UNAMBIGIOUS_DIST=" << params.unambigious_dist << "f";
+      oss << " -D INDIVIDUAL_AB_THRESHOLD=" << params.individual_ab_threshold << "f";
+      oss << " -D AB_THRESHOLD=" << params.ab_threshold << "f";
+      oss << " -D AB_CONFIDENCE_SLOPE=" << params.ab_confidence_slope << "f";
+      oss << " -D AB_CONFIDENCE_OFFSET=" << params.ab_confidence_offset << "f";
+      oss << " -D MIN_DEALIAS_CONFIDENCE=" << params.min_dealias_confidence << "f";
+      oss << " -D MAX_DEALIAS_CONFIDENCE=" << params.max_dealias_confidence << "f";
+
+      oss << " -D EDGE_AB_AVG_MIN_VALUE=" << params.edge_ab_avg_min_value << "f";
+      oss << " -D EDGE_AB_STD_DEV_THRESHOLD=" << params.edge_ab_std_dev_threshold << "f";
+      oss << " -D EDGE_CLOSE_DELTA_THRESHOLD=" << params.edge_close_delta_threshold << "f";
+      oss << " -D EDGE_FAR_DELTA_THRESHOLD=" << params.edge_far_delta_threshold << "f";
+      oss << " -D EDGE_MAX_DELTA_THRESHOLD=" << params.edge_max_delta_threshold << "f";
+      oss << " -D EDGE_AVG_DELTA_THRESHOLD=" << params.edge_avg_delta_threshold << "f";
+      oss << " -D MAX_EDGE_COUNT=" << params.max_edge_count << "f";
+
+      oss << " -D MIN_DEPTH=" << config.MinDepth * 1000.0f << "f";
+      oss << " -D MAX_DEPTH=" << config.MaxDepth * 1000.0f << "f";
+    }
+
+    // size of the image the passes after stage 1 run on
+    oss << " -D STAGE2_WIDTH=" << (config.EnableBinnedOutput ? 256 : 512);
+    oss << " -D STAGE2_HEIGHT=" << (config.EnableBinnedOutput ? 212 : 424);
+
+    oss << " -D FUSED_TILE_WIDTH=" << FusedTileWidth;
+    oss << " -D FUSED_TILE_HEIGHT=" << FusedTileHeight;
+
+    if(half_intermediates)
+    {
+      oss << " -D HALF_INTERMEDIATES";
+    }
     options = oss.str();
   }
 
@@ -323,6 +690,23 @@ public:
 
       context = cl::Context(device, NULL, NULL, NULL, &err);
       CHECK_CL_ERROR(err, "cl::Context");
+
+      queue = cl::CommandQueue(context, device, 0, &err);
+      CHECK_CL_ERROR(err, "cl::CommandQueue");
+
+      // on integrated and CPU devices mapping is free, so the packets and frames are not copied
+      cl_bool unified = CL_FALSE;
+      device.getInfo(CL_DEVICE_HOST_UNIFIED_MEMORY, &unified);
+      zero_copy = unified == CL_TRUE;
+      if(zero_copy)
+      {
+        LOG_INFO << "device shares memory with the host, using packets and frames in place";
+      }
+
+      if(half_intermediates)
+      {
+        LOG_INFO << "storing intermediate images in half precision";
+      }
     }
 
     return buildProgram(sourceCode);
@@ -341,14 +725,40 @@ public:
 
     cl_int err = CL_SUCCESS;
     {
-      queue = cl::CommandQueue(context, device, 0, &err);
-      CHECK_CL_ERROR(err, "cl::CommandQueue");
+      // a queue gets its properties when it is created
+      const cl_command_queue_properties properties = config.EnableOpenCLProfiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+      if(properties != queue_properties)
+      {
+        queue.finish();
+        queue = cl::CommandQueue(context, device, properties, &err);
+        CHECK_CL_ERROR(err, "cl::CommandQueue");
+        queue_properties = properties;
+
+        // zero copy frames belong to the queue they were allocated for
+        if(zero_copy)
+        {
+          allocateFrames(false, false);
+          allocateFrames(config.EnableIrOutput, config.EnableDepthOutput);
+        }
+      }
+
+      if(num_sets > 1)
+      {
+        queue_stage2 = cl::CommandQueue(context, device, properties, &err);
+        CHECK_CL_ERROR(err, "cl::CommandQueue");
+      }
+      else
+      {
+        queue_stage2 = queue;
+      }
 
       //Read only
       buf_lut11to16_size = 2048 * sizeof(cl_short);
       buf_p0_table_size = image_size * sizeof(cl_float3);
       buf_x_table_size = image_size * sizeof(cl_float);
       buf_z_table_size = image_size * sizeof(cl_float);
+      buf_x_table_binned_size = binned_image_size * sizeof(cl_float);
+      buf_z_table_binned_size = binned_image_size * sizeof(cl_float);
       buf_packet_size = ((image_size * 11) / 16) * 10 * sizeof(cl_ushort);
 
       buf_lut11to16 = cl::Buffer(context, CL_READ_ONLY_CACHE, buf_lut11to16_size, NULL, &err);
@@ -359,103 +769,45 @@ public:
       CHECK_CL_ERROR(err, "cl::Buffer");
       buf_z_table = cl::Buffer(context, CL_READ_ONLY_CACHE, buf_z_table_size, NULL, &err);
       CHECK_CL_ERROR(err, "cl::Buffer");
-      buf_packet = cl::Buffer(context, CL_READ_ONLY_CACHE, buf_packet_size, NULL, &err);
+      buf_x_table_binned = cl::Buffer(context, CL_READ_ONLY_CACHE, buf_x_table_binned_size, NULL, &err);
+      CHECK_CL_ERROR(err, "cl::Buffer");
+      buf_z_table_binned = cl::Buffer(context, CL_READ_ONLY_CACHE, buf_z_table_binned_size, NULL, &err);
+      CHECK_CL_ERROR(err, "cl::Buffer");
+      buf_parameters = cl::Buffer(context, CL_READ_ONLY_CACHE, sizeof(KernelParameters), NULL, &err);
       CHECK_CL_ERROR(err, "cl::Buffer");
 
+      // size of a pixel of the intermediate images, vstore_half3 packs three halfs without padding
+      const size_t intermediate3_size = half_intermediates ? 3 * sizeof(cl_half) : sizeof(cl_float3);
+      const size_t intermediate_size = half_intermediates ? sizeof(cl_half) : sizeof(cl_float);
+
       //Read-Write
-      buf_a_size = image_size * sizeof(cl_float3);
-      buf_b_size = image_size * sizeof(cl_float3);
-      buf_n_size = image_size * sizeof(cl_float3);
+      buf_a_size = image_size * intermediate3_size;
+      buf_b_size = image_size * intermediate3_size;
+      buf_n_size = image_size * intermediate3_size;
       buf_ir_size = image_size * sizeof(cl_float);
-      buf_a_filtered_size = image_size * sizeof(cl_float3);
-      buf_b_filtered_size = image_size * sizeof(cl_float3);
+      buf_a_binned_size = binned_image_size * intermediate3_size;
+      buf_b_binned_size = binned_image_size * intermediate3_size;
+      buf_n_binned_size = binned_image_size * intermediate3_size;
+      buf_ir_binned_size = binned_image_size * sizeof(cl_float);
+      buf_a_filtered_size = image_size * intermediate3_size;
+      buf_b_filtered_size = image_size * intermediate3_size;
       buf_edge_test_size = image_size * sizeof(cl_uchar);
       buf_depth_size = image_size * sizeof(cl_float);
-      buf_ir_sum_size = image_size * sizeof(cl_float);
+      buf_ir_sum_size = image_size * intermediate_size;
       buf_filtered_size = image_size * sizeof(cl_float);
+      buf_ir_packed_size = image_size * sizeof(cl_ushort);
+      buf_depth_packed_size = image_size * sizeof(cl_ushort);
 
-      buf_a = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_a_size, NULL, &err);
-      CHECK_CL_ERROR(err, "cl::Buffer");
-      buf_b = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_b_size, NULL, &err);
-      CHECK_CL_ERROR(err, "cl::Buffer");
-      buf_n = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_n_size, NULL, &err);
-      CHECK_CL_ERROR(err, "cl::Buffer");
-      buf_ir = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_ir_size, NULL, &err);
-      CHECK_CL_ERROR(err, "cl::Buffer");
-      buf_a_filtered = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_a_filtered_size, NULL, &err);
-      CHECK_CL_ERROR(err, "cl::Buffer");
-      buf_b_filtered = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_b_filtered_size, NULL, &err);
-      CHECK_CL_ERROR(err, "cl::Buffer");
-      buf_edge_test = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_edge_test_size, NULL, &err);
-      CHECK_CL_ERROR(err, "cl::Buffer");
-      buf_depth = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_depth_size, NULL, &err);
-      CHECK_CL_ERROR(err, "cl::Buffer");
-      buf_ir_sum = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_ir_sum_size, NULL, &err);
-      CHECK_CL_ERROR(err, "cl::Buffer");
-      buf_filtered = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_filtered_size, NULL, &err);
-      CHECK_CL_ERROR(err, "cl::Buffer");
-
-      kernel_processPixelStage1 = cl::Kernel(program, "processPixelStage1", &err);
-      CHECK_CL_ERROR(err, "cl::Kernel");
-      err = kernel_processPixelStage1.setArg(0, buf_lut11to16);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage1.setArg(1, buf_z_table);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage1.setArg(2, buf_p0_table);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage1.setArg(3, buf_packet);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage1.setArg(4, buf_a);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage1.setArg(5, buf_b);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage1.setArg(6, buf_n);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage1.setArg(7, buf_ir);
-      CHECK_CL_ERROR(err, "setArg");
-
-      kernel_filterPixelStage1 = cl::Kernel(program, "filterPixelStage1", &err);
-      CHECK_CL_ERROR(err, "cl::Kernel");
-      err = kernel_filterPixelStage1.setArg(0, buf_a);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_filterPixelStage1.setArg(1, buf_b);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_filterPixelStage1.setArg(2, buf_n);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_filterPixelStage1.setArg(3, buf_a_filtered);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_filterPixelStage1.setArg(4, buf_b_filtered);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_filterPixelStage1.setArg(5, buf_edge_test);
-      CHECK_CL_ERROR(err, "setArg");
-
-      kernel_processPixelStage2 = cl::Kernel(program, "processPixelStage2", &err);
-      CHECK_CL_ERROR(err, "cl::Kernel");
-      err = kernel_processPixelStage2.setArg(0, config.EnableBilateralFilter ? buf_a_filtered : buf_a);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage2.setArg(1, config.EnableBilateralFilter ? buf_b_filtered : buf_b);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage2.setArg(2, buf_x_table);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage2.setArg(3, buf_z_table);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage2.setArg(4, buf_depth);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_processPixelStage2.setArg(5, buf_ir_sum);
-      CHECK_CL_ERROR(err, "setArg");
+      for(size_t i = 0; i < num_sets; ++i)
+      {
+        if(!initBufferSet(sets[i]))
+          return false;
+      }
+      next_set = 0;
 
-      kernel_filterPixelStage2 = cl::Kernel(program, "filterPixelStage2", &err);
-      CHECK_CL_ERROR(err, "cl::Kernel");
-      err = kernel_filterPixelStage2.setArg(0, buf_depth);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_filterPixelStage2.setArg(1, buf_ir_sum);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_filterPixelStage2.setArg(2, buf_edge_test);
-      CHECK_CL_ERROR(err, "setArg");
-      err = kernel_filterPixelStage2.setArg(3, buf_filtered);
-      CHECK_CL_ERROR(err, "setArg");
+      binTables();
 
-      cl::Event event0, event1, event2, event3;
+      cl::Event event0, event1, event2, event3, event4, event5;
       err = queue.enqueueWriteBuffer(buf_lut11to16, CL_FALSE, 0, buf_lut11to16_size, lut11to16, NULL, &event0);
       CHECK_CL_ERROR(err, "enqueueWriteBuffer");
       err = queue.enqueueWriteBuffer(buf_p0_table, CL_FALSE, 0, buf_p0_table_size, p0_table, NULL, &event1);
@@ -464,6 +816,10 @@ public:
       CHECK_CL_ERROR(err, "enqueueWriteBuffer");
       err = queue.enqueueWriteBuffer(buf_z_table, CL_FALSE, 0, buf_z_table_size, z_table, NULL, &event3);
       CHECK_CL_ERROR(err, "enqueueWriteBuffer");
+      err = queue.enqueueWriteBuffer(buf_x_table_binned, CL_FALSE, 0, buf_x_table_binned_size, x_table_binned, NULL, &event4);
+      CHECK_CL_ERROR(err, "enqueueWriteBuffer");
+      err = queue.enqueueWriteBuffer(buf_z_table_binned, CL_FALSE, 0, buf_z_table_binned_size, z_table_binned, NULL, &event5);
+      CHECK_CL_ERROR(err, "enqueueWriteBuffer");
 
       err = event0.wait();
       CHECK_CL_ERROR(err, "wait");
@@ -473,156 +829,1647 @@ public:
       CHECK_CL_ERROR(err, "wait");
       err = event3.wait();
       CHECK_CL_ERROR(err, "wait");
+      err = event4.wait();
+      CHECK_CL_ERROR(err, "wait");
+      err = event5.wait();
+      CHECK_CL_ERROR(err, "wait");
+
+      if(config.EnableOpenCLRuntimeParameters && !writeKernelParameters())
+        return false;
     }
 
+    use_fused = validate_fused = config.EnableOpenCLFusedKernels;
+
+    resetTuning();
+    tune_pending = config.EnableWorkGroupTuning && !loadWorkGroupSizes();
+
     programInitialized = true;
     return true;
   }
 
-  bool run(const DepthPacket &packet)
+  /**
+   * Compute the runtime parameters of the kernels, the same values #generateOptions compiles in otherwise.
+   * @param [out] p Parameters to fill.
+   */
+  void fillKernelParameters(KernelParameters &p) const
   {
-    cl_int err;
-    {
-      std::vector<cl::Event> eventWrite(1), eventPPS1(1), eventFPS1(1), eventPPS2(1), eventFPS2(1);
-      cl::Event event0, event1;
-
-      err = queue.enqueueWriteBuffer(buf_packet, CL_FALSE, 0, buf_packet_size, packet.buffer, NULL, &eventWrite[0]);
-      CHECK_CL_ERROR(err, "enqueueWriteBuffer");
-
-      err = queue.enqueueNDRangeKernel(kernel_processPixelStage1, cl::NullRange, cl::NDRange(image_size), cl::NullRange, &eventWrite, &eventPPS1[0]);
-      CHECK_CL_ERROR(err, "enqueueNDRangeKernel");
-      err = queue.enqueueReadBuffer(buf_ir, CL_FALSE, 0, buf_ir_size, ir_frame->data, &eventPPS1, &event0);
-      CHECK_CL_ERROR(err, "enqueueReadBuffer");
-
-      if(config.EnableBilateralFilter)
-      {
-        err = queue.enqueueNDRangeKernel(kernel_filterPixelStage1, cl::NullRange, cl::NDRange(image_size), cl::NullRange, &eventPPS1, &eventFPS1[0]);
-        CHECK_CL_ERROR(err, "enqueueNDRangeKernel");
-      }
-      else
-      {
-        eventFPS1[0] = eventPPS1[0];
-      }
-
-      err = queue.enqueueNDRangeKernel(kernel_processPixelStage2, cl::NullRange, cl::NDRange(image_size), cl::NullRange, &eventFPS1, &eventPPS2[0]);
-      CHECK_CL_ERROR(err, "enqueueNDRangeKernel");
+    p.ab_multiplier = params.ab_multiplier;
+    p.ab_multiplier_per_frq0 = params.ab_multiplier_per_frq[0];
+    p.ab_multiplier_per_frq1 = params.ab_multiplier_per_frq[1];
+    p.ab_multiplier_per_frq2 = params.ab_multiplier_per_frq[2];
+    p.ab_output_multiplier = params.ab_output_multiplier;
+    p.phase_in_rad0 = params.phase_in_rad[0];
+    p.phase_in_rad1 = params.phase_in_rad[1];
+    p.phase_in_rad2 = params.phase_in_rad[2];
+    p.joint_bilateral_ab_threshold = params.joint_bilateral_ab_threshold;
+    p.joint_bilateral_max_edge = params.joint_bilateral_max_edge;
+    p.joint_bilateral_exp = params.joint_bilateral_exp;
+    p.joint_bilateral_threshold = (params.joint_bilateral_ab_threshold * params.joint_bilateral_ab_threshold) / (params.ab_multiplier * params.ab_multiplier);
+    p.gaussian_kernel_0 = params.gaussian_kernel[0];
+    p.gaussian_kernel_1 = params.gaussian_kernel[1];
+    p.gaussian_kernel_2 = params.gaussian_kernel[2];
+    p.gaussian_kernel_3 = params.gaussian_kernel[3];
+    p.gaussian_kernel_4 = params.gaussian_kernel[4];
+    p.gaussian_kernel_5 = params.gaussian_kernel[5];
+    p.gaussian_kernel_6 = params.gaussian_kernel[6];
+    p.gaussian_kernel_7 = params.gaussian_kernel[7];
+    p.gaussian_kernel_8 = params.gaussian_kernel[8];
+    p.phase_offset = params.phase_offset;
+    p.unambigious_dist = params.unambigious_dist;
+    p.individual_ab_threshold = params.individual_ab_threshold;
+    p.ab_threshold = params.ab_threshold;
+    p.ab_confidence_slope = params.ab_confidence_slope;
+    p.ab_confidence_offset = params.ab_confidence_offset;
+    p.min_dealias_confidence = params.min_dealias_confidence;
+    p.max_dealias_confidence = params.max_dealias_confidence;
+    p.edge_ab_avg_min_value = params.edge_ab_avg_min_value;
+    p.edge_ab_std_dev_threshold = params.edge_ab_std_dev_threshold;
+    p.edge_close_delta_threshold = params.edge_close_delta_threshold;
+    p.edge_far_delta_threshold = params.edge_far_delta_threshold;
+    p.edge_max_delta_threshold = params.edge_max_delta_threshold;
+    p.edge_avg_delta_threshold = params.edge_avg_delta_threshold;
+    p.max_edge_count = params.max_edge_count;
+    p.min_depth = config.MinDepth * 1000.0f;
+    p.max_depth = config.MaxDepth * 1000.0f;
+  }
 
-      if(config.EnableEdgeAwareFilter)
-      {
-        err = queue.enqueueNDRangeKernel(kernel_filterPixelStage2, cl::NullRange, cl::NDRange(image_size), cl::NullRange, &eventPPS2, &eventFPS2[0]);
-        CHECK_CL_ERROR(err, "enqueueWriteBuffer");
-      }
-      else
-      {
-        eventFPS2[0] = eventPPS2[0];
-      }
+  /** Write the current parameters to #buf_parameters, the next frame uses them. */
+  bool writeKernelParameters()
+  {
+    KernelParameters p;
+    fillKernelParameters(p);
 
-      err = queue.enqueueReadBuffer(config.EnableEdgeAwareFilter ? buf_filtered : buf_depth, CL_FALSE, 0, buf_depth_size, depth_frame->data, &eventFPS2, &event1);
-      CHECK_CL_ERROR(err, "enqueueReadBuffer");
-      err = event0.wait();
-      CHECK_CL_ERROR(err, "wait");
-      err = event1.wait();
-      CHECK_CL_ERROR(err, "wait");
-    }
+    cl_int err = queue.enqueueWriteBuffer(buf_parameters, CL_TRUE, 0, sizeof(p), &p);
+    CHECK_CL_ERROR(err, "enqueueWriteBuffer");
     return true;
   }
 
-  bool readProgram(std::string &source) const
+  /**
+   * Create the per frame buffers of a buffer set and bind them to its kernels.
+   * @param set Buffer set to initialize.
+   */
+  bool initBufferSet(BufferSet &set)
   {
-    source = loadCLSource("opencl_depth_packet_processor.cl");
-    return !source.empty();
-  }
+    cl_int err = CL_SUCCESS;
 
-  bool buildProgram(const std::string& sources)
-  {
-    cl_int err;
+    set.buf_packet = cl::Buffer(context, CL_READ_ONLY_CACHE, buf_packet_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_a = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_a_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_b = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_b_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_n = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_n_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_ir = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_ir_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_a_binned = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_a_binned_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_b_binned = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_b_binned_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_n_binned = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_n_binned_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_ir_binned = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_ir_binned_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_a_filtered = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_a_filtered_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_b_filtered = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_b_filtered_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_edge_test = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_edge_test_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_depth = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_depth_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_ir_sum = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_ir_sum_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_filtered = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_filtered_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_ir_packed = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_ir_packed_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+    set.buf_depth_packed = cl::Buffer(context, CL_READ_WRITE_CACHE, buf_depth_packed_size, NULL, &err);
+    CHECK_CL_ERROR(err, "cl::Buffer");
+
+    set.kernel_processPixelStage1 = cl::Kernel(program, "processPixelStage1", &err);
+    CHECK_CL_ERROR(err, "cl::Kernel");
+    err = set.kernel_processPixelStage1.setArg(0, buf_lut11to16);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage1.setArg(1, buf_z_table);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage1.setArg(2, buf_p0_table);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage1.setArg(3, set.buf_packet);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage1.setArg(4, set.buf_a);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage1.setArg(5, set.buf_b);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage1.setArg(6, set.buf_n);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage1.setArg(7, set.buf_ir);
+    CHECK_CL_ERROR(err, "setArg");
+
+    set.kernel_binPixelStage1 = cl::Kernel(program, "binPixelStage1", &err);
+    CHECK_CL_ERROR(err, "cl::Kernel");
+    err = set.kernel_binPixelStage1.setArg(0, set.buf_a);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_binPixelStage1.setArg(1, set.buf_b);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_binPixelStage1.setArg(2, set.buf_ir);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_binPixelStage1.setArg(3, set.buf_a_binned);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_binPixelStage1.setArg(4, set.buf_b_binned);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_binPixelStage1.setArg(5, set.buf_n_binned);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_binPixelStage1.setArg(6, set.buf_ir_binned);
+    CHECK_CL_ERROR(err, "setArg");
+
+    // with binned output the passes after stage 1 read the binned measurements and tables
+    const bool binned = config.EnableBinnedOutput;
+    const cl::Buffer &stage2_a = binned ? set.buf_a_binned : set.buf_a;
+    const cl::Buffer &stage2_b = binned ? set.buf_b_binned : set.buf_b;
+
+    set.kernel_filterPixelStage1 = cl::Kernel(program, "filterPixelStage1", &err);
+    CHECK_CL_ERROR(err, "cl::Kernel");
+    err = set.kernel_filterPixelStage1.setArg(0, stage2_a);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_filterPixelStage1.setArg(1, stage2_b);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_filterPixelStage1.setArg(2, binned ? set.buf_n_binned : set.buf_n);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_filterPixelStage1.setArg(3, set.buf_a_filtered);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_filterPixelStage1.setArg(4, set.buf_b_filtered);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_filterPixelStage1.setArg(5, set.buf_edge_test);
+    CHECK_CL_ERROR(err, "setArg");
+
+    set.kernel_processPixelStage2 = cl::Kernel(program, "processPixelStage2", &err);
+    CHECK_CL_ERROR(err, "cl::Kernel");
+    err = set.kernel_processPixelStage2.setArg(0, config.EnableBilateralFilter ? set.buf_a_filtered : stage2_a);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage2.setArg(1, config.EnableBilateralFilter ? set.buf_b_filtered : stage2_b);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage2.setArg(2, binned ? buf_x_table_binned : buf_x_table);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage2.setArg(3, binned ? buf_z_table_binned : buf_z_table);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage2.setArg(4, set.buf_depth);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage2.setArg(5, set.buf_ir_sum);
+    CHECK_CL_ERROR(err, "setArg");
+
+    set.kernel_filterPixelStage2 = cl::Kernel(program, "filterPixelStage2", &err);
+    CHECK_CL_ERROR(err, "cl::Kernel");
+    err = set.kernel_filterPixelStage2.setArg(0, set.buf_depth);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_filterPixelStage2.setArg(1, set.buf_ir_sum);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_filterPixelStage2.setArg(2, set.buf_edge_test);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_filterPixelStage2.setArg(3, set.buf_filtered);
+    CHECK_CL_ERROR(err, "setArg");
+
+    // the float results feed the later kernels, the 16 bit output is packed from the final ones
+    set.kernel_processFilterPixelStage1 = cl::Kernel(program, "processFilterPixelStage1", &err);
+    CHECK_CL_ERROR(err, "cl::Kernel");
+    err = set.kernel_processFilterPixelStage1.setArg(0, buf_lut11to16);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage1.setArg(1, buf_z_table);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage1.setArg(2, buf_p0_table);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage1.setArg(3, set.buf_packet);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage1.setArg(4, set.buf_a_filtered);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage1.setArg(5, set.buf_b_filtered);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage1.setArg(6, set.buf_edge_test);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage1.setArg(7, set.buf_ir);
+    CHECK_CL_ERROR(err, "setArg");
+
+    set.kernel_processFilterPixelStage2 = cl::Kernel(program, "processFilterPixelStage2", &err);
+    CHECK_CL_ERROR(err, "cl::Kernel");
+    err = set.kernel_processFilterPixelStage2.setArg(0, config.EnableBilateralFilter ? set.buf_a_filtered : stage2_a);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage2.setArg(1, config.EnableBilateralFilter ? set.buf_b_filtered : stage2_b);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage2.setArg(2, binned ? buf_x_table_binned : buf_x_table);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage2.setArg(3, binned ? buf_z_table_binned : buf_z_table);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage2.setArg(4, set.buf_edge_test);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage2.setArg(5, set.buf_filtered);
+    CHECK_CL_ERROR(err, "setArg");
+
+    set.kernel_packIr = cl::Kernel(program, "packOutputUInt16", &err);
+    CHECK_CL_ERROR(err, "cl::Kernel");
+    err = set.kernel_packIr.setArg(0, binned ? set.buf_ir_binned : set.buf_ir);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_packIr.setArg(1, set.buf_ir_packed);
+    CHECK_CL_ERROR(err, "setArg");
+
+    set.kernel_packDepth = cl::Kernel(program, "packOutputUInt16", &err);
+    CHECK_CL_ERROR(err, "cl::Kernel");
+    err = set.kernel_packDepth.setArg(0, config.EnableEdgeAwareFilter ? set.buf_filtered : set.buf_depth);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_packDepth.setArg(1, set.buf_depth_packed);
+    CHECK_CL_ERROR(err, "setArg");
+
+    // the kernels built with runtime parameters take them as their last argument
+    if(config.EnableOpenCLRuntimeParameters)
     {
-      LOG_INFO << "building OpenCL program...";
+      err = set.kernel_processPixelStage1.setArg(8, buf_parameters);
+      CHECK_CL_ERROR(err, "setArg");
+      err = set.kernel_filterPixelStage1.setArg(6, buf_parameters);
+      CHECK_CL_ERROR(err, "setArg");
+      err = set.kernel_processPixelStage2.setArg(6, buf_parameters);
+      CHECK_CL_ERROR(err, "setArg");
+      err = set.kernel_filterPixelStage2.setArg(4, buf_parameters);
+      CHECK_CL_ERROR(err, "setArg");
+      err = set.kernel_processFilterPixelStage1.setArg(8, buf_parameters);
+      CHECK_CL_ERROR(err, "setArg");
+      err = set.kernel_processFilterPixelStage2.setArg(6, buf_parameters);
+      CHECK_CL_ERROR(err, "setArg");
+    }
 
-      std::string options;
-      generateOptions(options);
+    return true;
+  }
 
-      cl::Program::Sources source(1, std::make_pair(sources.c_str(), sources.length()));
-      program = cl::Program(context, source, &err);
-      CHECK_CL_ERROR(err, "cl::Program");
+  /**
+   * Enqueue a kernel over a region of the image, with its tuned work group size if that divides the region.
+   * @param queue Queue to enqueue on.
+   * @param kernel Kernel taking the column and row as global ids 0 and 1.
+   * @param which Entry of #tuning of the kernel.
+   * @param roi Region to compute.
+   * @param events Events to wait for.
+   * @param [out] event Event of the kernel.
+   */
+  cl_int enqueueRoiKernel(cl::CommandQueue &queue, cl::Kernel &kernel, TunedKernel which, const DepthRoi &roi, const std::vector<cl::Event> *events, cl::Event *event)
+  {
+    const size_t width = tuning[which].local_width, height = tuning[which].local_height;
 
-      err = program.build(options.c_str());
-      if (err != CL_SUCCESS)
-      {
-        LOG_ERROR << "failed to build program: " << err;
-        LOG_ERROR << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device);
-        LOG_ERROR << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device);
-        LOG_ERROR << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
-        programBuilt = false;
-        return false;
-      }
+    // without non-uniform work groups the global size has to be a multiple of the work group size
+    if(width != 0 && roi.width() % width == 0 && roi.height() % height == 0)
+    {
+      return queue.enqueueNDRangeKernel(kernel, cl::NDRange(roi.x_begin, roi.y_begin), cl::NDRange(roi.width(), roi.height()), cl::NDRange(width, height), events, event);
     }
 
-    LOG_INFO << "OpenCL program built successfully";
-    programBuilt = true;
-    return true;
+    return queue.enqueueNDRangeKernel(kernel, cl::NDRange(roi.x_begin, roi.y_begin), cl::NDRange(roi.width(), roi.height()), cl::NullRange, events, event);
   }
 
-  void newIrFrame()
+  /**
+   * Enqueue a fused kernel over a region of the image, in work groups of one tile each.
+   * The region is rounded up to whole tiles, the kernels skip the pixels outside the image.
+   * @param queue Queue to enqueue on.
+   * @param kernel Fused kernel.
+   * @param roi Region to compute.
+   * @param events Events to wait for.
+   * @param [out] event Event of the kernel.
+   */
+  cl_int enqueueTileKernel(cl::CommandQueue &queue, cl::Kernel &kernel, const DepthRoi &roi, const std::vector<cl::Event> *events, cl::Event *event)
   {
-    ir_frame = new Frame(512, 424, 4);
+    const size_t width = (roi.width() + FusedTileWidth - 1) / FusedTileWidth * FusedTileWidth;
+    const size_t height = (roi.height() + FusedTileHeight - 1) / FusedTileHeight * FusedTileHeight;
+    return queue.enqueueNDRangeKernel(kernel, cl::NDRange(roi.x_begin, roi.y_begin), cl::NDRange(width, height), cl::NDRange(FusedTileWidth, FusedTileHeight), events, event);
   }
 
-  void newDepthFrame()
+  /** Whether stage 1 and the bilateral filter run fused, only at full resolution and with depth output. */
+  bool fuseStage1() const
   {
-    depth_frame = new Frame(512, 424, 4);
+    return use_fused && config.EnableDepthOutput && config.EnableBilateralFilter && !config.EnableBinnedOutput;
   }
 
-  void fill_trig_table(const libfreenect2::protocol::P0TablesResponse *p0table)
+  /** Whether stage 2 and the edge aware filter run fused. */
+  bool fuseStage2() const
   {
-    for(int r = 0; r < 424; ++r)
+    return use_fused && config.EnableDepthOutput && config.EnableEdgeAwareFilter;
+  }
+
+  /**
+   * Enqueue reading back the region of interest of an output image, the rest of the frame is left untouched.
+   * With 16 bit integer output the image is converted by the packOutputUInt16 kernel first.
+   * With #zero_copy the kernels wrote the frame in place (see #bindOutputs), and it is only mapped.
+   * @param queue Queue to enqueue on.
+   * @param buffer Float image on the device.
+   * @param pack Kernel packing \a buffer into \a packed.
+   * @param packed 16 bit integer image on the device.
+   * @param frame Frame to read into.
+   * @param events Events to wait for.
+   * @param [out] event Event of the read.
+   * @param [out] pack_event Event of the packing, left alone without 16 bit integer output.
+   */
+  cl_int enqueueReadOutput(cl::CommandQueue &queue, const cl::Buffer &buffer, cl::Kernel &pack, const cl::Buffer &packed, Frame *frame, const std::vector<cl::Event> *events, cl::Event *event, cl::Event *pack_event)
+  {
+    if(!config.EnableUInt16Output)
     {
-      cl_float3 *it = &p0_table[r * 512];
-      const uint16_t *it0 = &p0table->p0table0[r * 512];
-      const uint16_t *it1 = &p0table->p0table1[r * 512];
-      const uint16_t *it2 = &p0table->p0table2[r * 512];
-      for(int c = 0; c < 512; ++c, ++it, ++it0, ++it1, ++it2)
-      {
-        it->s[0] = -((float) * it0) * 0.000031 * M_PI;
-        it->s[1] = -((float) * it1) * 0.000031 * M_PI;
-        it->s[2] = -((float) * it2) * 0.000031 * M_PI;
-        it->s[3] = 0.0f;
-      }
+      if(zero_copy)
+        return enqueueMapOutput(queue, static_cast<OpenCLFrame *>(frame), events, event);
+
+      return enqueueReadRoi(queue, buffer, sizeof(cl_float), frame->data, events, event);
     }
-  }
-};
 
-OpenCLDepthPacketProcessor::OpenCLDepthPacketProcessor(const int deviceId) :
-  impl_(new OpenCLDepthPacketProcessorImpl(deviceId))
-{
-}
+    std::vector<cl::Event> eventPack(1);
+    const DepthRoi roi = config.EnableBinnedOutput ? rois.filter2.bin() : rois.filter2;
 
-OpenCLDepthPacketProcessor::~OpenCLDepthPacketProcessor()
-{
-  delete impl_;
-}
+    cl_int err = enqueueRoiKernel(queue, pack, TunedPack, roi, events, &eventPack[0]);
+    if(err != CL_SUCCESS) return err;
+    *pack_event = eventPack[0];
 
-void OpenCLDepthPacketProcessor::setConfiguration(const libfreenect2::DepthPacketProcessor::Config &config)
-{
-  DepthPacketProcessor::setConfiguration(config);
+    if(zero_copy)
+      return enqueueMapOutput(queue, static_cast<OpenCLFrame *>(frame), &eventPack, event);
 
-  if ( impl_->config.MaxDepth != config.MaxDepth 
-    || impl_->config.MinDepth != config.MinDepth)
+    return enqueueReadRoi(queue, packed, sizeof(cl_ushort), frame->data, &eventPack, event);
+  }
+
+  /**
+   * Enqueue mapping an output frame the kernels wrote in place.
+   * @param queue Queue to enqueue on.
+   * @param frame Frame to map.
+   * @param events Events to wait for.
+   * @param [out] event Event of the mapping, #Frame::data is valid once it completes.
+   */
+  cl_int enqueueMapOutput(cl::CommandQueue &queue, OpenCLFrame *frame, const std::vector<cl::Event> *events, cl::Event *event)
   {
-    // OpenCL program needs to be rebuilt, then reinitialized
-    impl_->programBuilt = false;
-    impl_->programInitialized = false;
+    cl_int err;
+    const size_t size = frame->width * frame->height * frame->bytes_per_pixel;
+    frame->data = static_cast<unsigned char *>(queue.enqueueMapBuffer(frame->buffer, CL_FALSE, CL_MAP_READ | CL_MAP_WRITE, 0, size, events, event, &err));
+    return err;
   }
-  else if (impl_->config.EnableBilateralFilter != config.EnableBilateralFilter
-    || impl_->config.EnableEdgeAwareFilter != config.EnableEdgeAwareFilter)
+
+  /**
+   * Enqueue giving a mapped output frame back to the device on #queue, before the kernels write it again.
+   * @param frame Frame to unmap, nothing is enqueued if it is null or not mapped.
+   * @param [out] events Events the kernels writing the frame wait for, the event of the unmapping is added.
+   */
+  cl_int unmapFrame(Frame *frame, std::vector<cl::Event> &events)
+  {
+    OpenCLFrame *f = static_cast<OpenCLFrame *>(frame);
+    if(f == 0 || f->data == 0)
+    {
+      return CL_SUCCESS;
+    }
+
+    cl::Event event;
+    cl_int err = queue.enqueueUnmapMemObject(f->buffer, f->data, NULL, &event);
+    f->data = 0;
+    if(err == CL_SUCCESS)
+    {
+      events.push_back(event);
+    }
+    return err;
+  }
+
+  /**
+   * Point the kernels at the output frames of a set, so the final IR and depth images are written
+   * into them in place. The kernels that do not write a final image get their own buffers back.
+   * @param set Buffer set whose kernels to bind.
+   */
+  bool bindOutputs(BufferSet &set)
+  {
+    cl_int err;
+    const bool binned = config.EnableBinnedOutput, uint16 = config.EnableUInt16Output;
+    OpenCLFrame *ir = static_cast<OpenCLFrame *>(set.ir_frame), *depth = static_cast<OpenCLFrame *>(set.depth_frame);
+
+    const bool ir_stage1 = ir != 0 && !uint16 && !binned;
+    const bool ir_bin = ir != 0 && !uint16 && binned;
+    const bool ir_pack = ir != 0 && uint16;
+    const bool depth_stage2 = depth != 0 && !uint16 && !config.EnableEdgeAwareFilter;
+    const bool depth_filter = depth != 0 && !uint16 && config.EnableEdgeAwareFilter;
+    const bool depth_pack = depth != 0 && uint16;
+
+    err = set.kernel_processPixelStage1.setArg(7, ir_stage1 ? ir->buffer : set.buf_ir);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage1.setArg(7, ir_stage1 ? ir->buffer : set.buf_ir);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_binPixelStage1.setArg(6, ir_bin ? ir->buffer : set.buf_ir_binned);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_packIr.setArg(1, ir_pack ? ir->buffer : set.buf_ir_packed);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processPixelStage2.setArg(4, depth_stage2 ? depth->buffer : set.buf_depth);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_filterPixelStage2.setArg(3, depth_filter ? depth->buffer : set.buf_filtered);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_processFilterPixelStage2.setArg(5, depth_filter ? depth->buffer : set.buf_filtered);
+    CHECK_CL_ERROR(err, "setArg");
+    err = set.kernel_packDepth.setArg(1, depth_pack ? depth->buffer : set.buf_depth_packed);
+    CHECK_CL_ERROR(err, "setArg");
+
+    return true;
+  }
+
+  /**
+   * Enqueue reading back the region of interest of an image, the rest of \a data is left untouched.
+   * @param queue Queue to enqueue on.
+   * @param buffer Image on the device.
+   * @param element_size Size of a pixel of the image.
+   * @param data Host memory for the whole image.
+   * @param events Events to wait for.
+   * @param [out] event Event of the read.
+   */
+  cl_int enqueueReadRoi(cl::CommandQueue &queue, const cl::Buffer &buffer, size_t element_size, unsigned char *data, const std::vector<cl::Event> *events, cl::Event *event)
+  {
+    const DepthRoi &roi = rois.filter2;
+
+    // binned output always covers the whole (binned) image
+    if(roi.isFullFrame())
+    {
+      const size_t size = config.EnableBinnedOutput ? binned_image_size : image_size;
+      return queue.enqueueReadBuffer(buffer, CL_FALSE, 0, size * element_size, data, events, event);
+    }
+
+    cl::size_t<3> origin, region;
+    origin[0] = roi.x_begin * element_size;
+    origin[1] = roi.y_begin;
+    origin[2] = 0;
+    region[0] = roi.width() * element_size;
+    region[1] = roi.height();
+    region[2] = 1;
+
+    return queue.enqueueReadBufferRect(buffer, CL_FALSE, origin, origin, region, 512 * element_size, 0, 512 * element_size, 0, data, events, event);
+  }
+
+  /**
+   * Enqueue processing a packet with a buffer set without waiting for it.
+   * The upload and the first stage go to #queue, the later passes and the readback to #queue_stage2,
+   * so with pipelining the first stage of a packet overlaps the second stage of the one before.
+   * @param set Buffer set to process with, its frames receive the output.
+   * @param packet Packet to process.
+   * @param wait_for_packet Whether to wait until the packet is read, so it may be reused after the call.
+   * @param [out] event Event of the last command, the frames of \a set are filled once it completes.
+   */
+  bool enqueue(BufferSet &set, const DepthPacket &packet, bool wait_for_packet, cl::Event &event)
+  {
+    cl_int err;
+    {
+      std::vector<cl::Event> eventWrite(1), eventPPS1(1), eventBPS1(1), eventFPS1(1), eventPPS2(1), eventFPS2(1);
+
+      // with binned output the passes after stage 1 run on the binned image
+      const bool binned = config.EnableBinnedOutput;
+      const DepthRoi stage2_roi = binned ? rois.stage2.bin() : rois.stage2;
+      const DepthRoi filter2_roi = binned ? rois.filter2.bin() : rois.filter2;
+
+      // the steps that run record their commands below
+      for(size_t i = 0; i < NumProfiledSteps; ++i)
+      {
+        set.events[i] = cl::Event();
+      }
+
+      // packets assembled in mapped device memory are read in place, others are uploaded
+      OpenCLBuffer *input = zero_copy ? allocator.find(packet.buffer) : 0;
+      std::vector<cl::Event> eventUnmap;
+
+      if(zero_copy)
+      {
+        // the frames are on the host until they are written again, stage 1 writes them first
+        err = unmapFrame(set.ir_frame, eventUnmap);
+        CHECK_CL_ERROR(err, "enqueueUnmapMemObject");
+        err = unmapFrame(set.depth_frame, eventUnmap);
+        CHECK_CL_ERROR(err, "enqueueUnmapMemObject");
+
+        if(!bindOutputs(set))
+          return false;
+
+        err = set.kernel_processPixelStage1.setArg(3, input != 0 ? input->buffer : set.buf_packet);
+        CHECK_CL_ERROR(err, "setArg");
+        err = set.kernel_processFilterPixelStage1.setArg(3, input != 0 ? input->buffer : set.buf_packet);
+        CHECK_CL_ERROR(err, "setArg");
+      }
+
+      if(input != 0)
+      {
+        err = allocator.unmap(*input, &eventWrite[0]);
+        CHECK_CL_ERROR(err, "enqueueUnmapMemObject");
+      }
+      else
+      {
+        err = queue.enqueueWriteBuffer(set.buf_packet, wait_for_packet ? CL_TRUE : CL_FALSE, 0, buf_packet_size, packet.buffer, NULL, &eventWrite[0]);
+        CHECK_CL_ERROR(err, "enqueueWriteBuffer");
+      }
+
+      set.events[ProfiledUpload] = eventWrite[0];
+      eventWrite.insert(eventWrite.end(), eventUnmap.begin(), eventUnmap.end());
+
+      // the fused stage 1 also runs the bilateral filter, over the region of stage 2
+      const bool fused1 = fuseStage1(), fused2 = fuseStage2();
+      cl_int err_stage1 = fused1
+        ? enqueueTileKernel(queue, set.kernel_processFilterPixelStage1, stage2_roi, &eventWrite, &eventPPS1[0])
+        : enqueueRoiKernel(queue, set.kernel_processPixelStage1, TunedStage1, rois.stage1, &eventWrite, &eventPPS1[0]);
+
+      if(input != 0)
+      {
+        // hand the buffer back to the stream parser once stage 1 has read it, also if it could not run
+        err = allocator.map(*input, err_stage1 == CL_SUCCESS ? &eventPPS1 : NULL, wait_for_packet);
+        CHECK_CL_ERROR(err, "enqueueMapBuffer");
+      }
+
+      err = err_stage1;
+      CHECK_CL_ERROR(err, "enqueueNDRangeKernel");
+      set.events[ProfiledStage1] = eventPPS1[0];
+
+      if(binned)
+      {
+        err = enqueueRoiKernel(queue, set.kernel_binPixelStage1, TunedBin, rois.stage1.bin(), &eventPPS1, &eventBPS1[0]);
+        CHECK_CL_ERROR(err, "enqueueNDRangeKernel");
+        set.events[ProfiledBin] = eventBPS1[0];
+      }
+      else
+      {
+        eventBPS1[0] = eventPPS1[0];
+      }
+
+      // #queue_stage2 runs in order, so its last command completes after all others of the frame
+      if(config.EnableIrOutput)
+      {
+        err = enqueueReadOutput(queue_stage2, binned ? set.buf_ir_binned : set.buf_ir, set.kernel_packIr, set.buf_ir_packed, set.ir_frame, &eventBPS1, &event, &set.events[ProfiledIrPack]);
+        CHECK_CL_ERROR(err, "enqueueReadBuffer");
+        set.events[ProfiledIrReadback] = event;
+      }
+
+      // the IR comes from stage 1, the rest only computes the depth
+      if(config.EnableDepthOutput)
+      {
+        if(config.EnableBilateralFilter && !fused1)
+        {
+          err = enqueueRoiKernel(queue_stage2, set.kernel_filterPixelStage1, TunedFilter1, stage2_roi, &eventBPS1, &eventFPS1[0]);
+          CHECK_CL_ERROR(err, "enqueueNDRangeKernel");
+          set.events[ProfiledFilter1] = eventFPS1[0];
+        }
+        else
+        {
+          eventFPS1[0] = eventBPS1[0];
+        }
+
+        if(fused2)
+        {
+          err = enqueueTileKernel(queue_stage2, set.kernel_processFilterPixelStage2, filter2_roi, &eventFPS1, &eventFPS2[0]);
+          CHECK_CL_ERROR(err, "enqueueNDRangeKernel");
+          set.events[ProfiledStage2] = eventFPS2[0];
+        }
+        else
+        {
+          err = enqueueRoiKernel(queue_stage2, set.kernel_processPixelStage2, TunedStage2, stage2_roi, &eventFPS1, &eventPPS2[0]);
+          CHECK_CL_ERROR(err, "enqueueNDRangeKernel");
+          set.events[ProfiledStage2] = eventPPS2[0];
+
+          if(config.EnableEdgeAwareFilter)
+          {
+            err = enqueueRoiKernel(queue_stage2, set.kernel_filterPixelStage2, TunedFilter2, filter2_roi, &eventPPS2, &eventFPS2[0]);
+            CHECK_CL_ERROR(err, "enqueueWriteBuffer");
+            set.events[ProfiledFilter2] = eventFPS2[0];
+          }
+          else
+          {
+            eventFPS2[0] = eventPPS2[0];
+          }
+        }
+
+        err = enqueueReadOutput(queue_stage2, config.EnableEdgeAwareFilter ? set.buf_filtered : set.buf_depth, set.kernel_packDepth, set.buf_depth_packed, set.depth_frame, &eventFPS2, &event, &set.events[ProfiledDepthPack]);
+        CHECK_CL_ERROR(err, "enqueueReadBuffer");
+        set.events[ProfiledDepthReadback] = event;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * Process a packet with a buffer set and wait for its frames.
+   * @param set Buffer set to process with.
+   * @param packet Packet to process.
+   */
+  bool run(BufferSet &set, const DepthPacket &packet)
+  {
+    cl::Event event;
+    if(!enqueue(set, packet, false, event))
+    {
+      return false;
+    }
+
+    cl_int err = event.wait();
+    CHECK_CL_ERROR(err, "wait");
+    return true;
+  }
+
+  /**
+   * Copy a packet to host memory, for the checks that process it more than once before it is processed for real.
+   * With #zero_copy a packet is read in place and mapped to the host again after stage 1, which may move its data.
+   * The copy is not allocated by #allocator, so every run uploads it and the packet itself is left alone.
+   * @param packet Packet to copy.
+   * @param [out] data Memory of the copy.
+   * @return The copy, valid while \a data is.
+   */
+  DepthPacket copyPacket(const DepthPacket &packet, std::vector<unsigned char> &data) const
+  {
+    data.assign(buf_packet_size, 0);
+    std::memcpy(&data[0], packet.buffer, std::min(packet.buffer_length, buf_packet_size));
+
+    DepthPacket copy = packet;
+    copy.buffer = &data[0];
+    copy.buffer_length = data.size();
+    return copy;
+  }
+
+  /**
+   * Check the fused kernels against the unfused ones, see Config::EnableOpenCLFusedKernels.
+   * A copy of the packet is processed twice with the first buffer set and the frames are not delivered.
+   * If the outputs differ, the unfused kernels are used from now on.
+   * @param packet Packet to check with.
+   */
+  void validateFusedKernels(const DepthPacket &packet)
+  {
+    validate_fused = false;
+    if(!fuseStage1() && !fuseStage2())
+    {
+      return;
+    }
+
+    // frames in flight use the buffer sets
+    finishPipeline();
+
+    BufferSet &set = sets[0];
+    std::vector<unsigned char> packet_data, ir, depth;
+    const DepthPacket copy = copyPacket(packet, packet_data);
+
+    use_fused = false;
+    bool ok = run(set, copy);
+    if(ok)
+    {
+      copyFrame(set.ir_frame, ir);
+      copyFrame(set.depth_frame, depth);
+    }
+
+    use_fused = true;
+    ok = ok && run(set, copy);
+
+    if(!ok)
+    {
+      LOG_WARNING << "could not validate the fused kernels, using the unfused kernels";
+      use_fused = false;
+      return;
+    }
+
+    const size_t mismatches = countMismatches(set.ir_frame, ir) + countMismatches(set.depth_frame, depth);
+    const DepthRoi roi = config.EnableBinnedOutput ? rois.filter2.bin() : rois.filter2;
+
+    // allow for the few pixels a differently contracted multiply-add may flip in the edge aware filter
+    if(mismatches * 1000 > (size_t)(roi.width() * roi.height()))
+    {
+      LOG_WARNING << mismatches << " pixels differ between the fused and the unfused kernels, using the unfused kernels";
+      use_fused = false;
+    }
+    else
+    {
+      LOG_INFO << "fused kernels match the unfused kernels, " << mismatches << " pixels differ";
+    }
+  }
+
+  /** Copy the data of a frame, if there is one. */
+  static void copyFrame(const Frame *frame, std::vector<unsigned char> &copy)
+  {
+    if(frame != 0)
+    {
+      copy.assign(frame->data, frame->data + frame->width * frame->height * frame->bytes_per_pixel);
+    }
+  }
+
+  /** Number of pixels in the region of interest of a frame that differ by more than 1 from a copy of it. */
+  size_t countMismatches(const Frame *frame, const std::vector<unsigned char> &copy) const
+  {
+    if(frame == 0 || copy.empty())
+    {
+      return 0;
+    }
+
+    const DepthRoi roi = config.EnableBinnedOutput ? rois.filter2.bin() : rois.filter2;
+    const bool uint16 = frame->format == Frame::UInt16;
+    size_t count = 0;
+
+    for(int y = roi.y_begin; y < roi.y_end; ++y)
+    {
+      for(int x = roi.x_begin; x < roi.x_end; ++x)
+      {
+        const size_t offset = (y * frame->width + x) * frame->bytes_per_pixel;
+        if(std::memcmp(frame->data + offset, &copy[offset], frame->bytes_per_pixel) == 0)
+        {
+          continue;
+        }
+
+        float a, b;
+        if(uint16)
+        {
+          a = *reinterpret_cast<const uint16_t *>(frame->data + offset);
+          b = *reinterpret_cast<const uint16_t *>(&copy[offset]);
+        }
+        else
+        {
+          a = *reinterpret_cast<const float *>(frame->data + offset);
+          b = *reinterpret_cast<const float *>(&copy[offset]);
+        }
+
+        // NaN in either counts too
+        if(!(fabs(a - b) <= 1.0f))
+        {
+          ++count;
+        }
+      }
+    }
+
+    return count;
+  }
+
+  /**
+   * Enqueue processing a packet with the next buffer set and return without waiting for it.
+   * The frames that completed meanwhile are delivered before and after, see #deliverCompleted.
+   * Blocks while every buffer set has a frame in flight.
+   * @param packet Packet to process.
+   */
+  bool submit(const DepthPacket &packet)
+  {
+    deliverCompleted(false);
+
+    // the sets are used in turn, so a busy set holds the oldest frame in flight
+    BufferSet &set = sets[next_set];
+    while(set.busy)
+    {
+      deliverCompleted(true);
+    }
+    next_set = (next_set + 1) % num_sets;
+
+    stampFrames(set, packet);
+
+    cl::Event event;
+    if(!enqueue(set, packet, true, event))
+    {
+      // commands enqueued before the failure may still use the set
+      queue.finish();
+      queue_stage2.finish();
+      return false;
+    }
+
+    {
+      libfreenect2::lock_guard l(pipeline_mutex);
+      set.busy = true;
+      set.done = false;
+      set.failed = false;
+      pending.push_back(&set);
+    }
+
+    cl_int err = event.setCallback(CL_COMPLETE, &onFrameComplete, &set);
+    if(err != CL_SUCCESS)
+    {
+      LOG_ERROR << "setCallback failed: " << err;
+      completeFrame(set, event.wait() == CL_SUCCESS);
+      return true;
+    }
+
+    queue.flush();
+    queue_stage2.flush();
+
+    deliverCompleted(false);
+    return true;
+  }
+
+  /** Completion callback of the last command of a frame in flight, called on a thread of the OpenCL runtime. */
+  static void CL_CALLBACK onFrameComplete(cl_event event, cl_int status, void *user_data)
+  {
+    BufferSet *set = static_cast<BufferSet *>(user_data);
+    set->impl->completeFrame(*set, status == CL_COMPLETE);
+  }
+
+  /**
+   * Mark the frame of a set as complete and wake the processor thread, which delivers it.
+   * Runs on a thread of the OpenCL runtime, so it neither calls the listener nor allocates.
+   * @param set Buffer set whose frame completed.
+   * @param ok Whether the frame was processed successfully, failed frames are dropped.
+   */
+  void completeFrame(BufferSet &set, bool ok)
+  {
+    libfreenect2::lock_guard l(pipeline_mutex);
+    set.done = true;
+    set.failed = !ok;
+    pipeline_condition.notify_all();
+  }
+
+  /**
+   * Deliver the complete frames in the order they were submitted, up to the first one still in flight.
+   * The listener is called without holding #pipeline_mutex.
+   * @param wait Whether to wait for the oldest frame in flight to complete first.
+   */
+  void deliverCompleted(bool wait)
+  {
+    for(;;)
+    {
+      BufferSet *set;
+      {
+        libfreenect2::unique_lock l(pipeline_mutex);
+        while(wait && !pending.empty() && !pending.front()->done)
+        {
+          WAIT_CONDITION(pipeline_condition, pipeline_mutex, l);
+        }
+
+        if(pending.empty() || !pending.front()->done)
+        {
+          return;
+        }
+
+        set = pending.front();
+        pending.pop_front();
+      }
+      wait = false;
+
+      if(set->failed)
+      {
+        LOG_ERROR << "OpenCL processing failed, dropping frame";
+      }
+      else
+      {
+        recordProfile(*set);
+        deliverFrames(*set);
+      }
+
+      set->done = false;
+      set->busy = false;
+    }
+  }
+
+  /** Wait until all frames in flight complete, and deliver them. */
+  void finishPipeline()
+  {
+    while(!pending.empty())
+    {
+      deliverCompleted(true);
+    }
+  }
+
+  /** Copy the timestamp and sequence number of a packet to the frames of a set. */
+  void stampFrames(BufferSet &set, const DepthPacket &packet)
+  {
+    // the frame of a disabled output is not allocated
+    if(set.ir_frame != 0)
+    {
+      set.ir_frame->timestamp = packet.timestamp;
+      set.ir_frame->sequence = packet.sequence;
+    }
+    if(set.depth_frame != 0)
+    {
+      set.depth_frame->timestamp = packet.timestamp;
+      set.depth_frame->sequence = packet.sequence;
+    }
+  }
+
+  /** Hand the read back frames of a set to the listener, and replace the frames it keeps. */
+  void deliverFrames(BufferSet &set)
+  {
+    if(!rois.filter2.isFullFrame())
+    {
+      if(set.ir_frame != 0) clearOutsideRoi(rois.filter2, set.ir_frame);
+      if(set.depth_frame != 0) clearOutsideRoi(rois.filter2, set.depth_frame);
+    }
+
+    if(listener == 0)
+    {
+      return;
+    }
+
+    if(set.ir_frame != 0 && listener->onNewFrame(Frame::Ir, set.ir_frame))
+    {
+      newIrFrame(set);
+    }
+
+    if(set.depth_frame != 0 && listener->onNewFrame(Frame::Depth, set.depth_frame))
+    {
+      newDepthFrame(set);
+    }
+  }
+
+  bool readProgram(std::string &source) const
+  {
+    source = loadCLSource("opencl_depth_packet_processor.cl");
+    return !source.empty();
+  }
+
+  bool buildProgram(const std::string& sources)
+  {
+    cl_int err;
+    {
+      LOG_INFO << "building OpenCL program...";
+
+      std::string options;
+      generateOptions(options);
+
+      std::string cache_path;
+      uint64_t cache_key = 0;
+
+      if(config.EnableProgramCache)
+      {
+        const std::string dir = getCacheDirectory();
+        cache_key = programKey(sources, options);
+        cache_path = dir.empty() ? dir : dir + cacheFileName("opencl", "", cache_key);
+      }
+
+      if(!cache_path.empty() && loadProgramBinary(cache_path, cache_key, options))
+      {
+        ++cache_stats.hits;
+        LOG_INFO << "loaded OpenCL program from " << cache_path;
+        programBuilt = true;
+        return true;
+      }
+
+      cl::Program::Sources source(1, std::make_pair(sources.c_str(), sources.length()));
+      program = cl::Program(context, source, &err);
+      CHECK_CL_ERROR(err, "cl::Program");
+
+      err = program.build(options.c_str());
+      if (err != CL_SUCCESS)
+      {
+        LOG_ERROR << "failed to build program: " << err;
+        LOG_ERROR << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device);
+        LOG_ERROR << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device);
+        LOG_ERROR << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+        programBuilt = false;
+        return false;
+      }
+
+      if(config.EnableProgramCache)
+      {
+        ++cache_stats.misses;
+      }
+      if(!cache_path.empty() && saveProgramBinary(cache_path, cache_key))
+      {
+        ++cache_stats.stores;
+        LOG_INFO << "saved OpenCL program to " << cache_path;
+      }
+    }
+
+    LOG_INFO << "OpenCL program built successfully";
+    programBuilt = true;
+    return true;
+  }
+
+  /** Clear the profiled durations of all steps. */
+  void resetProfiles()
+  {
+    libfreenect2::lock_guard l(profile_mutex);
+    for(size_t i = 0; i < NumProfiledSteps; ++i)
+    {
+      profiles[i].count = 0;
+      profiles[i].next = 0;
+    }
+  }
+
+  /**
+   * Add the profiled durations of the commands of a completed frame to #profiles, with Config::EnableOpenCLProfiling.
+   * @param set Buffer set whose frame completed.
+   */
+  void recordProfile(const BufferSet &set)
+  {
+    if(!config.EnableOpenCLProfiling)
+    {
+      return;
+    }
+
+    libfreenect2::lock_guard l(profile_mutex);
+    for(size_t i = 0; i < NumProfiledSteps; ++i)
+    {
+      const cl::Event &event = set.events[i];
+      if(event() == NULL)
+      {
+        continue;
+      }
+
+      cl_ulong queued = 0, submitted = 0, started = 0, ended = 0;
+      if(event.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED, &queued) != CL_SUCCESS
+        || event.getProfilingInfo(CL_PROFILING_COMMAND_SUBMIT, &submitted) != CL_SUCCESS
+        || event.getProfilingInfo(CL_PROFILING_COMMAND_START, &started) != CL_SUCCESS
+        || event.getProfilingInfo(CL_PROFILING_COMMAND_END, &ended) != CL_SUCCESS)
+      {
+        continue;
+      }
+
+      StepProfile &profile = profiles[i];
+      profile.queued[profile.next] = static_cast<float>(submitted - queued) / 1000000.0f;
+      profile.submitted[profile.next] = static_cast<float>(started - submitted) / 1000000.0f;
+      profile.executed[profile.next] = static_cast<float>(ended - started) / 1000000.0f;
+      profile.next = (profile.next + 1) % ProfileWindow;
+      profile.count = std::min(profile.count + 1, (size_t)ProfileWindow);
+    }
+  }
+
+  /**
+   * Percentiles of the durations in a window.
+   * @param durations Durations, the first \a count are used.
+   * @param count Number of durations, at least 1.
+   */
+  static OpenCLDepthPacketProcessor::ProfilePercentiles percentiles(const float *durations, size_t count)
+  {
+    std::vector<float> sorted(durations, durations + count);
+    std::sort(sorted.begin(), sorted.end());
+
+    OpenCLDepthPacketProcessor::ProfilePercentiles result;
+    result.p50 = sorted[(count - 1) * 50 / 100];
+    result.p90 = sorted[(count - 1) * 90 / 100];
+    result.p99 = sorted[(count - 1) * 99 / 100];
+    result.max = sorted[count - 1];
+    return result;
+  }
+
+  /** Percentiles of the profiled steps that ran in the window. */
+  std::vector<OpenCLDepthPacketProcessor::ProfileStats> profileStats()
+  {
+    static const char *const names[NumProfiledSteps] = { "upload", "stage1", "bin", "filter1", "stage2", "filter2", "ir pack", "ir readback", "depth pack", "depth readback" };
+
+    libfreenect2::lock_guard l(profile_mutex);
+    std::vector<OpenCLDepthPacketProcessor::ProfileStats> stats;
+    for(size_t i = 0; i < NumProfiledSteps; ++i)
+    {
+      const StepProfile &profile = profiles[i];
+      if(profile.count == 0)
+      {
+        continue;
+      }
+
+      OpenCLDepthPacketProcessor::ProfileStats step;
+      step.step = names[i];
+      step.frames = profile.count;
+      step.queued = percentiles(profile.queued, profile.count);
+      step.submitted = percentiles(profile.submitted, profile.count);
+      step.executed = percentiles(profile.executed, profile.count);
+      stats.push_back(step);
+    }
+    return stats;
+  }
+
+  /** Let the driver choose all work group sizes. */
+  void resetTuning()
+  {
+    static const char *const names[NumTunedKernels] = { "processPixelStage1", "binPixelStage1", "filterPixelStage1", "processPixelStage2", "filterPixelStage2", "packOutputUInt16" };
+
+    for(size_t i = 0; i < NumTunedKernels; ++i)
+    {
+      tuning[i].kernel = names[i];
+      tuning[i].local_width = 0;
+      tuning[i].local_height = 0;
+      tuning[i].time = 0.0f;
+      tuning[i].default_time = 0.0f;
+    }
+    tuned = false;
+  }
+
+  /**
+   * Time a kernel over a region with a work group size.
+   * @param queue Queue with profiling enabled.
+   * @param kernel Kernel with its arguments set.
+   * @param roi Region to compute.
+   * @param width Work group width, 0 lets the driver choose.
+   * @param height Work group height.
+   * @param [out] ms Average time of a run in milliseconds.
+   * @return Whether the device accepted the size.
+   */
+  bool timeKernel(cl::CommandQueue &queue, cl::Kernel &kernel, const DepthRoi &roi, size_t width, size_t height, float &ms)
+  {
+    static const int runs = 5;
+    const cl::NDRange local = width == 0 ? cl::NullRange : cl::NDRange(width, height);
+    cl_ulong total = 0;
+
+    // the first run is not counted, it may include lazy compilation
+    for(int i = 0; i <= runs; ++i)
+    {
+      cl::Event event;
+      cl_int err = queue.enqueueNDRangeKernel(kernel, cl::NDRange(roi.x_begin, roi.y_begin), cl::NDRange(roi.width(), roi.height()), local, NULL, &event);
+      if(err == CL_SUCCESS)
+        err = event.wait();
+      if(err != CL_SUCCESS)
+        return false;
+
+      cl_ulong start = 0, end = 0;
+      event.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
+      event.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
+      if(i > 0)
+        total += end - start;
+    }
+
+    ms = static_cast<float>(total / runs) / 1000000.0f;
+    return true;
+  }
+
+  /**
+   * Time each kernel with a set of work group sizes on a packet and use the fastest from now on, see
+   * Config::EnableWorkGroupTuning. The frames of the packet are not delivered.
+   * @param packet Packet to tune with, the kernels take data dependent branches.
+   */
+  bool tuneWorkGroupSizes(const DepthPacket &packet)
+  {
+    static const size_t candidates[][2] = {
+      {8, 8}, {16, 4}, {16, 8}, {16, 16}, {32, 1}, {32, 2}, {32, 4}, {32, 8}, {64, 1}, {64, 2}, {64, 4}, {128, 1}, {128, 2}, {256, 1}
+    };
+    static const size_t num_candidates = sizeof(candidates) / sizeof(candidates[0]);
+
+    tune_pending = false;
+
+    // frames in flight use the buffer sets
+    finishPipeline();
+
+    LOG_INFO << "tuning OpenCL work group sizes...";
+
+    // fill the intermediate images of the first set, the copy of the packet stays in its packet buffer
+    BufferSet &set = sets[0];
+    std::vector<unsigned char> packet_data;
+    resetTuning();
+    if(!run(set, copyPacket(packet, packet_data)))
+      return false;
+
+    // the kernels are timed on another queue, nothing may still run on these
+    cl_int err = queue.finish();
+    CHECK_CL_ERROR(err, "finish");
+    err = queue_stage2.finish();
+    CHECK_CL_ERROR(err, "finish");
+
+    cl::CommandQueue profiling_queue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+    CHECK_CL_ERROR(err, "cl::CommandQueue");
+
+    if(zero_copy)
+    {
+      // the frames the kernels were bound to are mapped to the host again
+      Frame *ir = set.ir_frame, *depth = set.depth_frame;
+      set.ir_frame = set.depth_frame = 0;
+      const bool bound = bindOutputs(set);
+      set.ir_frame = ir;
+      set.depth_frame = depth;
+      if(!bound)
+        return false;
+    }
+
+    // tuned on the whole image, the sizes apply to regions they divide
+    const DepthRoi image = { 0, 0, 512, 424 };
+    const DepthRoi stage2_image = config.EnableBinnedOutput ? image.bin() : image;
+    cl::Kernel *kernels[NumTunedKernels] = { &set.kernel_processPixelStage1, &set.kernel_binPixelStage1, &set.kernel_filterPixelStage1,
+                                             &set.kernel_processPixelStage2, &set.kernel_filterPixelStage2, &set.kernel_packDepth };
+    const DepthRoi regions[NumTunedKernels] = { image, image.bin(), stage2_image, stage2_image, stage2_image, stage2_image };
+
+    for(size_t k = 0; k < NumTunedKernels; ++k)
+    {
+      OpenCLDepthPacketProcessor::WorkGroupTuning &result = tuning[k];
+      const DepthRoi &roi = regions[k];
+
+      if(!timeKernel(profiling_queue, *kernels[k], roi, 0, 0, result.default_time))
+      {
+        LOG_ERROR << "could not time " << result.kernel;
+        resetTuning();
+        return false;
+      }
+      result.time = result.default_time;
+
+      size_t max_size = 0;
+      kernels[k]->getWorkGroupInfo(device, CL_KERNEL_WORK_GROUP_SIZE, &max_size);
+
+      for(size_t c = 0; c < num_candidates; ++c)
+      {
+        const size_t width = candidates[c][0], height = candidates[c][1];
+        if(width * height > max_size || roi.width() % width != 0 || roi.height() % height != 0)
+          continue;
+
+        float ms;
+        if(timeKernel(profiling_queue, *kernels[k], roi, width, height, ms) && ms < result.time)
+        {
+          result.local_width = width;
+          result.local_height = height;
+          result.time = ms;
+        }
+      }
+
+      LOG_INFO << result.kernel << ": " << result.local_width << "x" << result.local_height << " " << result.time << "ms, driver's choice " << result.default_time << "ms";
+    }
+
+    tuned = true;
+    saveWorkGroupSizes();
+    return true;
+  }
+
+  /** Path of the work group size cache file of the current program, empty if there is no cache directory. */
+  std::string workGroupCachePath(uint64_t &key) const
+  {
+    const std::string dir = getCacheDirectory();
+    if(dir.empty())
+      return dir;
+
+    // the best sizes depend on the device, its driver and the compiled kernels
+    std::string options;
+    generateOptions(options);
+    const uint32_t version = WorkGroupCacheHeader::Version;
+    key = hashBytes(&version, sizeof(version), programKey(sourceCode, options));
+    return dir + cacheFileName("openclwg", "", key);
+  }
+
+  /**
+   * Use the work group sizes tuned before for the current program, if they are in the cache.
+   * @return Whether the sizes were loaded.
+   */
+  bool loadWorkGroupSizes()
+  {
+    uint64_t key = 0;
+    const std::string path = workGroupCachePath(key);
+    CacheFile file;
+    if(path.empty() || !file.open(path))
+      return false;
+
+    const WorkGroupCacheHeader *header = reinterpret_cast<const WorkGroupCacheHeader *>(file.data());
+
+    if(file.size() != sizeof(WorkGroupCacheHeader) + NumTunedKernels * sizeof(WorkGroupCacheEntry)
+      || std::memcmp(header->magic, "FN2CLWGS", 8) != 0
+      || header->version != WorkGroupCacheHeader::Version
+      || header->count != NumTunedKernels
+      || header->key != key)
+    {
+      LOG_WARNING << "ignoring invalid work group size cache file " << path;
+      return false;
+    }
+
+    const WorkGroupCacheEntry *entries = reinterpret_cast<const WorkGroupCacheEntry *>(file.data() + sizeof(WorkGroupCacheHeader));
+    for(size_t i = 0; i < NumTunedKernels; ++i)
+    {
+      tuning[i].local_width = entries[i].width;
+      tuning[i].local_height = entries[i].height;
+      tuning[i].time = entries[i].time;
+      tuning[i].default_time = entries[i].default_time;
+    }
+
+    tuned = true;
+    LOG_INFO << "loaded OpenCL work group sizes from " << path;
+    return true;
+  }
+
+  /** Write the tuned work group sizes to the cache. */
+  void saveWorkGroupSizes() const
+  {
+    uint64_t key = 0;
+    const std::string path = workGroupCachePath(key);
+    if(path.empty())
+      return;
+
+    WorkGroupCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "FN2CLWGS", 8);
+    header.version = WorkGroupCacheHeader::Version;
+    header.count = NumTunedKernels;
+    header.key = key;
+
+    WorkGroupCacheEntry entries[NumTunedKernels];
+    for(size_t i = 0; i < NumTunedKernels; ++i)
+    {
+      entries[i].width = static_cast<uint32_t>(tuning[i].local_width);
+      entries[i].height = static_cast<uint32_t>(tuning[i].local_height);
+      entries[i].time = tuning[i].time;
+      entries[i].default_time = tuning[i].default_time;
+    }
+
+    if(writeCacheFile(path, &header, sizeof(header), entries, sizeof(entries)))
+      LOG_INFO << "saved OpenCL work group sizes to " << path;
+  }
+
+  /**
+   * Key of the program binary cache: the binary depends on the device, its driver, the source and the build options.
+   * @param source Source of the program.
+   * @param options Build options.
+   */
+  uint64_t programKey(const std::string &source, const std::string &options) const
+  {
+    const uint32_t version = ProgramCacheHeader::Version;
+    std::string name, vendor, device_version, driver_version;
+    device.getInfo(CL_DEVICE_NAME, &name);
+    device.getInfo(CL_DEVICE_VENDOR, &vendor);
+    device.getInfo(CL_DEVICE_VERSION, &device_version);
+    device.getInfo(CL_DRIVER_VERSION, &driver_version);
+
+    // the terminating zeros separate the strings
+    uint64_t key = hashBytes(&version, sizeof(version));
+    key = hashBytes(name.c_str(), name.size() + 1, key);
+    key = hashBytes(vendor.c_str(), vendor.size() + 1, key);
+    key = hashBytes(device_version.c_str(), device_version.size() + 1, key);
+    key = hashBytes(driver_version.c_str(), driver_version.size() + 1, key);
+    key = hashBytes(source.c_str(), source.size() + 1, key);
+    key = hashBytes(options.c_str(), options.size() + 1, key);
+    return key;
+  }
+
+  /**
+   * Create #program from a binary in the program cache.
+   * @param path Path of the cache file.
+   * @param key Expected key, see #programKey.
+   * @param options Build options, binaries have to be built as well.
+   * @return Whether the file exists and holds a binary the device accepts.
+   */
+  bool loadProgramBinary(const std::string &path, uint64_t key, const std::string &options)
+  {
+    CacheFile file;
+    if(!file.open(path)) return false;
+
+    const ProgramCacheHeader *header = reinterpret_cast<const ProgramCacheHeader *>(file.data());
+
+    if(file.size() < sizeof(ProgramCacheHeader)
+      || std::memcmp(header->magic, "FN2CLBIN", 8) != 0
+      || header->version != ProgramCacheHeader::Version
+      || header->key != key
+      || header->binary_size != file.size() - sizeof(ProgramCacheHeader))
+    {
+      LOG_WARNING << "ignoring invalid program cache file " << path;
+      ++cache_stats.rejected;
+      return false;
+    }
+
+    std::vector<cl::Device> devices(1, device);
+    cl::Program::Binaries binaries(1, std::make_pair(static_cast<const void *>(file.data() + sizeof(ProgramCacheHeader)), static_cast<size_t>(header->binary_size)));
+
+    cl_int err;
+    cl::Program cached(context, devices, binaries, NULL, &err);
+    if(err == CL_SUCCESS)
+    {
+      err = cached.build(devices, options.c_str());
+    }
+    if(err != CL_SUCCESS)
+    {
+      LOG_WARNING << "cached OpenCL program " << path << " was rejected (" << err << "), building from source";
+      ++cache_stats.rejected;
+      return false;
+    }
+
+    program = cached;
+    return true;
+  }
+
+  /**
+   * Write the binary of #program to the program cache.
+   * @param path Path of the cache file.
+   * @param key Key of the program, see #programKey.
+   * @return Whether the file was written.
+   */
+  bool saveProgramBinary(const std::string &path, uint64_t key)
+  {
+    // the context has a single device, so the program has a single binary
+    size_t size = 0;
+    cl_int err = clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL);
+    if(err != CL_SUCCESS || size == 0) return false;
+
+    std::vector<unsigned char> binary(size);
+    unsigned char *binaries[1] = { &binary[0] };
+    err = clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL);
+    if(err != CL_SUCCESS) return false;
+
+    ProgramCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "FN2CLBIN", 8);
+    header.version = ProgramCacheHeader::Version;
+    header.key = key;
+    header.binary_size = size;
+    return writeCacheFile(path, &header, sizeof(header), &binary[0], size);
+  }
+
+  /** Allocate a new IR or depth frame of the configured output size and format. */
+  Frame *newOutputFrame() const
+  {
+    const size_t width = config.EnableBinnedOutput ? 256 : 512, height = config.EnableBinnedOutput ? 212 : 424;
+    if(zero_copy)
+    {
+      return config.EnableUInt16Output ? new OpenCLFrame(width, height, 2, Frame::UInt16, context, queue) : new OpenCLFrame(width, height, 4, Frame::Float, context, queue);
+    }
+    return config.EnableUInt16Output ? new Frame(width, height, 2, Frame::UInt16) : new Frame(width, height, 4, Frame::Float);
+  }
+
+  void newIrFrame(BufferSet &set)
+  {
+    set.ir_frame = newOutputFrame();
+  }
+
+  void newDepthFrame(BufferSet &set)
+  {
+    set.depth_frame = newOutputFrame();
+  }
+
+  /**
+   * Allocate the frames of the enabled outputs in the buffer sets in use and release the others.
+   * @param ir Whether IR output is enabled.
+   * @param depth Whether depth output is enabled.
+   */
+  void allocateFrames(bool ir, bool depth)
+  {
+    for(size_t i = 0; i < MaxBufferSets; ++i)
+    {
+      BufferSet &set = sets[i];
+      const bool used = i < num_sets;
+
+      if(!ir || !used)
+      {
+        delete set.ir_frame;
+        set.ir_frame = 0;
+      }
+      else if(set.ir_frame == 0)
+      {
+        newIrFrame(set);
+      }
+
+      if(!depth || !used)
+      {
+        delete set.depth_frame;
+        set.depth_frame = 0;
+      }
+      else if(set.depth_frame == 0)
+      {
+        newDepthFrame(set);
+      }
+    }
+  }
+
+  /** Average the x and z tables over 2x2 blocks, counting only the pixels with a valid (positive) z multiplier. */
+  void binTables()
+  {
+    for(int y = 0; y < 212; ++y)
+      for(int x = 0; x < 256; ++x)
+      {
+        float x_sum = 0.0f, z_sum = 0.0f;
+        int n = 0;
+
+        for(int i = 0; i < 4; ++i)
+        {
+          const int offset = (2 * y + i / 2) * 512 + 2 * x + i % 2;
+
+          if(0.0f < z_table[offset])
+          {
+            x_sum += x_table[offset];
+            z_sum += z_table[offset];
+            ++n;
+          }
+        }
+
+        x_table_binned[y * 256 + x] = n != 0 ? x_sum / n : 0.0f;
+        z_table_binned[y * 256 + x] = n != 0 ? z_sum / n : 0.0f;
+      }
+  }
+
+  /**
+   * Load an x or z table from the resources. Its rows are in the order of the sensor, the last output row first,
+   * so they are stored upside down to let the kernels index them by output row like the p0 table.
+   * @param filename Name of the resource.
+   * @param [out] table Table of 512x424 values.
+   */
+  bool loadTable(const char *filename, cl_float *table)
+  {
+    const unsigned char *data;
+    size_t length;
+    const size_t line = 512 * sizeof(cl_float);
+
+    if(!loadResource(filename, &data, &length) || length != image_size * sizeof(cl_float))
+    {
+      return false;
+    }
+
+    unsigned char *out = reinterpret_cast<unsigned char *>(table);
+    for(int r = 0; r < 424; ++r)
+    {
+      std::copy(data + (423 - r) * line, data + (424 - r) * line, out + r * line);
+    }
+    return true;
+  }
+
+  void fill_trig_table(const libfreenect2::protocol::P0TablesResponse *p0table)
+  {
+    for(int r = 0; r < 424; ++r)
+    {
+      cl_float3 *it = &p0_table[r * 512];
+      const uint16_t *it0 = &p0table->p0table0[r * 512];
+      const uint16_t *it1 = &p0table->p0table1[r * 512];
+      const uint16_t *it2 = &p0table->p0table2[r * 512];
+      for(int c = 0; c < 512; ++c, ++it, ++it0, ++it1, ++it2)
+      {
+        it->s[0] = -((float) * it0) * 0.000031 * M_PI;
+        it->s[1] = -((float) * it1) * 0.000031 * M_PI;
+        it->s[2] = -((float) * it2) * 0.000031 * M_PI;
+        it->s[3] = 0.0f;
+      }
+    }
+  }
+};
+
+OpenCLDepthPacketProcessor::OpenCLDepthPacketProcessor(const int deviceId, bool half_intermediates) :
+  impl_(new OpenCLDepthPacketProcessorImpl(deviceId, half_intermediates))
+{
+}
+
+OpenCLDepthPacketProcessor::~OpenCLDepthPacketProcessor()
+{
+  impl_->finishPipeline();
+  // the frames the buffer sets read back into, unmapped while their queue is still there
+  impl_->allocateFrames(false, false);
+  delete impl_;
+}
+
+OpenCLDepthPacketProcessor::ProgramCacheStats OpenCLDepthPacketProcessor::getProgramCacheStats() const
+{
+  return impl_->cache_stats;
+}
+
+std::vector<OpenCLDepthPacketProcessor::WorkGroupTuning> OpenCLDepthPacketProcessor::getWorkGroupTuning() const
+{
+  if(!impl_->tuned)
+    return std::vector<WorkGroupTuning>();
+
+  return std::vector<WorkGroupTuning>(impl_->tuning, impl_->tuning + OpenCLDepthPacketProcessorImpl::NumTunedKernels);
+}
+
+std::vector<OpenCLDepthPacketProcessor::ProfileStats> OpenCLDepthPacketProcessor::getProfileStats() const
+{
+  return impl_->profileStats();
+}
+
+void OpenCLDepthPacketProcessor::resetProfileStats()
+{
+  impl_->resetProfiles();
+}
+
+Allocator *OpenCLDepthPacketProcessor::getAllocator()
+{
+  return impl_->zero_copy ? &impl_->allocator : 0;
+}
+
+void OpenCLDepthPacketProcessor::setFrameListener(libfreenect2::FrameListener *listener)
+{
+  DepthPacketProcessor::setFrameListener(listener);
+  // frames still in flight go to the listener set when they are delivered, none once it is reset to 0
+  impl_->listener = listener;
+}
+
+void OpenCLDepthPacketProcessor::setConfiguration(const libfreenect2::DepthPacketProcessor::Config &config)
+{
+  DepthPacketProcessor::setConfiguration(config);
+
+  // the buffers and frames of frames in flight may be replaced below
+  impl_->finishPipeline();
+
+  const size_t num_sets = config.NumOpenCLBufferSets < 1 ? 1 : config.NumOpenCLBufferSets > 3 ? 3 : config.NumOpenCLBufferSets;
+
+  // with runtime parameters the depth range is not compiled in
+  const bool depth_range_changed = impl_->config.MaxDepth != config.MaxDepth || impl_->config.MinDepth != config.MinDepth;
+
+  if ( (depth_range_changed && !config.EnableOpenCLRuntimeParameters)
+    || impl_->config.EnableOpenCLRuntimeParameters != config.EnableOpenCLRuntimeParameters
+    || impl_->config.EnableBinnedOutput != config.EnableBinnedOutput)
+  {
+    // OpenCL program needs to be rebuilt, then reinitialized
+    impl_->programBuilt = false;
+    impl_->programInitialized = false;
+  }
+  else if (impl_->config.EnableBilateralFilter != config.EnableBilateralFilter
+    || impl_->config.EnableEdgeAwareFilter != config.EnableEdgeAwareFilter
+    || impl_->config.EnableOpenCLFusedKernels != config.EnableOpenCLFusedKernels
+    || impl_->config.EnableWorkGroupTuning != config.EnableWorkGroupTuning
+    || impl_->config.EnableOpenCLProfiling != config.EnableOpenCLProfiling
+    || impl_->num_sets != num_sets)
   {
     // OpenCL program only needs to be reinitialized
     impl_->programInitialized = false;
   }
 
+  if(!config.EnableIrOutput && !config.EnableDepthOutput)
+  {
+    LOG_WARNING << "neither IR nor depth output enabled, packets will be dropped";
+  }
+
+  if(impl_->config.EnableBinnedOutput != config.EnableBinnedOutput
+    || impl_->config.EnableUInt16Output != config.EnableUInt16Output)
+  {
+    // the frames change size or format
+    impl_->allocateFrames(false, false);
+  }
+
   impl_->config = config;
+  impl_->rois = DepthPassRois(config);
+  impl_->num_sets = num_sets;
+  impl_->allocateFrames(config.EnableIrOutput, config.EnableDepthOutput);
   if (!impl_->programBuilt)
     impl_->buildProgram(impl_->sourceCode);
+  else if (depth_range_changed && impl_->programInitialized)
+    impl_->writeKernelParameters();
+}
+
+void OpenCLDepthPacketProcessor::setParameters(const libfreenect2::DepthPacketProcessor::Parameters &params)
+{
+  // frames in flight read the parameter buffer
+  impl_->finishPipeline();
+  impl_->params = params;
+
+  if (impl_->config.EnableOpenCLRuntimeParameters)
+  {
+    if (impl_->programInitialized)
+      impl_->writeKernelParameters();
+  }
+  else
+  {
+    // the parameters are compiled into the program
+    impl_->programBuilt = false;
+    impl_->programInitialized = false;
+    impl_->buildProgram(impl_->sourceCode);
+  }
 }
 
 void OpenCLDepthPacketProcessor::loadP0TablesFromCommandResponse(unsigned char *buffer, size_t buffer_length)
@@ -640,7 +2487,7 @@ void OpenCLDepthPacketProcessor::loadP0TablesFromCommandResponse(unsigned char *
 
 void OpenCLDepthPacketProcessor::loadXTableFromFile(const char *filename)
 {
-  if(!loadBufferFromResources(filename, (unsigned char *)impl_->x_table, impl_->image_size * sizeof(float)))
+  if(!impl_->loadTable(filename, impl_->x_table))
   {
     LOG_ERROR << "could not load x table from: " << filename;
   }
@@ -648,7 +2495,7 @@ void OpenCLDepthPacketProcessor::loadXTableFromFile(const char *filename)
 
 void OpenCLDepthPacketProcessor::loadZTableFromFile(const char *filename)
 {
-  if(!loadBufferFromResources(filename, (unsigned char *)impl_->z_table, impl_->image_size * sizeof(float)))
+  if(!impl_->loadTable(filename, impl_->z_table))
   {
     LOG_ERROR << "could not load z table from: " << filename;
   }
@@ -664,7 +2511,7 @@ void OpenCLDepthPacketProcessor::load11To16LutFromFile(const char *filename)
 
 void OpenCLDepthPacketProcessor::process(const DepthPacket &packet)
 {
-  bool has_listener = this->listener_ != 0;
+  if(!impl_->config.EnableIrOutput && !impl_->config.EnableDepthOutput) return;
 
   if(!impl_->programInitialized && !impl_->initProgram())
   {
@@ -672,28 +2519,38 @@ void OpenCLDepthPacketProcessor::process(const DepthPacket &packet)
     return;
   }
 
+  if(impl_->tune_pending)
+  {
+    impl_->tuneWorkGroupSizes(packet);
+  }
+
+  if(impl_->validate_fused)
+  {
+    impl_->validateFusedKernels(packet);
+  }
+
   impl_->startTiming();
 
-  impl_->ir_frame->timestamp = packet.timestamp;
-  impl_->depth_frame->timestamp = packet.timestamp;
-  impl_->ir_frame->sequence = packet.sequence;
-  impl_->depth_frame->sequence = packet.sequence;
+  if(impl_->num_sets > 1)
+  {
+    // returns once the packet is enqueued unless all buffer sets are in flight,
+    // so the timing still averages to the frame period the pipeline sustains
+    impl_->submit(packet);
+    impl_->stopTiming(LOG_INFO);
+    return;
+  }
+
+  OpenCLDepthPacketProcessorImpl::BufferSet &set = impl_->sets[0];
+  impl_->stampFrames(set, packet);
 
-  bool r = impl_->run(packet);
+  bool r = impl_->run(set, packet);
 
   impl_->stopTiming(LOG_INFO);
 
-  if(has_listener && r)
+  if(r)
   {
-    if(this->listener_->onNewFrame(Frame::Ir, impl_->ir_frame))
-    {
-      impl_->newIrFrame();
-    }
-
-    if(this->listener_->onNewFrame(Frame::Depth, impl_->depth_frame))
-    {
-      impl_->newDepthFrame();
-    }
+    impl_->recordProfile(set);
+    impl_->deliverFrames(set);
   }
 }
 
@@ -30,13 +30,20 @@
 #include <libfreenect2/resource.h>
 #include <libfreenect2/protocol/response.h>
 #include <libfreenect2/logging.h>
+#include <libfreenect2/depth_roi.h>
+#include <libfreenect2/threading.h>
+#include <libfreenect2/file_cache.h>
 #include "flextGL.h"
 #include <GLFW/glfw3.h>
 
 #include <fstream>
 #include <string>
 #include <map>
+#include <vector>
+#include <deque>
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 
 #include <stdint.h>
 
@@ -124,6 +131,18 @@ bool loadBufferFromFile(const std::string& filename, unsigned char *buffer, size
   return success;
 }
 
+/** Header of a program cache file, followed by the program binary. */
+struct ProgramCacheHeader
+{
+  static const uint32_t Version = 1;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t format;  ///< Binary format reported by glGetProgramBinary.
+  uint64_t key;     ///< See ShaderProgram::programKey.
+  uint64_t binary_size;
+};
+
 struct ShaderProgram : public WithOpenGLBindings
 {
   typedef std::map<std::string, int> FragDataMap;
@@ -135,6 +154,8 @@ struct ShaderProgram : public WithOpenGLBindings
   std::string defines;
   bool is_mesa_checked;
 
+  std::string vertex_source, fragment_source; ///< Complete sources, including the version and the defines.
+
   ShaderProgram() :
     program(0),
     is_mesa_checked(false),
@@ -168,19 +189,13 @@ struct ShaderProgram : public WithOpenGLBindings
   void setVertexShader(const std::string& src)
   {
     checkMesaBug();
-    const GLchar *sources[] = {"#version 140\n", defines.c_str(), src.c_str()};
-    vertex_shader = gl()->glCreateShader(GL_VERTEX_SHADER);
-    gl()->glShaderSource(vertex_shader, 3, sources, NULL);
-    CHECKGL();
+    vertex_source = "#version 140\n" + defines + src;
   }
 
   void setFragmentShader(const std::string& src)
   {
     checkMesaBug();
-    const GLchar *sources[] = {"#version 140\n", defines.c_str(), src.c_str()};
-    fragment_shader = gl()->glCreateShader(GL_FRAGMENT_SHADER);
-    gl()->glShaderSource(fragment_shader, 3, sources, NULL);
-    CHECKGL();
+    fragment_source = "#version 140\n" + defines + src;
   }
 
   void bindFragDataLocation(const std::string &name, int output)
@@ -188,10 +203,142 @@ struct ShaderProgram : public WithOpenGLBindings
     frag_data_map_[name] = output;
   }
 
-  void build()
+  /**
+   * Key of the program binary cache: the binary depends on the driver and the renderer, the sources and the
+   * locations of the outputs.
+   */
+  uint64_t programKey()
+  {
+    const uint32_t version = ProgramCacheHeader::Version;
+    const char *vendor = reinterpret_cast<const char *>(glGetString(GL_VENDOR));
+    const char *renderer = reinterpret_cast<const char *>(glGetString(GL_RENDERER));
+    const char *gl_version = reinterpret_cast<const char *>(glGetString(GL_VERSION));
+
+    // the terminating zeros separate the strings
+    uint64_t key = hashBytes(&version, sizeof(version));
+    key = hashBytes(vendor, vendor != 0 ? std::strlen(vendor) + 1 : 0, key);
+    key = hashBytes(renderer, renderer != 0 ? std::strlen(renderer) + 1 : 0, key);
+    key = hashBytes(gl_version, gl_version != 0 ? std::strlen(gl_version) + 1 : 0, key);
+    key = hashBytes(vertex_source.c_str(), vertex_source.size() + 1, key);
+    key = hashBytes(fragment_source.c_str(), fragment_source.size() + 1, key);
+
+    for(FragDataMap::iterator it = frag_data_map_.begin(); it != frag_data_map_.end(); ++it)
+    {
+      const int32_t output = it->second;
+      key = hashBytes(it->first.c_str(), it->first.size() + 1, key);
+      key = hashBytes(&output, sizeof(output), key);
+    }
+    return key;
+  }
+
+  /**
+   * Create #program from a binary in the program cache.
+   * @param path Path of the cache file.
+   * @param key Expected key, see #programKey.
+   * @return Whether the file exists and holds a binary the driver accepts.
+   */
+  bool loadProgramBinary(const std::string &path, uint64_t key)
+  {
+    CacheFile file;
+    if(!file.open(path)) return false;
+
+    const ProgramCacheHeader *header = reinterpret_cast<const ProgramCacheHeader *>(file.data());
+
+    if(file.size() < sizeof(ProgramCacheHeader)
+      || std::memcmp(header->magic, "FN2GLBIN", 8) != 0
+      || header->version != ProgramCacheHeader::Version
+      || header->key != key
+      || header->binary_size != file.size() - sizeof(ProgramCacheHeader))
+    {
+      LOG_WARNING << "ignoring invalid program cache file " << path;
+      return false;
+    }
+
+    GLuint cached = gl()->glCreateProgram();
+    gl()->glProgramBinary(cached, header->format, file.data() + sizeof(ProgramCacheHeader), header->binary_size);
+    // a format the driver no longer lists is GL_INVALID_ENUM, a binary of another driver version fails like a link
+    const GLenum error = glGetError();
+
+    GLint status = GL_FALSE;
+    if(error == GL_NO_ERROR)
+      gl()->glGetProgramiv(cached, GL_LINK_STATUS, &status);
+
+    if(status != GL_TRUE)
+    {
+      LOG_WARNING << "cached OpenGL program " << path << " was rejected, compiling from source";
+      gl()->glDeleteProgram(cached);
+      return false;
+    }
+
+    program = cached;
+    return true;
+  }
+
+  /**
+   * Write the binary of #program to the program cache.
+   * @param path Path of the cache file.
+   * @param key Key of the program, see #programKey.
+   * @return Whether the file was written.
+   */
+  bool saveProgramBinary(const std::string &path, uint64_t key)
+  {
+    GLint size = 0;
+    gl()->glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+    CHECKGL();
+    if(size <= 0) return false;
+
+    std::vector<unsigned char> binary(size);
+    GLsizei length = 0;
+    GLenum format = 0;
+    gl()->glGetProgramBinary(program, size, &length, &format, &binary[0]);
+    CHECKGL();
+    if(length <= 0) return false;
+
+    ProgramCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "FN2GLBIN", 8);
+    header.version = ProgramCacheHeader::Version;
+    header.format = format;
+    header.key = key;
+    header.binary_size = length;
+    return writeCacheFile(path, &header, sizeof(header), &binary[0], length);
+  }
+
+  GLuint createShader(GLenum type, const std::string &source)
+  {
+    const GLchar *sources[] = { source.c_str() };
+    GLuint shader = gl()->glCreateShader(type);
+    gl()->glShaderSource(shader, 1, sources, NULL);
+    CHECKGL();
+    return shader;
+  }
+
+  /**
+   * Compile and link the program, or load it from the program binary cache.
+   * @param cache_dir Directory of the program cache, empty to always compile, see Config::EnableProgramCache.
+   */
+  void build(const std::string &cache_dir)
   {
+    std::string cache_path;
+    uint64_t cache_key = 0;
+
+    if(!cache_dir.empty() && FLEXT_ARB_get_program_binary)
+    {
+      cache_key = programKey();
+      cache_path = cache_dir + cacheFileName("opengl", "", cache_key);
+
+      if(loadProgramBinary(cache_path, cache_key))
+      {
+        LOG_DEBUG << "loaded OpenGL program from " << cache_path;
+        return;
+      }
+    }
+
     GLint status;
 
+    vertex_shader = createShader(GL_VERTEX_SHADER, vertex_source);
+    fragment_shader = createShader(GL_FRAGMENT_SHADER, fragment_source);
+
     gl()->glCompileShader(vertex_shader);
     gl()->glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &status);
 
@@ -221,6 +368,11 @@ struct ShaderProgram : public WithOpenGLBindings
       gl()->glBindFragDataLocation(program, it->second, it->first.c_str());
     }
 
+    if(!cache_path.empty())
+    {
+      gl()->glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
     gl()->glLinkProgram(program);
 
     gl()->glGetProgramiv(program, GL_LINK_STATUS, &status);
@@ -231,6 +383,11 @@ struct ShaderProgram : public WithOpenGLBindings
       LOG_ERROR << "failed to link shader program!" << std::endl << error_buffer;
     }
     CHECKGL();
+
+    if(status == GL_TRUE && !cache_path.empty() && saveProgramBinary(cache_path, cache_key))
+    {
+      LOG_DEBUG << "saved OpenGL program to " << cache_path;
+    }
   }
 
   GLint getAttributeLocation(const std::string& name)
@@ -256,6 +413,15 @@ struct ShaderProgram : public WithOpenGLBindings
     CHECKGL();
   }
 
+  void setUniformVector2(const std::string& name, GLint value[2])
+  {
+    GLint idx = gl()->glGetUniformLocation(program, name.c_str());
+    if(idx == -1) return;
+
+    gl()->glUniform2iv(idx, 1, value);
+    CHECKGL();
+  }
+
   void setUniformVector3(const std::string& name, GLfloat value[3])
   {
     GLint idx = gl()->glGetUniformLocation(program, name.c_str());
@@ -364,54 +530,230 @@ public:
     CHECKGL();
   }
 
-  void flipY()
+  /**
+   * Fill #data with a table whose lines are in the order of the sensor, the last output line first.
+   * The passes draw the output lines from the bottom of their textures up, so reading back needs no flipping.
+   * @param table Table of the size of the texture.
+   */
+  void copyFromFlippedTable(const unsigned char *table)
+  {
+    const size_t line = width * bytes_per_pixel;
+
+    for(size_t y = 0; y < height; ++y)
+    {
+      std::copy(table + (height - 1 - y) * line, table + (height - y) * line, data + y * line);
+    }
+  }
+
+  Frame *downloadToNewFrame()
+  {
+    Frame *f = new Frame(width, height, bytes_per_pixel);
+    downloadToBuffer(f->data);
+
+    return f;
+  }
+
+  /**
+   * Download the lower left corner of the texture, which the passes drawing into a smaller viewport fill.
+   * @param frame_width Width of the corner.
+   * @param frame_height Height of the corner.
+   */
+  Frame *downloadCornerToNewFrame(size_t frame_width, size_t frame_height)
   {
-    flipYBuffer(data);
+    Frame *f = new Frame(frame_width, frame_height, bytes_per_pixel);
+    downloadCornerToBuffer(frame_width, frame_height, f->data);
+
+    return f;
   }
 
-  void flipYBuffer(unsigned char *data)
+  /**
+   * Read the lower left corner of the texture, see #downloadCornerToNewFrame.
+   * @param frame_width Width of the corner.
+   * @param frame_height Height of the corner.
+   * @param data Image, or offset into the bound pixel pack buffer.
+   */
+  void downloadCornerToBuffer(size_t frame_width, size_t frame_height, unsigned char *data)
   {
-    typedef unsigned char type;
+    glReadPixels(0, 0, frame_width, frame_height, FormatT::Format, FormatT::Type, data);
+    CHECKGL();
+  }
+};
+
+/** Most pixel buffers the outputs are read back through, see Config::NumOpenGLReadbackBuffers. */
+static const size_t MaxReadbackSlots = 8;
+
+/** Most packets whose output textures are held by frames, see Config::EnableOpenGLTextureOutput. */
+static const size_t MaxTextureSlots = 8;
 
-    int linestep = width * bytes_per_pixel / sizeof(type);
+/** Number of entries of ReadbackState::in_use, the pixel buffers first, then the output textures. */
+static const size_t NumReadbackTargets = 2 * (MaxReadbackSlots + MaxTextureSlots);
 
-    type *first_line = reinterpret_cast<type *>(data), *last_line = reinterpret_cast<type *>(data) + (height - 1) * linestep;
+class OpenGLReadbackFrame;
 
-    for(int y = 0; y < height / 2; ++y)
+/** State of the readback buffers and output textures shared with their frames, which listeners may delete on any thread. */
+struct ReadbackState
+{
+  libfreenect2::mutex mutex;
+  size_t references;                 ///< The processor and each frame alive.
+  bool in_use[NumReadbackTargets];   ///< Whether a frame over the buffer or texture is alive, IR and depth of each slot.
+  OpenGLReadbackFrame *frames[NumReadbackTargets]; ///< Frame over each mapped pixel buffer in use.
+
+  ReadbackState() : references(1)
+  {
+    std::fill(in_use, in_use + NumReadbackTargets, false);
+    std::fill(frames, frames + NumReadbackTargets, static_cast<OpenGLReadbackFrame *>(0));
+  }
+
+  /** Drop a reference, the last one deletes the state. */
+  void release()
+  {
+    bool last;
     {
-      for(int x = 0; x < linestep; ++x, ++first_line, ++last_line)
-      {
-        std::swap(*first_line, *last_line);
-      }
-      last_line -= 2 * linestep;
+      libfreenect2::lock_guard l(mutex);
+      last = --references == 0;
     }
+    if(last) delete this;
   }
+};
 
-  Frame *downloadToNewFrame()
+/** Frame over a mapped pixel buffer, which is given back to the processor when the frame is deleted. */
+class OpenGLReadbackFrame : public Frame
+{
+public:
+  OpenGLReadbackFrame(size_t width, size_t height, size_t bytes_per_pixel, Format format, unsigned char *data, ReadbackState *state, size_t buffer) :
+    Frame(width, height, bytes_per_pixel, format, data),
+    state(state),
+    buffer(buffer)
   {
-    Frame *f = new Frame(width, height, bytes_per_pixel);
-    downloadToBuffer(f->data);
-    flipYBuffer(f->data);
+  }
 
-    return f;
+  virtual ~OpenGLReadbackFrame()
+  {
+    {
+      libfreenect2::lock_guard l(state->mutex);
+      state->in_use[buffer] = false;
+      state->frames[buffer] = 0;
+    }
+    state->release();
+  }
+
+  /**
+   * Copy the pixels out of the mapped buffer into memory the frame owns, before the processor deletes the buffer.
+   * Called with the lock of the state held.
+   */
+  void detach()
+  {
+    const size_t alignment = 64;
+    const size_t size = width * height * bytes_per_pixel;
+    rawdata = new unsigned char[size + alignment];
+    uintptr_t ptr = reinterpret_cast<uintptr_t>(rawdata);
+    uintptr_t aligned = (ptr - 1u + alignment) & -alignment;
+    std::copy(data, data + size, reinterpret_cast<unsigned char *>(aligned));
+    data = reinterpret_cast<unsigned char *>(aligned);
+  }
+
+private:
+  ReadbackState *state;
+  size_t buffer; ///< Index into ReadbackState::in_use.
+};
+
+/** Frame over an output texture, which is given back to the processor when the frame is deleted. */
+class OpenGLTextureOutputFrame : public OpenGLTextureFrame
+{
+public:
+  OpenGLTextureOutputFrame(size_t width, size_t height, size_t bytes_per_pixel, Format format, GLuint texture, GLsync fence, ReadbackState *state, size_t index) :
+    OpenGLTextureFrame(width, height, bytes_per_pixel, format, texture, fence),
+    state(state),
+    index(index)
+  {
+  }
+
+  virtual ~OpenGLTextureOutputFrame()
+  {
+    {
+      libfreenect2::lock_guard l(state->mutex);
+      state->in_use[index] = false;
+    }
+    state->release();
   }
+
+private:
+  ReadbackState *state;
+  size_t index; ///< Index into ReadbackState::in_use.
+};
+
+/** Pixel buffer an output is read back into, only used on the thread of the processor. */
+struct ReadbackBuffer
+{
+  GLuint pbo;
+  size_t index;           ///< Index into ReadbackState::in_use.
+  size_t size;            ///< Allocated bytes of #pbo.
+  unsigned char *mapped;  ///< Mapping of #pbo for a frame, or 0.
+  size_t width, height, bytes_per_pixel;
+  Frame::Format format;
+
+  ReadbackBuffer() : pbo(0), index(0), size(0), mapped(0), width(0), height(0), bytes_per_pixel(0), format(Frame::Invalid) {}
+};
+
+/** Outputs of a packet on their way back to the host. */
+struct ReadbackSlot
+{
+  ReadbackBuffer ir, depth;
+  bool has_ir, has_depth;
+  GLsync fence;           ///< Signaled when the readback is done, 0 while the slot is not pending.
+  uint32_t timestamp, sequence;
+
+  ReadbackSlot() : has_ir(false), has_depth(false), fence(0), timestamp(0), sequence(0) {}
+};
+
+/** Texture an output is copied into for an OpenGLTextureFrame, only used on the thread of the processor. */
+struct OutputTexture
+{
+  GLuint texture;
+  size_t index;           ///< Index into ReadbackState::in_use.
+  bool in_use;            ///< Whether a frame over #texture was delivered, updated by #reclaimOutputTextures.
+  size_t width, height, bytes_per_pixel;
+  GLenum internal_format; ///< Format #texture is allocated with, 0 before the first copy.
+  Frame::Format format;
+
+  OutputTexture() : texture(0), index(0), in_use(false), width(0), height(0), bytes_per_pixel(0), internal_format(0), format(Frame::Invalid) {}
+};
+
+/** Output textures of a packet, see Config::EnableOpenGLTextureOutput. */
+struct TextureSlot
+{
+  OutputTexture ir, depth;
+  bool has_ir, has_depth;
+  GLsync fence;           ///< Signaled when the copies into the textures are done, 0 before the first packet.
+
+  TextureSlot() : has_ir(false), has_depth(false), fence(0) {}
 };
 
 struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPerfLogging
 {
   GLFWwindow *opengl_context_ptr;
   libfreenect2::DepthPacketProcessor::Config config;
+  DepthPassRois rois;
 
   GLuint square_vbo, square_vao, stage1_framebuffer, filter1_framebuffer, stage2_framebuffer, filter2_framebuffer;
+  GLuint binned_square_vbo, binned_square_vao, bin_framebuffer;
+  GLuint debug_square_vbo, debug_square_vao; ///< Square with the texture upside down, showing the output lines top down.
   Texture<S16C1> lut11to16;
   Texture<U16C1> p0table[3];
   Texture<F32C1> x_table, z_table;
+  Texture<F32C1> x_table_binned, z_table_binned; ///< Tables averaged over 2x2 blocks for binned output, see #binTables.
 
   Texture<U16C1> input_data;
 
   Texture<F32C4> stage1_debug;
   Texture<F32C4> stage1_data[3];
   Texture<F32C1> stage1_infrared;
+  Texture<U16C1> stage1_infrared_uint16;
+
+  Texture<F32C4> bin_data[3];
+  Texture<F32C1> bin_infrared;
+  Texture<U16C1> bin_infrared_uint16;
+  Texture<F32C4> bin_debug;
 
   Texture<F32C4> filter1_data[2];
   Texture<U8C1> filter1_max_edge_test;
@@ -420,18 +762,31 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
   Texture<F32C4> stage2_debug;
 
   Texture<F32C1> stage2_depth;
+  Texture<U16C1> stage2_depth_uint16;
   Texture<F32C2> stage2_depth_and_ir_sum;
 
   Texture<F32C4> filter2_debug;
   Texture<F32C1> filter2_depth;
+  Texture<U16C1> filter2_depth_uint16;
 
-  ShaderProgram stage1, filter1, stage2, filter2, debug;
+  ShaderProgram stage1, bin, filter1, stage2, filter2, debug;
 
   DepthPacketProcessor::Parameters params;
   bool params_need_update;
+  bool draw_buffers_need_update; ///< Whether the output format changed, see #updateDrawBuffers.
+  bool programs_built;           ///< Whether #buildPrograms ran.
 
   bool do_debug;
 
+  std::vector<ReadbackSlot> readback_slots;
+  std::deque<size_t> pending_readbacks;  ///< Slots waiting for their fence, oldest first.
+  ReadbackState *readback_state;
+  ReadbackSlot *readback_slot;           ///< Slot run() reads the outputs into, or 0 for new frames.
+  bool readback_checked;                 ///< Whether the missing GL_ARB_sync was reported.
+
+  std::vector<TextureSlot> texture_slots;
+  TextureSlot *texture_slot;             ///< Slot run() copies the outputs into, or 0 to read them back.
+
   struct Vertex
   {
     float x, y;
@@ -440,19 +795,61 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
 
   OpenGLDepthPacketProcessorImpl(GLFWwindow *new_opengl_context_ptr, bool debug) :
     opengl_context_ptr(new_opengl_context_ptr),
+    rois(config),
     square_vao(0),
     square_vbo(0),
+    binned_square_vbo(0),
+    binned_square_vao(0),
+    debug_square_vbo(0),
+    debug_square_vao(0),
+    bin_framebuffer(0),
     stage1_framebuffer(0),
     filter1_framebuffer(0),
     stage2_framebuffer(0),
     filter2_framebuffer(0),
     params_need_update(true),
-    do_debug(debug)
+    draw_buffers_need_update(true),
+    programs_built(false),
+    do_debug(debug),
+    readback_state(new ReadbackState()),
+    readback_slot(0),
+    readback_checked(false),
+    texture_slot(0)
   {
   }
 
   virtual ~OpenGLDepthPacketProcessorImpl()
   {
+    if(gl() != 0)
+    {
+      ChangeCurrentOpenGLContext ctx(opengl_context_ptr);
+      dropReadbacks();
+
+      // frames still alive may be deleted meanwhile on other threads, which must not touch the context
+      libfreenect2::lock_guard l(readback_state->mutex);
+
+      for(size_t i = 0; i < readback_slots.size(); ++i)
+      {
+        releaseReadbackBuffer(readback_slots[i].ir);
+        releaseReadbackBuffer(readback_slots[i].depth);
+      }
+      readback_slots.clear();
+
+      bool outlived = false;
+      for(size_t i = 0; i < texture_slots.size(); ++i)
+      {
+        outlived = outlived || readback_state->in_use[texture_slots[i].ir.index] || readback_state->in_use[texture_slots[i].depth.index];
+        deleteTextureSlot(texture_slots[i]);
+      }
+      texture_slots.clear();
+
+      if(outlived)
+      {
+        LOG_ERROR << "texture frames outlive the OpenGL processor, their textures are gone";
+      }
+    }
+    readback_state->release();
+
     if(gl() != 0)
     {
       delete gl();
@@ -470,6 +867,8 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
     p0table[2].gl(b);
     x_table.gl(b);
     z_table.gl(b);
+    x_table_binned.gl(b);
+    z_table_binned.gl(b);
 
     input_data.gl(b);
 
@@ -478,6 +877,14 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
     stage1_data[1].gl(b);
     stage1_data[2].gl(b);
     stage1_infrared.gl(b);
+    stage1_infrared_uint16.gl(b);
+
+    bin_data[0].gl(b);
+    bin_data[1].gl(b);
+    bin_data[2].gl(b);
+    bin_infrared.gl(b);
+    bin_infrared_uint16.gl(b);
+    bin_debug.gl(b);
 
     filter1_data[0].gl(b);
     filter1_data[1].gl(b);
@@ -487,12 +894,15 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
     stage2_debug.gl(b);
 
     stage2_depth.gl(b);
+    stage2_depth_uint16.gl(b);
     stage2_depth_and_ir_sum.gl(b);
 
     filter2_debug.gl(b);
     filter2_depth.gl(b);
+    filter2_depth_uint16.gl(b);
  
     stage1.gl(b);
+    bin.gl(b);
     filter1.gl(b);
     stage2.gl(b);
     filter2.gl(b);
@@ -540,6 +950,14 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
 
     if(do_debug) stage1_debug.allocate(512, 424);
     stage1_infrared.allocate(512, 424);
+    stage1_infrared_uint16.allocate(512, 424);
+
+    for(int i = 0; i < 3; ++i)
+      bin_data[i].allocate(256, 212);
+
+    if(do_debug) bin_debug.allocate(256, 212);
+    bin_infrared.allocate(256, 212);
+    bin_infrared_uint16.allocate(256, 212);
 
     for(int i = 0; i < 2; ++i)
       filter1_data[i].allocate(512, 424);
@@ -549,10 +967,80 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
 
     if(do_debug) stage2_debug.allocate(512, 424);
     stage2_depth.allocate(512, 424);
+    stage2_depth_uint16.allocate(512, 424);
     stage2_depth_and_ir_sum.allocate(512, 424);
 
     if(do_debug) filter2_debug.allocate(512, 424);
     filter2_depth.allocate(512, 424);
+    filter2_depth_uint16.allocate(512, 424);
+
+    gl()->glGenFramebuffers(1, &stage1_framebuffer);
+    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, stage1_framebuffer);
+
+    if(do_debug) gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, stage1_debug.texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_RECTANGLE, stage1_data[0].texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_RECTANGLE, stage1_data[1].texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_RECTANGLE, stage1_data[2].texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_RECTANGLE, stage1_infrared.texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT5, GL_TEXTURE_RECTANGLE, stage1_infrared_uint16.texture, 0);
+
+    gl()->glGenFramebuffers(1, &bin_framebuffer);
+    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, bin_framebuffer);
+
+    if(do_debug) gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, bin_debug.texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_RECTANGLE, bin_data[0].texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_RECTANGLE, bin_data[1].texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_RECTANGLE, bin_data[2].texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_RECTANGLE, bin_infrared.texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT5, GL_TEXTURE_RECTANGLE, bin_infrared_uint16.texture, 0);
+
+    gl()->glGenFramebuffers(1, &filter1_framebuffer);
+    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, filter1_framebuffer);
+
+    if(do_debug) gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, filter1_debug.texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_RECTANGLE, filter1_data[0].texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_RECTANGLE, filter1_data[1].texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_RECTANGLE, filter1_max_edge_test.texture, 0);
+
+    gl()->glGenFramebuffers(1, &stage2_framebuffer);
+    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, stage2_framebuffer);
+
+    if(do_debug) gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, stage2_debug.texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_RECTANGLE, stage2_depth.texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_RECTANGLE, stage2_depth_and_ir_sum.texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_RECTANGLE, stage2_depth_uint16.texture, 0);
+
+    gl()->glGenFramebuffers(1, &filter2_framebuffer);
+    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, filter2_framebuffer);
+
+    if(do_debug) gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, filter2_debug.texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_RECTANGLE, filter2_depth.texture, 0);
+    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_RECTANGLE, filter2_depth_uint16.texture, 0);
+
+    // the draw buffers are part of the completeness check
+    updateDrawBuffers();
+
+    const GLuint framebuffers[] = { stage1_framebuffer, bin_framebuffer, filter1_framebuffer, stage2_framebuffer, filter2_framebuffer };
+    for(int i = 0; i < 5; ++i)
+    {
+      gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[i]);
+      checkFBO(GL_DRAW_FRAMEBUFFER);
+    }
+
+  }
+
+  /**
+   * Build the shader programs and the squares they draw, on the first packet so that
+   * Config::EnableProgramCache applies.
+   */
+  void buildPrograms()
+  {
+    const std::string cache_dir = config.EnableProgramCache ? getCacheDirectory() : std::string();
+
+    if(!cache_dir.empty() && !FLEXT_ARB_get_program_binary)
+    {
+      LOG_INFO << "GL_ARB_get_program_binary not supported, compiling OpenGL programs without cache";
+    }
 
     stage1.setVertexShader(loadShaderSource("default.vs"));
     stage1.setFragmentShader(loadShaderSource("stage1.fs"));
@@ -561,7 +1049,18 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
     stage1.bindFragDataLocation("B", 2);
     stage1.bindFragDataLocation("Norm", 3);
     stage1.bindFragDataLocation("Infrared", 4);
-    stage1.build();
+    stage1.bindFragDataLocation("InfraredUInt16", 5);
+    stage1.build(cache_dir);
+
+    bin.setVertexShader(loadShaderSource("default.vs"));
+    bin.setFragmentShader(loadShaderSource("bin.fs"));
+    bin.bindFragDataLocation("Debug", 0);
+    bin.bindFragDataLocation("BinnedA", 1);
+    bin.bindFragDataLocation("BinnedB", 2);
+    bin.bindFragDataLocation("BinnedNorm", 3);
+    bin.bindFragDataLocation("BinnedInfrared", 4);
+    bin.bindFragDataLocation("BinnedInfraredUInt16", 5);
+    bin.build(cache_dir);
 
     filter1.setVertexShader(loadShaderSource("default.vs"));
     filter1.setFragmentShader(loadShaderSource("filter1.fs"));
@@ -569,86 +1068,91 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
     filter1.bindFragDataLocation("FilterA", 1);
     filter1.bindFragDataLocation("FilterB", 2);
     filter1.bindFragDataLocation("MaxEdgeTest", 3);
-    filter1.build();
+    filter1.build(cache_dir);
 
     stage2.setVertexShader(loadShaderSource("default.vs"));
     stage2.setFragmentShader(loadShaderSource("stage2.fs"));
     stage2.bindFragDataLocation("Debug", 0);
     stage2.bindFragDataLocation("Depth", 1);
     stage2.bindFragDataLocation("DepthAndIrSum", 2);
-    stage2.build();
+    stage2.bindFragDataLocation("DepthUInt16", 3);
+    stage2.build(cache_dir);
 
     filter2.setVertexShader(loadShaderSource("default.vs"));
     filter2.setFragmentShader(loadShaderSource("filter2.fs"));
     filter2.bindFragDataLocation("Debug", 0);
     filter2.bindFragDataLocation("FilterDepth", 1);
-    filter2.build();
+    filter2.bindFragDataLocation("FilterDepthUInt16", 2);
+    filter2.build(cache_dir);
 
     if(do_debug)
     {
       debug.setVertexShader(loadShaderSource("default.vs"));
       debug.setFragmentShader(loadShaderSource("debug.fs"));
       debug.bindFragDataLocation("Debug", 0);
-      debug.build();
+      debug.build(cache_dir);
     }
 
-    GLenum debug_attachment = do_debug ? GL_COLOR_ATTACHMENT0 : GL_NONE;
-
-    gl()->glGenFramebuffers(1, &stage1_framebuffer);
-    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, stage1_framebuffer);
+    createSquare(512.0f, 424.0f, false, square_vao, square_vbo);
+    createSquare(256.0f, 212.0f, false, binned_square_vao, binned_square_vbo);
+    if(do_debug) createSquare(512.0f, 424.0f, true, debug_square_vao, debug_square_vbo);
+    CHECKGL();
 
-    const GLenum stage1_buffers[] = { debug_attachment, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4 };
-    gl()->glDrawBuffers(5, stage1_buffers);
+    programs_built = true;
+  }
 
-    if(do_debug) gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, stage1_debug.texture, 0);
-    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_RECTANGLE, stage1_data[0].texture, 0);
-    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_RECTANGLE, stage1_data[1].texture, 0);
-    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_RECTANGLE, stage1_data[2].texture, 0);
-    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_RECTANGLE, stage1_infrared.texture, 0);
-    checkFBO(GL_DRAW_FRAMEBUFFER);
+  /**
+   * Select the output textures the passes draw into: the depth goes either to the float or to the
+   * 16 bit integer textures, the float IR is always drawn because binning and the filters read it.
+   */
+  void updateDrawBuffers()
+  {
+    const GLenum debug_attachment = do_debug ? GL_COLOR_ATTACHMENT0 : GL_NONE;
+    const bool uint16 = config.EnableUInt16Output;
+    const GLenum float_attachment = uint16 ? GL_NONE : GL_COLOR_ATTACHMENT1;
 
-    gl()->glGenFramebuffers(1, &filter1_framebuffer);
-    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, filter1_framebuffer);
+    const GLenum stage1_buffers[] = { debug_attachment, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4, uint16 ? GL_COLOR_ATTACHMENT5 : GL_NONE };
+    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, stage1_framebuffer);
+    gl()->glDrawBuffers(6, stage1_buffers);
+    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, bin_framebuffer);
+    gl()->glDrawBuffers(6, stage1_buffers);
 
     const GLenum filter1_buffers[] = { debug_attachment, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3 };
+    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, filter1_framebuffer);
     gl()->glDrawBuffers(4, filter1_buffers);
 
-    if(do_debug) gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, filter1_debug.texture, 0);
-    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_RECTANGLE, filter1_data[0].texture, 0);
-    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_RECTANGLE, filter1_data[1].texture, 0);
-    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_RECTANGLE, filter1_max_edge_test.texture, 0);
-    checkFBO(GL_DRAW_FRAMEBUFFER);
-
-    gl()->glGenFramebuffers(1, &stage2_framebuffer);
+    const GLenum stage2_buffers[] = { debug_attachment, float_attachment, GL_COLOR_ATTACHMENT2, uint16 ? GL_COLOR_ATTACHMENT3 : GL_NONE };
     gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, stage2_framebuffer);
+    gl()->glDrawBuffers(4, stage2_buffers);
 
-    const GLenum stage2_buffers[] = { debug_attachment, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
-    gl()->glDrawBuffers(3, stage2_buffers);
-
-    if(do_debug) gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, stage2_debug.texture, 0);
-    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_RECTANGLE, stage2_depth.texture, 0);
-    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_RECTANGLE, stage2_depth_and_ir_sum.texture, 0);
-    checkFBO(GL_DRAW_FRAMEBUFFER);
-
-    gl()->glGenFramebuffers(1, &filter2_framebuffer);
+    const GLenum filter2_buffers[] = { debug_attachment, float_attachment, uint16 ? GL_COLOR_ATTACHMENT2 : GL_NONE };
     gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, filter2_framebuffer);
+    gl()->glDrawBuffers(3, filter2_buffers);
+    CHECKGL();
 
-    const GLenum filter2_buffers[] = { debug_attachment, GL_COLOR_ATTACHMENT1 };
-    gl()->glDrawBuffers(2, filter2_buffers);
-
-    if(do_debug) gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, filter2_debug.texture, 0);
-    gl()->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_RECTANGLE, filter2_depth.texture, 0);
-    checkFBO(GL_DRAW_FRAMEBUFFER);
+    draw_buffers_need_update = false;
+  }
 
-    Vertex bl = {-1.0f, -1.0f, 0.0f, 0.0f }, br = { 1.0f, -1.0f, 512.0f, 0.0f }, tl = {-1.0f, 1.0f, 0.0f, 424.0f }, tr = { 1.0f, 1.0f, 512.0f, 424.0f };
+  /**
+   * Create the vertex array of a viewport filling square.
+   * @param width Texture coordinate of the right edge.
+   * @param height Texture coordinate of the top edge.
+   * @param flip_y Whether the texture coordinates run from the top edge down instead.
+   * @param [out] vao Vertex array.
+   * @param [out] vbo Vertex buffer.
+   */
+  void createSquare(float width, float height, bool flip_y, GLuint &vao, GLuint &vbo)
+  {
+    const float bottom = flip_y ? height : 0.0f, top = flip_y ? 0.0f : height;
+    Vertex bl = {-1.0f, -1.0f, 0.0f, bottom }, br = { 1.0f, -1.0f, width, bottom }, tl = {-1.0f, 1.0f, 0.0f, top }, tr = { 1.0f, 1.0f, width, top };
     Vertex vertices[] = {
         bl, tl, tr, tr, br, bl
     };
-    gl()->glGenBuffers(1, &square_vbo);
-    gl()->glGenVertexArrays(1, &square_vao);
+    gl()->glGenBuffers(1, &vbo);
+    gl()->glGenVertexArrays(1, &vao);
 
-    gl()->glBindVertexArray(square_vao);
-    gl()->glBindBuffer(GL_ARRAY_BUFFER, square_vbo);
+    gl()->glBindVertexArray(vao);
+    gl()->glBindBuffer(GL_ARRAY_BUFFER, vbo);
     gl()->glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 
     GLint position_attr = stage1.getAttributeLocation("InputPosition");
@@ -661,33 +1165,599 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
     CHECKGL();
   }
 
-  void deinitialize()
+  /**
+   * Average the x and z tables over 2x2 blocks, counting only the pixels with a valid (positive) z multiplier.
+   * Does nothing until both tables are loaded.
+   */
+  void binTables()
   {
-  }
+    if(x_table.data == 0 || z_table.data == 0) return;
 
-  void updateShaderParametersForProgram(ShaderProgram &program)
-  {
-    if(!params_need_update) return;
+    x_table_binned.allocate(256, 212);
+    z_table_binned.allocate(256, 212);
 
-    program.setUniform("Params.ab_multiplier", params.ab_multiplier);
-    program.setUniformVector3("Params.ab_multiplier_per_frq", params.ab_multiplier_per_frq);
-    program.setUniform("Params.ab_output_multiplier", params.ab_output_multiplier);
+    const float *x_in = reinterpret_cast<const float *>(x_table.data), *z_in = reinterpret_cast<const float *>(z_table.data);
+    float *x_out = reinterpret_cast<float *>(x_table_binned.data), *z_out = reinterpret_cast<float *>(z_table_binned.data);
 
-    program.setUniformVector3("Params.phase_in_rad", params.phase_in_rad);
+    for(int y = 0; y < 212; ++y)
+      for(int x = 0; x < 256; ++x)
+      {
+        float x_sum = 0.0f, z_sum = 0.0f;
+        int n = 0;
 
-    program.setUniform("Params.joint_bilateral_ab_threshold", params.joint_bilateral_ab_threshold);
-    program.setUniform("Params.joint_bilateral_max_edge", params.joint_bilateral_max_edge);
-    program.setUniform("Params.joint_bilateral_exp", params.joint_bilateral_exp);
-    program.setUniformMatrix3("Params.gaussian_kernel", params.gaussian_kernel);
+        for(int i = 0; i < 4; ++i)
+        {
+          const int offset = (2 * y + i / 2) * 512 + 2 * x + i % 2;
+
+          if(0.0f < z_in[offset])
+          {
+            x_sum += x_in[offset];
+            z_sum += z_in[offset];
+            ++n;
+          }
+        }
 
-    program.setUniform("Params.phase_offset", params.phase_offset);
-    program.setUniform("Params.unambigious_dist", params.unambigious_dist);
-    program.setUniform("Params.individual_ab_threshold", params.individual_ab_threshold);
-    program.setUniform("Params.ab_threshold", params.ab_threshold);
-    program.setUniform("Params.ab_confidence_slope", params.ab_confidence_slope);
-    program.setUniform("Params.ab_confidence_offset", params.ab_confidence_offset);
-    program.setUniform("Params.min_dealias_confidence", params.min_dealias_confidence);
-    program.setUniform("Params.max_dealias_confidence", params.max_dealias_confidence);
+        x_out[y * 256 + x] = n != 0 ? x_sum / n : 0.0f;
+        z_out[y * 256 + x] = n != 0 ? z_sum / n : 0.0f;
+      }
+
+    x_table_binned.upload();
+    z_table_binned.upload();
+  }
+
+  /**
+   * Read back the output of a pass from the bound read framebuffer.
+   * Binned output fills the lower left corner of the texture.
+   * @param texture Output texture.
+   */
+  template<typename FormatT>
+  Frame *downloadOutput(Texture<FormatT> &texture)
+  {
+    return config.EnableBinnedOutput ? texture.downloadCornerToNewFrame(256, 212) : texture.downloadToNewFrame();
+  }
+
+  /**
+   * Clear an output of the bound framebuffer outside the region of interest, where its pass did not draw.
+   * The whole output is read back then, with no clearing on the host.
+   * @param attachment Attachment of the output, which is also the index of its draw buffer.
+   * @param integer Whether the output is a 16 bit integer texture.
+   */
+  void clearOutsideRoi(GLenum attachment, bool integer)
+  {
+    const DepthRoi &roi = rois.filter2;
+    if(config.EnableBinnedOutput || roi.isFullFrame()) return;
+
+    const GLint draw_buffer = attachment - GL_COLOR_ATTACHMENT0;
+    const GLfloat zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    const GLuint zero_uint[4] = { 0, 0, 0, 0 };
+
+    // the lines above and below the region, then the columns left and right of it
+    const int bands[4][4] = {
+      { 0, 0, 512, roi.y_begin },
+      { 0, roi.y_end, 512, 424 - roi.y_end },
+      { 0, roi.y_begin, roi.x_begin, roi.height() },
+      { roi.x_end, roi.y_begin, 512 - roi.x_end, roi.height() }
+    };
+
+    for(int i = 0; i < 4; ++i)
+    {
+      if(bands[i][2] <= 0 || bands[i][3] <= 0) continue;
+
+      glScissor(bands[i][0], bands[i][1], bands[i][2], bands[i][3]);
+      if(integer)
+        gl()->glClearBufferuiv(GL_COLOR, draw_buffer, zero_uint);
+      else
+        gl()->glClearBufferfv(GL_COLOR, draw_buffer, zero);
+    }
+    CHECKGL();
+  }
+
+  /**
+   * Start reading back the output of a pass from the bound read framebuffer into a pixel buffer, like #downloadOutput.
+   * @param texture Output texture.
+   * @param buffer Pixel buffer, mapped by #mapReadbackBuffer once the fence after the readback is signaled.
+   * @param format Encoding of the pixels.
+   */
+  template<typename FormatT>
+  void readbackOutput(Texture<FormatT> &texture, ReadbackBuffer &buffer, Frame::Format format)
+  {
+    const bool binned = config.EnableBinnedOutput;
+
+    buffer.width = binned ? 256 : 512;
+    buffer.height = binned ? 212 : 424;
+    buffer.bytes_per_pixel = FormatT::BytesPerPixel;
+    buffer.format = format;
+
+    const size_t size = buffer.width * buffer.height * buffer.bytes_per_pixel;
+
+    gl()->glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.pbo);
+    if(buffer.size != size)
+    {
+      gl()->glBufferData(GL_PIXEL_PACK_BUFFER, size, 0, GL_STREAM_READ);
+      buffer.size = size;
+    }
+
+    // with a pixel pack buffer bound the pointers are offsets into it
+    if(binned)
+      texture.downloadCornerToBuffer(256, 212, 0);
+    else
+      texture.downloadToBuffer(0);
+
+    gl()->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    CHECKGL();
+  }
+
+  /**
+   * Copy the output of a pass from the bound read framebuffer into a texture of its own, see #TextureSlot.
+   * The copy stays on the GPU, the texture is (re)allocated when the size or the format of the output changed.
+   * @param output Texture to copy into.
+   * @param format Encoding of the pixels.
+   */
+  template<typename FormatT>
+  void copyOutput(OutputTexture &output, Frame::Format format)
+  {
+    const bool binned = config.EnableBinnedOutput;
+    const size_t width = binned ? 256 : 512;
+    const size_t height = binned ? 212 : 424;
+
+    if(output.texture == 0)
+    {
+      glGenTextures(1, &output.texture);
+    }
+
+    gl()->glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_RECTANGLE, output.texture);
+
+    if(output.width != width || output.height != height || output.internal_format != FormatT::InternalFormat)
+    {
+      glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+      glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+      glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexImage2D(GL_TEXTURE_RECTANGLE, 0, FormatT::InternalFormat, width, height, 0, FormatT::Format, FormatT::Type, 0);
+
+      output.width = width;
+      output.height = height;
+      output.internal_format = FormatT::InternalFormat;
+    }
+    output.bytes_per_pixel = FormatT::BytesPerPixel;
+    output.format = format;
+
+    // the passes drawing into a smaller viewport fill the lower left corner
+    glCopyTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, 0, 0, 0, width, height);
+    CHECKGL();
+  }
+
+  /**
+   * Read back an output from the bound framebuffer, in the configured format.
+   * @param texture Float output texture.
+   * @param attachment Attachment of \a texture.
+   * @param texture_uint16 16 bit integer output texture.
+   * @param attachment_uint16 Attachment of \a texture_uint16.
+   * @param buffer Pixel buffer to read into, or 0.
+   * @param output Texture to copy into instead of reading back, or 0.
+   * @return New frame, 0 when reading into \a buffer or copying into \a output.
+   */
+  Frame *downloadOutput(Texture<F32C1> &texture, GLenum attachment, Texture<U16C1> &texture_uint16, GLenum attachment_uint16, ReadbackBuffer *buffer, OutputTexture *output)
+  {
+    Frame *frame = 0;
+
+    if(config.EnableUInt16Output)
+    {
+      clearOutsideRoi(attachment_uint16, true);
+      glReadBuffer(attachment_uint16);
+      if(output != 0)
+      {
+        copyOutput<U16C1>(*output, Frame::UInt16);
+      }
+      else if(buffer != 0)
+      {
+        readbackOutput(texture_uint16, *buffer, Frame::UInt16);
+      }
+      else
+      {
+        frame = downloadOutput(texture_uint16);
+        frame->format = Frame::UInt16;
+      }
+    }
+    else
+    {
+      clearOutsideRoi(attachment, false);
+      glReadBuffer(attachment);
+      if(output != 0)
+      {
+        copyOutput<F32C1>(*output, Frame::Float);
+      }
+      else if(buffer != 0)
+      {
+        readbackOutput(texture, *buffer, Frame::Float);
+      }
+      else
+      {
+        frame = downloadOutput(texture);
+        frame->format = Frame::Float;
+      }
+    }
+
+    return frame;
+  }
+
+  /** Whether neither a pending readback nor a frame uses the slot. */
+  static bool isReadbackSlotFree(const ReadbackSlot &slot)
+  {
+    return slot.fence == 0 && slot.ir.mapped == 0 && slot.depth.mapped == 0;
+  }
+
+  void unmapReadbackBuffer(ReadbackBuffer &buffer)
+  {
+    gl()->glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.pbo);
+    gl()->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    gl()->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    buffer.mapped = 0;
+    CHECKGL();
+  }
+
+  void deleteReadbackSlot(ReadbackSlot &slot)
+  {
+    if(slot.fence != 0) gl()->glDeleteSync(slot.fence);
+    if(slot.ir.mapped != 0) unmapReadbackBuffer(slot.ir);
+    if(slot.depth.mapped != 0) unmapReadbackBuffer(slot.depth);
+    gl()->glDeleteBuffers(1, &slot.ir.pbo);
+    gl()->glDeleteBuffers(1, &slot.depth.pbo);
+    CHECKGL();
+  }
+
+  /**
+   * Delete a pixel buffer when the processor is deleted, after a frame still mapping it copied its pixels out.
+   * Called with the lock of #readback_state held.
+   */
+  void releaseReadbackBuffer(ReadbackBuffer &buffer)
+  {
+    if(buffer.mapped != 0 && readback_state->in_use[buffer.index])
+    {
+      readback_state->frames[buffer.index]->detach();
+    }
+
+    // deleting a mapped buffer unmaps it
+    gl()->glDeleteBuffers(1, &buffer.pbo);
+    CHECKGL();
+  }
+
+  /**
+   * Grow or shrink the ring of readback slots.
+   * Slots at the end that are still in use are kept until a later call, see #isReadbackSlotFree.
+   * @param n Number of slots.
+   */
+  void resizeReadbackSlots(size_t n)
+  {
+    while(readback_slots.size() > n && isReadbackSlotFree(readback_slots.back()))
+    {
+      deleteReadbackSlot(readback_slots.back());
+      readback_slots.pop_back();
+    }
+
+    while(readback_slots.size() < n)
+    {
+      const size_t i = readback_slots.size();
+      readback_slots.push_back(ReadbackSlot());
+
+      ReadbackSlot &slot = readback_slots.back();
+      gl()->glGenBuffers(1, &slot.ir.pbo);
+      gl()->glGenBuffers(1, &slot.depth.pbo);
+      slot.ir.index = 2 * i;
+      slot.depth.index = 2 * i + 1;
+      CHECKGL();
+    }
+  }
+
+  /** Unmap the buffers whose frames were deleted. */
+  void reclaimReadbackBuffers()
+  {
+    bool in_use[NumReadbackTargets];
+    {
+      libfreenect2::lock_guard l(readback_state->mutex);
+      std::copy(readback_state->in_use, readback_state->in_use + NumReadbackTargets, in_use);
+    }
+
+    for(size_t i = 0; i < readback_slots.size(); ++i)
+    {
+      ReadbackSlot &slot = readback_slots[i];
+      if(slot.ir.mapped != 0 && !in_use[slot.ir.index]) unmapReadbackBuffer(slot.ir);
+      if(slot.depth.mapped != 0 && !in_use[slot.depth.index]) unmapReadbackBuffer(slot.depth);
+    }
+  }
+
+  /** Forget the pending readbacks without delivering their frames. */
+  void dropReadbacks()
+  {
+    for(size_t i = 0; i < pending_readbacks.size(); ++i)
+    {
+      ReadbackSlot &slot = readback_slots[pending_readbacks[i]];
+      gl()->glDeleteSync(slot.fence);
+      slot.fence = 0;
+    }
+    pending_readbacks.clear();
+  }
+
+  /**
+   * Map a buffer whose readback is done and wrap it in a frame.
+   * @return New frame, or 0 if mapping failed.
+   */
+  Frame *mapReadbackBuffer(ReadbackBuffer &buffer)
+  {
+    gl()->glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.pbo);
+    buffer.mapped = static_cast<unsigned char *>(gl()->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, buffer.size, GL_MAP_READ_BIT | GL_MAP_WRITE_BIT));
+    gl()->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    CHECKGL();
+
+    if(buffer.mapped == 0)
+    {
+      LOG_ERROR << "failed to map readback buffer";
+      return 0;
+    }
+
+    libfreenect2::lock_guard l(readback_state->mutex);
+    readback_state->in_use[buffer.index] = true;
+    ++readback_state->references;
+
+    OpenGLReadbackFrame *frame = new OpenGLReadbackFrame(buffer.width, buffer.height, buffer.bytes_per_pixel, buffer.format, buffer.mapped, readback_state, buffer.index);
+    readback_state->frames[buffer.index] = frame;
+    return frame;
+  }
+
+  void deliverReadback(ReadbackBuffer &buffer, Frame::Type type, const ReadbackSlot &slot, FrameListener *listener)
+  {
+    if(listener == 0) return;
+
+    Frame *frame = mapReadbackBuffer(buffer);
+    if(frame == 0) return;
+
+    frame->timestamp = slot.timestamp;
+    frame->sequence = slot.sequence;
+
+    if(!listener->onNewFrame(type, frame))
+    {
+      delete frame;
+    }
+  }
+
+  /**
+   * Deliver the frames of all pending readbacks, before the configuration changes or the processor is deleted.
+   * @param listener Listener, or 0 to drop the frames.
+   */
+  void flushReadbacks(FrameListener *listener)
+  {
+    if(pending_readbacks.empty()) return;
+
+    ChangeCurrentOpenGLContext ctx(opengl_context_ptr);
+    deliverReadbacks(0, listener);
+  }
+
+  /**
+   * Wait for the oldest pending readbacks and hand their frames to the listener.
+   * @param keep Number of the newest readbacks left pending.
+   * @param listener Listener, or 0 to drop the frames.
+   */
+  void deliverReadbacks(size_t keep, FrameListener *listener)
+  {
+    while(pending_readbacks.size() > keep)
+    {
+      ReadbackSlot &slot = readback_slots[pending_readbacks.front()];
+      pending_readbacks.pop_front();
+
+      GLenum status = GL_TIMEOUT_EXPIRED;
+      while(status == GL_TIMEOUT_EXPIRED)
+      {
+        status = gl()->glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000ull);
+      }
+      if(status == GL_WAIT_FAILED)
+      {
+        LOG_ERROR << "waiting for readback failed";
+      }
+      gl()->glDeleteSync(slot.fence);
+      slot.fence = 0;
+
+      if(slot.has_ir) deliverReadback(slot.ir, Frame::Ir, slot, listener);
+      if(slot.has_depth) deliverReadback(slot.depth, Frame::Depth, slot, listener);
+    }
+  }
+
+  ReadbackSlot *findFreeReadbackSlot(size_t n)
+  {
+    for(size_t i = 0; i < n && i < readback_slots.size(); ++i)
+    {
+      if(isReadbackSlotFree(readback_slots[i])) return &readback_slots[i];
+    }
+    return 0;
+  }
+
+  /**
+   * Pick the slot to read the outputs of the next packet into, see Config::NumOpenGLReadbackBuffers.
+   * @param listener Listener of the frames of pending readbacks delivered meanwhile.
+   * @return Free slot, or 0 to read back into new frames.
+   */
+  ReadbackSlot *beginReadback(FrameListener *listener)
+  {
+    size_t n = std::min<size_t>(std::max(config.NumOpenGLReadbackBuffers, 0), MaxReadbackSlots);
+
+    if(n > 0 && !FLEXT_ARB_sync)
+    {
+      if(!readback_checked) LOG_WARNING << "GL_ARB_sync not supported, reading back without pixel buffers";
+      readback_checked = true;
+      n = 0;
+    }
+
+    reclaimReadbackBuffers();
+    resizeReadbackSlots(n);
+
+    ReadbackSlot *slot = findFreeReadbackSlot(n);
+
+    if(slot == 0)
+    {
+      // frames of new frame readbacks come after the pending ones
+      deliverReadbacks(0, listener);
+      reclaimReadbackBuffers();
+      slot = findFreeReadbackSlot(n);
+
+      if(slot == 0 && n > 0)
+      {
+        LOG_DEBUG << "all readback buffers are held by frames, reading back with a copy";
+      }
+    }
+
+    return slot;
+  }
+
+  /**
+   * Fence the readbacks into a slot and deliver the frames of the earlier ones.
+   * With one slot the frames are delivered right away, with more the newest readback stays pending.
+   */
+  void endReadback(ReadbackSlot &slot, uint32_t timestamp, uint32_t sequence, FrameListener *listener)
+  {
+    slot.fence = gl()->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.timestamp = timestamp;
+    slot.sequence = sequence;
+    glFlush();
+    CHECKGL();
+
+    pending_readbacks.push_back(&slot - &readback_slots[0]);
+    deliverReadbacks(config.NumOpenGLReadbackBuffers >= 2 ? 1 : 0, listener);
+  }
+
+  /** Mark the output textures whose frames were deleted as free. */
+  void reclaimOutputTextures()
+  {
+    libfreenect2::lock_guard l(readback_state->mutex);
+
+    for(size_t i = 0; i < texture_slots.size(); ++i)
+    {
+      TextureSlot &slot = texture_slots[i];
+      slot.ir.in_use = readback_state->in_use[slot.ir.index];
+      slot.depth.in_use = readback_state->in_use[slot.depth.index];
+    }
+  }
+
+  void deleteTextureSlot(TextureSlot &slot)
+  {
+    if(slot.fence != 0) gl()->glDeleteSync(slot.fence);
+    if(slot.ir.texture != 0) glDeleteTextures(1, &slot.ir.texture);
+    if(slot.depth.texture != 0) glDeleteTextures(1, &slot.depth.texture);
+    CHECKGL();
+  }
+
+  /**
+   * Pick the textures to copy the outputs of the next packet into, see Config::EnableOpenGLTextureOutput.
+   * @param listener Listener of the frames of pending readbacks, which are delivered first.
+   * @return Slot none of whose textures is held by a frame, or 0 to read the outputs back.
+   */
+  TextureSlot *beginTextureOutput(FrameListener *listener)
+  {
+    if(!config.EnableOpenGLTextureOutput) return 0;
+
+    if(!FLEXT_ARB_sync)
+    {
+      if(!readback_checked) LOG_WARNING << "GL_ARB_sync not supported, reading back into host memory";
+      readback_checked = true;
+      return 0;
+    }
+
+    // frames read back before the mode was switched on come first
+    deliverReadbacks(0, listener);
+    reclaimOutputTextures();
+
+    TextureSlot *slot = 0;
+    for(size_t i = 0; i < texture_slots.size() && slot == 0; ++i)
+    {
+      if(!texture_slots[i].ir.in_use && !texture_slots[i].depth.in_use) slot = &texture_slots[i];
+    }
+
+    if(slot == 0 && texture_slots.size() < MaxTextureSlots)
+    {
+      const size_t i = texture_slots.size();
+      texture_slots.reserve(MaxTextureSlots);
+      texture_slots.push_back(TextureSlot());
+
+      slot = &texture_slots.back();
+      slot->ir.index = 2 * (MaxReadbackSlots + i);
+      slot->depth.index = 2 * (MaxReadbackSlots + i) + 1;
+    }
+
+    if(slot == 0)
+    {
+      LOG_DEBUG << "all output textures are held by frames, reading back into host memory";
+      return 0;
+    }
+
+    // the fence of the previous packet in this slot is not needed any more, its frames are gone
+    if(slot->fence != 0)
+    {
+      gl()->glDeleteSync(slot->fence);
+      slot->fence = 0;
+    }
+
+    return slot;
+  }
+
+  void deliverOutputTexture(OutputTexture &output, Frame::Type type, GLsync fence, uint32_t timestamp, uint32_t sequence, FrameListener *listener)
+  {
+    {
+      libfreenect2::lock_guard l(readback_state->mutex);
+      readback_state->in_use[output.index] = true;
+      ++readback_state->references;
+    }
+    output.in_use = true;
+
+    Frame *frame = new OpenGLTextureOutputFrame(output.width, output.height, output.bytes_per_pixel, output.format, output.texture, fence, readback_state, output.index);
+    frame->timestamp = timestamp;
+    frame->sequence = sequence;
+
+    if(!listener->onNewFrame(type, frame))
+    {
+      delete frame;
+    }
+  }
+
+  /**
+   * Fence the copies into the output textures and hand their frames to the listener.
+   * The commands are flushed, so that contexts sharing the fence see it signaled eventually.
+   */
+  void endTextureOutput(TextureSlot &slot, uint32_t timestamp, uint32_t sequence, FrameListener *listener)
+  {
+    slot.fence = gl()->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    CHECKGL();
+
+    if(slot.has_ir) deliverOutputTexture(slot.ir, Frame::Ir, slot.fence, timestamp, sequence, listener);
+    if(slot.has_depth) deliverOutputTexture(slot.depth, Frame::Depth, slot.fence, timestamp, sequence, listener);
+  }
+
+  void deinitialize()
+  {
+  }
+
+  void updateShaderParametersForProgram(ShaderProgram &program)
+  {
+    if(!params_need_update) return;
+
+    program.setUniform("Params.ab_multiplier", params.ab_multiplier);
+    program.setUniformVector3("Params.ab_multiplier_per_frq", params.ab_multiplier_per_frq);
+    program.setUniform("Params.ab_output_multiplier", params.ab_output_multiplier);
+
+    program.setUniformVector3("Params.phase_in_rad", params.phase_in_rad);
+
+    program.setUniform("Params.joint_bilateral_ab_threshold", params.joint_bilateral_ab_threshold);
+    program.setUniform("Params.joint_bilateral_max_edge", params.joint_bilateral_max_edge);
+    program.setUniform("Params.joint_bilateral_exp", params.joint_bilateral_exp);
+    program.setUniformMatrix3("Params.gaussian_kernel", params.gaussian_kernel);
+
+    program.setUniform("Params.phase_offset", params.phase_offset);
+    program.setUniform("Params.unambigious_dist", params.unambigious_dist);
+    program.setUniform("Params.individual_ab_threshold", params.individual_ab_threshold);
+    program.setUniform("Params.ab_threshold", params.ab_threshold);
+    program.setUniform("Params.ab_confidence_slope", params.ab_confidence_slope);
+    program.setUniform("Params.ab_confidence_offset", params.ab_confidence_offset);
+    program.setUniform("Params.min_dealias_confidence", params.min_dealias_confidence);
+    program.setUniform("Params.max_dealias_confidence", params.max_dealias_confidence);
 
     program.setUniform("Params.edge_ab_avg_min_value", params.edge_ab_avg_min_value);
     program.setUniform("Params.edge_ab_std_dev_threshold", params.edge_ab_std_dev_threshold);
@@ -701,10 +1771,25 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
     program.setUniform("Params.max_depth", params.max_depth);
   }
 
+  /**
+   * Restrict drawing and clearing to a region.
+   * @param roi Region in output image coordinates, which are the texture coordinates of the passes.
+   */
+  void scissor(const DepthRoi &roi)
+  {
+    glScissor(roi.x_begin, roi.y_begin, roi.width(), roi.height());
+  }
+
   void run(Frame **ir, Frame **depth)
   {
+    if(draw_buffers_need_update) updateDrawBuffers();
+
+    // every pass only draws its region of interest, widened by the halo of the filters after it
+    glEnable(GL_SCISSOR_TEST);
+
     // data processing 1
     glViewport(0, 0, 512, 424);
+    scissor(rois.stage1);
     stage1.use();
     updateShaderParametersForProgram(stage1);
 
@@ -728,102 +1813,148 @@ struct OpenGLDepthPacketProcessorImpl : public WithOpenGLBindings, public WithPe
     glDrawArrays(GL_TRIANGLES, 0, 6);
     CHECKGL();
 
-    if(ir != 0)
-    {
-      gl()->glBindFramebuffer(GL_READ_FRAMEBUFFER, stage1_framebuffer);
-      glReadBuffer(GL_COLOR_ATTACHMENT4);
-      *ir = stage1_infrared.downloadToNewFrame();
-    }
+    // with binned output the passes after stage 1 draw the lower left quarter of their textures
+    const bool binned = config.EnableBinnedOutput;
+    GLint image_size[2] = { 512, 424 };
+    GLuint stage2_vao = square_vao;
+    Texture<F32C4> *stage2_data = stage1_data;
+    GLuint ir_framebuffer = stage1_framebuffer;
+    Texture<F32C1> *infrared = &stage1_infrared;
+    Texture<U16C1> *infrared_uint16 = &stage1_infrared_uint16;
 
-    if(config.EnableBilateralFilter)
+    if(binned)
     {
-      // bilateral filter
-      gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, filter1_framebuffer);
+      // 2x2 binning
+      glViewport(0, 0, 256, 212);
+      gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, bin_framebuffer);
       glClear(GL_COLOR_BUFFER_BIT);
 
-      filter1.use();
-      updateShaderParametersForProgram(filter1);
+      bin.use();
 
       stage1_data[0].bindToUnit(GL_TEXTURE0);
-      filter1.setUniform("A", 0);
+      bin.setUniform("A", 0);
       stage1_data[1].bindToUnit(GL_TEXTURE1);
-      filter1.setUniform("B", 1);
-      stage1_data[2].bindToUnit(GL_TEXTURE2);
-      filter1.setUniform("Norm", 2);
+      bin.setUniform("B", 1);
+      stage1_infrared.bindToUnit(GL_TEXTURE2);
+      bin.setUniform("Infrared", 2);
 
-      gl()->glBindVertexArray(square_vao);
+      gl()->glBindVertexArray(binned_square_vao);
       glDrawArrays(GL_TRIANGLES, 0, 6);
+      CHECKGL();
+
+      image_size[0] = 256;
+      image_size[1] = 212;
+      stage2_vao = binned_square_vao;
+      stage2_data = bin_data;
+      ir_framebuffer = bin_framebuffer;
+      infrared = &bin_infrared;
+      infrared_uint16 = &bin_infrared_uint16;
     }
-    // data processing 2
-    gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, stage2_framebuffer);
-    glClear(GL_COLOR_BUFFER_BIT);
-
-    stage2.use();
-    updateShaderParametersForProgram(stage2);
-    CHECKGL();
 
-    if(config.EnableBilateralFilter)
-    {
-      filter1_data[0].bindToUnit(GL_TEXTURE0);
-      filter1_data[1].bindToUnit(GL_TEXTURE1);
-    }
-    else
+    if(ir != 0)
     {
-      stage1_data[0].bindToUnit(GL_TEXTURE0);
-      stage1_data[1].bindToUnit(GL_TEXTURE1);
+      gl()->glBindFramebuffer(GL_FRAMEBUFFER, ir_framebuffer);
+      *ir = downloadOutput(*infrared, GL_COLOR_ATTACHMENT4, *infrared_uint16, GL_COLOR_ATTACHMENT5, readback_slot != 0 ? &readback_slot->ir : 0, texture_slot != 0 ? &texture_slot->ir : 0);
     }
-    stage2.setUniform("A", 0);
-    stage2.setUniform("B", 1);
-    x_table.bindToUnit(GL_TEXTURE2);
-    stage2.setUniform("XTable", 2);
-    z_table.bindToUnit(GL_TEXTURE3);
-    stage2.setUniform("ZTable", 3);
-
-    gl()->glBindVertexArray(square_vao);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
-    CHECKGL();
 
-    if(config.EnableEdgeAwareFilter)
+    // the IR comes from stage 1, the rest only computes the depth
+    if(config.EnableDepthOutput)
     {
-      // edge aware filter
-      gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, filter2_framebuffer);
+      if(config.EnableBilateralFilter)
+      {
+        // bilateral filter
+        scissor(rois.stage2);
+        gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, filter1_framebuffer);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        filter1.use();
+        updateShaderParametersForProgram(filter1);
+        filter1.setUniformVector2("ImageSize", image_size);
+
+        stage2_data[0].bindToUnit(GL_TEXTURE0);
+        filter1.setUniform("A", 0);
+        stage2_data[1].bindToUnit(GL_TEXTURE1);
+        filter1.setUniform("B", 1);
+        stage2_data[2].bindToUnit(GL_TEXTURE2);
+        filter1.setUniform("Norm", 2);
+
+        gl()->glBindVertexArray(stage2_vao);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+      }
+      // data processing 2
+      scissor(rois.stage2);
+      gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, stage2_framebuffer);
       glClear(GL_COLOR_BUFFER_BIT);
 
-      filter2.use();
-      updateShaderParametersForProgram(filter2);
-
-      stage2_depth_and_ir_sum.bindToUnit(GL_TEXTURE0);
-      filter2.setUniform("DepthAndIrSum", 0);
-      filter1_max_edge_test.bindToUnit(GL_TEXTURE1);
-      filter2.setUniform("MaxEdgeTest", 1);
+      stage2.use();
+      updateShaderParametersForProgram(stage2);
+      CHECKGL();
 
-      gl()->glBindVertexArray(square_vao);
+      if(config.EnableBilateralFilter)
+      {
+        filter1_data[0].bindToUnit(GL_TEXTURE0);
+        filter1_data[1].bindToUnit(GL_TEXTURE1);
+      }
+      else
+      {
+        stage2_data[0].bindToUnit(GL_TEXTURE0);
+        stage2_data[1].bindToUnit(GL_TEXTURE1);
+      }
+      stage2.setUniform("A", 0);
+      stage2.setUniform("B", 1);
+      (binned ? x_table_binned : x_table).bindToUnit(GL_TEXTURE2);
+      stage2.setUniform("XTable", 2);
+      (binned ? z_table_binned : z_table).bindToUnit(GL_TEXTURE3);
+      stage2.setUniform("ZTable", 3);
+
+      gl()->glBindVertexArray(stage2_vao);
       glDrawArrays(GL_TRIANGLES, 0, 6);
-      if(depth != 0)
+      CHECKGL();
+
+      if(config.EnableEdgeAwareFilter)
       {
-        gl()->glBindFramebuffer(GL_READ_FRAMEBUFFER, filter2_framebuffer);
-        glReadBuffer(GL_COLOR_ATTACHMENT1);
-        *depth = filter2_depth.downloadToNewFrame();
+        // edge aware filter
+        scissor(rois.filter2);
+        gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, filter2_framebuffer);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        filter2.use();
+        updateShaderParametersForProgram(filter2);
+        filter2.setUniformVector2("ImageSize", image_size);
+
+        stage2_depth_and_ir_sum.bindToUnit(GL_TEXTURE0);
+        filter2.setUniform("DepthAndIrSum", 0);
+        filter1_max_edge_test.bindToUnit(GL_TEXTURE1);
+        filter2.setUniform("MaxEdgeTest", 1);
+
+        gl()->glBindVertexArray(stage2_vao);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        if(depth != 0)
+        {
+          gl()->glBindFramebuffer(GL_FRAMEBUFFER, filter2_framebuffer);
+          *depth = downloadOutput(filter2_depth, GL_COLOR_ATTACHMENT1, filter2_depth_uint16, GL_COLOR_ATTACHMENT2, readback_slot != 0 ? &readback_slot->depth : 0, texture_slot != 0 ? &texture_slot->depth : 0);
+        }
       }
-    }
-    else
-    {
-      if(depth != 0)
+      else
       {
-        gl()->glBindFramebuffer(GL_READ_FRAMEBUFFER, stage2_framebuffer);
-        glReadBuffer(GL_COLOR_ATTACHMENT1);
-        *depth = stage2_depth.downloadToNewFrame();
+        if(depth != 0)
+        {
+          gl()->glBindFramebuffer(GL_FRAMEBUFFER, stage2_framebuffer);
+          *depth = downloadOutput(stage2_depth, GL_COLOR_ATTACHMENT1, stage2_depth_uint16, GL_COLOR_ATTACHMENT3, readback_slot != 0 ? &readback_slot->depth : 0, texture_slot != 0 ? &texture_slot->depth : 0);
+        }
       }
     }
+    glDisable(GL_SCISSOR_TEST);
     CHECKGL();
 
     if(do_debug)
     {
       // debug drawing
+      glViewport(0, 0, 512, 424);
       gl()->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
       glClear(GL_COLOR_BUFFER_BIT);
 
-      gl()->glBindVertexArray(square_vao);
+      gl()->glBindVertexArray(debug_square_vao);
 
       debug.use();
       stage2_debug.bindToUnit(GL_TEXTURE0);
@@ -891,14 +2022,31 @@ OpenGLDepthPacketProcessor::OpenGLDepthPacketProcessor(void *parent_opengl_conte
 
 OpenGLDepthPacketProcessor::~OpenGLDepthPacketProcessor()
 {
+  // the frames of the last packets, see Config::NumOpenGLReadbackBuffers
+  impl_->flushReadbacks(listener_);
   delete impl_;
 }
 
 
 void OpenGLDepthPacketProcessor::setConfiguration(const libfreenect2::DepthPacketProcessor::Config &config)
 {
+  // frames read back with the old configuration come first
+  impl_->flushReadbacks(listener_);
+
   DepthPacketProcessor::setConfiguration(config);
+
+  if(impl_->config.EnableUInt16Output != config.EnableUInt16Output)
+  {
+    impl_->draw_buffers_need_update = true;
+  }
+
   impl_->config = config;
+  impl_->rois = DepthPassRois(config);
+
+  if(!config.EnableIrOutput && !config.EnableDepthOutput)
+  {
+    LOG_WARNING << "neither IR nor depth output enabled, packets will be dropped";
+  }
 
   impl_->params.min_depth = impl_->config.MinDepth * 1000.0f;
   impl_->params.max_depth = impl_->config.MaxDepth * 1000.0f;
@@ -915,17 +2063,14 @@ void OpenGLDepthPacketProcessor::loadP0TablesFromCommandResponse(unsigned char*
 
   impl_->p0table[0].allocate(512, 424);
   std::copy(reinterpret_cast<unsigned char*>(p0table->p0table0), reinterpret_cast<unsigned char*>(p0table->p0table0 + n), impl_->p0table[0].data);
-  impl_->p0table[0].flipY();
   impl_->p0table[0].upload();
 
   impl_->p0table[1].allocate(512, 424);
   std::copy(reinterpret_cast<unsigned char*>(p0table->p0table1), reinterpret_cast<unsigned char*>(p0table->p0table1 + n), impl_->p0table[1].data);
-  impl_->p0table[1].flipY();
   impl_->p0table[1].upload();
 
   impl_->p0table[2].allocate(512, 424);
   std::copy(reinterpret_cast<unsigned char*>(p0table->p0table2), reinterpret_cast<unsigned char*>(p0table->p0table2 + n), impl_->p0table[2].data);
-  impl_->p0table[2].flipY();
   impl_->p0table[2].upload();
 
 }
@@ -975,13 +2120,15 @@ void OpenGLDepthPacketProcessor::loadXTableFromFile(const char* filename)
 
   if(loadResource("xTable.bin", &data, &length))
   {
-    std::copy(data, data + length, impl_->x_table.data);
+    impl_->x_table.copyFromFlippedTable(data);
     impl_->x_table.upload();
   }
   else
   {
     LOG_ERROR << "Loading xtable from resource 'xTable.bin' failed!";
   }
+
+  impl_->binTables();
 }
 
 void OpenGLDepthPacketProcessor::loadZTableFromFile(const char* filename)
@@ -995,13 +2142,15 @@ void OpenGLDepthPacketProcessor::loadZTableFromFile(const char* filename)
 
   if(loadResource("zTable.bin", &data, &length))
   {
-    std::copy(data, data + length, impl_->z_table.data);
+    impl_->z_table.copyFromFlippedTable(data);
     impl_->z_table.upload();
   }
   else
   {
     LOG_ERROR << "Loading ztable from resource 'zTable.bin' failed!";
   }
+
+  impl_->binTables();
 }
 
 void OpenGLDepthPacketProcessor::load11To16LutFromFile(const char* filename)
@@ -1029,29 +2178,78 @@ void OpenGLDepthPacketProcessor::process(const DepthPacket &packet)
   bool has_listener = this->listener_ != 0;
   Frame *ir = 0, *depth = 0;
 
-  impl_->startTiming();
+  if(!impl_->config.EnableIrOutput && !impl_->config.EnableDepthOutput) return;
 
   glfwMakeContextCurrent(impl_->opengl_context_ptr);
 
+  // outside of the timing, compiling takes far longer than a packet
+  if(!impl_->programs_built) impl_->buildPrograms();
+
+  impl_->startTiming();
+
   std::copy(packet.buffer, packet.buffer + packet.buffer_length/10*9, impl_->input_data.data);
   impl_->input_data.upload();
-  impl_->run(has_listener ? &ir : 0, has_listener ? &depth : 0);
+
+  ReadbackSlot *slot = 0;
+  TextureSlot *texture_slot = 0;
+  if(has_listener)
+  {
+    texture_slot = impl_->beginTextureOutput(this->listener_);
+    if(texture_slot == 0) slot = impl_->beginReadback(this->listener_);
+  }
+  else
+  {
+    impl_->dropReadbacks();
+  }
+
+  if(slot != 0)
+  {
+    slot->has_ir = impl_->config.EnableIrOutput;
+    slot->has_depth = impl_->config.EnableDepthOutput;
+  }
+
+  if(texture_slot != 0)
+  {
+    texture_slot->has_ir = impl_->config.EnableIrOutput;
+    texture_slot->has_depth = impl_->config.EnableDepthOutput;
+  }
+
+  // a disabled output is neither read back nor allocated
+  impl_->readback_slot = slot;
+  impl_->texture_slot = texture_slot;
+  impl_->run(has_listener && impl_->config.EnableIrOutput ? &ir : 0, has_listener && impl_->config.EnableDepthOutput ? &depth : 0);
+  impl_->readback_slot = 0;
+  impl_->texture_slot = 0;
 
   if(impl_->do_debug) glfwSwapBuffers(impl_->opengl_context_ptr);
 
+  if(slot != 0)
+  {
+    impl_->endReadback(*slot, packet.timestamp, packet.sequence, this->listener_);
+  }
+
+  if(texture_slot != 0)
+  {
+    impl_->endTextureOutput(*texture_slot, packet.timestamp, packet.sequence, this->listener_);
+  }
+
   impl_->stopTiming(LOG_INFO);
 
-  if(has_listener)
+  if(ir != 0)
   {
     ir->timestamp = packet.timestamp;
-    depth->timestamp = packet.timestamp;
     ir->sequence = packet.sequence;
-    depth->sequence = packet.sequence;
 
     if(!this->listener_->onNewFrame(Frame::Ir, ir))
     {
       delete ir;
     }
+  }
+
+  if(depth != 0)
+  {
+    depth->timestamp = packet.timestamp;
+    depth->sequence = packet.sequence;
 
     if(!this->listener_->onNewFrame(Frame::Depth, depth))
     {
@@ -56,12 +56,14 @@ void BasePacketPipeline::initialize()
 
 BasePacketPipeline::~BasePacketPipeline()
 {
+  // join the processing threads first, they may still read a buffer of the parsers
   delete async_rgb_processor_;
   delete async_depth_processor_;
-  delete rgb_processor_;
-  delete depth_processor_;
+  // the parsers release their buffers through the allocators of the processors
   delete rgb_parser_;
   delete depth_parser_;
+  delete rgb_processor_;
+  delete depth_processor_;
 }
 
 BasePacketPipeline::PacketParser *BasePacketPipeline::getRgbPacketParser() const
@@ -123,7 +125,7 @@ DepthPacketProcessor *OpenGLPacketPipeline::createDepthPacketProcessor()
 
 #ifdef LIBFREENECT2_WITH_OPENCL_SUPPORT
 
-OpenCLPacketPipeline::OpenCLPacketPipeline(const int deviceId) : deviceId(deviceId)
+OpenCLPacketPipeline::OpenCLPacketPipeline(const int deviceId, bool half_intermediates) : deviceId(deviceId), half_intermediates(half_intermediates)
 { 
   initialize();
 }
@@ -132,7 +134,7 @@ OpenCLPacketPipeline::~OpenCLPacketPipeline() { }
 
 DepthPacketProcessor *OpenCLPacketPipeline::createDepthPacketProcessor()
 {
-  OpenCLDepthPacketProcessor *depth_processor = new OpenCLDepthPacketProcessor(deviceId);
+  OpenCLDepthPacketProcessor *depth_processor = new OpenCLDepthPacketProcessor(deviceId, half_intermediates);
   depth_processor->load11To16LutFromFile("11to16.bin");
   depth_processor->loadXTableFromFile("xTable.bin");
   depth_processor->loadZTableFromFile("zTable.bin");
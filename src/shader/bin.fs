@@ -0,0 +1,29 @@
+uniform sampler2DRect A;
+uniform sampler2DRect B;
+uniform sampler2DRect Infrared;
+
+in vec2 TexCoord;
+
+/*layout(location = 0)*/ out vec4 Debug;
+/*layout(location = 1)*/ out vec3 BinnedA;
+/*layout(location = 2)*/ out vec3 BinnedB;
+/*layout(location = 3)*/ out vec3 BinnedNorm;
+/*layout(location = 4)*/ out float BinnedInfrared;
+/*layout(location = 5)*/ out uint BinnedInfraredUInt16;
+
+void main(void)
+{
+  ivec2 uv = 2 * ivec2(TexCoord.x, TexCoord.y);
+
+  BinnedA = 0.25 * (texelFetch(A, uv).xyz + texelFetch(A, uv + ivec2(1, 0)).xyz + texelFetch(A, uv + ivec2(0, 1)).xyz + texelFetch(A, uv + ivec2(1, 1)).xyz);
+  BinnedB = 0.25 * (texelFetch(B, uv).xyz + texelFetch(B, uv + ivec2(1, 0)).xyz + texelFetch(B, uv + ivec2(0, 1)).xyz + texelFetch(B, uv + ivec2(1, 1)).xyz);
+
+  // the bilateral filter takes Norm as the norm of A and B
+  BinnedNorm = sqrt(BinnedA * BinnedA + BinnedB * BinnedB);
+
+  BinnedInfrared = 0.25 * (texelFetch(Infrared, uv).x + texelFetch(Infrared, uv + ivec2(1, 0)).x + texelFetch(Infrared, uv + ivec2(0, 1)).x + texelFetch(Infrared, uv + ivec2(1, 1)).x);
+  // rounded to nearest and saturated for 16 bit integer output, NaN and negative values become 0
+  BinnedInfraredUInt16 = BinnedInfrared > 0.0 ? uint(BinnedInfrared + 0.5) : 0u;
+
+  Debug = vec4(sqrt(vec3(BinnedInfrared / 65535.0)), 1.0);
+}
@@ -37,6 +37,7 @@ uniform sampler2DRect B;
 uniform sampler2DRect Norm;
 
 uniform Parameters Params;
+uniform ivec2 ImageSize;
 
 in vec2 TexCoord;
 
@@ -98,7 +99,7 @@ void applyBilateralFilter(ivec2 uv)
   FilterA = mix(vec3(0.0), weighted_a_acc.xyz / weight_acc.xyz, c2);
   FilterB = mix(vec3(0.0), weighted_b_acc.xyz / weight_acc.xyz, c2);
   
-  if(uv.x < 1 || uv.y < 1 || uv.x > 510 || uv.y > 422)
+  if(uv.x < 1 || uv.y < 1 || uv.x > ImageSize.x - 2 || uv.y > ImageSize.y - 2)
   {
     FilterA = self_a;
     FilterB = self_b;
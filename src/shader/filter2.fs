@@ -36,11 +36,13 @@ uniform sampler2DRect DepthAndIrSum;
 uniform usampler2DRect MaxEdgeTest;
 
 uniform Parameters Params;
+uniform ivec2 ImageSize;
 
 in vec2 TexCoord;
 
 /*layout(location = 0)*/ out vec4 Debug;
 /*layout(location = 1)*/ out float FilterDepth;
+/*layout(location = 2)*/ out uint FilterDepthUInt16;
 
 void applyEdgeAwareFilter(ivec2 uv)
 {
@@ -48,7 +50,7 @@ void applyEdgeAwareFilter(ivec2 uv)
   
   if(v.x >= Params.min_depth && v.x <= Params.max_depth)
   {
-    if(uv.x < 1 || uv.y < 1 || uv.x > 510 || uv.y > 422)
+    if(uv.x < 1 || uv.y < 1 || uv.x > ImageSize.x - 2 || uv.y > ImageSize.y - 2)
     {
       FilterDepth = v.x;
     }
@@ -125,6 +127,8 @@ void main(void)
   ivec2 uv = ivec2(TexCoord.x, TexCoord.y);
   
   applyEdgeAwareFilter(uv);
+  // rounded to nearest and saturated for 16 bit integer output, NaN and negative values become 0
+  FilterDepthUInt16 = FilterDepth > 0.0 ? uint(min(FilterDepth + 0.5, 65535.0)) : 0u;
   
   Debug = vec4(vec3(FilterDepth / Params.max_depth), 1);
 }
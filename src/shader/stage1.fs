@@ -49,6 +49,7 @@ in vec2 TexCoord;
 /*layout(location = 2)*/ out vec3 B;
 /*layout(location = 3)*/ out vec3 Norm;
 /*layout(location = 4)*/ out float Infrared;
+/*layout(location = 5)*/ out uint InfraredUInt16;
 
 #define M_PI 3.1415926535897932384626433832795
 
@@ -59,7 +60,9 @@ int data(ivec2 uv)
 
 float decode_data(ivec2 uv, int sub)
 {
-  int row_idx = 424 * sub + (uv.y < 212 ? uv.y + 212 : 423 - uv.y);
+  // uv.y counts the output lines from the top, the packet holds them in the order of the sensor
+  int y = 423 - uv.y;
+  int row_idx = 424 * sub + (y < 212 ? y + 212 : 423 - y);
 
   int m = int(0xffffffff);
   int bitmask = (((1 << 2) - 1) << 7) & m;
@@ -115,6 +118,8 @@ void main(void)
   B = mix(B, vec3(0.0), saturated);
   
   Infrared = min(dot(mix(Norm, vec3(65535.0), saturated), vec3(0.333333333  * Params.ab_multiplier * Params.ab_output_multiplier)), 65535.0);
+  // rounded to nearest and saturated for 16 bit integer output, NaN and negative values become 0
+  InfraredUInt16 = Infrared > 0.0 ? uint(Infrared + 0.5) : 0u;
   
   Debug = vec4(sqrt(vec3(Infrared / 65535.0)), 1.0);
 }
@@ -44,6 +44,7 @@ in vec2 TexCoord;
 /*layout(location = 0)*/ out vec4 Debug;
 /*layout(location = 1)*/ out float Depth;
 /*layout(location = 2)*/ out vec2 DepthAndIrSum;
+/*layout(location = 3)*/ out uint DepthUInt16;
 
 #define M_PI 3.1415926535897932384626433832795
 
@@ -150,6 +151,8 @@ void main(void)
   
   Depth = cond1 ? depth_fit : depth_linear; // r1.y -> later r2.z
   DepthAndIrSum = vec2(Depth, ir_sum);
+  // rounded to nearest and saturated for 16 bit integer output, NaN and negative values become 0
+  DepthUInt16 = Depth > 0.0 ? uint(min(Depth + 0.5, 65535.0)) : 0u;
   
   Debug = vec4(vec3(Depth / Params.max_depth), 1.0);
 }
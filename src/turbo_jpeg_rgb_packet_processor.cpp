@@ -66,7 +66,7 @@ public:
 
   void newFrame()
   {
-    frame = new Frame(1920, 1080, tjPixelSize[TJPF_BGRX]);
+    frame = new Frame(1920, 1080, tjPixelSize[TJPF_BGRX], Frame::BGRX);
   }
 };
 